@@ -0,0 +1,369 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <Arduino.h>
+
+/*
+ * Hardware abstraction layer.
+ *
+ * The control firmware (state machine, PIDs, profile engine, settings in
+ * firmware.cpp) reaches the machine and the network only through the
+ * functions below. src/hal_esp32.cpp implements them on the Nano ESP32;
+ * src/native/ implements them on the host so the same control code can run
+ * against simulated hardware (pio run -e native).
+ */
+
+// =================================================================
+// --- BOARD WIRING (pins owned by HAL drivers) ---
+// =================================================================
+const int ZERO_CROSS_PIN = D13; // green
+const int PUMP_TRIAC_PIN = A2;  // yellow
+const int ADS_SCLK_PIN = D4;    // scale
+const int ADS_DOUT_PIN = D12;   // scale
+#ifdef HAS_ADS_ALERT
+const int ADS_ALERT_PIN = D2; // ADS1115 ALERT/RDY (open drain, active low)
+#endif
+
+// =================================================================
+// --- CLOCK ---
+// =================================================================
+unsigned long halMillis();
+unsigned long halMicros();
+void halDelay(unsigned long ms);
+
+// =================================================================
+// --- GPIO ---
+// =================================================================
+void halPinMode(int pin, int mode);
+int halDigitalRead(int pin);
+void halDigitalWrite(int pin, int level);
+
+// =================================================================
+// --- ADS1115 (NTCs & PRESSURE TRANSDUCER) ---
+// =================================================================
+const int ADS_CHANNEL_COUNT = 4;
+
+struct AdsSample
+{
+  int16_t raw;          // Averaged result, scaled to GAIN_ONE counts
+  uint32_t timestampUs; // halMicros() when the last conversion finished
+  uint32_t seq;         // Increments on every published sample (0 = none yet)
+};
+
+/**
+ * @brief Starts background acquisition of the given channels, visited in
+ * schedule order. Returns false if the converter does not respond.
+ */
+bool halAdsBegin(const uint8_t *schedule, int scheduleLength);
+
+/**
+ * @brief Copies the latest sample of a channel. Returns false if the channel
+ * has not delivered a sample yet. Never blocks.
+ */
+bool halAdsGetSample(int channel, AdsSample &sample);
+
+/**
+ * @brief Latest reading of a channel. Channels outside the schedule get a
+ * single conversion on demand (debug use, may block ~100 ms).
+ */
+int16_t halAdsRead(int channel);
+
+/**
+ * @brief Waits until every scheduled channel has delivered a sample.
+ */
+bool halAdsWaitForSamples(unsigned long timeoutMs);
+
+void halAdsPrintStats(Print &out);
+
+// =================================================================
+// --- ADS1232 SCALE ---
+// =================================================================
+// Gain, speed, power-down and channel are staged and only reach the chip
+// (through the PCF8574 expander) on halScaleApplyConfig().
+bool halScaleBegin();
+
+struct ScaleSample
+{
+  int32_t raw;          // Signed 24-bit conversion
+  uint32_t timestampUs; // halMicros() when the data-ready line signalled it
+  uint8_t channel;      // Input (1 or 2) it was converted from
+};
+
+/**
+ * @brief Takes the oldest conversion not taken yet. Every conversion is read
+ * out in the background as it completes and queued, so a slow control step
+ * delays samples but does not lose them. Returns false if none is waiting.
+ */
+bool halScaleTakeSample(ScaleSample &sample);
+
+bool halScaleIsReady();
+void halScaleSetInterruptEnabled(bool enabled);
+void halScaleSetGain(uint8_t gain);
+void halScaleSetSpeed(bool highSpeed);
+void halScalePowerDown(bool powerDown);
+void halScaleSelectChannel(uint8_t channel);
+bool halScaleApplyConfig();
+
+/**
+ * @brief Alternates the two inputs in bursts of dwell conversions, or stays on
+ * the selected input with 0. The switch is made in the background straight
+ * after the last conversion of a burst is read. After any channel change the
+ * conversions from the settling time are dropped, so every queued sample is
+ * a settled one of the input it names.
+ */
+void halScaleSetDwell(uint8_t dwell);
+
+// =================================================================
+// --- PUMP TRIAC DIMMER ---
+// =================================================================
+void halDimmerBegin();
+void halDimmerSet(uint8_t brightness);
+
+// =================================================================
+// --- PERSISTENT STORAGE ---
+// =================================================================
+/**
+ * @brief Namespaced key/value store with the same calls as ESP32 Preferences.
+ */
+class HalStorage
+{
+public:
+  virtual ~HalStorage() {}
+  virtual bool begin(const char *name, bool readOnly = false) = 0;
+  virtual void end() = 0;
+  virtual bool clear() = 0;
+  virtual bool isKey(const char *key) = 0;
+  virtual bool remove(const char *key) = 0;
+
+  virtual size_t putBool(const char *key, bool value) = 0;
+  virtual size_t putInt(const char *key, int32_t value) = 0;
+  virtual size_t putLong(const char *key, int32_t value) = 0;
+  virtual size_t putFloat(const char *key, float value) = 0;
+  virtual size_t putDouble(const char *key, double value) = 0;
+  virtual size_t putString(const char *key, const char *value) = 0;
+  virtual size_t putBytes(const char *key, const void *value, size_t len) = 0;
+
+  virtual bool getBool(const char *key, bool defaultValue = false) = 0;
+  virtual int32_t getInt(const char *key, int32_t defaultValue = 0) = 0;
+  virtual int32_t getLong(const char *key, int32_t defaultValue = 0) = 0;
+  virtual float getFloat(const char *key, float defaultValue = NAN) = 0;
+  virtual double getDouble(const char *key, double defaultValue = NAN) = 0;
+  virtual size_t getString(const char *key, char *value, size_t maxLen) = 0;
+  virtual size_t getBytesLength(const char *key) = 0;
+  virtual size_t getBytes(const char *key, void *buf, size_t maxLen) = 0;
+};
+
+HalStorage &halStorage();
+
+/**
+ * @brief Wipes every namespace, including WiFi credentials.
+ */
+void halEraseAllStorage();
+
+// =================================================================
+// --- MESSAGE TRANSPORTS (MQTT, ESP-NOW, TELNET CONSOLE) ---
+// =================================================================
+/**
+ * @brief Joins WiFi (non-blocking portal) and, once online, starts MQTT,
+ * ESP-NOW, OTA and the telnet console. The MQTT strings must stay valid for
+ * the lifetime of the program. Returns true if WiFi connected immediately.
+ */
+bool halNetworkBegin(const char *mqttServer, int mqttPort, const char *mqttUser, const char *mqttPassword);
+
+/**
+ * @brief Applies changed broker settings and reconnects. From the control
+ * task the reconnect is left to the comms task.
+ */
+void halMqttConfigure(const char *mqttServer, int mqttPort, const char *mqttUser, const char *mqttPassword);
+
+bool halIsOnline();
+bool halMqttConnected();
+
+/**
+ * @brief Publishes a topic to MQTT and/or the screen. Safe from any context;
+ * from the control task the message is queued for the comms task.
+ */
+void halPublish(const char *topic, const char *payload, bool retained, bool espNowSendNow, bool sendToMqtt, bool sendToESP);
+
+/**
+ * @brief Queues a raw payload for every ESP-NOW peer; the comms side sends it
+ * ahead of the next screen frame. Returns 0 or an error code.
+ */
+int halEspNowBroadcast(const char *payload);
+
+/**
+ * @brief Console output stream for the calling context.
+ */
+Print &halConsole();
+
+/**
+ * @brief Takes the next complete console command line. Returns false if none.
+ */
+bool halReadCommand(char *line, size_t size);
+
+/**
+ * @brief Takes the next key=value setting received over MQTT / ESP-NOW. The
+ * transports only queue them, so settings change at a safe point of the
+ * control step. Returns false if none.
+ */
+const size_t INBOUND_SETTING_MAX_LENGTH = 2048;
+bool halReadSetting(char *message, size_t size);
+
+/**
+ * @brief Marks the setting taken last as applied, for the latency stats.
+ */
+void halSettingApplied();
+
+/**
+ * @brief Publishes dropped since boot because the outbound queue was full.
+ */
+uint32_t halPublishDropCount();
+
+/**
+ * @brief Takes the clients that connected since the last call and want a
+ * full resync of settings, state and profiles (RESYNC_* bits, 0 if none).
+ * The transports only note the event; the control task publishes the sync.
+ */
+const uint8_t RESYNC_MQTT = 1 << 0;
+const uint8_t RESYNC_SCREEN = 1 << 1;
+uint8_t halTakeResyncRequest();
+
+/**
+ * @brief Fill levels, drops and inbound setting latency of the queues
+ * between the transports and the control task, and the ESP-NOW transmit
+ * ring (delivery, retries, high-water mark, throughput).
+ */
+void halQueuePrintStats(Print &out);
+
+void halCloseConsole();
+
+/**
+ * @brief Ask the comms side to run publishProfileSync(), which publishes the
+ * profile snapshot the control task has just encoded.
+ */
+void halRequestProfilesSync();
+
+/**
+ * @brief Ask the comms side to run commitSettings(), which writes the images
+ * the control task has just encoded. NVS writes stall the flash cache of both
+ * cores, so they never run inside the control task.
+ */
+void halRequestSettingsCommit();
+
+// =================================================================
+// --- INPUT TRACE (RECORD & REPLAY) ---
+// =================================================================
+// Records every value the control code reads through this file, and the
+// outputs it drives, in the format of include/input_trace.h. The native
+// build replays a trace through the same firmware (--replay).
+
+/**
+ * @brief First call in setup(). Starts recording if halTraceArm() asked for
+ * it before the last restart, so a trace always starts from boot.
+ */
+void halTraceBegin();
+
+/**
+ * @brief Records from the next boot onwards (restarts the machine).
+ */
+void halTraceArm();
+
+void halTraceStop();
+void halTracePrintStats(Print &out);
+
+// =================================================================
+// --- CONTROL STAGES & LOOP PROFILER ---
+// =================================================================
+// controlStep() marks where each stage starts; a stage ends where the next
+// one starts, STAGE_END closes the step. Stages called from inside another
+// one (the heater PID and pump profile run inside the state machine) use
+// StageScope to hand back to the caller's stage.
+//
+// With HAS_LOOP_PROFILER the HAL times every stage (CPU cycles on the
+// machine) and keeps min / avg / p99 / max per PERF_WINDOW_MS window, for
+// the control task and, on the machine, the comms task. Without it the
+// markers compile to nothing.
+enum ControlStage : uint8_t
+{
+  STAGE_COMMANDS,
+  STAGE_INPUTS,
+  STAGE_SENSORS,
+  STAGE_SCALE,
+  STAGE_BOILER_CHECK,
+  STAGE_SWITCHES,
+  STAGE_STATE_MACHINE,
+  STAGE_HEATER_PID,
+  STAGE_PUMP_PROFILE,
+  STAGE_PUBLISH,
+  STAGE_END,
+  STAGE_COUNT = STAGE_END
+};
+
+const char *const CONTROL_STAGE_NAMES[STAGE_COUNT] = {
+    "commands", "inputs", "sensors", "scale", "boiler check", "switches",
+    "state machine", "heater PID", "pump profile", "publish"};
+
+const uint32_t PERF_WINDOW_MS = 10000;
+
+#ifdef HAS_LOOP_PROFILER
+/**
+ * @brief Starts a stage. Returns the stage that was running (STAGE_END if
+ * none).
+ */
+ControlStage halStageBegin(ControlStage stage);
+#else
+inline ControlStage halStageBegin(ControlStage stage)
+{
+  return STAGE_END;
+}
+#endif
+
+/**
+ * @brief Runs a nested stage until the end of the enclosing block.
+ */
+struct StageScope
+{
+  explicit StageScope(ControlStage stage) : previous(halStageBegin(stage)) {}
+  ~StageScope() { halStageBegin(previous); }
+  ControlStage previous;
+};
+
+/**
+ * @brief Prints the last complete profiler window.
+ */
+void halPerfPrintStats(Print &out);
+
+// =================================================================
+// --- SYSTEM ---
+// =================================================================
+/**
+ * @brief True when called from the control task. Work that touches the
+ * network must then be deferred (see halRequestProfilesSync()).
+ */
+bool halIsControlContext();
+
+/**
+ * @brief Starts the periodic control task (calls controlStep()) and the
+ * comms task. On the host the simulation runner drives controlStep() itself.
+ */
+void halStartTasks();
+
+void halRestart();
+void halMacAddress(char *buffer, size_t size);
+int halWifiChannel();
+int halWifiRssi();
+int halResetReason();
+
+// =================================================================
+// --- APPLICATION HOOKS (implemented in firmware.cpp) ---
+// =================================================================
+const uint32_t CONTROL_PERIOD_MS = 10; // controlStep() runs at 100 Hz
+
+void controlStep();
+void handleIncomingSetting(char *message);
+void publishProfileSync();
+void discardProfileSync();
+void commitSettings();
+void discardSettingsCommit();
+
+#endif // HAL_H
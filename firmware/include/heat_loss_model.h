@@ -0,0 +1,21 @@
+#ifndef HEAT_LOSS_MODEL_H
+#define HEAT_LOSS_MODEL_H
+
+/*
+ * Steady-state heat loss model of the Mara X, fitted at the machine.
+ *
+ * Loss at temperature T is c1 * (T - Tamb) + c2 * (T^4 - Tamb^4) (Kelvin for
+ * the radiative term) as a fraction of full heater power. The brew pair is
+ * fitted against the HX sensor, the boiler pair against the boiler sensor, so
+ * at equilibrium both describe the same heater duty.
+ *
+ * Used by the heater feed-forward in firmware.cpp and by the host thermal
+ * model (src/native/thermal_twin.cpp).
+ */
+constexpr double ASSUMED_AMBIENT_TEMP = 20.0;
+constexpr double c1Brew = 0.000363;
+constexpr double c2Brew = 5.623e-12;
+constexpr double c1Boiler = 0.000041;
+constexpr double c2Boiler = 4.984e-12;
+
+#endif // HEAT_LOSS_MODEL_H
@@ -0,0 +1,362 @@
+#ifndef INPUT_TRACE_H
+#define INPUT_TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hal.h"
+
+/*
+ * Binary trace of everything the control code reads through hal.h, plus the
+ * actuator and publish calls it makes, so a recorded run can be fed back
+ * through the same firmware on the host and the outputs compared.
+ *
+ * A HAL records only calls made from the recording context (setup() and the
+ * control task); settings from MQTT / ESP-NOW reach it through
+ * halReadSetting() like any other input.
+ *
+ * Layout: "MXTR", a version byte, then records of
+ *   type (1 byte), length (1 byte; 255 = a 16-bit length follows), payload
+ * Little-endian throughout. Types below TRACE_OUTPUT are inputs and are
+ * replayed in order; TRACE_OUTPUT and above are outputs and are compared in
+ * order. Frequent inputs are delta coded (see TraceEncoder).
+ */
+
+const uint8_t TRACE_MAGIC[4] = {'M', 'X', 'T', 'R'};
+const uint8_t TRACE_VERSION = 6;
+const size_t TRACE_FILE_HEADER_SIZE = sizeof(TRACE_MAGIC) + 1;
+const size_t TRACE_MAX_RECORD_HEADER = 4;
+const size_t TRACE_MAX_STORAGE_BYTES = 512;
+
+enum TraceRecordType : uint8_t
+{
+  // --- Inputs ---
+  TRACE_STEP = 1,          // controlStep() is about to run (no payload)
+  TRACE_MILLIS,            // empty = unchanged, 1 byte = delta, 4 bytes = value
+  TRACE_MICROS,            // 2 bytes = delta, 4 bytes = value
+  TRACE_DIGITAL_READ,      // pin, level
+  TRACE_ADS_SAMPLE,        // channel [, ok, raw, timestampUs, seq]; channel only = unchanged
+  TRACE_ADS_READ,          // int16
+  TRACE_ADS_BEGIN,         // bool
+  TRACE_ADS_WAIT,          // bool
+  TRACE_SCALE_BEGIN,       // bool
+  TRACE_SCALE_SAMPLE,      // empty = none, else raw (int32), timestampUs, channel
+  TRACE_SCALE_IS_READY,    // bool
+  TRACE_SCALE_APPLY,       // bool
+  TRACE_STORAGE,           // return value, then any string / bytes read
+  TRACE_COMMAND,           // empty = none, else 1 + line
+  TRACE_SETTING,           // empty = none, else key=value (never empty)
+  TRACE_NETWORK_BEGIN,     // bool
+  TRACE_ONLINE,            // bool
+  TRACE_MQTT_CONNECTED,    // bool
+  TRACE_ESPNOW_SEND,       // int32
+  TRACE_MAC_ADDRESS,       // string
+  TRACE_WIFI_CHANNEL,      // int32
+  TRACE_WIFI_RSSI,         // int32
+  TRACE_RESET_REASON,      // int32
+  TRACE_CONTROL_CONTEXT,   // bool
+  TRACE_GAP,               // the recorder dropped records before this one
+  TRACE_PUBLISH_DROPS,     // uint32
+  TRACE_RESYNC,            // uint8, RESYNC_* bits
+
+  // --- Outputs ---
+  TRACE_OUTPUT = 0x80,
+  TRACE_DIGITAL_WRITE = TRACE_OUTPUT, // pin, level
+  TRACE_DIMMER,                       // brightness
+  TRACE_PUBLISH,                      // payload CRC-32, flags, topic
+};
+
+/**
+ * @brief Callback that receives one encoded record. Header and payload must
+ * be stored back to back and, with several producers, atomically.
+ */
+typedef void (*TraceSink)(const uint8_t *header, size_t headerLength, const void *payload, size_t payloadLength);
+
+inline uint32_t traceCrc32(const char *text)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (; *text != '\0'; text++)
+  {
+    crc ^= (uint8_t)*text;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+/**
+ * @brief Encodes HAL calls into trace records. Only the recording context
+ * may use it; the delta state belongs to that context.
+ */
+class TraceEncoder
+{
+public:
+  explicit TraceEncoder(TraceSink sink) : sink(sink) {}
+
+  /**
+   * @brief Emits the file header and forgets the delta state.
+   */
+  void begin()
+  {
+    uint8_t header[TRACE_FILE_HEADER_SIZE];
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header[sizeof(TRACE_MAGIC)] = TRACE_VERSION;
+    sink(header, sizeof(header), nullptr, 0);
+    haveMillis = false;
+    haveMicros = false;
+    memset(lastAds, 0, sizeof(lastAds));
+    memset(haveAds, 0, sizeof(haveAds));
+  }
+
+  void record(uint8_t type, const void *payload, size_t length)
+  {
+    uint8_t header[TRACE_MAX_RECORD_HEADER];
+    size_t headerLength = 2;
+    header[0] = type;
+    if (length < 255)
+    {
+      header[1] = (uint8_t)length;
+    }
+    else
+    {
+      header[1] = 255;
+      header[2] = (uint8_t)(length & 0xFF);
+      header[3] = (uint8_t)(length >> 8);
+      headerLength = 4;
+    }
+    sink(header, headerLength, payload, length);
+  }
+
+  template <typename T>
+  void value(uint8_t type, T v)
+  {
+    record(type, &v, sizeof(v));
+  }
+
+  void millis(uint32_t now)
+  {
+    uint32_t delta = now - lastMillis;
+    if (haveMillis && delta == 0)
+      record(TRACE_MILLIS, nullptr, 0);
+    else if (haveMillis && delta <= 0xFF)
+      value(TRACE_MILLIS, (uint8_t)delta);
+    else
+      value(TRACE_MILLIS, now);
+    lastMillis = now;
+    haveMillis = true;
+  }
+
+  void micros(uint32_t now)
+  {
+    uint32_t delta = now - lastMicros;
+    if (haveMicros && delta <= 0xFFFF)
+      value(TRACE_MICROS, (uint16_t)delta);
+    else
+      value(TRACE_MICROS, now);
+    lastMicros = now;
+    haveMicros = true;
+  }
+
+  void digitalRead(int pin, int level)
+  {
+    uint8_t payload[2] = {(uint8_t)pin, (uint8_t)level};
+    record(TRACE_DIGITAL_READ, payload, sizeof(payload));
+  }
+
+  void adsSample(int channel, bool ok, const AdsSample &sample)
+  {
+    uint8_t payload[12];
+    payload[0] = (uint8_t)channel;
+    bool unchanged = channel >= 0 && channel < ADS_CHANNEL_COUNT && haveAds[channel] &&
+                     lastAdsOk[channel] == ok && lastAds[channel].raw == sample.raw &&
+                     lastAds[channel].timestampUs == sample.timestampUs && lastAds[channel].seq == sample.seq;
+    if (unchanged)
+    {
+      record(TRACE_ADS_SAMPLE, payload, 1);
+      return;
+    }
+    payload[1] = ok;
+    memcpy(payload + 2, &sample.raw, 2);
+    memcpy(payload + 4, &sample.timestampUs, 4);
+    memcpy(payload + 8, &sample.seq, 4);
+    record(TRACE_ADS_SAMPLE, payload, sizeof(payload));
+    if (channel >= 0 && channel < ADS_CHANNEL_COUNT)
+    {
+      lastAds[channel] = sample;
+      lastAdsOk[channel] = ok;
+      haveAds[channel] = true;
+    }
+  }
+
+  void scaleSample(bool ok, const ScaleSample &sample)
+  {
+    if (!ok)
+    {
+      record(TRACE_SCALE_SAMPLE, nullptr, 0);
+      return;
+    }
+    uint8_t payload[9];
+    memcpy(payload, &sample.raw, 4);
+    memcpy(payload + 4, &sample.timestampUs, 4);
+    payload[8] = sample.channel;
+    record(TRACE_SCALE_SAMPLE, payload, sizeof(payload));
+  }
+
+  /**
+   * @brief A storage call: its return value plus whatever it copied out.
+   */
+  void storage(const void *result, size_t resultLength, const void *data = nullptr, size_t dataLength = 0)
+  {
+    uint8_t payload[sizeof(double) + TRACE_MAX_STORAGE_BYTES];
+    dataLength = data == nullptr ? 0 : min(dataLength, TRACE_MAX_STORAGE_BYTES);
+    memcpy(payload, result, resultLength);
+    if (dataLength > 0)
+      memcpy(payload + resultLength, data, dataLength);
+    record(TRACE_STORAGE, payload, resultLength + dataLength);
+  }
+
+  void command(bool available, const char *line)
+  {
+    if (!available)
+    {
+      record(TRACE_COMMAND, nullptr, 0);
+      return;
+    }
+    char payload[1 + 128];
+    payload[0] = 1;
+    size_t length = strlcpy(payload + 1, line, sizeof(payload) - 1);
+    record(TRACE_COMMAND, payload, 1 + min(length, sizeof(payload) - 2));
+  }
+
+  void digitalWrite(int pin, int level)
+  {
+    uint8_t payload[2] = {(uint8_t)pin, (uint8_t)(level ? 1 : 0)};
+    record(TRACE_DIGITAL_WRITE, payload, sizeof(payload));
+  }
+
+  void publish(const char *topic, const char *payload, bool retained, bool espNowSendNow, bool sendToMqtt, bool sendToESP)
+  {
+    uint8_t buffer[5 + 64];
+    uint32_t crc = traceCrc32(payload);
+    memcpy(buffer, &crc, 4);
+    buffer[4] = (retained ? 1 : 0) | (espNowSendNow ? 2 : 0) | (sendToMqtt ? 4 : 0) | (sendToESP ? 8 : 0);
+    size_t topicLength = min(strlen(topic), sizeof(buffer) - 5);
+    memcpy(buffer + 5, topic, topicLength);
+    record(TRACE_PUBLISH, buffer, 5 + topicLength);
+  }
+
+private:
+  TraceSink sink;
+  uint32_t lastMillis = 0;
+  uint32_t lastMicros = 0;
+  bool haveMillis = false;
+  bool haveMicros = false;
+  AdsSample lastAds[ADS_CHANNEL_COUNT];
+  bool lastAdsOk[ADS_CHANNEL_COUNT];
+  bool haveAds[ADS_CHANNEL_COUNT];
+};
+
+struct TraceRecord
+{
+  uint8_t type;
+  uint16_t length;
+  const uint8_t *payload;
+};
+
+/**
+ * @brief Reads the record at pos and moves pos past it. Returns false at the
+ * end of the data or on a truncated record.
+ */
+inline bool traceReadRecord(const uint8_t *data, size_t size, size_t &pos, TraceRecord &record)
+{
+  if (pos + 2 > size)
+    return false;
+  size_t at = pos;
+  record.type = data[at];
+  record.length = data[at + 1];
+  at += 2;
+  if (record.length == 255)
+  {
+    if (at + 2 > size)
+      return false;
+    record.length = data[at] | (data[at + 1] << 8);
+    at += 2;
+  }
+  if (at + record.length > size)
+    return false;
+  record.payload = data + at;
+  pos = at + record.length;
+  return true;
+}
+
+/**
+ * @brief Undoes the delta coding of TraceEncoder. Feed it every input record
+ * of a trace in order.
+ */
+class TraceDecoder
+{
+public:
+  template <typename T>
+  T value(const TraceRecord &record, T fallback) const
+  {
+    if (record.length < sizeof(T))
+      return fallback;
+    T v;
+    memcpy(&v, record.payload, sizeof(T));
+    return v;
+  }
+
+  uint32_t millis(const TraceRecord &record)
+  {
+    if (record.length == 1)
+      lastMillis += record.payload[0];
+    else if (record.length == 4)
+      lastMillis = value(record, lastMillis);
+    return lastMillis;
+  }
+
+  uint32_t micros(const TraceRecord &record)
+  {
+    if (record.length == 2)
+      lastMicros += value(record, (uint16_t)0);
+    else if (record.length == 4)
+      lastMicros = value(record, lastMicros);
+    return lastMicros;
+  }
+
+  bool adsSample(const TraceRecord &record, AdsSample &sample)
+  {
+    int channel = record.length > 0 ? record.payload[0] : -1;
+    if (channel < 0 || channel >= ADS_CHANNEL_COUNT)
+      return false;
+    if (record.length >= 12)
+    {
+      lastAdsOk[channel] = record.payload[1] != 0;
+      memcpy(&lastAds[channel].raw, record.payload + 2, 2);
+      memcpy(&lastAds[channel].timestampUs, record.payload + 4, 4);
+      memcpy(&lastAds[channel].seq, record.payload + 8, 4);
+    }
+    sample = lastAds[channel];
+    return lastAdsOk[channel];
+  }
+
+  bool scaleSample(const TraceRecord &record, ScaleSample &sample) const
+  {
+    if (record.length < 9)
+      return false;
+    memcpy(&sample.raw, record.payload, 4);
+    memcpy(&sample.timestampUs, record.payload + 4, 4);
+    sample.channel = record.payload[8];
+    return true;
+  }
+
+private:
+  uint32_t lastMillis = 0;
+  uint32_t lastMicros = 0;
+  AdsSample lastAds[ADS_CHANNEL_COUNT] = {};
+  bool lastAdsOk[ADS_CHANNEL_COUNT] = {};
+};
+
+#endif // INPUT_TRACE_H
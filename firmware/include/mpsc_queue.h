@@ -0,0 +1,147 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A bounded, lock-free multi-producer / single-consumer queue of
+ * preallocated slots (Vyukov's bounded queue, single consumer).
+ *
+ * Any number of tasks may call the producer side (push/claim/commit); they
+ * race for a slot with one compare-and-swap and never block or disable
+ * interrupts. Exactly one task may call the consumer side
+ * (pop/front/release). Every slot carries a sequence number that says
+ * whether it is free for ticket t (sequence == t), filled (t + 1) or still
+ * being read by the consumer. When the queue is full, push() fails.
+ *
+ * A producer that claimed a slot but has not committed it yet holds back
+ * the consumer at that slot; the elements behind it wait until it commits.
+ *
+ * N must be a power of two.
+ */
+template <typename T, size_t N>
+class MpscQueue
+{
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "MpscQueue capacity must be a power of two");
+
+public:
+  MpscQueue() : tail(0), head(0)
+  {
+    for (size_t i = 0; i < N; i++)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  /**
+   * Copies an element into the queue. Returns false if the queue is full.
+   */
+  bool push(const T &item)
+  {
+    size_t ticket;
+    T *slot = claim(ticket);
+    if (slot == nullptr)
+      return false;
+    *slot = item;
+    commit(ticket);
+    return true;
+  }
+
+  /**
+   * Reserves the next free slot for this producer and returns it so the
+   * element can be built in place, or nullptr if the queue is full. Must be
+   * followed by commit(ticket).
+   */
+  T *claim(size_t &ticket)
+  {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      Cell &cell = cells[pos & (N - 1)];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0)
+      {
+        // Free for this ticket; take it unless another producer was faster
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          ticket = pos;
+          return &cell.data;
+        }
+      }
+      else if (diff < 0)
+      {
+        return nullptr; // the consumer has not released this slot yet
+      }
+      else
+      {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * Publishes the slot previously returned by claim().
+   */
+  void commit(size_t ticket)
+  {
+    cells[ticket & (N - 1)].sequence.store(ticket + 1, std::memory_order_release);
+  }
+
+  /**
+   * Moves the oldest element out of the queue. Returns false if empty.
+   */
+  bool pop(T &item)
+  {
+    const T *slot = front();
+    if (slot == nullptr)
+      return false;
+    item = *slot;
+    release();
+    return true;
+  }
+
+  /**
+   * Returns a pointer to the oldest element without removing it, or nullptr
+   * if there is none (or it is still being written). Must be followed by
+   * release() once consumed.
+   */
+  T *front()
+  {
+    Cell &cell = cells[head & (N - 1)];
+    if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+      return nullptr;
+    return &cell.data;
+  }
+
+  /**
+   * Frees the slot previously returned by front() for the producers.
+   */
+  void release()
+  {
+    cells[head & (N - 1)].sequence.store(head + N, std::memory_order_release);
+    head++;
+  }
+
+  static constexpr size_t capacity()
+  {
+    return N;
+  }
+
+private:
+  struct Cell
+  {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  Cell cells[N];
+
+  // Next ticket to hand to a producer
+  std::atomic<size_t> tail;
+
+  // Next ticket to read (owned by the consumer)
+  size_t head;
+};
+
+#endif // MPSC_QUEUE_H
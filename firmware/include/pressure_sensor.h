@@ -0,0 +1,15 @@
+#ifndef PRESSURE_SENSOR_H
+#define PRESSURE_SENSOR_H
+
+/*
+ * Pressure transducer on ADS1115 channel 3 (HAS_PRESSURE_GAUGE).
+ *
+ * The sensor output is linear in pressure: PRESSURE_VOLTAGE_MIN at 0 bar and
+ * PRESSURE_VOLTAGE_MAX at PRESSURE_BAR_MAX, as seen at the ADC input. Shared
+ * by the firmware and the host hydraulic model (src/native/hydraulic_twin.cpp).
+ */
+constexpr double PRESSURE_VOLTAGE_MIN = 0.392;
+constexpr double PRESSURE_VOLTAGE_MAX = 3.683;
+constexpr double PRESSURE_BAR_MAX = 16.0;
+
+#endif // PRESSURE_SENSOR_H
@@ -0,0 +1,130 @@
+#ifndef RATE_SCHEDULER_H
+#define RATE_SCHEDULER_H
+
+#include "hal.h"
+
+/*
+ * Cooperative rate-group scheduler for the control task.
+ *
+ * The control task calls step() once per base period. Each group is
+ * released every periodMs on a fixed grid, so it does not drift with the
+ * step it happens to run in, and due groups run in declaration order
+ * (declare the fastest, most important first). All time comes from
+ * halMillis() / halMicros(), so the schedule is part of an input trace.
+ *
+ * A group's deadline is its next release. A release that passes before
+ * the group ran is dropped and counted as an overrun. When the step itself
+ * is late (it started more than lateMs after its period) or the groups
+ * that already ran used up budgetUs, RATE_SHEDDABLE groups are deferred to
+ * the next step and counted as shed; RATE_CRITICAL groups always run.
+ */
+
+enum RatePriority : uint8_t
+{
+  RATE_CRITICAL,
+  RATE_SHEDDABLE
+};
+
+struct RateGroup
+{
+  const char *name;
+  uint32_t periodMs;
+  RatePriority priority;
+  void (*run)(unsigned long nowMs);
+
+  // --- Statistics (since boot) ---
+  uint32_t runs = 0;
+  uint32_t overruns = 0;     // releases dropped because the group ran too late
+  uint32_t shed = 0;         // steps it was deferred to protect critical groups
+  uint32_t maxLatencyMs = 0; // release to start
+  unsigned long nextRelease = 0;
+};
+
+class RateScheduler
+{
+public:
+  RateScheduler(RateGroup *groups, int count, uint32_t periodMs, uint32_t lateMs, uint32_t budgetUs)
+      : groups(groups), count(count), periodMs(periodMs), lateMs(lateMs), budgetUs(budgetUs) {}
+
+  void step()
+  {
+    unsigned long now = halMillis();
+    unsigned long startUs = halMicros();
+    bool late = false;
+    if (steps > 0)
+    {
+      uint32_t interval = now - lastStepMs;
+      maxIntervalMs = max(maxIntervalMs, interval);
+      late = interval > periodMs + lateMs;
+    }
+    else
+    {
+      for (int i = 0; i < count; i++)
+        groups[i].nextRelease = now;
+    }
+    steps++;
+    lastStepMs = now;
+    if (late)
+      lateSteps++;
+
+    for (int i = 0; i < count; i++)
+    {
+      RateGroup &group = groups[i];
+      if ((long)(now - group.nextRelease) < 0)
+        continue;
+
+      uint32_t missed = (now - group.nextRelease) / group.periodMs;
+      if (missed > 0)
+      {
+        group.overruns += missed;
+        group.nextRelease += missed * group.periodMs;
+      }
+      if (group.priority == RATE_SHEDDABLE && (late || halMicros() - startUs > budgetUs))
+      {
+        group.shed++;
+        continue;
+      }
+
+      group.maxLatencyMs = max(group.maxLatencyMs, (uint32_t)(now - group.nextRelease));
+      group.nextRelease += group.periodMs;
+      group.runs++;
+      group.run(now);
+    }
+  }
+
+  void printStats(Print &out) const
+  {
+    char line[96];
+    out.print("--- Rate Groups (");
+    out.print(steps);
+    out.print(" steps, ");
+    out.print(lateSteps);
+    out.print(" late, longest interval ");
+    out.print(maxIntervalMs);
+    out.println(" ms) ---");
+    snprintf(line, sizeof(line), "  %-14s %7s %10s %9s %6s %9s", "Group", "Period", "Runs", "Overruns", "Shed",
+             "Max late");
+    out.println(line);
+    for (int i = 0; i < count; i++)
+    {
+      const RateGroup &group = groups[i];
+      snprintf(line, sizeof(line), "  %-14s %5lums %10lu %9lu %6lu %7lums", group.name, (unsigned long)group.periodMs,
+               (unsigned long)group.runs, (unsigned long)group.overruns, (unsigned long)group.shed,
+               (unsigned long)group.maxLatencyMs);
+      out.println(line);
+    }
+  }
+
+private:
+  RateGroup *groups;
+  int count;
+  uint32_t periodMs;
+  uint32_t lateMs;
+  uint32_t budgetUs;
+  uint32_t steps = 0;
+  uint32_t lateSteps = 0;
+  uint32_t maxIntervalMs = 0;
+  unsigned long lastStepMs = 0;
+};
+
+#endif // RATE_SCHEDULER_H
@@ -0,0 +1,102 @@
+#ifndef REPORT_POLICY_H
+#define REPORT_POLICY_H
+
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * Report-by-exception for published signals.
+ *
+ * Every signal has a ReportChannel that remembers the last value it sent.
+ * A new value goes out when it moved by more than the deadband and the
+ * minimum interval has passed since the last send, or when the heartbeat
+ * (maximum interval) expires even though nothing moved. A change that is
+ * held back by the minimum interval is not lost: it is still measured
+ * against the last sent value and goes out as soon as the interval allows.
+ *
+ * The deadband is the larger of an absolute band and a band relative to the
+ * last sent value, so a deadband of zero sends every change. Discrete
+ * signals (on/off, state) are offered as small integers.
+ */
+
+struct ReportPolicy
+{
+  float absoluteBand;     // in the signal's unit
+  float relativeBand;     // fraction of the last sent value
+  uint32_t minIntervalMs; // between two sends
+  uint32_t maxIntervalMs; // heartbeat, 0 = none
+};
+
+class ReportChannel
+{
+public:
+  ReportPolicy policy;
+  uint32_t sent = 0;
+  uint32_t suppressed = 0;
+
+  /**
+   * @brief Decides whether value is sent now. minIntervalMs overrides the
+   * policy's (the caller may stretch it while the machine is idle). Counts the
+   * outcome and, when it returns true, takes value as the last sent one.
+   */
+  bool offer(float value, unsigned long now, uint32_t minIntervalMs)
+  {
+    bool due = !hasValue;
+    if (!due)
+    {
+      uint32_t elapsed = now - lastSentMs;
+      if (policy.maxIntervalMs > 0 && elapsed >= policy.maxIntervalMs)
+        due = true;
+      else if (elapsed >= minIntervalMs && moved(value))
+        due = true;
+    }
+    if (!due)
+    {
+      suppressed++;
+      return false;
+    }
+    take(value, now);
+    return true;
+  }
+
+  bool offer(float value, unsigned long now)
+  {
+    return offer(value, now, policy.minIntervalMs);
+  }
+
+  /**
+   * @brief Records a value that was published outside the policy (state sync).
+   */
+  void take(float value, unsigned long now)
+  {
+    lastValue = value;
+    lastSentMs = now;
+    hasValue = true;
+    sent++;
+  }
+
+  /**
+   * @brief Makes the next offer send, e.g. for a client that just connected.
+   */
+  void invalidate()
+  {
+    hasValue = false;
+  }
+
+private:
+  bool moved(float value) const
+  {
+    if (isnan(value) || isnan(lastValue))
+      return isnan(value) != isnan(lastValue);
+    float band = fabsf(lastValue) * policy.relativeBand;
+    if (band < policy.absoluteBand)
+      band = policy.absoluteBand;
+    return fabsf(value - lastValue) > band;
+  }
+
+  float lastValue = 0;
+  unsigned long lastSentMs = 0;
+  bool hasValue = false;
+};
+
+#endif // REPORT_POLICY_H
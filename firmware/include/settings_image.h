@@ -0,0 +1,158 @@
+#ifndef SETTINGS_IMAGE_H
+#define SETTINGS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Versioned binary image for persisted settings.
+ *
+ * An image is one NVS blob: a header followed by records.
+ *
+ *   header:  magic (u32), version (u16), payload length (u16), CRC-32 (u32)
+ *   record:  key (u32), length (u8), length bytes
+ *
+ * The CRC covers the payload, so a torn or corrupted write is detected and
+ * the image is ignored as a whole. Records are self-describing: a reader
+ * skips keys it does not know and keeps the default for keys it does not
+ * find, so adding or dropping a record needs no new version. The version
+ * only changes when a record changes meaning; the reader then migrates the
+ * older record forward. Multi-byte values are little-endian, as stored by
+ * both the ESP32 and the host build.
+ */
+
+struct __attribute__((packed)) ImageHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t length; // payload bytes after the header
+  uint32_t crc;    // CRC-32 of the payload
+};
+
+const size_t IMAGE_HEADER_SIZE = sizeof(ImageHeader);
+const size_t IMAGE_RECORD_OVERHEAD = sizeof(uint32_t) + sizeof(uint8_t);
+const size_t IMAGE_RECORD_MAX = 255;
+
+/**
+ * @brief CRC-32 (IEEE, reflected), the same polynomial as traceCrc32().
+ */
+inline uint32_t imageCrc32(const uint8_t *data, size_t length)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+/**
+ * @brief Builds an image in a caller-owned buffer. end() returns the image
+ * size, or 0 if a record did not fit.
+ */
+class ImageWriter
+{
+public:
+  ImageWriter(uint8_t *buffer, size_t size) : buffer(buffer), size(size) {}
+
+  void begin(uint32_t magic, uint16_t version)
+  {
+    this->magic = magic;
+    this->version = version;
+    length = IMAGE_HEADER_SIZE;
+    overflow = size < IMAGE_HEADER_SIZE;
+  }
+
+  void record(uint32_t key, const void *data, size_t dataLength)
+  {
+    if (dataLength > IMAGE_RECORD_MAX || length + IMAGE_RECORD_OVERHEAD + dataLength > size)
+    {
+      overflow = true;
+      return;
+    }
+    memcpy(buffer + length, &key, sizeof(key));
+    buffer[length + sizeof(key)] = (uint8_t)dataLength;
+    memcpy(buffer + length + IMAGE_RECORD_OVERHEAD, data, dataLength);
+    length += IMAGE_RECORD_OVERHEAD + dataLength;
+  }
+
+  /**
+   * @brief A string record, without its terminator.
+   */
+  void text(uint32_t key, const char *value)
+  {
+    record(key, value, strlen(value));
+  }
+
+  size_t end()
+  {
+    if (overflow || length - IMAGE_HEADER_SIZE > UINT16_MAX)
+      return 0;
+    ImageHeader header;
+    header.magic = magic;
+    header.version = version;
+    header.length = (uint16_t)(length - IMAGE_HEADER_SIZE);
+    header.crc = imageCrc32(buffer + IMAGE_HEADER_SIZE, header.length);
+    memcpy(buffer, &header, sizeof(header));
+    return length;
+  }
+
+private:
+  uint8_t *buffer;
+  size_t size;
+  size_t length = 0;
+  uint32_t magic = 0;
+  uint16_t version = 0;
+  bool overflow = false;
+};
+
+/**
+ * @brief Walks the records of an image read back from NVS.
+ */
+class ImageReader
+{
+public:
+  /**
+   * @brief valid() is true only if length bytes hold a complete image with
+   * the expected magic and a matching CRC.
+   */
+  ImageReader(const uint8_t *buffer, size_t length, uint32_t magic) : buffer(buffer)
+  {
+    if (length < IMAGE_HEADER_SIZE)
+      return;
+    memcpy(&header, buffer, sizeof(header));
+    ok = header.magic == magic && IMAGE_HEADER_SIZE + header.length <= length &&
+         imageCrc32(buffer + IMAGE_HEADER_SIZE, header.length) == header.crc;
+    position = IMAGE_HEADER_SIZE;
+  }
+
+  bool valid() const { return ok; }
+  uint16_t version() const { return header.version; }
+
+  bool next(uint32_t &key, const uint8_t *&data, uint8_t &dataLength)
+  {
+    size_t end = IMAGE_HEADER_SIZE + header.length;
+    if (!ok || position + IMAGE_RECORD_OVERHEAD > end)
+      return false;
+    memcpy(&key, buffer + position, sizeof(key));
+    dataLength = buffer[position + sizeof(key)];
+    if (position + IMAGE_RECORD_OVERHEAD + dataLength > end)
+      return false;
+    data = buffer + position + IMAGE_RECORD_OVERHEAD;
+    position += IMAGE_RECORD_OVERHEAD + dataLength;
+    return true;
+  }
+
+private:
+  const uint8_t *buffer;
+  ImageHeader header = {};
+  size_t position = 0;
+  bool ok = false;
+};
+
+#endif // SETTINGS_IMAGE_H
@@ -0,0 +1,344 @@
+#ifndef SETTINGS_REGISTRY_H
+#define SETTINGS_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+/*
+ * Compile-time registry of settings.
+ *
+ * Every key=value setting is one SettingDescriptor: its key (and an optional
+ * alias), how the value is parsed and range-checked, the variable it lives
+ * in, whether it is stored, its status topic and whether the screen gets that
+ * status.
+ * Setting, saving, loading and publishing all walk the same table, so a new
+ * setting is one table entry. Keys that trigger an action instead of storing
+ * a value (tare, profile upload, ...) are SETTING_ACTION entries.
+ *
+ * Keys are found through a perfect hash built at compile time (hash and
+ * displace): the key is hashed once, its bucket's displacement picks a slot,
+ * and one strcasecmp confirms the match. Keys are case-insensitive.
+ */
+
+enum SettingType : uint8_t
+{
+  SETTING_FLOAT,  // float
+  SETTING_DOUBLE, // double
+  SETTING_INT,    // int32_t (or uint32_t within int32 range)
+  SETTING_BOOL,   // bool, "true" / "false" / "1" / "0"
+  SETTING_TEXT,   // char[size]
+  SETTING_CHOICE, // uint8_t-based enum, value is one of choices[0..size-1]
+  SETTING_ACTION  // no value, action(value) runs
+};
+
+enum SettingFlags : uint8_t
+{
+  SETTING_TO_SCREEN = 1 << 0, // status goes to ESP-NOW as well as MQTT
+  SETTING_RECONNECT = 1 << 1, // changing it reconnects MQTT instead of echoing
+  SETTING_ON_REQUEST = 1 << 2 // published on request only, not by the full sync
+};
+
+const size_t SETTING_TEXT_MAX = 48; // largest SETTING_TEXT buffer
+
+struct SettingDescriptor
+{
+  const char *key;
+  const char *alias; // second accepted key, or nullptr
+  SettingType type;
+  uint8_t flags;
+  uint8_t decimals; // when published
+  void *value;
+  uint16_t size; // SETTING_TEXT buffer size, SETTING_CHOICE choice count
+  const char *const *choices;
+  double minValue;
+  double maxValue;
+  double defaultValue; // loaded when NVS has no value (numbers, choice index)
+  const char *nvsKey;  // nullptr = not stored; key of the per-key layout of older firmware
+  const char *const *topic; // status topic, nullptr = not published
+  bool *override;           // physical switch this setting overrides ("auto" hands back), or nullptr
+  const char *overrideNvsKey;
+  void (*changed)(double previous);    // after the value changed
+  void (*action)(char *value);         // SETTING_ACTION
+  void (*publish)(bool forceFlush);    // replaces the default status publish
+
+  constexpr SettingDescriptor withAlias(const char *second) const
+  {
+    SettingDescriptor setting = *this;
+    setting.alias = second;
+    return setting;
+  }
+
+  /**
+   * @brief The setting overrides a physical switch while flag is set; the
+   * value "auto" clears it. flag is stored under nvsFlagKey.
+   */
+  constexpr SettingDescriptor withOverride(bool *flag, const char *nvsFlagKey) const
+  {
+    SettingDescriptor setting = *this;
+    setting.override = flag;
+    setting.overrideNvsKey = nvsFlagKey;
+    return setting;
+  }
+
+  constexpr SettingDescriptor withPublish(void (*hook)(bool forceFlush)) const
+  {
+    SettingDescriptor setting = *this;
+    setting.publish = hook;
+    return setting;
+  }
+};
+
+// --- Table entries ---
+
+constexpr SettingDescriptor settingNumber(const char *key, SettingType type, void *value, double minValue,
+                                          double maxValue, double defaultValue, uint8_t decimals, const char *nvsKey,
+                                          const char *const *topic, uint8_t flags, void (*changed)(double))
+{
+  return {key, nullptr, type, flags, decimals, value, 0, nullptr, minValue, maxValue, defaultValue,
+          nvsKey, topic, nullptr, nullptr, changed, nullptr, nullptr};
+}
+
+constexpr SettingDescriptor settingFloat(const char *key, float *value, double minValue, double maxValue,
+                                         double defaultValue, uint8_t decimals, const char *nvsKey,
+                                         const char *const *topic, uint8_t flags = 0,
+                                         void (*changed)(double) = nullptr)
+{
+  return settingNumber(key, SETTING_FLOAT, value, minValue, maxValue, defaultValue, decimals, nvsKey, topic, flags,
+                       changed);
+}
+
+constexpr SettingDescriptor settingDouble(const char *key, double *value, double minValue, double maxValue,
+                                          double defaultValue, uint8_t decimals, const char *nvsKey,
+                                          const char *const *topic, uint8_t flags = 0,
+                                          void (*changed)(double) = nullptr)
+{
+  return settingNumber(key, SETTING_DOUBLE, value, minValue, maxValue, defaultValue, decimals, nvsKey, topic, flags,
+                       changed);
+}
+
+template <typename T>
+constexpr SettingDescriptor settingInt(const char *key, T *value, double minValue, double maxValue,
+                                       double defaultValue, const char *nvsKey, const char *const *topic,
+                                       uint8_t flags = 0, void (*changed)(double) = nullptr)
+{
+  static_assert(sizeof(T) == sizeof(int32_t), "integer settings are 32 bit");
+  return settingNumber(key, SETTING_INT, value, minValue, maxValue, defaultValue, 0, nvsKey, topic, flags, changed);
+}
+
+constexpr SettingDescriptor settingBool(const char *key, bool *value, bool defaultValue, const char *nvsKey,
+                                        const char *const *topic, uint8_t flags = 0,
+                                        void (*changed)(double) = nullptr)
+{
+  return settingNumber(key, SETTING_BOOL, value, 0, 1, defaultValue, 0, nvsKey, topic, flags, changed);
+}
+
+template <size_t SIZE>
+constexpr SettingDescriptor settingText(const char *key, char (&value)[SIZE], const char *nvsKey,
+                                        const char *const *topic, uint8_t flags = 0)
+{
+  static_assert(SIZE <= SETTING_TEXT_MAX, "text setting larger than SETTING_TEXT_MAX");
+  return {key, nullptr, SETTING_TEXT, flags, 0, value, SIZE, nullptr, 0, SIZE - 1, 0,
+          nvsKey, topic, nullptr, nullptr, nullptr, nullptr, nullptr};
+}
+
+/**
+ * @brief An enum setting. The enum is kept in one byte and published and
+ * stored as its name, so the NVS value reads the same as the topic.
+ */
+template <typename E, size_t COUNT>
+constexpr SettingDescriptor settingChoice(const char *key, E *value, const char *const (&names)[COUNT],
+                                          E defaultValue, const char *nvsKey, const char *const *topic,
+                                          uint8_t flags = 0, void (*changed)(double) = nullptr)
+{
+  static_assert(sizeof(E) == 1, "choice settings are uint8_t enums");
+  return {key, nullptr, SETTING_CHOICE, flags, 0, value, COUNT, names, 0, COUNT - 1, (double)defaultValue,
+          nvsKey, topic, nullptr, nullptr, changed, nullptr, nullptr};
+}
+
+constexpr SettingDescriptor settingAction(const char *key, void (*action)(char *value), uint8_t flags = 0)
+{
+  return {key, nullptr, SETTING_ACTION, flags, 0, nullptr, 0, nullptr, 0, 0, 0,
+          nullptr, nullptr, nullptr, nullptr, nullptr, action, nullptr};
+}
+
+/**
+ * @brief Bytes the setting's variable takes, 0 for actions.
+ */
+constexpr size_t settingValueSize(const SettingDescriptor &setting)
+{
+  switch (setting.type)
+  {
+  case SETTING_FLOAT:
+    return sizeof(float);
+  case SETTING_DOUBLE:
+    return sizeof(double);
+  case SETTING_INT:
+    return sizeof(int32_t);
+  case SETTING_BOOL:
+    return sizeof(bool);
+  case SETTING_TEXT:
+    return setting.size;
+  case SETTING_CHOICE:
+    return sizeof(uint8_t);
+  default:
+    return 0;
+  }
+}
+
+// --- Perfect hash ---
+
+/**
+ * @brief FNV-1a of the lower-cased key. Passing a previous hash continues it:
+ * settingKeyHash(b, settingKeyHash(a)) is the hash of a followed by b.
+ */
+constexpr uint32_t settingKeyHash(const char *key, uint32_t hash = 2166136261u)
+{
+  for (; *key != '\0'; key++)
+  {
+    char c = *key;
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    hash = (hash ^ (uint8_t)c) * 16777619u;
+  }
+  return hash;
+}
+
+constexpr uint32_t settingSlotHash(uint32_t hash, uint8_t displacement)
+{
+  hash ^= displacement * 0x9E3779B9u;
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6Bu;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+constexpr size_t settingPowerOfTwo(size_t n)
+{
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+constexpr size_t settingKeyCount(const SettingDescriptor *table, size_t count)
+{
+  size_t keys = 0;
+  for (size_t i = 0; i < count; i++)
+    keys += table[i].alias != nullptr ? 2 : 1;
+  return keys;
+}
+
+const uint8_t SETTING_SLOT_EMPTY = 0xFF;
+
+template <size_t BUCKETS, size_t SLOTS>
+struct SettingIndex
+{
+  uint8_t displacement[BUCKETS];
+  uint8_t slots[SLOTS]; // descriptor index or SETTING_SLOT_EMPTY
+  bool complete;        // every key got a slot
+};
+
+/**
+ * @brief Builds the index at compile time. Buckets are placed largest first;
+ * each gets the first displacement that moves all of its keys to free slots.
+ */
+template <size_t BUCKETS, size_t SLOTS, size_t N>
+constexpr SettingIndex<BUCKETS, SLOTS> buildSettingIndex(const SettingDescriptor (&table)[N])
+{
+  static_assert(N < SETTING_SLOT_EMPTY, "too many settings for 8-bit slots");
+  SettingIndex<BUCKETS, SLOTS> index{};
+  uint32_t hashes[2 * N] = {};
+  uint8_t owners[2 * N] = {};
+  size_t keys = 0;
+  for (size_t i = 0; i < N; i++)
+  {
+    hashes[keys] = settingKeyHash(table[i].key);
+    owners[keys++] = i;
+    if (table[i].alias != nullptr)
+    {
+      hashes[keys] = settingKeyHash(table[i].alias);
+      owners[keys++] = i;
+    }
+  }
+  for (size_t s = 0; s < SLOTS; s++)
+    index.slots[s] = SETTING_SLOT_EMPTY;
+
+  size_t bucketSize[BUCKETS] = {};
+  for (size_t k = 0; k < keys; k++)
+    bucketSize[hashes[k] & (BUCKETS - 1)]++;
+
+  index.complete = true;
+  for (size_t size = keys; size > 0; size--)
+  {
+    for (size_t b = 0; b < BUCKETS; b++)
+    {
+      if (bucketSize[b] != size)
+        continue;
+      bool placed = false;
+      for (int d = 0; d < 256 && !placed; d++)
+      {
+        size_t taken[2 * N] = {};
+        size_t count = 0;
+        bool fits = true;
+        for (size_t k = 0; k < keys && fits; k++)
+        {
+          if ((hashes[k] & (BUCKETS - 1)) != b)
+            continue;
+          size_t slot = settingSlotHash(hashes[k], d) & (SLOTS - 1);
+          if (index.slots[slot] != SETTING_SLOT_EMPTY)
+            fits = false;
+          for (size_t t = 0; t < count && fits; t++)
+            fits = taken[t] != slot;
+          taken[count++] = slot;
+        }
+        if (!fits)
+          continue;
+        size_t t = 0;
+        for (size_t k = 0; k < keys; k++)
+        {
+          if ((hashes[k] & (BUCKETS - 1)) == b)
+            index.slots[taken[t++]] = owners[k];
+        }
+        index.displacement[b] = d;
+        placed = true;
+      }
+      if (!placed)
+        index.complete = false;
+    }
+  }
+  return index;
+}
+
+/**
+ * @brief Returns the descriptor for key (or its alias), or nullptr.
+ */
+template <size_t BUCKETS, size_t SLOTS, size_t N>
+const SettingDescriptor *findSetting(const SettingDescriptor (&table)[N], const SettingIndex<BUCKETS, SLOTS> &index,
+                                     const char *key)
+{
+  uint32_t hash = settingKeyHash(key);
+  uint8_t owner = index.slots[settingSlotHash(hash, index.displacement[hash & (BUCKETS - 1)]) & (SLOTS - 1)];
+  if (owner == SETTING_SLOT_EMPTY)
+    return nullptr;
+  const SettingDescriptor &setting = table[owner];
+  if (strcasecmp(key, setting.key) == 0 || (setting.alias != nullptr && strcasecmp(key, setting.alias) == 0))
+    return &setting;
+  return nullptr;
+}
+
+/**
+ * @brief Returns the descriptor whose primary key hashes to hash, or nullptr.
+ * Used for stored records, which carry the key's hash instead of its name.
+ */
+template <size_t BUCKETS, size_t SLOTS, size_t N>
+const SettingDescriptor *findSettingByHash(const SettingDescriptor (&table)[N],
+                                           const SettingIndex<BUCKETS, SLOTS> &index, uint32_t hash)
+{
+  uint8_t owner = index.slots[settingSlotHash(hash, index.displacement[hash & (BUCKETS - 1)]) & (SLOTS - 1)];
+  if (owner == SETTING_SLOT_EMPTY || settingKeyHash(table[owner].key) != hash)
+    return nullptr;
+  return &table[owner];
+}
+
+#endif // SETTINGS_REGISTRY_H
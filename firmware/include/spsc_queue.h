@@ -0,0 +1,120 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+/*
+ * A bounded, lock-free single-producer / single-consumer ring buffer.
+ *
+ * Exactly one task (or ISR) may call the producer side (push/claim/commit)
+ * and exactly one other task may call the consumer side (pop/front/release).
+ * Neither side ever blocks or disables interrupts, so a slow consumer can
+ * never stall the producer: when the queue is full, push() simply fails.
+ *
+ * N must be a power of two.
+ */
+template <typename T, size_t N>
+class SpscQueue
+{
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue capacity must be a power of two");
+
+public:
+  SpscQueue() : head(0), tail(0) {}
+
+  /**
+   * Copies an element into the queue. Returns false if the queue is full.
+   */
+  bool push(const T &item)
+  {
+    T *slot = claim();
+    if (slot == nullptr)
+      return false;
+    *slot = item;
+    commit();
+    return true;
+  }
+
+  /**
+   * Returns a pointer to the next free slot so the producer can build the
+   * element in place, or nullptr if the queue is full. Must be followed by
+   * commit() to make the element visible to the consumer.
+   */
+  T *claim()
+  {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) >= N)
+      return nullptr;
+    return &buffer[t & (N - 1)];
+  }
+
+  /**
+   * Publishes the slot previously returned by claim().
+   */
+  void commit()
+  {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /**
+   * Moves the oldest element out of the queue. Returns false if empty.
+   */
+  bool pop(T &item)
+  {
+    const T *slot = front();
+    if (slot == nullptr)
+      return false;
+    item = *slot;
+    release();
+    return true;
+  }
+
+  /**
+   * Returns a pointer to the oldest element without removing it, or nullptr
+   * if the queue is empty. Must be followed by release() once consumed.
+   */
+  T *front()
+  {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (tail.load(std::memory_order_acquire) == h)
+      return nullptr;
+    return &buffer[h & (N - 1)];
+  }
+
+  /**
+   * Frees the slot previously returned by front().
+   */
+  void release()
+  {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /**
+   * Number of queued elements. Only exact when called from either endpoint.
+   */
+  size_t size() const
+  {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+  }
+
+  bool empty() const
+  {
+    return size() == 0;
+  }
+
+  static constexpr size_t capacity()
+  {
+    return N;
+  }
+
+private:
+  T buffer[N];
+
+  // Index of the next element to read (owned by the consumer)
+  std::atomic<size_t> head;
+
+  // Index of the next slot to write (owned by the producer)
+  std::atomic<size_t> tail;
+};
+
+#endif // SPSC_QUEUE_H
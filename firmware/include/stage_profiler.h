@@ -0,0 +1,214 @@
+#ifndef STAGE_PROFILER_H
+#define STAGE_PROFILER_H
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Per-stage timing of a periodic loop.
+ *
+ * The loop marks where each stage starts and where the pass ends (mark()
+ * with stage N). The time a pass spends in each stage, summed over every
+ * stretch of that stage, goes into a histogram per stage, plus one for the
+ * whole pass. roll() turns the histograms into min / avg / p99 / max and
+ * starts the next window.
+ *
+ * Times are ticks of any free-running 32-bit counter (CPU cycles on the
+ * ESP32), so a mark costs one counter read and a few adds. Histogram buckets
+ * are log-linear: PROFILE_SUB_BUCKETS per power of two, so p99 is exact to
+ * within 25 %. Not thread safe: one task marks, rolls and owns the profiler.
+ */
+
+const int PROFILE_SUB_BITS = 2;
+const int PROFILE_SUB_BUCKETS = 1 << PROFILE_SUB_BITS;
+const int PROFILE_BUCKETS = (32 - PROFILE_SUB_BITS + 1) * PROFILE_SUB_BUCKETS;
+
+inline int profileBucket(uint32_t ticks)
+{
+  if (ticks < (uint32_t)PROFILE_SUB_BUCKETS)
+    return ticks;
+  int shift = 31 - __builtin_clz(ticks) - PROFILE_SUB_BITS;
+  return ((shift + 1) << PROFILE_SUB_BITS) + ((ticks >> shift) & (PROFILE_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Largest tick count that falls into a bucket.
+ */
+inline uint32_t profileBucketTop(int bucket)
+{
+  if (bucket < PROFILE_SUB_BUCKETS)
+    return bucket;
+  int shift = (bucket >> PROFILE_SUB_BITS) - 1;
+  uint32_t base = (uint32_t)(PROFILE_SUB_BUCKETS + (bucket & (PROFILE_SUB_BUCKETS - 1))) << shift;
+  return base + ((1u << shift) - 1);
+}
+
+struct StageSummary
+{
+  uint32_t count; // passes that ran the stage
+  float minUs;
+  float avgUs;
+  float p99Us;
+  float maxUs;
+};
+
+struct StageHistogram
+{
+  uint32_t count;
+  uint32_t minTicks;
+  uint32_t maxTicks;
+  uint64_t sumTicks;
+  uint32_t buckets[PROFILE_BUCKETS];
+
+  StageHistogram()
+  {
+    clear();
+  }
+
+  void clear()
+  {
+    memset(this, 0, sizeof(*this));
+    minTicks = UINT32_MAX;
+  }
+
+  void add(uint32_t ticks)
+  {
+    count++;
+    sumTicks += ticks;
+    if (ticks < minTicks)
+      minTicks = ticks;
+    if (ticks > maxTicks)
+      maxTicks = ticks;
+    buckets[profileBucket(ticks)]++;
+  }
+
+  StageSummary summarize(float ticksPerUs) const
+  {
+    StageSummary summary = {count, 0, 0, 0, 0};
+    if (count == 0)
+      return summary;
+    uint32_t rank = count - count / 100; // the sample at or below which 99 % fall
+    uint32_t seen = 0;
+    uint32_t p99Ticks = maxTicks;
+    for (int i = 0; i < PROFILE_BUCKETS; i++)
+    {
+      seen += buckets[i];
+      if (seen >= rank)
+      {
+        p99Ticks = profileBucketTop(i) < maxTicks ? profileBucketTop(i) : maxTicks;
+        break;
+      }
+    }
+    summary.minUs = minTicks / ticksPerUs;
+    summary.avgUs = (float)((double)sumTicks / count / ticksPerUs);
+    summary.p99Us = p99Ticks / ticksPerUs;
+    summary.maxUs = maxTicks / ticksPerUs;
+    return summary;
+  }
+};
+
+/**
+ * @brief Profiles N stages (0..N-1) of a loop. Index N of the summaries is the
+ * whole pass.
+ */
+template <int N>
+class StageProfiler
+{
+public:
+  StageProfiler()
+  {
+    reset();
+  }
+
+  /**
+   * @brief Starts stage at now and ends the running one; stage N ends the
+   * pass. Returns the stage that was running (N if none), so a nested stage
+   * can hand back to it.
+   */
+  int mark(int stage, uint32_t now)
+  {
+    int previous = current;
+    if (current < N)
+    {
+      passTicks[current] += now - stageStart;
+    }
+    else
+    {
+      passStart = now;
+    }
+    if (stage < N)
+    {
+      ran[stage] = true;
+    }
+    current = stage;
+    stageStart = now;
+    if (stage == N && previous < N)
+    {
+      endPass(now);
+    }
+    return previous;
+  }
+
+  /**
+   * @brief Fills summaries[0..N] with the window so far and starts a new one.
+   */
+  void roll(StageSummary *summaries, float ticksPerUs)
+  {
+    for (int i = 0; i <= N; i++)
+    {
+      summaries[i] = histograms[i].summarize(ticksPerUs);
+      histograms[i].clear();
+    }
+  }
+
+  void reset()
+  {
+    for (int i = 0; i <= N; i++)
+      histograms[i].clear();
+    memset(passTicks, 0, sizeof(passTicks));
+    memset(ran, 0, sizeof(ran));
+    current = N;
+  }
+
+private:
+  void endPass(uint32_t now)
+  {
+    for (int i = 0; i < N; i++)
+    {
+      if (ran[i])
+        histograms[i].add(passTicks[i]);
+    }
+    histograms[N].add(now - passStart);
+    memset(passTicks, 0, sizeof(passTicks));
+    memset(ran, 0, sizeof(ran));
+  }
+
+  StageHistogram histograms[N + 1];
+  uint32_t passTicks[N];
+  bool ran[N];
+  int current;
+  uint32_t stageStart = 0;
+  uint32_t passStart = 0;
+};
+
+/**
+ * @brief Prints summaries[0..count] as a table; the last row is the whole pass.
+ */
+inline void printStageSummaries(Print &out, const char *const *names, const StageSummary *summaries, int count)
+{
+  char line[96];
+  snprintf(line, sizeof(line), "  %-17s %7s %8s %8s %8s %8s", "Stage", "Passes", "Min us", "Avg us", "P99 us", "Max us");
+  out.println(line);
+  for (int i = 0; i <= count; i++)
+  {
+    const StageSummary &summary = summaries[i];
+    if (summary.count == 0)
+      continue;
+    snprintf(line, sizeof(line), "  %-17s %7lu %8.1f %8.1f %8.1f %8.1f", i < count ? names[i] : "(whole pass)",
+             (unsigned long)summary.count, summary.minUs, summary.avgUs, summary.p99Us, summary.maxUs);
+    out.println(line);
+  }
+}
+
+#endif // STAGE_PROFILER_H
@@ -0,0 +1,152 @@
+#ifndef TELEMETRY_FRAME_H
+#define TELEMETRY_FRAME_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Allocation-free writer for the packed telemetry frame.
+ *
+ * A frame is a compact JSON array with a fixed field order, so one MQTT
+ * message carries every signal of a telemetry tick:
+ *
+ *   [version, seq, uptime_ms, boiler, hx, pressure, weight, flow,
+ *    "STATE", lever, pump, heater, heater_output, p_term, i_term, d_term]
+ *
+ * Numbers are written with integer arithmetic (no printf, no dtostrf);
+ * fields the build does not have, and values that are not finite, are null.
+ * Flags are 0 / 1. The writer fills a caller-owned buffer and end() returns
+ * nullptr if the frame did not fit.
+ */
+
+const int TELEMETRY_FRAME_VERSION = 1;
+
+class FrameWriter
+{
+public:
+  FrameWriter(char *buffer, size_t size) : buffer(buffer), size(size) {}
+
+  void begin()
+  {
+    length = 0;
+    fields = 0;
+    overflow = false;
+    put('[');
+  }
+
+  void uint(uint32_t value)
+  {
+    separator();
+    putUnsigned(value);
+  }
+
+  /**
+   * @brief Writes value rounded to decimals (0-4) places.
+   */
+  void fixed(float value, int decimals)
+  {
+    separator();
+    if (!isfinite(value))
+    {
+      putText("null");
+      return;
+    }
+    static const uint32_t SCALE[] = {1, 10, 100, 1000, 10000};
+    uint32_t scale = SCALE[decimals];
+    float scaled = fabsf(value) * scale + 0.5f;
+    if (scaled >= 4294967295.0f)
+    {
+      putText("null");
+      return;
+    }
+    uint32_t units = (uint32_t)scaled;
+    if (value < 0 && units > 0)
+      put('-');
+    putUnsigned(units / scale);
+    if (decimals == 0)
+      return;
+    put('.');
+    uint32_t fraction = units % scale;
+    for (uint32_t digit = scale / 10; digit > 0; digit /= 10)
+    {
+      put('0' + fraction / digit);
+      fraction %= digit;
+    }
+  }
+
+  void flag(bool value)
+  {
+    separator();
+    put(value ? '1' : '0');
+  }
+
+  void null()
+  {
+    separator();
+    putText("null");
+  }
+
+  /**
+   * @brief Writes a quoted string; the caller passes plain identifiers that
+   * need no escaping.
+   */
+  void text(const char *value)
+  {
+    separator();
+    put('"');
+    putText(value);
+    put('"');
+  }
+
+  const char *end()
+  {
+    put(']');
+    if (overflow || length >= size)
+      return nullptr;
+    buffer[length] = '\0';
+    return buffer;
+  }
+
+private:
+  void separator()
+  {
+    if (fields++ > 0)
+      put(',');
+  }
+
+  void put(char c)
+  {
+    if (length + 1 < size)
+      buffer[length++] = c;
+    else
+      overflow = true;
+  }
+
+  void putText(const char *value)
+  {
+    while (*value)
+      put(*value++);
+  }
+
+  void putUnsigned(uint32_t value)
+  {
+    char digits[10];
+    int count = 0;
+    do
+    {
+      digits[count++] = '0' + value % 10;
+      value /= 10;
+    } while (value > 0);
+    while (count > 0)
+      put(digits[--count]);
+  }
+
+  char *buffer;
+  size_t size;
+  size_t length = 0;
+  int fields = 0;
+  bool overflow = false;
+};
+
+#endif // TELEMETRY_FRAME_H
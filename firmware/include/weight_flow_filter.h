@@ -0,0 +1,155 @@
+#ifndef WEIGHT_FLOW_FILTER_H
+#define WEIGHT_FLOW_FILTER_H
+
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * Two-state Kalman filter for the cup scale (HAS_SCALE).
+ *
+ * The state is x = [weight (g), flow (g/s)] with a constant-flow model, fed
+ * with every raw scale sample at the interval given by its timestamp:
+ *
+ *   predict:  weight += flow * dt
+ *             P = F P F' + Q(dt)
+ *             Q(dt) = flowNoise * [dt^3/3, dt^2/2; dt^2/2, dt]
+ *                     + weightNoise * [dt, 0; 0, 0]
+ *   update:   innovation v = z - weight, S = P00 + R, K = [P00, P10] / S
+ *
+ * flowNoise ((g/s)^2 per s) is how fast the flow may change, weightNoise
+ * (g^2 per s) lets the weight step without a flow, e.g. a cup set down.
+ *
+ * The measurement noise R is not fixed: it follows an exponential average
+ * of v^2 - P00, the part of the innovation variance the state uncertainty
+ * does not explain, over noiseWindow samples. A noisy load cell is trusted
+ * less and a quiet one more without retuning. Samples the caller rejected
+ * as outliers never reach update(), so they do not inflate R.
+ */
+class WeightFlowFilter
+{
+public:
+  /**
+   * @brief Sets the tuning. measurementNoise is the starting R (g^2);
+   * weightError and flowError are the variances a reset starts from.
+   */
+  void configure(float flowNoise, float weightNoise, float measurementNoise, float weightError, float flowError,
+                 float noiseWindow)
+  {
+    this->flowNoise = flowNoise;
+    this->weightNoise = weightNoise;
+    this->initialNoise = measurementNoise;
+    this->weightError = weightError;
+    this->flowError = flowError;
+    noiseAlpha = noiseWindow >= 1.0f ? 1.0f / noiseWindow : 1.0f;
+  }
+
+  /**
+   * @brief Starts over from a first sample, at rest.
+   */
+  void reset(float weight, uint32_t timestampUs)
+  {
+    w = weight;
+    f = 0.0f;
+    p00 = weightError;
+    p01 = 0.0f;
+    p11 = flowError;
+    r = initialNoise;
+    lastUs = timestampUs;
+    started = true;
+  }
+
+  bool isStarted() const { return started; }
+  void stop() { started = false; }
+
+  /**
+   * @brief Advances the state to the sample time.
+   */
+  void predict(uint32_t timestampUs)
+  {
+    float dt = (uint32_t)(timestampUs - lastUs) / 1000000.0f;
+    lastUs = timestampUs;
+    if (dt <= 0.0f)
+      return;
+    float dt2 = dt * dt;
+    w += f * dt;
+    // P = F P F' with F = [1 dt; 0 1]
+    float n00 = p00 + 2.0f * dt * p01 + dt2 * p11;
+    float n01 = p01 + dt * p11;
+    p00 = n00 + flowNoise * dt2 * dt / 3.0f + weightNoise * dt;
+    p01 = n01 + flowNoise * dt2 / 2.0f;
+    p11 = p11 + flowNoise * dt;
+  }
+
+  /**
+   * @brief Difference between a sample and the predicted weight.
+   */
+  float innovation(float z) const { return z - w; }
+
+  void update(float z)
+  {
+    float v = z - w;
+    float unexplained = v * v - p00;
+    r += noiseAlpha * (unexplained - r);
+    if (r < MIN_MEASUREMENT_NOISE)
+      r = MIN_MEASUREMENT_NOISE;
+
+    float s = p00 + r;
+    float k0 = p00 / s;
+    float k1 = p01 / s;
+    w += k0 * v;
+    f += k1 * v;
+    // P = (I - K H) P
+    float n11 = p11 - k1 * p01;
+    float n01 = p01 - k0 * p01;
+    p00 = p00 - k0 * p00;
+    p01 = n01;
+    p11 = n11;
+  }
+
+  /**
+   * @brief Moves the weight to a confirmed step (cup set down or lifted)
+   * without reading the jump as flow.
+   */
+  void step(float weight)
+  {
+    w = weight;
+    p00 = weightError;
+    p01 = 0.0f;
+  }
+
+  /**
+   * @brief Scales the current measurement noise, e.g. when the converter
+   * changes rate and with it its noise. The estimate adapts from there.
+   */
+  void scaleMeasurementNoise(float factor)
+  {
+    r *= factor;
+    if (r < MIN_MEASUREMENT_NOISE)
+      r = MIN_MEASUREMENT_NOISE;
+  }
+
+  float weight() const { return w; }
+  float flow() const { return f; }
+  float measurementNoise() const { return r; }
+
+private:
+  static constexpr float MIN_MEASUREMENT_NOISE = 1e-4f; // (0.01 g)^2
+
+  float flowNoise = 0.1f;
+  float weightNoise = 0.1f;
+  float initialNoise = 8.0f;
+  float weightError = 2.0f;
+  float flowError = 2.0f;
+  float noiseAlpha = 1.0f / 30.0f;
+
+  float w = 0.0f;
+  float f = 0.0f;
+  float p00 = 0.0f;
+  float p01 = 0.0f;
+  float p11 = 0.0f;
+  float r = 8.0f;
+  uint32_t lastUs = 0;
+  bool started = false;
+};
+
+#endif // WEIGHT_FLOW_FILTER_H
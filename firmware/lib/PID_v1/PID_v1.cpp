@@ -13,6 +13,16 @@
 
 #include "PID_v1.h"
 
+/* Time source. Defaults to millis(); a build can point it at its own clock
+ * (-D PID_MILLIS=halMillis) so the controller runs on the same time base as
+ * the rest of the firmware.
+ */
+#ifdef PID_MILLIS
+unsigned long PID_MILLIS();
+#else
+#define PID_MILLIS millis
+#endif
+
 /*Constructor (...)*********************************************************
  *    The parameters specified here are those for for which we can't set up
  *    reliable defaults, so we need to have the user set them.
@@ -33,7 +43,7 @@ PID::PID(double *Input, double *Output, double *Setpoint,
    PID::SetControllerDirection(ControllerDirection);
    PID::SetTunings(Kp, Ki, Kd, POn);
 
-   lastTime = millis() - SampleTime;
+   lastTime = PID_MILLIS() - SampleTime;
 }
 
 /*Constructor (...)*********************************************************
@@ -57,7 +67,7 @@ bool PID::Compute()
 {
    if (!inAuto)
       return false;
-   unsigned long now = millis();
+   unsigned long now = PID_MILLIS();
    unsigned long timeChange = (now - lastTime);
    if (timeChange >= SampleTime)
    {
@@ -4,36 +4,25 @@
 // #define HAS_PRESSURE_GAUGE
 // #define HAS_SCALE
 // #define HAS_SCREEN
+// #define HAS_ADS_ALERT   // ADS1115 ALERT/RDY wired to ADS_ALERT_PIN
 
 // =================================================================
 // --- LIBRARIES ---
 // =================================================================
 #include <Arduino.h>
-#include <WiFi.h>
-#include <ESPmDNS.h>
-#include <WiFiUdp.h>
-#include <ArduinoOTA.h>
-#include <Wire.h>
-#include <Adafruit_ADS1X15.h>
 #include "PID_v1.h"
-#include <AsyncMqttClient.h>
-#include <Preferences.h>
 #include <ArduinoJson.h>
-#include <DNSServer.h>
-#include <WebServer.h>
-#include <WiFiManager.h>
-#include <nvs_flash.h>
-#ifdef HAS_SCREEN
-#include <esp_now.h>
-#endif
-#include <esp_pm.h>
-#include <esp_wifi.h>
-#include <esp_wifi_types.h>
+#include "hal.h"
+#include "ntc_table.h"
+#include "heat_loss_model.h"
+#include "pressure_sensor.h"
+#include "rate_scheduler.h"
+#include "telemetry_frame.h"
+#include "report_policy.h"
+#include "settings_registry.h"
+#include "settings_image.h"
 #ifdef HAS_SCALE
-#include "SimpleKalmanFilter.h"
-#endif
-#ifdef HAS_PRESSURE_GAUGE
-#include "dimmable_light.h"
+#include "weight_flow_filter.h"
 #endif
 
 // =================================================================
@@ -53,10 +42,6 @@ const int LEDWATER = D5;
 const int PUMP_RELAY = A3;
 const int COFFEE_RELAY = D7;
 const int HEATER_SSR = A7;
-const int ZERO_CROSS_PIN = D13; // green
-const int PUMP_TRIAC_PIN = A2;  // yellow
-const int ADS_SCLK_PIN = D4;    // scale
-const int ADS_DOUT_PIN = D12;   // scale
 
 // Analog input channels for ADS1115
 const int BOILER_TEMP = 0;
@@ -104,13 +89,15 @@ char mqtt_server[40] = "";
 int mqtt_port = 1883;
 char mqtt_user[33] = "";
 char mqtt_password[33] = "";
-const char *mqtt_client_id = "MaraXV2CustomEspresso";
 
 // --- MQTT Topics ---
 // Status Topics
 const char *mqtt_topic_state = "espresso/status/state";
 const char *mqtt_topic_brew_mode = "espresso/status/brew_mode";
 const char *mqtt_topic_steam_boost = "espresso/status/steam_boost";
+const char *mqtt_topic_telemetry = "espresso/status/telemetry";
+const char *mqtt_topic_shot_stream = "espresso/status/shot_stream";
+const char *mqtt_topic_shot_stream_stats = "espresso/status/shot_stream_stats";
 const char *mqtt_topic_boiler_temp = "espresso/sensor/boiler_temp";
 const char *mqtt_topic_hx_temp = "espresso/sensor/hx_temp";
 #ifdef HAS_PRESSURE_GAUGE
@@ -126,6 +113,8 @@ const char *mqtt_topic_dterm = "espresso/sensor/dterm";
 #ifdef HAS_SCALE
 const char *mqtt_topic_weight = "espresso/sensor/weight";
 const char *mqtt_topic_flow_rate = "espresso/sensor/flow_rate";
+const char *mqtt_topic_cup_weight[] = {"espresso/sensor/cup1_weight", "espresso/sensor/cup2_weight"};
+const char *mqtt_topic_cup_flow_rate[] = {"espresso/sensor/cup1_flow_rate", "espresso/sensor/cup2_flow_rate"};
 #endif
 const char *mqtt_topic_mqtt_server = "espresso/settings/status/mqtt_server";
 const char *mqtt_topic_mqtt_port = "espresso/settings/status/mqtt_port";
@@ -144,6 +133,9 @@ const char *mqtt_topic_set_profiling_target = "espresso/settings/status/profilin
 const char *mqtt_topic_profile_data = "espresso/settings/status/profile_data";
 const char *mqtt_topic_profile_flat = "espresso/settings/status/profiling_flat_value";
 const char *mqtt_topic_active_profile_id = "espresso/settings/status/active_profile_id";
+const char *mqtt_topic_set_telemetry_mode = "espresso/settings/status/telemetry_mode";
+const char *mqtt_topic_set_telemetry_period = "espresso/settings/status/telemetry_period_ms";
+const char *mqtt_topic_set_shot_stream_hz = "espresso/settings/status/shot_stream_hz";
 
 const char *mqtt_topic_set_kp_pressure = "espresso/settings/status/kp_pressure";
 const char *mqtt_topic_set_ki_pressure = "espresso/settings/status/ki_pressure";
@@ -159,109 +151,141 @@ const char *mqtt_topic_set_flow_kalman_q = "espresso/settings/status/flow_kalman
 const char *mqtt_topic_set_weight_kalman_me = "espresso/settings/status/weight_kalman_me";
 const char *mqtt_topic_set_weight_kalman_e = "espresso/settings/status/weight_kalman_e";
 const char *mqtt_topic_set_weight_kalman_q = "espresso/settings/status/weight_kalman_q";
+const char *mqtt_topic_set_scale_cups = "espresso/settings/status/scale_cups";
 #endif
-// Settings Control Topic
-const char *mqtt_topic_set = "espresso/settings/set";
-
-// --- OTA (Over-the-Air Updates) ---
-const char *ota_hostname = "esp32-arduino";
-const char *ota_password = "1234";
-
-// --- Global Connection State ---
-bool isOnline = false;
-WiFiManager wm;
 
 // =================================================================
 // --- SYSTEM & LIBRARY OBJECTS ---
 // =================================================================
-WiFiServer telnetServer(23);
-WiFiClient telnetClient;
-AsyncMqttClient mqttClient;
-Preferences preferences;
-Adafruit_ADS1115 ads;
-#ifdef HAS_PRESSURE_GAUGE
-DimmableLight pumpDimmer(PUMP_TRIAC_PIN);
-#endif
-#ifdef HAS_SCREEN
-typedef struct struct_message
-{
-  char payload[250];
-} struct_message;
-typedef struct struct_pairing
-{
-  uint8_t id;
-  uint8_t macAddr[6];
-  uint8_t channel;
-  char identifier[10];
-} struct_pairing;
-const char *espIdentifier = "espresso";
-struct_message myData;
-struct_pairing pairingData;
-uint8_t screenMacAddress[6];
-bool isScreenPaired = false;
-int myChannel = 0;
-esp_now_peer_info_t peerInfo;
-#define PAIR_REQUEST 1
-#define PAIR_RESPONSE 2
-
-// --- ESP-NOW Buffering ---
-const int MAX_ESPNOW_BUFFER = 250;
-char espNowMessageBuffer[MAX_ESPNOW_BUFFER] = {0}; // Initialize with nulls
-int espNowCurrentLength = 0;
-const unsigned long ESP_NOW_SEND_INTERVAL_MS = 250;
-static unsigned long lastEspNowSendTime = 0;
-volatile bool espNowBusy = false;
-volatile bool pendingScreenSync = false;
-#endif
+HalStorage &preferences = halStorage();
 
 #ifdef HAS_SCALE
 // =================================================================
 // --- SCALE (ADS1232) CONFIGURATION & GLOBALS ---
 // =================================================================
-// --- I2C Configuration ---
-const int PCF8574_ADDRESS = 0x38;
+// --- ADS1232 Input Channels ---
+// One cup on input 2 (a single load cell, or several wired together). With
+// scale_cups at 2 the platform is split: cup 1 on input 1, cup 2 on input 2,
+// each with its own calibration, tare and estimator. currentWeight and
+// flowRate are then the sums of both cups.
 const int SCALE_CHANNEL = 2;
-
-// --- PCF8574 Pin Mapping ---
-const byte PCF_PDWN_BIT = 7;
-const byte PCF_SPEED_BIT = 4;
-const byte PCF_GAIN0_BIT = 6;
-const byte PCF_GAIN1_BIT = 5;
-const byte PCF_TEMP_BIT = 0;
-const byte PCF_A0_BIT = 2;
+const int SCALE_CUPS_MAX = 2;
+int scaleCups = 1;
 
 // --- Calibration Values ---
+// COMBINED_* serve the single cup, CUP_* the split cups. A cup whose scale
+// is still 0 was never tared or calibrated and reads with COMBINED_*, and
+// COMBINED_SCALE stays SCALE_UNCALIBRATED until a calibration is stored.
+const float SCALE_UNCALIBRATED = 1.0;
 long COMBINED_OFFSET = 0;
-float COMBINED_SCALE = 1.0;
+float COMBINED_SCALE = SCALE_UNCALIBRATED;
+long CUP_OFFSET[SCALE_CUPS_MAX] = {};
+float CUP_SCALE[SCALE_CUPS_MAX] = {};
 
 // --- Global Variables ---
-volatile boolean newDataReady = false;
-portMUX_TYPE scaleMux = portMUX_INITIALIZER_UNLOCKED;
-byte pcfState = 0;
 long loadCellValue = 0;
 float currentWeight = 0.0;
 float calibrationWeight = 0.0;
-static float lastRawWeight = 0.0;
-static float pendingWeight = 0.0;
-static bool isWeightPending = false;
-static bool isFirstScaleReading = true;
+int calibrationCup = 0; // cup the test weight is on
 const float SPIKE_THRESHOLD_G = 25.0;
 const int SCALE_BLANKING_PERIOD_MS = 500;
 
-// --- Kalman Filter for Flow Rate ---
+// --- Weight & Flow Estimator ---
+// One two-state Kalman filter (weight_flow_filter.h) estimates weight and
+// flow from the raw samples. The six tuning settings keep their keys:
+//   weight_kalman_me  starting measurement noise (g^2), then adapted
+//   flow_kalman_me    samples the measurement noise is averaged over
+//   weight_kalman_e   weight variance after a reset (g^2)
+//   flow_kalman_e     flow variance after a reset ((g/s)^2)
+//   weight_kalman_q   weight random walk (g^2/s)
+//   flow_kalman_q     flow change ((g/s)^2/s)
 float flowKalmanMe = 30.0;
 float flowKalmanE = 2.0;
 float flowKalmanQ = 0.1;
-SimpleKalmanFilter flowKalmanFilter(flowKalmanMe, flowKalmanE, flowKalmanQ);
 float weightKalmanMe = 8.0;
 float weightKalmanE = 2.0;
 float weightKalmanQ = 0.1;
-SimpleKalmanFilter weightKalmanFilter(weightKalmanMe, weightKalmanE, weightKalmanQ);
 
-// --- Flow Rate Calculation ---
+struct CupEstimate
+{
+  WeightFlowFilter filter;
+  float weight;
+  float flow; // >= 0 during a shot and its post-drip, 0 otherwise
+  float pendingWeight;
+  uint32_t pendingTimestampUs;
+  bool isWeightPending;
+};
+CupEstimate cupEstimates[SCALE_CUPS_MAX];
+
 float flowRate = 0.0f;
-float previousWeightForFlowCalc = 0.0f;
-unsigned long previousTimeForFlowCalc = 0;
+
+// --- Conversion Rate ---
+// The ADS1232 runs at 10 SPS, its lowest-noise rate, and switches to 80 SPS
+// while the lever is up and through the post-drip window, so flow profiling
+// gets 8x the samples when it matters. After a switch the converter's
+// digital filter needs SCALE_SETTLE_CONVERSIONS conversions at the new rate;
+// samples stamped before that and the first one after are dropped. The
+// estimator keeps its time-based tuning, only the measurement noise and the
+// number of samples it is averaged over follow the rate.
+const int SCALE_SLOW_SPS = 10;
+const int SCALE_FAST_SPS = 80;
+const int SCALE_SETTLE_CONVERSIONS = 4;
+const int SCALE_SPEED_DISCARD = 1;
+const float SCALE_FAST_NOISE_RATIO = 7.0f; // noise variance at 80 vs 10 SPS
+const unsigned long SCALE_PUBLISH_PERIOD_MS = 100;
+bool scaleFastRate = false;
+uint32_t scaleSettleUntilUs = 0;
+int scaleSpeedDiscard = 0;
+unsigned long lastScalePublishTime = 0;
+
+// --- Split-Cup Scheduling ---
+// With two cups the HAL alternates the inputs in bursts (halScaleSetDwell)
+// and the converter settles for SCALE_SETTLE_CONVERSIONS after each switch,
+// so a burst of n keeps n / (n + 4) of the sample rate. Longer bursts keep
+// more, but leave each cup unseen for the other cup's burst plus two
+// settlings. The burst is the longest that keeps that gap within
+// SCALE_CUP_GAP_MS, and at least SCALE_MIN_DWELL: at 80 SPS 16 conversions,
+// 64 of the 80 SPS kept; at 10 SPS 4 conversions, half kept.
+const uint32_t SCALE_CUP_GAP_MS = 300;
+const int SCALE_MIN_DWELL = 4;
+
+// --- Background Scale Jobs ---
+// Tare and both calibration steps average the normal sample stream while
+// everything else keeps running: handleScale() hands each raw sample to the
+// running job instead of the weight filter. A job drops the first
+// SCALE_JOB_DISCARD samples after the channel is applied, then finishes as
+// soon as the last SCALE_SETTLE_WINDOW samples scatter by less than
+// SCALE_SETTLE_STDDEV_G, or after SCALE_JOB_TIMEOUT_MS with what it has.
+// Before the first calibration grams mean nothing, so the window is held to
+// SCALE_SETTLE_STDDEV_COUNTS, about 0.1 g at the few hundred counts per gram
+// of a typical load cell.
+const int SCALE_JOB_DISCARD = 4;
+const int SCALE_SETTLE_WINDOW = 16;
+const float SCALE_SETTLE_STDDEV_G = 0.1;
+const float SCALE_SETTLE_STDDEV_COUNTS = 50;
+const uint32_t SCALE_JOB_TIMEOUT_MS = 8000;
+
+struct ScaleJobWindow
+{
+  int discard; // samples still to drop
+  int count;   // samples in the window
+  int next;
+  long window[SCALE_SETTLE_WINDOW];
+  long average;
+  float stddevCounts;
+  bool quiet; // full window within scaleSettleLimitCounts()
+};
+
+// One window per cup; the job settles when every cup's window is quiet
+struct ScaleJob
+{
+  const char *name;
+  void (*done)(const ScaleJob &job); // nullptr = no job running
+  unsigned long startTime;
+  ScaleJobWindow cups[SCALE_CUPS_MAX];
+  bool settled;
+};
+ScaleJob scaleJob = {};
 #endif
 
 // =================================================================
@@ -296,10 +320,37 @@ uint8_t currentProfileIndex = 0;
 
 int numProfilePoints = 0;
 
+// --- Compiled Profile (runtime representation) ---
+// EspressoProfile is packed for storage, which leaves its floats unaligned.
+// The active profile and its nextProfileId chain are compiled once into this
+// aligned layout whenever profiles change; the pump loop only reads from here.
+struct CompiledSegment
+{
+  float startX[MAX_PROFILE_STEPS];      // X at which each step begins
+  float advanceX[MAX_PROFILE_STEPS];    // X at which each step is complete
+  float startY[MAX_PROFILE_STEPS];      // Target at the start of the step
+  float deltaY[MAX_PROFILE_STEPS];      // Ramp height (0 for stepped/instant steps)
+  float invDuration[MAX_PROFILE_STEPS]; // 1 / step length (0 for stepped/instant steps)
+  float finalY;                         // Target once all steps are complete
+  int8_t lastNonZeroStep;               // Last step with a setpoint >= 0.1 (-1 if none)
+  uint8_t profileId;
+  uint8_t numSteps;
+  bool isTargetWeight;
+  bool isSourceFlow;
+  bool declaresNext; // nextProfileId is set (keeps the pump primed at 0 target)
+};
+
+struct CompiledProfile
+{
+  uint8_t numSegments; // Flattened chain, cycles removed
+  CompiledSegment segments[MAX_PROFILES];
+};
+
+CompiledProfile compiledProfile;
+
 // --- Profiling State Tracking ---
 int currentProfileStepIndex = 0;
-float currentStepStartX = 0.0f;
-float prevStepTargetY = 0.0f;
+uint8_t executingSegment = 0;
 unsigned long shotStartTime = 0;
 unsigned long profileStartTime = 0;
 float profileStartWeight = 0.0f;
@@ -353,11 +404,47 @@ bool threeWaySwitch1High = false;
 bool threeWaySwitch2High = false;
 bool leverLiftedInStandby = false;
 bool isBoilerPinHigh = false;
-unsigned long lastBoilerCheckTime = 0;
 unsigned long lastLeverChangedTime = 0;
 unsigned long lastWaterLevelChangedTime = 0;
 const unsigned long debounceDelay = 100;
 
+// --- Boiler Level Probe ---
+// The LM1830 is only powered while it probes: the pin is noted with the IC
+// off (high means the IC is faulty), the IC is enabled and the pin read once
+// it settled. Two empty readings in a row mean the boiler is empty. The probe
+// advances in the level probe rate group and never runs while the pump does.
+// It probes more often right after the pump drew water (shot, flush, refill)
+// and less often while the machine sits in IDLE or STANDBY.
+const uint32_t LEVEL_PROBE_SETTLE_MS = 500;
+const uint32_t LEVEL_PROBE_FAST_MS = 1000;   // after the pump ran
+const uint32_t LEVEL_PROBE_NORMAL_MS = 3000; // otherwise
+const uint32_t LEVEL_PROBE_SLOW_MS = 15000;  // IDLE, STANDBY
+const uint32_t LEVEL_PROBE_FAST_WINDOW_MS = 30000;
+
+enum LevelProbePhase : uint8_t
+{
+  LEVEL_PROBE_WAITING,
+  LEVEL_PROBE_SETTLING, // level reading
+  LEVEL_PROBE_TEST_OFF, // checkic: pin with the IC off
+  LEVEL_PROBE_TEST_ON   // checkic: pin with the IC on
+};
+
+struct LevelProbe
+{
+  LevelProbePhase phase = LEVEL_PROBE_WAITING;
+  unsigned long phaseStart = 0;
+  unsigned long lastStart = 0;  // of the last level reading
+  unsigned long lastResult = 0; // when isBoilerEmpty was last confirmed
+  bool hasResult = false;
+  bool lastReadingEmpty = true; // one empty reading at boot is enough
+  unsigned long fastUntil = 0;  // probe every LEVEL_PROBE_FAST_MS until then
+  bool testRequested = false;   // checkic
+  bool testPinOff = false;
+  uint32_t readings = 0;
+  uint32_t aborted = 0; // by the pump starting
+};
+LevelProbe levelProbe;
+
 // --- Override Flags ---
 bool ignoreBrewSwitch = false;
 bool ignoreTempSwitch = false;
@@ -367,7 +454,13 @@ bool firstMqttConnection = true;
 // --- OPERATIONAL PARAMETERS & SETTINGS ---
 // =================================================================
 // --- Brewing & Steaming Temperatures ---
-char brewMode[7];
+enum BrewMode : uint8_t
+{
+  BREW_COFFEE,
+  BREW_STEAM
+};
+const char *const BREW_MODE_NAMES[] = {"COFFEE", "STEAM"};
+BrewMode brewMode = BREW_COFFEE;
 bool enableSteamBoost = true;
 float tempSetBrew = 94.0;
 float tempSetSteamBoost = 124.0;
@@ -394,11 +487,160 @@ const int TOTAL_CLEANING_REPETITIONS = 10;
 MachineState cleaningStateToResume = IDLE;
 
 // --- Profiling Settings ---
-char profilingMode[10] = "manual";
-char profilingSource[10] = "";
-char profilingTarget[10] = "time";
+enum ProfilingMode : uint8_t
+{
+  PROFILING_MANUAL,
+  PROFILING_FLAT,
+  PROFILING_PROFILE
+};
+const char *const PROFILING_MODE_NAMES[] = {"manual", "flat", "profile"};
+
+enum ProfilingSource : uint8_t
+{
+  SOURCE_PRESSURE,
+  SOURCE_FLOW
+};
+const char *const PROFILING_SOURCE_NAMES[] = {"pressure", "flow"};
+
+enum ProfilingTarget : uint8_t
+{
+  TARGET_TIME,
+  TARGET_WEIGHT
+};
+const char *const PROFILING_TARGET_NAMES[] = {"time", "weight"};
+
+#if defined(HAS_SCALE) && !defined(HAS_PRESSURE_GAUGE)
+const ProfilingSource DEFAULT_PROFILING_SOURCE = SOURCE_FLOW;
+const ProfilingTarget DEFAULT_PROFILING_TARGET = TARGET_WEIGHT;
+#else
+const ProfilingSource DEFAULT_PROFILING_SOURCE = SOURCE_PRESSURE;
+const ProfilingTarget DEFAULT_PROFILING_TARGET = TARGET_TIME;
+#endif
+
+ProfilingMode profilingMode = PROFILING_MANUAL;
+ProfilingSource profilingSource = DEFAULT_PROFILING_SOURCE;
+ProfilingTarget profilingTarget = DEFAULT_PROFILING_TARGET;
 float profilingFlatValue = 100.0;
 
+// --- Telemetry Settings ---
+// "topics" publishes every signal on its own topic (Home Assistant), "frame"
+// one packed frame per tick on mqtt_topic_telemetry (see telemetry_frame.h),
+// "both" does both. The screen gets the per-topic values in every mode.
+enum TelemetryMode : uint8_t
+{
+  TELEMETRY_TOPICS,
+  TELEMETRY_FRAME,
+  TELEMETRY_BOTH
+};
+const char *const TELEMETRY_MODE_NAMES[] = {"topics", "frame", "both"};
+TelemetryMode telemetryMode = TELEMETRY_TOPICS;
+const uint32_t TELEMETRY_PERIOD_MS = 1000; // default, see telemetry_period_ms
+const uint32_t TELEMETRY_PERIOD_MIN_MS = 100;
+const uint32_t TELEMETRY_PERIOD_MAX_MS = 60000;
+uint32_t telemetryPeriodMs = TELEMETRY_PERIOD_MS; // frame period, and the shortest report interval outside BREWING
+uint32_t telemetrySequence = 0;
+unsigned long lastTelemetryFrame = 0;
+
+// --- Report-by-exception (see report_policy.h) ---
+// Per-topic signals are only published when they move past their deadband
+// or their heartbeat expires. Outside BREWING, rate-limited signals (a
+// non-zero minimum interval) are held to telemetryPeriodMs at most.
+enum ReportSignal
+{
+  REPORT_BOILER_TEMP,
+  REPORT_HX_TEMP,
+  REPORT_PRESSURE,
+  REPORT_WEIGHT,
+  REPORT_FLOW_RATE,
+  REPORT_STATE,
+  REPORT_LEVER,
+  REPORT_PUMP,
+  REPORT_HEATER,
+  REPORT_PID_OUTPUT,
+  REPORT_P_TERM,
+  REPORT_I_TERM,
+  REPORT_D_TERM,
+  REPORT_CUP1_WEIGHT, // split cups (scale_cups=2) only
+  REPORT_CUP1_FLOW,
+  REPORT_CUP2_WEIGHT,
+  REPORT_CUP2_FLOW,
+  REPORT_SIGNAL_COUNT
+};
+const int REPORT_LEGACY_SIGNAL_COUNT = REPORT_CUP1_WEIGHT; // in the pre-image "reportPolicy" blob
+const char *const REPORT_SIGNAL_NAMES[REPORT_SIGNAL_COUNT] = {
+    "boiler_temp", "hx_temp", "pressure", "weight", "flow_rate", "state", "lever",
+    "pump", "heater", "pidoutput", "pterm", "iterm", "dterm", "cup1_weight",
+    "cup1_flow", "cup2_weight", "cup2_flow"};
+// {absolute band, relative band, min interval ms, heartbeat ms}
+const ReportPolicy DEFAULT_REPORT_POLICIES[REPORT_SIGNAL_COUNT] = {
+    {0.1, 0, 250, 30000},       // boiler_temp (C)
+    {0.1, 0, 250, 30000},       // hx_temp (C)
+    {0.05, 0, 250, 30000},      // pressure (bar)
+    {0.1, 0, 250, 30000},       // weight (g)
+    {0.1, 0, 250, 30000},       // flow_rate (g/s)
+    {0, 0, 0, 60000},           // state
+    {0, 0, 0, 60000},           // lever
+    {0, 0, 0, 60000},           // pump
+    {0, 0, 1000, 60000},        // heater, toggles every PWM window
+    {0.5, 0, 1000, 30000},      // pidoutput (%)
+    {0.001, 0.05, 1000, 60000}, // pterm
+    {0.001, 0.05, 1000, 60000}, // iterm
+    {0.001, 0.05, 1000, 60000}, // dterm
+    {0.1, 0, 250, 30000},       // cup1_weight (g)
+    {0.1, 0, 250, 30000},       // cup1_flow (g/s)
+    {0.1, 0, 250, 30000},       // cup2_weight (g)
+    {0.1, 0, 250, 30000},       // cup2_flow (g/s)
+};
+ReportChannel reportChannels[REPORT_SIGNAL_COUNT];
+bool reportResyncPending = true; // set when a client connects, see onMqttConnected()
+
+// --- Shot Stream ---
+// From BREWING entry until SHOT_POST_DRIP_DURATION_MS after it ends, the
+// shot signals are sampled at shotStreamHz and published to MQTT and the
+// screen in batches of SHOT_STREAM_BATCH samples. Each frame is a flat array
+// (same writer as the telemetry frame):
+//   [version, shot, seq, t0_ms, then per sample:
+//    dt_ms, pressure, flow, weight, pump_power, target, hx]
+// dt_ms is the time since the previous sample (0 for the first of a frame).
+const int SHOT_STREAM_VERSION = 1;
+const int SHOT_STREAM_BATCH = 5; // a frame of 5 fits one ESP-NOW packet
+const int SHOT_STREAM_MIN_HZ = 10;
+const int SHOT_STREAM_MAX_HZ = 50;
+const uint32_t SHOT_STREAM_IDLE_PERIOD_MS = 100;
+int shotStreamHz = 0; // 0 = off
+
+struct ShotSample
+{
+  unsigned long timeMs;
+  float pressure;
+  float flow;
+  float weight;
+  float target;
+  float hx;
+  uint8_t pumpPower;
+};
+
+struct ShotStream
+{
+  bool active;
+  uint32_t shot;
+  uint32_t seq;
+  unsigned long startMs;
+  unsigned long endMs; // BREWING left, 0 while brewing
+  unsigned long lastSampleMs;
+  ShotSample batch[SHOT_STREAM_BATCH];
+  int batched;
+
+  // --- Statistics (per shot) ---
+  uint32_t samples;
+  uint32_t missed; // sample periods that passed without a sample
+  uint32_t frames;
+  uint32_t overflows; // frames that did not fit the buffer
+  uint32_t bytes;
+  uint32_t publishDropsAtStart;
+};
+ShotStream shotStream = {};
+
 // --- General Flags & Variables ---
 const bool BUZZER_ENABLE = true;
 bool pumpRunning = false;
@@ -422,16 +664,13 @@ double kp_temperature = 0.169;
 double ki_temperature = 0.00002216;
 double kd_temperature = 0;
 
-const double ASSUMED_AMBIENT_TEMP = 20.0;
-const double c1Brew = 0.000363;
-const double c2Brew = 5.623e-12;
-const double c1Boiler = 0.000041;
-const double c2Boiler = 4.984e-12;
+// Heat loss model constants (c1Brew, c2Brew, ...) are in heat_loss_model.h
 
 // --- PID Control Variables ---
 double pidSetpoint;
 double pidInput;
 double pidOutput;
+double heaterOutput = 0.0; // last duty cycle in %, including feed-forward
 PID heaterPID(&pidInput, &pidOutput, &pidSetpoint, kp_temperature, ki_temperature, kd_temperature, DIRECT);
 
 // --- Slow PWM & Manual Control ---
@@ -449,6 +688,8 @@ unsigned long stableTempStartTime = 0;
 double pumpSetpoint;
 double pumpInput;
 double pumpOutput;
+int pumpPower = 0;       // last setPumpPower() value, %
+float pumpTarget = 0.0f; // profile target (bar or g/s), 0 when none
 
 #ifdef HAS_PRESSURE_GAUGE
 // --- PUMP PID (PRESSURE) ---
@@ -471,36 +712,29 @@ PID flowPID(&pumpInput, &pumpOutput, &pumpSetpoint, kp_flow, ki_flow, kd_flow, D
 // =================================================================
 // --- SENSOR CONFIGURATION & DATA ---
 // =================================================================
-// --- NTC Thermistor LUT (Look-Up Table) Generation ---
-// Configuration for the OLD system
-const int OLD_ADC_MAX = 1023;
-const float VCC_OLD = 5.0;
-const float R_SERIES_OHMS_OLD = 7150.0;
-
-const int NEW_ADC_MAX = 32767;
-const float VCC_NEW = 3;
-const float R_SERIES_OHMS_NEW = 10000.0;
-const float V_REF_NEW = 4.096;
-
-const int LEGACY_TEMP_LOOKUP_TABLE[] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 10, 15, 18, 20, 25, 30, 35, 40, 45, 48, 50, 55, 58, 60, 65, 70, 75, 78, 80, 85, 88, 90, 95, 98, 100, 105, 108, 110, 115, 118, 120, 123, 125, 128, 130, 135, 138, 140, 143, 145, 148, 150, 155, 158, 160, 163, 165, 168, 170, 173, 175, 178, 180, 183, 185, 188, 190, 193, 195, 198, 200, 203, 205, 207, 209, 210, 213, 215, 218, 220, 223, 224, 225, 228, 230, 233, 235, 237, 239, 240, 243, 245, 247, 249, 250, 253, 255, 257, 259, 260, 263, 265, 267, 269, 270, 273, 275, 277, 279, 280, 283, 285, 287, 289, 290, 292, 294, 295, 297, 299, 300, 303, 305, 307, 309, 310, 312, 313, 315, 317, 319, 320, 322, 324, 325, 327, 329, 330, 332, 334, 335, 337, 339, 340, 342, 344, 345, 347, 349, 350, 352, 354, 355, 356, 358, 359, 360, 362, 364, 365, 367, 369, 370, 372, 374, 375, 376, 378, 379, 380, 382, 384, 385, 386, 388, 389, 390, 392, 394, 395, 396, 398, 399, 400, 402, 404, 405, 406, 408, 409, 410, 412, 414, 415, 416, 418, 419, 420, 422, 424, 425, 426, 428, 429, 430, 432, 434, 435, 436, 438, 439, 440, 442, 443, 444, 445, 446, 447, 449, 450, 452, 454, 455, 456, 458, 459, 460, 462, 463, 464, 465, 466, 468, 469, 470, 472, 474, 475, 476, 478, 479, 480, 482, 484, 485, 486, 487, 488, 489, 490, 492, 493, 494, 495, 496, 498, 499, 500, 502, 503, 504, 505, 506, 508, 509, 510, 512, 513, 514, 515, 516, 518, 519, 520, 521, 523, 524, 525, 526, 528, 529, 530, 532, 533, 534, 535, 536, 537, 538, 539, 540, 542, 543, 544, 545, 547, 548, 549, 550, 551, 553, 554, 555, 556, 557, 559, 560, 562, 563, 564, 565, 566, 567, 568, 569, 570, 571, 573, 574, 575, 577, 578, 579, 580, 582, 583, 584, 585, 586, 587, 588, 589, 590, 591, 593, 594, 595, 596, 597, 598, 599, 600, 601, 602, 604, 605, 607, 608, 609, 610, 611, 613, 614, 615, 616, 617, 618, 619, 620, 621, 622, 623, 624, 625, 626, 627, 628, 630, 631, 632, 634, 635, 637, 638, 639, 640, 641, 642, 644, 645, 646, 647, 648, 649, 650, 651, 652, 653, 654, 655, 657, 658, 659, 660, 662, 663, 664, 665, 666, 667, 669, 670, 672, 673, 674, 675, 676, 677, 678, 679, 680, 681, 682, 683, 684, 685, 686, 687, 688, 690, 691, 693, 694, 695, 696, 698, 699, 700, 701, 702, 703, 704, 705, 706, 707, 708, 710, 712, 713, 714, 715, 716, 717, 718, 719, 720, 722, 723, 724, 725, 726, 727, 728, 730, 732, 733, 734, 735, 736, 737, 738, 739, 740, 741, 743, 744, 745, 746, 747, 748, 749, 750, 751, 752, 753, 755, 757, 758, 759, 760, 762, 763, 764, 765, 767, 768, 769, 770, 771, 772, 773, 774, 775, 776, 777, 778, 780, 781, 782, 783, 785, 786, 787, 789, 790, 791, 792, 793, 795, 796, 797, 799, 800, 801, 802, 804, 805, 806, 807, 808, 809, 810, 812, 813, 814, 815, 816, 817, 818, 820, 821, 822, 824, 825, 826, 827, 829, 830, 832, 833, 834, 835, 836, 838, 839, 840, 841, 843, 844, 845, 847, 848, 849, 850, 852, 853, 854, 855, 857, 858, 859, 860, 861, 862, 864, 865, 866, 868, 869, 870, 871, 873, 874, 875, 876, 877, 878, 880, 882, 884, 885, 886, 887, 889, 890, 891, 893, 894, 895, 897, 898, 899, 900, 901, 903, 905, 906, 908, 909, 910, 912, 914, 915, 916, 917, 918, 919, 920, 922, 923, 924, 925, 927, 928, 930, 932, 933, 935, 936, 937, 939, 940, 941, 943, 944, 945, 947, 948, 949, 950, 952, 953, 955, 956, 957, 959, 960, 962, 964, 965, 966, 968, 970, 972, 974, 975, 977, 978, 979, 980, 982, 983, 985, 986, 987, 989, 990, 991, 993, 995, 997, 998, 1000, 1002, 1003, 1005, 1006, 1008, 1009, 1010, 1013, 1015, 1017, 1019, 1020, 1022, 1024, 1025, 1027, 1028, 1029, 1030, 1031, 1033, 1035, 1036, 1038, 1040, 1042, 1043, 1044, 1045, 1047, 1048, 1050, 1052, 1054, 1055, 1056, 1058, 1060, 1063, 1065, 1067, 1069, 1070, 1071, 1073, 1075, 1076, 1078, 1080, 1082, 1084, 1085, 1086, 1088, 1090, 1091, 1093, 1095, 1097, 1099, 1100, 1103, 1105, 1107, 1109, 1110, 1112, 1113, 1115, 1116, 1118, 1120, 1123, 1125, 1126, 1128, 1130, 1133, 1135, 1137, 1138, 1140, 1143, 1145, 1147, 1149, 1150, 1151, 1153, 1155, 1157, 1160, 1163, 1165, 1167, 1169, 1170, 1172, 1174, 1175, 1177, 1180, 1182, 1185, 1188, 1190, 1192, 1194, 1195, 1197, 1200, 1203, 1205, 1207, 1209, 1210, 1213, 1215, 1217, 1220, 1223, 1225, 1228, 1230, 1233, 1235, 1237, 1240, 1243, 1245, 1248, 1250, 1252, 1255, 1257, 1259, 1260, 1263, 1265, 1267, 1270, 1275, 1278, 1280, 1283, 1285, 1288, 1290, 1293, 1295, 1297, 1300, 1303, 1305, 1308, 1310, 1313, 1315, 1320, 1322, 1325, 1328, 1330, 1335, 1337, 1340, 1343, 1345, 1348, 1350, 1353, 1355, 1360, 1365, 1368, 1370, 1373, 1375, 1378, 1380, 1385, 1387, 1390, 1393, 1395, 1400, 1402, 1405, 1410, 1413, 1417, 1420, 1425, 1430, 1433, 1437, 1440, 1443, 1447, 1450, 1455, 1460, 1463, 1467, 1470, 1475, 1480, 1483, 1487, 1490, 1495, 1500, 1503, 1507, 1510, 1515, 1520, 1523, 1527, 1530, 1535, 1540, 1545, 1550};
-const int LEGACY_TEMP_LOOKUP_TABLE_SIZE = sizeof(LEGACY_TEMP_LOOKUP_TABLE) / sizeof(int);
+// --- NTC Thermistor Conversion ---
+// Generated at compile time into flash, see ntc_table.h. Build with
+// -D NTC_BETA=<B> -D NTC_R25_OHMS=<R> (Beta model) or -D NTC_SH_A/B/C
+// (Steinhart-Hart) for NTCs that don't follow the stock Mara X curve.
+#if defined(NTC_SH_A) && defined(NTC_SH_B) && defined(NTC_SH_C)
+constexpr NtcTable NTC_TABLE = ntcBuildSteinhartHartTable(NTC_SH_A, NTC_SH_B, NTC_SH_C);
+#elif defined(NTC_BETA) && defined(NTC_R25_OHMS)
+constexpr NtcTable NTC_TABLE = ntcBuildBetaTable(NTC_BETA, NTC_R25_OHMS);
+#else
+constexpr NtcTable NTC_TABLE = ntcBuildLegacyTable();
+#endif
 
-float remappedAdcValues[LEGACY_TEMP_LOOKUP_TABLE_SIZE];
-float remappedTemperatureValues[LEGACY_TEMP_LOOKUP_TABLE_SIZE];
+const int NEW_ADC_MAX = NTC_ADC_MAX;
+const float V_REF_NEW = NTC_V_REF;
 
 // --- Pressure Sensor Configuration ---
-#define PRESSURE_VOLTAGE_MIN 0.392
-#define PRESSURE_VOLTAGE_MAX 3.683
-#define PRESSURE_BAR_MAX 16.0
+// Transducer range (PRESSURE_VOLTAGE_MIN/MAX, PRESSURE_BAR_MAX) is in pressure_sensor.h
 
 // --- General Sensor Constants & Safety Limits ---
 const int16_t ADC_RAILED_THRESHOLD = 500;
 const int16_t ADC_MAX_VALUE = 32767;
 const float MAX_SAFE_TEMPERATURE = 150.0;
 const float MAX_ALLOWED_BOILER_TEMP = 133.0;
-const int16_t BOILER_CHECK_PERIOD = 3000;
-const int16_t BOILER_CHECK_DURATION = 500;
 
 // --- Global Sensor Reading Variables ---
 float boilerTemp = 0.0;
@@ -512,6 +746,16 @@ int16_t hxTempADC = 0;
 // --- Sensor Smoothing (Moving Average) ---
 const int SENSOR_SMOOTHING_SAMPLES = 10;
 
+// --- ADS1115 Channel Schedule ---
+// Sampled continuously in the background (see halAdsBegin()). Pressure is
+// visited twice per round so it updates at ~2x the NTC rate.
+#ifdef HAS_PRESSURE_GAUGE
+const uint8_t adsSchedule[] = {PRESSURE, BOILER_TEMP, PRESSURE, HX_TEMP};
+#else
+const uint8_t adsSchedule[] = {BOILER_TEMP, HX_TEMP};
+#endif
+const int ADS_SCHEDULE_LENGTH = sizeof(adsSchedule) / sizeof(adsSchedule[0]);
+
 // =================================================================
 // --- FORWARD DECLARATIONS ---f
 // =================================================================
@@ -523,17 +767,12 @@ template <typename T>
 void printlnToAll(const T &message);
 void printlnToAll(double value, int precision);
 void publishData(const char *topic, const char *payload, bool retained, bool espNowSendNow = true, bool sendToMqtt = true, bool sendToESP = true);
-void handleTelnet();
-void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total);
-void onMqttConnect(bool sessionPresent);
-void onMqttDisconnect(AsyncMqttClientDisconnectReason reason);
 void saveProfile(int index);
 void handleIncomingSetting(char *message);
-#ifdef HAS_SCREEN
-void OnDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
-void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status);
-void sendEspNowBuffer();
-#endif
+char *nextSettingPair(char *value);
+void onMqttConnected();
+void onScreenPaired();
+void serviceResync();
 // --- Command Processing & Utilities ---
 int getPinByName(const char *pinName);
 void processCommand(char *command);
@@ -559,16 +798,16 @@ void enableWaterLevelSensor(bool on);
 
 // --- Interrupts & Input Handling ---
 void pollDigitalInputs();
-int checkLM1830();
-void periodicBoilerLevelCheck();
+void requestLevelProbeTest();
+void startLevelProbe(unsigned long nowTime);
+uint32_t levelProbeInterval(unsigned long nowTime);
+void serviceLevelProbe(unsigned long nowTime);
 
 // --- Sensor Reading & Processing ---
 void updateSensorReadings();
 bool readPin(const int pin);
-bool detectBoilerLevel();
 int16_t readADSADC(const int pin);
 float convertADCToTemp(int16_t adc);
-float linearInterpolation(float xValues[], float yValues[], int numValues, float pointX, bool trim);
 double feedForwardHeater(double c1, double c2, double steadyStateTemp, double ambientTemp);
 double getTempFromPower(double targetPower, double c1, double c2, double ambientTemp);
 bool checkCriticalSensorFailure();
@@ -576,16 +815,29 @@ void updateCalculatedBoilerTemp();
 
 // --- Scale (ADS1232) Functions ---
 #ifdef HAS_SCALE
-void IRAM_ATTR dataReadyISR();
-void updatePcf();
-long readADCScale();
-void setGain(uint8_t gain);
-void setSpeed(bool high_speed);
-void powerDown(bool power_down);
-void selectChannelScale(uint8_t channel);
 void handleScale();
-long getStableCombinedReadingADS1232(int times = 16);
+void filterScaleSample(CupEstimate &cup, float newRawWeight, uint32_t timestampUs);
+void updateScaleRate();
+bool scaleSampleSettled(const ScaleSample &sample);
+int scaleCupForChannel(uint8_t channel);
+long scaleCupOffset(int cup);
+float scaleCupScale(int cup);
+float scaleSettleLimitCounts(int cup);
+void setScaleCupOffset(int cup, long offset);
+void setScaleCupScale(int cup, float scale);
+uint8_t scaleCupDwell();
+float scaleCupRate();
+void applyScaleCups();
+void printScaleCup(int cup);
+bool startScaleJob(const char *name, void (*done)(const ScaleJob &job));
+void feedScaleJob(int cup, long raw);
+void finishScaleJob(bool settled);
+bool scaleJobUsable(const ScaleJob &job);
+void resetWeightFilter();
 void tareScale();
+void tareDone(const ScaleJob &job);
+void calibrationEmptyDone(const ScaleJob &job);
+void calibrationWeightDone(const ScaleJob &job);
 void calculateFlowRate();
 #endif
 
@@ -603,7 +855,9 @@ void ledStandby();
 void runHeaterPID();
 bool isStable();
 void runPumpProfile();
+bool activeSourceIsFlow();
 float getTargetAt(float currentX);
+void compileActiveProfile();
 void updateBrewMode();
 void updateTempSwitch();
 bool standbyTimoutReached();
@@ -612,15 +866,334 @@ void startProgrammaticFlush(unsigned long duration);
 
 // --- Settings & Configuration ---
 void saveSettings(const char *key);
+void saveScaleCalibration();
+void saveReportPolicy();
+void saveActiveProfileIndex();
+void markSettingsDirty(volatile bool &flag);
+void serviceSettingsCache(unsigned long nowTime);
+void clearSettingsCache();
+size_t countNvsWrite(size_t written);
+void writeImage(const char *key, const uint8_t *buffer, size_t size);
+size_t readImage(const char *key, size_t maxLength);
+size_t buildSettingsImage();
+size_t buildProfileImage(uint8_t *buffer);
+void requestSettingsCommit();
+bool waitForSettingsCommit(uint32_t timeoutMs);
+bool flushSettingsCommit(uint32_t timeoutMs);
+bool decodeSettingValue(const SettingDescriptor &setting, const uint8_t *data, uint8_t length);
+void readSettingRecord(uint32_t key, const uint8_t *data, uint8_t length);
+size_t encodeProfile(const EspressoProfile &profile, uint8_t *out);
+bool decodeProfile(uint16_t version, const uint8_t *data, size_t length, EspressoProfile &profile);
+bool readSettingsImage();
+bool readProfileImage();
+bool loadLegacySettings();
+bool loadLegacyProfiles();
+void removeLegacySettings();
+void markAllSettingsDirty();
+void printSettingsCacheStats();
 void loadSettings();
 void publishSettings();
 void publishSingleSetting(const char *key, bool forceFlush = true);
+void publishSetting(const SettingDescriptor &setting, bool forceFlush);
+void loadLegacySetting(const SettingDescriptor &setting);
+void resetSetting(const SettingDescriptor &setting);
+bool settingIsSynced(const SettingDescriptor &setting);
+double settingValue(const SettingDescriptor &setting);
+bool parseSetting(const SettingDescriptor &setting, const char *value);
+const char *formatSetting(const SettingDescriptor &setting, char *buffer, size_t size);
 void publishAllProfiles();
+void publishProfileSync();
+void discardProfileSync();
+void publishProfileData(bool forceFlush);
+void publishActiveProfileIndex(bool forceFlush);
 void publishState();
-void generateSparseMap();
+bool telemetryTopicsToMqtt();
+bool reportDue(ReportSignal signal, float value, unsigned long now);
+void reportNumber(ReportSignal signal, const char *topic, float value, int decimals, unsigned long now);
+void reportText(ReportSignal signal, const char *topic, int code, const char *text, unsigned long now);
+bool applyReportPolicy(char *value);
+void printReportStats();
+void publishTelemetryFrame(unsigned long nowTime);
+void startShotStream();
+void flushShotStream();
+void finishShotStream(unsigned long nowTime);
+void applyShotStreamRate();
+bool profilingIsManual();
 void setup();
-void loop();
-void startNetworkServices();
+
+// --- Setting Hooks (see SETTINGS REGISTRY) ---
+void brewTempChanged(double previous);
+void steamBoostChanged(double previous);
+#ifdef HAS_PRESSURE_GAUGE
+void pressureTuningsChanged(double previous);
+#endif
+#ifdef HAS_SCALE
+void flowTuningsChanged(double previous);
+void weightFlowTuningChanged(double previous);
+void scaleCupsChanged(double previous);
+void tareScaleAction(char *value);
+void calibrateScaleAction(char *value);
+void calibrationStepAction(char *value);
+#endif
+void shotStreamChanged(double previous);
+void activeProfileAction(char *value);
+void profileDataAction(char *value);
+void startCleaningAction(char *value);
+void reportPolicyAction(char *value);
+void requestAction(char *value);
+
+// --- Control Loop ---
+void controlStep();
+void drainCommandQueue();
+void drainSettingQueue();
+void runControlGroup(unsigned long nowTime);
+void runShotStreamGroup(unsigned long nowTime);
+void runLevelProbeGroup(unsigned long nowTime);
+void runTelemetryGroup(unsigned long nowTime);
+
+// =================================================================
+// --- CONTROL SCHEDULE ---
+// =================================================================
+// controlStep() runs every CONTROL_PERIOD_MS and hands out the time by rate
+// group (see rate_scheduler.h). Control work is critical and runs every
+// step; the level probe and telemetry give way when a step runs late.
+const uint32_t CONTROL_LATE_MS = 5;         // step start jitter that counts as late
+const uint32_t CONTROL_BUDGET_US = 5000;    // critical work after which the rest waits
+const uint32_t LEVEL_PROBE_PERIOD_MS = 100; // LM1830 timing is in 100s of ms
+const uint32_t REPORT_TICK_MS = 100;        // report-by-exception evaluation
+
+enum RateGroupIndex
+{
+  GROUP_CONTROL,
+  GROUP_SHOT_STREAM,
+  GROUP_LEVEL_PROBE,
+  GROUP_TELEMETRY
+};
+
+RateGroup rateGroups[] = {
+    {"control", CONTROL_PERIOD_MS, RATE_CRITICAL, runControlGroup},
+    {"shot stream", SHOT_STREAM_IDLE_PERIOD_MS, RATE_SHEDDABLE, runShotStreamGroup},
+    {"level probe", LEVEL_PROBE_PERIOD_MS, RATE_SHEDDABLE, runLevelProbeGroup},
+    {"telemetry", REPORT_TICK_MS, RATE_SHEDDABLE, runTelemetryGroup},
+};
+RateScheduler scheduler(rateGroups, sizeof(rateGroups) / sizeof(rateGroups[0]), CONTROL_PERIOD_MS, CONTROL_LATE_MS,
+                        CONTROL_BUDGET_US);
+
+// =================================================================
+// --- SETTINGS REGISTRY ---
+// =================================================================
+// Every key=value setting (see settings_registry.h). The order is the order
+// of the full settings sync. Defaults are what loadSettings() uses when NVS
+// has no value; values outside [min, max] are rejected.
+constexpr SettingDescriptor SETTINGS[] = {
+    // --- Network & MQTT ---
+    settingText("mqtt_server", mqtt_server, "mqttServer", &mqtt_topic_mqtt_server, SETTING_TO_SCREEN | SETTING_RECONNECT),
+    settingInt("mqtt_port", &mqtt_port, 1, 65535, 1883, "mqttPort", &mqtt_topic_mqtt_port,
+               SETTING_TO_SCREEN | SETTING_RECONNECT),
+    settingText("mqtt_user", mqtt_user, "mqttUser", &mqtt_topic_mqtt_user, SETTING_TO_SCREEN | SETTING_RECONNECT),
+    settingText("mqtt_password", mqtt_password, "mqttPass", &mqtt_topic_mqtt_pass, SETTING_TO_SCREEN | SETTING_RECONNECT)
+        .withAlias("mqtt_pass"),
+
+    // --- Profiles ---
+    settingAction("profile_data", profileDataAction, SETTING_TO_SCREEN).withAlias("profile").withPublish(publishProfileData),
+    settingAction("active_profile_id", activeProfileAction, SETTING_TO_SCREEN | SETTING_ON_REQUEST)
+        .withPublish(publishActiveProfileIndex),
+
+    // --- Temperatures & Modes ---
+    settingFloat("tempsetbrew", &tempSetBrew, 80, 100, 94.0, 3, "tempSetBrew", &mqtt_topic_set_temp_brew,
+                 SETTING_TO_SCREEN, brewTempChanged)
+        .withOverride(&ignoreTempSwitch, "ignoreTempSw"),
+    settingFloat("tempsetsteam", &tempSetSteam, 100, 150, 136.0, 3, "tempSetSteam", &mqtt_topic_set_temp_steam),
+    settingFloat("tempsetsteamboost", &tempSetSteamBoost, 100, 150, 124.0, 3, "tempSetSteamB",
+                 &mqtt_topic_set_temp_steam_boost),
+    settingChoice("brewmode", &brewMode, BREW_MODE_NAMES, BREW_COFFEE, "brewMode", &mqtt_topic_brew_mode,
+                  SETTING_TO_SCREEN)
+        .withOverride(&ignoreBrewSwitch, "ignoreBrewSw"),
+    settingBool("steamboost", &enableSteamBoost, true, "steamBoost", &mqtt_topic_steam_boost, SETTING_TO_SCREEN,
+                steamBoostChanged)
+        .withAlias("enablesteamboost"),
+
+    // --- Temperature PID ---
+    settingDouble("kp_temperature", &kp_temperature, 0, 100, 0.16, 3, "kp_temperature", &mqtt_topic_set_kp_temperature)
+        .withAlias("kp"),
+    settingDouble("ki_temperature", &ki_temperature, 0, 100, 0.0000261, 8, "ki_temperature",
+                  &mqtt_topic_set_ki_temperature)
+        .withAlias("ki"),
+    settingDouble("kd_temperature", &kd_temperature, 0, 1000, 0, 2, "kd_temperature", &mqtt_topic_set_kd_temperature)
+        .withAlias("kd"),
+
+    // --- Profiling ---
+    settingChoice("profiling_mode", &profilingMode, PROFILING_MODE_NAMES, PROFILING_MANUAL, "profMode",
+                  &mqtt_topic_set_profiling_mode, SETTING_TO_SCREEN)
+        .withAlias("prof_mode"),
+    settingChoice("profiling_source", &profilingSource, PROFILING_SOURCE_NAMES, DEFAULT_PROFILING_SOURCE, "profSource",
+                  &mqtt_topic_set_profiling_source, SETTING_TO_SCREEN)
+        .withAlias("prof_src"),
+    settingChoice("profiling_target", &profilingTarget, PROFILING_TARGET_NAMES, DEFAULT_PROFILING_TARGET, "profTarget",
+                  &mqtt_topic_set_profiling_target, SETTING_TO_SCREEN)
+        .withAlias("prof_trg"),
+    settingFloat("profiling_flat_value", &profilingFlatValue, 0, 100, 100.0, 1, "profFlatVal", &mqtt_topic_profile_flat,
+                 SETTING_TO_SCREEN)
+        .withAlias("prof_flat"),
+
+    // --- Telemetry ---
+    settingChoice("telemetry_mode", &telemetryMode, TELEMETRY_MODE_NAMES, TELEMETRY_TOPICS, "telemMode",
+                  &mqtt_topic_set_telemetry_mode),
+    settingInt("telemetry_period_ms", &telemetryPeriodMs, TELEMETRY_PERIOD_MIN_MS, TELEMETRY_PERIOD_MAX_MS,
+               TELEMETRY_PERIOD_MS, "telemPeriod", &mqtt_topic_set_telemetry_period),
+    settingInt("shot_stream_hz", &shotStreamHz, 0, SHOT_STREAM_MAX_HZ, 0, "shotStreamHz", &mqtt_topic_set_shot_stream_hz,
+               0, shotStreamChanged),
+    settingAction("report_policy", reportPolicyAction),
+
+#ifdef HAS_PRESSURE_GAUGE
+    // --- Pressure PID ---
+    settingDouble("kp_pressure", &kp_pressure, 0, 100, 0.05, 3, "kp_pressure", &mqtt_topic_set_kp_pressure, 0,
+                  pressureTuningsChanged),
+    settingDouble("ki_pressure", &ki_pressure, 0, 100, 22, 3, "ki_pressure", &mqtt_topic_set_ki_pressure, 0,
+                  pressureTuningsChanged),
+    settingDouble("kd_pressure", &kd_pressure, 0, 100, 0, 3, "kd_pressure", &mqtt_topic_set_kd_pressure, 0,
+                  pressureTuningsChanged),
+#endif
+#ifdef HAS_SCALE
+    // --- Flow PID ---
+    settingDouble("kp_flow", &kp_flow, 0, 100, 1.0, 3, "kp_flow", &mqtt_topic_set_kp_flow, 0, flowTuningsChanged),
+    settingDouble("ki_flow", &ki_flow, 0, 100, 0.5, 3, "ki_flow", &mqtt_topic_set_ki_flow, 0, flowTuningsChanged),
+    settingDouble("kd_flow", &kd_flow, 0, 100, 0, 3, "kd_flow", &mqtt_topic_set_kd_flow, 0, flowTuningsChanged),
+
+    // --- Kalman Filters ---
+    settingFloat("weight_kalman_me", &weightKalmanMe, 0.01, 1000, 8.0, 2, "weightKalmanMe",
+                 &mqtt_topic_set_weight_kalman_me, 0, weightFlowTuningChanged),
+    settingFloat("weight_kalman_e", &weightKalmanE, 0.01, 1000, 2.0, 2, "weightKalmanE", &mqtt_topic_set_weight_kalman_e,
+                 0, weightFlowTuningChanged),
+    settingFloat("weight_kalman_q", &weightKalmanQ, 0.001, 100, 0.1, 2, "weightKalmanQ", &mqtt_topic_set_weight_kalman_q,
+                 0, weightFlowTuningChanged),
+    settingFloat("flow_kalman_me", &flowKalmanMe, 0.01, 1000, 30.0, 2, "flowKalmanMe", &mqtt_topic_set_flow_kalman_me, 0,
+                 weightFlowTuningChanged),
+    settingFloat("flow_kalman_e", &flowKalmanE, 0.01, 1000, 2.0, 2, "flowKalmanE", &mqtt_topic_set_flow_kalman_e, 0,
+                 weightFlowTuningChanged),
+    settingFloat("flow_kalman_q", &flowKalmanQ, 0.001, 100, 0.1, 2, "flowKalmanQ", &mqtt_topic_set_flow_kalman_q, 0,
+                 weightFlowTuningChanged),
+
+    // --- Scale ---
+    settingAction("tare_scale", tareScaleAction),
+    settingAction("calibratescale", calibrateScaleAction),
+    settingAction("calibration_step", calibrationStepAction),
+    settingInt("scale_cups", &scaleCups, 1, SCALE_CUPS_MAX, 1, "scaleCups", &mqtt_topic_set_scale_cups, 0,
+               scaleCupsChanged),
+#endif
+
+    // --- Commands ---
+    settingAction("start_cleaning", startCleaningAction),
+    settingAction("request", requestAction),
+};
+constexpr size_t SETTING_COUNT = sizeof(SETTINGS) / sizeof(SETTINGS[0]);
+constexpr size_t SETTING_KEYS = settingKeyCount(SETTINGS, SETTING_COUNT);
+constexpr auto settingIndex =
+    buildSettingIndex<settingPowerOfTwo(SETTING_KEYS), settingPowerOfTwo(2 * SETTING_KEYS)>(SETTINGS);
+static_assert(settingIndex.complete, "settings perfect hash has a collision, grow the slot table");
+
+// --- Settings Cache ---
+// The variables above are the cache. A change marks its entry dirty and
+// requestSettingsCommit() hands all dirty entries to the comms task, which
+// writes them in one NVS session (commitSettings()), once settings
+// have been quiet for SETTINGS_COMMIT_QUIET_MS, or at the next state
+// transition. Nothing is written while BREWING.
+const uint32_t SETTINGS_COMMIT_QUIET_MS = 2000;
+const size_t SETTING_TRANSACTION_MAX = 16; // pairs in one k1=v1|k2=v2 message
+
+volatile bool settingDirty[SETTING_COUNT] = {};
+volatile bool profileDirty[MAX_PROFILES] = {};
+volatile bool scaleCalibrationDirty = false;
+volatile bool reportPolicyDirty = false;
+volatile bool activeProfileIndexDirty = false;
+volatile bool settingsDirty = false; // any of the above
+bool storedOverride[SETTING_COUNT] = {}; // as saved; the offline fallback to the switches is not
+unsigned long lastSettingChangeTime = 0;
+
+struct SettingsCacheStats
+{
+  uint32_t changes;   // values marked dirty
+  uint32_t coalesced; // of those, already dirty (no extra flash write)
+  uint32_t commits;
+  uint32_t writes; // NVS put calls
+  uint32_t failedWrites;
+  uint32_t lastCommitWrites;
+  uint32_t lastCommitUs;
+  uint32_t maxCommitUs;
+  uint32_t totalCommitUs;
+  uint32_t bootReads; // NVS reads of the last loadSettings()
+  uint32_t bootLoadUs;
+  const char *bootSource;
+};
+SettingsCacheStats settingsCacheStats = {};
+
+// --- Settings Image (see settings_image.h) ---
+// Settings and profiles are stored as two CRC-protected images, so a boot
+// reads two blobs. Settings records are keyed by settingKeyHash() of the
+// table key, profile records by profile index. Firmware before the images
+// stored one NVS key per value; that layout is read when there is no
+// settings image, written back as images by the next commit and removed.
+const uint32_t SETTINGS_IMAGE_MAGIC = 0x3153584D; // "MXS1"
+const uint32_t PROFILE_IMAGE_MAGIC = 0x3150584D;  // "MXP1"
+const uint16_t SETTINGS_IMAGE_VERSION = 1;
+const uint16_t PROFILE_IMAGE_VERSION = 1; // 0 = raw EspressoProfile blob (per-key layout)
+const char *const SETTINGS_IMAGE_KEY = "settings";
+const char *const PROFILE_IMAGE_KEY = "profiles";
+// flags, next profile, name length, name, step count, steps
+const size_t PROFILE_RECORD_MAX = 4 + sizeof(EspressoProfile::name) - 1 + MAX_PROFILE_STEPS * 2 * sizeof(float);
+static_assert(PROFILE_RECORD_MAX <= IMAGE_RECORD_MAX, "profile record too long for an image record");
+const size_t SETTINGS_IMAGE_MAX = 1024;
+const size_t PROFILE_IMAGE_MAX = IMAGE_HEADER_SIZE + MAX_PROFILES * (IMAGE_RECORD_OVERHEAD + PROFILE_RECORD_MAX);
+constexpr uint32_t SCALE_OFFSET_RECORD = settingKeyHash("scaleOffset");
+constexpr uint32_t SCALE_SCALE_RECORD = settingKeyHash("scaleScale");
+constexpr uint32_t CUP_OFFSET_RECORDS[] = {settingKeyHash("cup1Offset"), settingKeyHash("cup2Offset")};
+constexpr uint32_t CUP_SCALE_RECORDS[] = {settingKeyHash("cup1Scale"), settingKeyHash("cup2Scale")};
+constexpr uint32_t ACTIVE_PROFILE_RECORD = settingKeyHash("curIdx");
+constexpr uint32_t REPORT_POLICY_RECORD = settingKeyHash("report_"); // continued with the signal name
+const uint8_t PROFILE_FLAG_STEPPED = 1 << 0;
+const uint8_t PROFILE_FLAG_TARGET_WEIGHT = 1 << 1;
+const uint8_t PROFILE_FLAG_SOURCE_FLOW = 1 << 2;
+
+uint8_t settingsImageBuffer[PROFILE_IMAGE_MAX];  // boot load, then the profile image of a commit
+uint8_t settingsCommitBuffer[SETTINGS_IMAGE_MAX]; // the settings image of a commit
+volatile bool legacySettingsStored = false;      // per-key layout still in NVS
+
+// --- Commit Snapshot ---
+// The control task encodes the images holding a dirty entry
+// (requestSettingsCommit()) and the comms task only writes the encoded bytes
+// (commitSettings()), so a commit never reads a setting or profile halfway
+// through a change. One snapshot is out at a time: settingsCommitBusy is set
+// when it is handed over and cleared once it is written; changes made
+// meanwhile stay dirty for the next one. reboot and factoryreset wait for it.
+const uint32_t SETTINGS_FLUSH_TIMEOUT_MS = 2000;
+
+struct SettingsCommit
+{
+  bool settingsChanged;
+  size_t settingsSize; // 0 = did not fit its buffer
+  bool profilesChanged;
+  size_t profilesSize;
+  bool savedProfiles[MAX_PROFILES];
+};
+SettingsCommit settingsCommit = {};
+volatile bool settingsCommitBusy = false;
+
+// --- Resync ---
+// A new MQTT client or screen gets the settings, the state and the profiles
+// again. The transports only note the connection (halTakeResyncRequest())
+// and the sync is built on the control task, which owns all of it. Settings
+// go through the outbound queue a few per telemetry tick, so a sync never
+// fills it. Profile JSON does not fit a queue slot: the control task encodes
+// the profiles into profileSyncBuffer and the comms task publishes from that
+// (publishProfileSync()), one snapshot at a time like a commit.
+const size_t SETTINGS_SYNC_PER_TICK = 8;
+size_t settingsSyncNext = SETTING_COUNT; // next entry of a running sync
+size_t settingsSyncLastToScreen = 0;
+bool profileSyncPending = false;
+uint8_t profileSyncBuffer[PROFILE_IMAGE_MAX];
+size_t profileSyncSize = 0;
+uint8_t profileSyncActiveIndex = 0;
+volatile bool profileSyncBusy = false;
 
 // =================================================================
 // --- FUNCTION DEFINITIONS ---
@@ -632,812 +1205,274 @@ void startNetworkServices();
 template <typename T>
 void printToAll(const T &message)
 {
-  if (telnetClient && telnetClient.connected())
-  {
-    telnetClient.print(message);
-  }
+  halConsole().print(message);
 }
 
 void printToAll(double value, int precision)
 {
-  if (telnetClient && telnetClient.connected())
-  {
-    telnetClient.print(value, precision);
-  }
+  halConsole().print(value, precision);
 }
 
 template <typename T>
 void printlnToAll(const T &message)
 {
-  if (telnetClient && telnetClient.connected())
-  {
-    telnetClient.println(message);
-  }
+  halConsole().println(message);
 }
 
 void printlnToAll(double value, int precision)
 {
-  if (telnetClient && telnetClient.connected())
-  {
-    telnetClient.println(value, precision);
-  }
+  halConsole().println(value, precision);
 }
 
 void publishData(const char *topic, const char *payload, bool retained, bool espNowSendNow, bool sendToMqtt, bool sendToESP)
 {
-  if (sendToMqtt && isOnline)
-  {
-    if (mqttClient.connected())
-    {
-      mqttClient.publish(topic, 0, retained, payload);
-    }
-  }
-#ifdef HAS_SCREEN
-  if (!sendToESP)
-  {
-    return;
-  }
-  if (!isScreenPaired)
-  {
-    return;
-  }
-
-  const char *keyStart = strrchr(topic, '/');
+  halPublish(topic, payload, retained, espNowSendNow, sendToMqtt, sendToESP);
+}
 
-  if (keyStart == NULL)
-  {
-    keyStart = topic;
-  }
-  else
+/**
+ * @brief Resync for a new MQTT connection; runs on the control task (see
+ * serviceResync()).
+ */
+void onMqttConnected()
+{
+  reportResyncPending = true;
+  publishSettings();
+  if (firstMqttConnection)
   {
-    keyStart = keyStart + 1;
+    printlnToAll("First connection: Performing initial state sync.");
+    publishState();
+    firstMqttConnection = false;
   }
-  int keyLen = strlen(keyStart);
-  int valLen = strlen(payload);
-  int neededSpace = keyLen + 1 + valLen;
+}
 
-  if (espNowCurrentLength > 0)
-  {
-    neededSpace++;
-  }
+void onScreenPaired()
+{
+  printlnToAll("Syncing all settings and state to new screen.");
+  reportResyncPending = true;
+  publishSettings();
+  publishState();
+}
 
-  if (espNowCurrentLength + neededSpace >= MAX_ESPNOW_BUFFER - 1)
+/**
+ * @brief Starts the resyncs the transports asked for and feeds a running
+ * settings sync and profile snapshot to the comms side. Called every
+ * telemetry tick.
+ */
+void serviceResync()
+{
+  // A batch per tick; a sync started below sends its first one next tick
+  if (settingsSyncNext < SETTING_COUNT)
   {
-    sendEspNowBuffer();
+    size_t published = 0;
+    while (settingsSyncNext < SETTING_COUNT && published < SETTINGS_SYNC_PER_TICK)
+    {
+      size_t i = settingsSyncNext++;
+      if (!settingIsSynced(SETTINGS[i]))
+        continue;
+      publishSetting(SETTINGS[i], i == settingsSyncLastToScreen);
+      published++;
+    }
+    if (settingsSyncNext == SETTING_COUNT)
+      printlnToAll("Full settings sync complete.");
   }
 
-  if (espNowCurrentLength > 0)
-  {
-    strcat(espNowMessageBuffer, "|");
-    espNowCurrentLength++;
-  }
-  strcat(espNowMessageBuffer, keyStart);
-  strcat(espNowMessageBuffer, "=");
-  strcat(espNowMessageBuffer, payload);
-  espNowCurrentLength = strlen(espNowMessageBuffer);
-  if (espNowSendNow)
+  uint8_t requests = halTakeResyncRequest();
+  if (requests & RESYNC_MQTT)
+    onMqttConnected();
+  if (requests & RESYNC_SCREEN)
+    onScreenPaired();
+
+  if (profileSyncPending && !profileSyncBusy)
   {
-    sendEspNowBuffer();
+    profileSyncPending = false;
+    profileSyncActiveIndex = currentProfileIndex;
+    profileSyncSize = buildProfileImage(profileSyncBuffer);
+    profileSyncBusy = true;
+    halRequestProfilesSync();
   }
-#endif
 }
 
-void handleTelnet()
+/**
+ * @brief Applies "key=value", or "k1=v1|k2=v2|..." as one transaction: every
+ * value is checked first and if one is unknown or invalid none is applied.
+ * Actions in a transaction run after its values were applied. A '|' only
+ * starts a new pair when a known key and '=' follow, so profile JSON and
+ * report policies can contain it.
+ */
+void handleIncomingSetting(char *message)
 {
-  if (telnetServer.hasClient())
+  struct PendingSetting
+  {
+    const SettingDescriptor *setting;
+    char *value;
+    double previous;
+    bool automatic; // "auto": hand back to the physical switch
+    uint8_t saved[SETTING_TEXT_MAX];
+  };
+  static PendingSetting pending[SETTING_TRANSACTION_MAX];
+  size_t count = 0;
+
+  // --- Split and look up ---
+  char *pair = message;
+  while (pair != NULL)
   {
-    if (telnetClient && telnetClient.connected())
+    char *separator = strchr(pair, '=');
+    if (separator == NULL)
     {
-      telnetClient.println("\nAnother client is connecting, disconnecting you.");
-      telnetClient.stop();
+      printToAll("Invalid format. Expected key=value.");
+      return;
     }
-    telnetClient = telnetServer.available();
-    if (telnetClient)
+    *separator = '\0';
+    const SettingDescriptor *setting = findSetting(SETTINGS, settingIndex, pair);
+    if (setting == nullptr)
     {
-      telnetClient.println("\nWelcome to the ESP32 Telnet Serial Monitor!");
-      telnetClient.println("--------------------------------------------");
-
-      // --- TELNET NEGOTIATION ---
-      telnetClient.write(255); // IAC (Interpret As Command)
-      telnetClient.write(251); // WILL
-      telnetClient.write(1);   // ECHO
-      telnetClient.write(255); // IAC
-      telnetClient.write(251); // WILL
-      telnetClient.write(3);   // SUPPRESS GO AHEAD
-
-      telnetClient.print("> ");
+      printToAll("Unknown setting key: ");
+      printlnToAll(pair);
+      return;
+    }
+    if (count == SETTING_TRANSACTION_MAX)
+    {
+      printlnToAll("Too many settings in one message.");
+      return;
     }
+    pending[count].setting = setting;
+    pending[count].value = separator + 1;
+    count++;
+    pair = nextSettingPair(separator + 1);
   }
 
-  static char telnetBuffer[128];
-  static int telnetIndex = 0;
-  if (telnetClient && telnetClient.connected() && telnetClient.available())
+  if (count == 1 && pending[0].setting->type == SETTING_ACTION)
   {
-    const char IAC = 255;
-    char c = telnetClient.read();
-
-    // --- TELNET COMMAND HANDLING ---
-    if (c == IAC)
-    {
-      if (telnetClient.available() >= 2)
-      {
-        telnetClient.read();
-        telnetClient.read();
-      }
-    }
+    pending[0].setting->action(pending[0].value);
+    return;
+  }
 
-    // --- BACKSPACE HANDLING ---
-    else if (c == 8 || c == 127)
+  // --- Check and apply values, undo all on the first bad one ---
+  for (size_t i = 0; i < count; i++)
+  {
+    PendingSetting &entry = pending[i];
+    const SettingDescriptor &setting = *entry.setting;
+    if (setting.type == SETTING_ACTION)
+      continue;
+    entry.previous = settingValue(setting);
+    memcpy(entry.saved, setting.value, settingValueSize(setting));
+    entry.automatic = setting.override != nullptr && strcasecmp(entry.value, "auto") == 0;
+    if (!entry.automatic && !parseSetting(setting, entry.value))
     {
-      if (telnetIndex > 0)
+      while (i-- > 0)
       {
-        telnetIndex--;
-        telnetBuffer[telnetIndex] = '\0'; // Null-terminate just in case
-
-        // Visual backspace for the user's terminal
-        telnetClient.write('\b');
-        telnetClient.write(' ');
-        telnetClient.write('\b');
+        if (pending[i].setting->type != SETTING_ACTION)
+          memcpy(pending[i].setting->value, pending[i].saved, settingValueSize(*pending[i].setting));
       }
+      printToAll("Invalid value for ");
+      printToAll(setting.key);
+      printToAll(": ");
+      printlnToAll(entry.value);
+      if (count > 1)
+        printlnToAll("Nothing applied.");
+      return;
     }
+  }
 
-    // --- COMMAND EXECUTION on NEWLINE ---
-    else if (c == '\r') // Only trigger on Carriage Return
-    {
-      telnetBuffer[telnetIndex] = '\0'; // Null-terminate the char array
-
-      // Move cursor to next line for the user
-      telnetClient.println();
-      // OR use your helper: printlnToAll("");
-
-      if (telnetIndex > 0)
-      {
-        processCommand(telnetBuffer);
-      }
-
-      // Reset prompt and buffer
-      telnetClient.print("> ");
-      telnetIndex = 0;
-      telnetBuffer[0] = '\0';
-    }
+  // --- Side effects, persistence and echo ---
+  bool reconnect = false;
+  for (size_t i = 0; i < count; i++)
+  {
+    const PendingSetting &entry = pending[i];
+    const SettingDescriptor &setting = *entry.setting;
+    if (setting.type == SETTING_ACTION)
+      continue;
+    if (setting.override != nullptr)
+      *setting.override = !entry.automatic;
+    if (!entry.automatic && setting.changed != nullptr)
+      setting.changed(entry.previous);
+    saveSettings(setting.key);
 
-    // --- IGNORE NEWLINE (The second half of Enter) ---
-    else if (c == '\n')
+    if (setting.flags & SETTING_RECONNECT)
     {
-      // Do nothing. This prevents the double prompt.
+      reconnect = true;
+      continue;
     }
-
-    else if (isPrintable(c))
+    publishSingleSetting(setting.key, true);
+    if (entry.automatic)
     {
-      if (telnetIndex < sizeof(telnetBuffer) - 1)
-      {
-        telnetBuffer[telnetIndex] = c;
-        telnetIndex++;
-        telnetBuffer[telnetIndex] = '\0';
-
-        telnetClient.write(c);
-      }
+      printToAll(setting.key);
+      printlnToAll(" returned to switch control.");
+      continue;
     }
+    printToAll("Setting updated: ");
+    printToAll(setting.key);
+    printToAll("=");
+    printlnToAll(entry.value);
   }
-}
+  if (reconnect)
+    halMqttConfigure(mqtt_server, mqtt_port, mqtt_user, mqtt_password);
 
-void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)
-{
-  if (len > 2048)
+  for (size_t i = 0; i < count; i++)
   {
-    printlnToAll("Error: MQTT message too large for stack buffer.");
-    return;
+    if (pending[i].setting->type == SETTING_ACTION)
+      pending[i].setting->action(pending[i].value);
   }
-  char message[len + 1];
-  memcpy(message, payload, len);
-  message[len] = '\0';
-  char logBuf[128];
-  snprintf(logBuf, sizeof(logBuf), "MQTT received on %s: %s", topic, message);
-  printlnToAll(logBuf);
-  handleIncomingSetting(message);
 }
 
-void onMqttConnect(bool sessionPresent)
+/**
+ * @brief Finds the next "|key=" of a transaction in value, cuts value there
+ * and returns the start of the next pair (nullptr if there is none).
+ */
+char *nextSettingPair(char *value)
 {
-  printlnToAll("MQTT connected!");
-
-  mqttClient.subscribe(mqtt_topic_set, 0); // 0 = QoS 0
-  publishSettings();
-  if (firstMqttConnection)
+  for (char *bar = strchr(value, '|'); bar != NULL; bar = strchr(bar + 1, '|'))
   {
-    printlnToAll("First connection: Performing initial state sync.");
-    publishState();
-    firstMqttConnection = false;
+    const char *equals = strchr(bar + 1, '=');
+    char key[32];
+    size_t length = equals != NULL ? equals - (bar + 1) : 0;
+    if (length == 0 || length >= sizeof(key))
+      continue;
+    memcpy(key, bar + 1, length);
+    key[length] = '\0';
+    if (findSetting(SETTINGS, settingIndex, key) != nullptr)
+    {
+      *bar = '\0';
+      return bar + 1;
+    }
   }
+  return NULL;
 }
 
-void onMqttDisconnect(AsyncMqttClientDisconnectReason reason)
-{
-  printToAll("Disconnected from MQTT. Reason: ");
-  printlnToAll((int)reason);
-}
-#ifdef HAS_SCREEN
-void OnDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+// ----------------------------------------------------------------
+// --- Command Processing & Utilities ---
+// ----------------------------------------------------------------
+/**
+ * @brief Gets a pin number from a string name using a fast lookup table.
+ * * This function is heap-safe, using no String allocations.
+ * @param pinName A pointer to a C-string (null-terminated)
+ * @return The pin number, or -1 if not found.
+ */
+int getPinByName(const char *pinName)
 {
-  if (len == sizeof(struct_pairing))
+  for (int i = 0; i < pinMapSize; i++)
   {
-    memcpy(&pairingData, incomingData, sizeof(pairingData));
-    if (pairingData.id == PAIR_REQUEST && strcmp(pairingData.identifier, espIdentifier) == 0)
+    if (strcmp(pinName, pinMap[i].name) == 0)
     {
-      if (isScreenPaired && memcmp(mac_addr, screenMacAddress, 6) != 0)
-      {
-        printlnToAll("New pairing request received. Dropping old screen.");
-        esp_err_t del_status = esp_now_del_peer(screenMacAddress);
-        if (del_status != ESP_OK)
-        {
-          printlnToAll("Warning: Failed to delete old peer. Continuing anyway...");
-        }
-      }
-      else if (isScreenPaired)
-      {
-        printlnToAll("Pairing request from already-paired screen. Re-syncing.");
-      }
-      else
-      {
-        printlnToAll("Pairing request received from a new screen.");
-      }
-      memcpy(screenMacAddress, mac_addr, 6);
-      int screenChannel = pairingData.channel;
-
-      memset(&peerInfo, 0, sizeof(peerInfo));
-      memcpy(peerInfo.peer_addr, screenMacAddress, 6);
-      peerInfo.channel = 0;
-      peerInfo.ifidx = WIFI_IF_STA;
-      peerInfo.encrypt = false;
-      if (esp_now_add_peer(&peerInfo) != ESP_OK)
-      {
-        if (esp_now_mod_peer(&peerInfo) != ESP_OK)
-        {
-          printlnToAll("Failed to add or modify new screen as peer.");
-          return;
-        }
-        printlnToAll("Screen peer modified successfully.");
-      }
-      else
-      {
-        printlnToAll("Screen peer added successfully.");
-      }
-
-      pairingData.id = PAIR_RESPONSE;
-      pairingData.channel = 0;
-      WiFi.macAddress(pairingData.macAddr);
-      strcpy(pairingData.identifier, espIdentifier);
-      esp_now_send(screenMacAddress, (uint8_t *)&pairingData, sizeof(pairingData));
-
-      isScreenPaired = true;
-      pendingScreenSync = true;
+      return pinMap[i].pin;
     }
   }
 
-  else if (len == sizeof(struct_message))
+  int pinNum = atoi(pinName);
+  if (pinNum != 0 || strcmp(pinName, "0") == 0)
   {
-
-    if (!isScreenPaired || memcmp(mac_addr, screenMacAddress, 6) != 0)
-    {
-      printlnToAll("Data received from unknown/unpaired MAC. Ignoring.");
-      return;
-    }
-
-    memcpy(&myData, incomingData, sizeof(myData));
-    myData.payload[sizeof(myData.payload) - 1] = '\0';
-    char *token = strtok(myData.payload, "|");
-
-    while (token != NULL)
-    {
-      handleIncomingSetting(token);
-      token = strtok(NULL, "|");
-    }
+    return pinNum;
   }
-}
 
-void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
-{
-  espNowBusy = false;
+  return -1;
 }
 
-void sendEspNowBuffer()
+void processCommand(char *command)
 {
-  if (espNowCurrentLength == 0)
-    return;
-
-  if (!isScreenPaired)
-  {
-    espNowCurrentLength = 0;
-    espNowMessageBuffer[0] = '\0';
-    return;
-  }
-
-  if (espNowBusy)
-  {
-    unsigned long waitStart = millis();
-    while (espNowBusy)
-    {
-      if (millis() - waitStart > 250)
-      {
-        espNowBusy = false;
-        break;
-      }
-      yield();
-    }
-  }
-  struct_message espnow_message;
-  strncpy(espnow_message.payload, espNowMessageBuffer, sizeof(espnow_message.payload) - 1);
-  espnow_message.payload[sizeof(espnow_message.payload) - 1] = '\0';
-  espNowBusy = true;
-
-  esp_err_t result = esp_now_send(screenMacAddress, (uint8_t *)&espnow_message, sizeof(espnow_message));
-
-  if (result != ESP_OK)
-  {
-    espNowBusy = false;
-
-    printToAll("Error: ESP-NOW Send Failed Code: ");
-    printlnToAll(result);
-  }
-
-  espNowCurrentLength = 0;
-  espNowMessageBuffer[0] = '\0';
-}
-#endif
-void handleIncomingSetting(char *message)
-{
-  char *separator = strchr(message, '=');
-  if (separator == NULL)
-  {
-    printToAll("Invalid format. Expected key=value.");
-    return;
-  }
-  *separator = '\0';
-  char *key = message;
-  char *value = separator + 1;
-
-  bool settingsChanged = false;
-  bool connectionSettingsChanged = false;
-
-  if (strcasecmp(key, "mqtt_server") == 0)
-  {
-    strlcpy(mqtt_server, value, sizeof(mqtt_server));
-    connectionSettingsChanged = true;
-  }
-  else if (strcasecmp(key, "mqtt_port") == 0)
-  {
-    mqtt_port = atoi(value);
-    connectionSettingsChanged = true;
-  }
-  else if (strcasecmp(key, "mqtt_user") == 0)
-  {
-    strlcpy(mqtt_user, value, sizeof(mqtt_user));
-    connectionSettingsChanged = true;
-  }
-  else if (strcasecmp(key, "mqtt_password") == 0)
-  {
-    strlcpy(mqtt_password, value, sizeof(mqtt_password));
-    connectionSettingsChanged = true;
-  }
-
-  else if (strcasecmp(key, "tempsetbrew") == 0)
-  {
-    if (strcasecmp(value, "auto") == 0)
-    {
-      printlnToAll("Brew Temp returned to 3-Way Switch control.");
-      settingsChanged = true;
-      ignoreTempSwitch = false;
-    }
-    else
-    {
-      float val = atof(value);
-      if (val > 0)
-      {
-        float oldTemp = tempSetBrew;
-        tempSetBrew = val;
-        updateCalculatedBoilerTemp();
-        ignoreTempSwitch = true;
-        settingsChanged = true;
-
-        if (currentState == IDLE && abs(tempSetBrew - oldTemp) > 0.1)
-        {
-          transitionToState(HEATING);
-        }
-      }
-    }
-  }
-  else if (strcasecmp(key, "tempsetsteam") == 0)
-  {
-    tempSetSteam = atof(value);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "tempsetsteamboost") == 0)
-  {
-    tempSetSteamBoost = atof(value);
-    settingsChanged = true;
-  }
-
-  // --- PID ---
-  else if (strcasecmp(key, "kp_temperature") == 0)
-  {
-    kp_temperature = atof(value);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "ki_temperature") == 0)
-  {
-    ki_temperature = atof(value);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "kd_temperature") == 0)
-  {
-    kd_temperature = atof(value);
-    settingsChanged = true;
-  }
-#ifdef HAS_PRESSURE_GAUGE
-  else if (strcasecmp(key, "kp_pressure") == 0)
-  {
-    kp_pressure = atof(value);
-    pressurePID.SetTunings(kp_pressure, ki_pressure, kd_pressure);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "ki_pressure") == 0)
-  {
-    ki_pressure = atof(value);
-    pressurePID.SetTunings(kp_pressure, ki_pressure, kd_pressure);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "kd_pressure") == 0)
-  {
-    kd_pressure = atof(value);
-    pressurePID.SetTunings(kp_pressure, ki_pressure, kd_pressure);
-    settingsChanged = true;
-  }
-#endif
-#ifdef HAS_SCALE
-  else if (strcasecmp(key, "kp_flow") == 0)
-  {
-    kp_flow = atof(value);
-    flowPID.SetTunings(kp_flow, ki_flow, kd_flow);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "ki_flow") == 0)
-  {
-    ki_flow = atof(value);
-    flowPID.SetTunings(kp_flow, ki_flow, kd_flow);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "kd_flow") == 0)
-  {
-    kd_flow = atof(value);
-    flowPID.SetTunings(kp_flow, ki_flow, kd_flow);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "flow_kalman_me") == 0)
-  {
-    flowKalmanMe = atof(value);
-    flowKalmanFilter.setMeasurementError(flowKalmanMe);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "flow_kalman_e") == 0)
-  {
-    flowKalmanE = atof(value);
-    flowKalmanFilter.setEstimateError(flowKalmanE);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "flow_kalman_q") == 0)
-  {
-    flowKalmanQ = atof(value);
-    flowKalmanFilter.setProcessNoise(flowKalmanQ);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "weight_kalman_me") == 0)
-  {
-    weightKalmanMe = atof(value);
-    weightKalmanFilter.setMeasurementError(weightKalmanMe);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "weight_kalman_e") == 0)
-  {
-    weightKalmanE = atof(value);
-    weightKalmanFilter.setEstimateError(weightKalmanE);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "weight_kalman_q") == 0)
-  {
-    weightKalmanQ = atof(value);
-    weightKalmanFilter.setProcessNoise(weightKalmanQ);
-    settingsChanged = true;
-  }
-
-  else if (strcasecmp(key, "tare_scale") == 0)
-  {
-    if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
-      tareScale();
-  }
-  else if (strcasecmp(key, "calibratescale") == 0)
-  {
-    startCalibration();
-  }
-  else if (strcasecmp(key, "calibration_step") == 0)
-  {
-    handleCalibrationStep(atof(value));
-  }
-#endif
-  else if (strcasecmp(key, "profiling_mode") == 0)
-  {
-    strlcpy(profilingMode, value, sizeof(profilingMode));
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "profiling_source") == 0)
-  {
-    strlcpy(profilingSource, value, sizeof(profilingSource));
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "profiling_target") == 0)
-  {
-    strlcpy(profilingTarget, value, sizeof(profilingTarget));
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "profiling_flat_value") == 0)
-  {
-    profilingFlatValue = atof(value);
-    settingsChanged = true;
-  }
-  else if (strcasecmp(key, "active_profile_id") == 0)
-  {
-    int newIndex = atoi(value);
-    if (newIndex >= 0 && newIndex < MAX_PROFILES)
-    {
-      currentProfileIndex = newIndex;
-      currentProfile = &profiles[currentProfileIndex];
-
-      // Reset shot tracking
-      currentProfileStepIndex = 0;
-      currentStepStartX = 0.0f;
-
-      printToAll("Active profile switched to ID: ");
-      printlnToAll(currentProfileIndex);
-      settingsChanged = true;
-    }
-  }
-  else if (strcasecmp(key, "profile_data") == 0)
-  {
-    printlnToAll("Parsing profile update...");
-    JsonDocument doc;
-    DeserializationError error = deserializeJson(doc, value);
-
-    if (!error)
-    {
-      int id = doc["id"] | -1;
-
-      if (id >= 0 && id < MAX_PROFILES)
-      {
-        const char *newName = doc["n"] | "";
-
-        if (strlen(newName) == 0)
-        {
-          profiles[id].id = id;
-          profiles[id].numSteps = 0;
-          profiles[id].name[0] = '\0';
-          profiles[id].isStepped = false;
-          if (id == currentProfileIndex)
-          {
-            printlnToAll("Active profile deleted! Searching for new active profile...");
-
-            int newIndex = 0;
-            bool foundNew = false;
-
-            for (int i = 0; i < MAX_PROFILES; i++)
-            {
-              if (i == id)
-                continue;
-
-              if (strlen(profiles[i].name) > 0)
-              {
-                newIndex = i;
-                foundNew = true;
-                break;
-              }
-            }
-
-            if (foundNew)
-            {
-              printToAll("Switching to first available profile: ID ");
-              printlnToAll(newIndex);
-            }
-            else
-            {
-              printlnToAll("No other profiles found. Reverting to ID 0 (Default).");
-            }
-
-            currentProfileIndex = newIndex;
-            currentProfile = &profiles[currentProfileIndex];
-
-            saveSettings("active_profile_id");
-
-            char idxStr[5];
-            itoa(currentProfileIndex, idxStr, 10);
-            publishData(mqtt_topic_active_profile_id, idxStr, true, true);
-          }
-        }
-        else
-        {
-          profiles[id].id = id;
-          strlcpy(profiles[id].name, newName, sizeof(profiles[id].name));
-          profiles[id].isStepped = (doc["m"] == 1);
-          profiles[id].isTargetWeight = (doc["tw"] == 1);
-          profiles[id].isSourceFlow = (doc["sf"] == 1);
-          profiles[id].nextProfileId = doc["nxt"] | -1;
-
-          JsonArray steps = doc["s"];
-          profiles[id].numSteps = 0;
-          for (JsonVariant step : steps)
-          {
-            if (profiles[id].numSteps >= MAX_PROFILE_STEPS)
-              break;
-            profiles[id].steps[profiles[id].numSteps].setpoint = step[0].as<float>();
-            profiles[id].steps[profiles[id].numSteps].trigger = step[1].as<float>();
-            profiles[id].numSteps++;
-          }
-          printlnToAll("Profile slot updated.");
-        }
-        if (id == currentProfileIndex)
-        {
-          currentProfile = &profiles[currentProfileIndex];
-        }
-        saveProfile(id);
-        JsonDocument outDoc;
-        outDoc["id"] = profiles[id].id;
-        outDoc["n"] = profiles[id].name;
-        outDoc["m"] = profiles[id].isStepped ? 1 : 0;
-        outDoc["tw"] = profiles[id].isTargetWeight ? 1 : 0;
-        outDoc["sf"] = profiles[id].isSourceFlow ? 1 : 0;
-        outDoc["nxt"] = profiles[id].nextProfileId;
-
-        JsonArray outSteps = outDoc["s"].to<JsonArray>();
-        for (int i = 0; i < profiles[id].numSteps; i++)
-        {
-          JsonArray step = outSteps.add<JsonArray>();
-          step.add(profiles[id].steps[i].setpoint);
-          step.add(profiles[id].steps[i].trigger);
-        }
-
-        char outBuffer[1024];
-        serializeJson(outDoc, outBuffer, sizeof(outBuffer));
-
-        printlnToAll("Syncing updated profile to network...");
-        publishData(mqtt_topic_profile_data, outBuffer, true);
-      }
-      else
-      {
-        printlnToAll("Error: Invalid Profile ID in JSON");
-      }
-    }
-    else
-    {
-      printlnToAll("JSON Error");
-    }
-  }
-
-  else if (strcasecmp(key, "start_cleaning") == 0)
-  {
-    if ((strcmp(value, "true") == 0 || strcmp(value, "1") == 0) &&
-        (currentState == IDLE || (currentState == HEATING && hxTemp >= 80.0)))
-    {
-      cleaningRepetitionCounter = 0;
-      cleaningStateToResume = IDLE;
-      transitionToState(CLEANING_START);
-    }
-  }
-  else if (strcasecmp(key, "brewmode") == 0)
-  {
-
-    if (strcasecmp(value, "coffee") == 0)
-    {
-      ignoreBrewSwitch = true;
-      strcpy(brewMode, "COFFEE");
-      settingsChanged = true;
-    }
-    else if (strcasecmp(value, "steam") == 0)
-    {
-      ignoreBrewSwitch = true;
-      strcpy(brewMode, "STEAM");
-      settingsChanged = true;
-    }
-    else if (strcasecmp(value, "auto") == 0)
-    {
-      ignoreBrewSwitch = false;
-      printlnToAll("Brew Mode returned to Physical Switch control.");
-    }
-  }
-  else if (strcasecmp(key, "steamboost") == 0 || strcasecmp(key, "enablesteamboost") == 0)
-  {
-    ignoreBrewSwitch = true;
-    if (strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0)
-    {
-      enableSteamBoost = true;
-      settingsChanged = true;
-    }
-    else if (strcasecmp(value, "false") == 0 || strcmp(value, "0") == 0)
-    {
-      enableSteamBoost = false;
-      settingsChanged = true;
-    }
-  }
-  else if (strcasecmp(key, "request") == 0)
-  {
-    if (strcasecmp(value, "true") == 0 || strlen(value) == 0)
-      publishSettings();
-    else
-      publishSingleSetting(value, true);
-  }
-  else
-  {
-    printToAll("Unknown setting key: ");
-    printlnToAll(key);
-  }
-
-  if (settingsChanged || connectionSettingsChanged)
-  {
-    saveSettings(key);
-  }
-  if (settingsChanged)
-  {
-    publishSingleSetting(key, true);
-    printToAll("Setting updated: ");
-    printToAll(key);
-    printToAll("=");
-    printlnToAll(value);
-  }
-  if (connectionSettingsChanged)
-  {
-    mqttClient.setServer(mqtt_server, mqtt_port);
-    if (strcmp(mqtt_user, "") != 0)
-    {
-      mqttClient.setCredentials(mqtt_user, mqtt_password);
-    }
-    else
-    {
-      mqttClient.setCredentials(nullptr, nullptr);
-    }
-    mqttClient.connect();
-  }
-}
-
-// ----------------------------------------------------------------
-// --- Command Processing & Utilities ---
-// ----------------------------------------------------------------
-/**
- * @brief Gets a pin number from a string name using a fast lookup table.
- * * This function is heap-safe, using no String allocations.
- * @param pinName A pointer to a C-string (null-terminated)
- * @return The pin number, or -1 if not found.
- */
-int getPinByName(const char *pinName)
-{
-  for (int i = 0; i < pinMapSize; i++)
-  {
-    if (strcmp(pinName, pinMap[i].name) == 0)
-    {
-      return pinMap[i].pin;
-    }
-  }
-
-  int pinNum = atoi(pinName);
-  if (pinNum != 0 || strcmp(pinName, "0") == 0)
-  {
-    return pinNum;
-  }
-
-  return -1;
-}
-
-void processCommand(char *command)
-{
-  char *cmd = strtok(command, " ");
-  char *args = strtok(NULL, "");
-
-  if (cmd == NULL)
+  char *cmd = strtok(command, " ");
+  char *args = strtok(NULL, "");
+
+  if (cmd == NULL)
     return;
 
   if (strcasecmp(cmd, "help") == 0)
@@ -1446,8 +1481,14 @@ void processCommand(char *command)
     printlnToAll("--- SYSTEM COMMANDS ---");
     printlnToAll("  help                     - Show this help menu.");
     printlnToAll("  status                   - Print real-time system, pin, and profile status.");
+    printlnToAll("  adsstats                 - ADS1115 sample rates & drops, ADS1232 readout timing.");
     printlnToAll("  lasterror                - Display the last recorded critical error.");
     printlnToAll("  macaddress               - Print WiFi MAC address.");
+    printlnToAll("  trace [start|stop]       - Input trace status / record from next boot / stop.");
+    printlnToAll("  perf                     - Loop timing per stage and rate group overruns.");
+    printlnToAll("  queues                   - Inbound/outbound queue drops and setting apply latency.");
+    printlnToAll("  reports                  - Published vs held-back messages per signal and their policy.");
+    printlnToAll("  nvs                      - Settings changes, NVS commits, flash writes and commit time.");
     printlnToAll("  debug                    - Toggle DEBUG state (enables manual hardware controls).");
     printlnToAll("  reboot                   - Restart the ESP32.");
     printlnToAll("  factoryreset             - Erase all NVS flash settings, profiles & WiFi.");
@@ -1464,6 +1505,9 @@ void processCommand(char *command)
     printlnToAll("          profiling_source=<flow|pressure>, profiling_target=<time|weight>");
     printlnToAll("          active_profile_id=<0-19>, profile_data=<json>");
     printlnToAll("          mqtt_server=<ip>, mqtt_port=<port>, mqtt_user=<u>, mqtt_password=<p>");
+    printlnToAll("          telemetry_mode=<topics|frame|both>, telemetry_period_ms=<100-60000>");
+    printlnToAll("          report_policy=<signal>:<abs>,<rel>,<min_ms>,<max_ms> | defaults");
+    printlnToAll("          shot_stream_hz=<0|10-50>");
     printlnToAll("          start_cleaning=true, request=true");
 #ifdef HAS_PRESSURE_GAUGE
     printlnToAll("          kp_pressure=<val>, ki_pressure=<val>, kd_pressure=<val>");
@@ -1534,30 +1578,35 @@ void processCommand(char *command)
   else if (strcasecmp(cmd, "reboot") == 0)
   {
     printlnToAll("Rebooting device...");
-    delay(100);
-    ESP.restart();
+    if (!flushSettingsCommit(SETTINGS_FLUSH_TIMEOUT_MS))
+      printlnToAll("Warning: Settings could not be saved before the restart.");
+    halDelay(100);
+    halRestart();
   }
   else if (strcasecmp(cmd, "factoryreset") == 0)
   {
     printlnToAll("!!! WARNING !!!");
     printlnToAll("Erasing ALL settings, profiles, and WiFi credentials...");
-    delay(1000);
+    halDelay(1000);
 
-    nvs_flash_erase();
-    nvs_flash_init();
+    // A commit still being written would put the old images back
+    if (!waitForSettingsCommit(SETTINGS_FLUSH_TIMEOUT_MS))
+      printlnToAll("Warning: A settings commit did not finish, erasing anyway.");
+    clearSettingsCache();
+    halEraseAllStorage();
 
     preferences.begin("espresso-app", false);
     preferences.clear();
     preferences.end();
 
     printlnToAll("Erase Complete. Rebooting in 3 seconds...");
-    delay(3000);
-    ESP.restart();
+    halDelay(3000);
+    halRestart();
   }
   else if (strcasecmp(cmd, "exit") == 0)
   {
     printlnToAll("Goodbye!");
-    telnetClient.stop();
+    halCloseConsole();
   }
   else if (strcasecmp(cmd, "lasterror") == 0)
   {
@@ -1575,25 +1624,64 @@ void processCommand(char *command)
   {
     printStatus();
   }
+  else if (strcasecmp(cmd, "adsstats") == 0)
+  {
+    halAdsPrintStats(halConsole());
+  }
   else if (strcasecmp(cmd, "macaddress") == 0)
   {
+    char macAddress[18];
+    halMacAddress(macAddress, sizeof(macAddress));
     printlnToAll("MAC Address: ");
-    printlnToAll(WiFi.macAddress());
+    printlnToAll(macAddress);
   }
-  else if (strcasecmp(cmd, "espnow") == 0)
+  else if (strcasecmp(cmd, "queues") == 0)
   {
-#ifdef HAS_SCREEN
-    if (args != NULL)
+    halQueuePrintStats(halConsole());
+  }
+  else if (strcasecmp(cmd, "reports") == 0)
+  {
+    printReportStats();
+  }
+  else if (strcasecmp(cmd, "nvs") == 0)
+  {
+    printSettingsCacheStats();
+  }
+  else if (strcasecmp(cmd, "perf") == 0)
+  {
+    halPerfPrintStats(halConsole());
+    scheduler.printStats(halConsole());
+  }
+  else if (strcasecmp(cmd, "trace") == 0)
+  {
+    if (args != NULL && strcasecmp(args, "start") == 0)
     {
-      struct_message tempMessage;
-      strlcpy(tempMessage.payload, args, sizeof(tempMessage.payload));
-      esp_err_t result = esp_now_send(NULL, (uint8_t *)&tempMessage, sizeof(tempMessage));
-      if (result != ESP_OK)
-      {
-        printToAll("Error queueing ESP-NOW message. Code: ");
-        printlnToAll((int)result);
-      }
-      else
+      printlnToAll("Restarting to record an input trace from boot...");
+      halDelay(100);
+      halTraceArm();
+    }
+    else if (args != NULL && strcasecmp(args, "stop") == 0)
+    {
+      halTraceStop();
+      halTracePrintStats(halConsole());
+    }
+    else
+    {
+      halTracePrintStats(halConsole());
+    }
+  }
+  else if (strcasecmp(cmd, "espnow") == 0)
+  {
+#ifdef HAS_SCREEN
+    if (args != NULL)
+    {
+      int result = halEspNowBroadcast(args);
+      if (result != 0)
+      {
+        printToAll("Error queueing ESP-NOW message. Code: ");
+        printlnToAll((int)result);
+      }
+      else
       {
         printlnToAll("ESP-NOW message queued.");
       }
@@ -1675,7 +1763,7 @@ void processCommand(char *command)
   }
   else if (strcasecmp(cmd, "updatepcf") == 0)
   {
-    updatePcf();
+    halScaleApplyConfig();
   }
 #endif
   else if (currentState == DEBUG)
@@ -1726,32 +1814,37 @@ void processCommand(char *command)
     }
     else if (strcasecmp(cmd, "checkic") == 0)
     {
-      int lm1830State = checkLM1830();
-      if (lm1830State == 1)
-        printlnToAll("OK: Pin toggled correctly.");
-      else if (lm1830State == 0)
-        printlnToAll("Inconclusive. Pin high in both states.");
-      else
-        printlnToAll("FAIL: IC failed (Pin high when OFF).");
+      requestLevelProbeTest();
+      printlnToAll("Testing LM1830, result follows in about a second...");
     }
 #ifdef HAS_SCALE
     else if (strcasecmp(cmd, "readweight") == 0)
     {
-      long currentRawADC;
+      ScaleSample sample;
+      ScaleSample taken;
+      bool haveSample = false;
       int attempts = 0;
       const int MAX_ATTEMPTS = 200;
-      do
+      while (attempts < MAX_ATTEMPTS)
       {
-        currentRawADC = readADCScale();
-
-        if (currentRawADC == -1 || currentRawADC == -2)
+        // Newest queued conversion of a cup, or wait for the next one
+        while (halScaleTakeSample(taken))
+        {
+          if (scaleCupForChannel(taken.channel) >= 0)
+          {
+            sample = taken;
+            haveSample = true;
+          }
+        }
+        if (haveSample)
         {
-          attempts++;
-          delay(2);
+          break;
         }
-      } while ((currentRawADC == -1 || currentRawADC == -2) && attempts < MAX_ATTEMPTS);
+        attempts++;
+        halDelay(2);
+      }
 
-      if (currentRawADC == -1 || currentRawADC == -2)
+      if (!haveSample)
       {
         printlnToAll("--- SCALE ERROR ---");
         printlnToAll("Timeout: Could not retrieve a valid reading.");
@@ -1759,12 +1852,15 @@ void processCommand(char *command)
         return;
       }
 
-      float currentInstantWeight = (float)(currentRawADC - COMBINED_OFFSET) / COMBINED_SCALE;
+      int cup = scaleCupForChannel(sample.channel);
+      long currentRawADC = sample.raw;
+      float currentInstantWeight = (float)(currentRawADC - scaleCupOffset(cup)) / scaleCupScale(cup);
 
       printlnToAll("--- SCALE DIAGNOSTIC ---");
 
+      printScaleCup(cup);
       printToAll("Filtered Weight (Kalman): ");
-      printToAll(currentWeight, 2);
+      printToAll(cupEstimates[cup].weight, 2);
       printlnToAll(" g");
 
       printToAll("Instant Weight (Unfiltered): ");
@@ -1775,9 +1871,9 @@ void processCommand(char *command)
       printlnToAll(currentRawADC);
 
       printToAll("Calibration Offset: ");
-      printToAll(COMBINED_OFFSET);
+      printToAll(scaleCupOffset(cup));
       printToAll(" | Scale Factor: ");
-      printlnToAll(COMBINED_SCALE, 6);
+      printlnToAll(scaleCupScale(cup), 6);
       printlnToAll("--------------------------");
     }
 #endif
@@ -1810,30 +1906,30 @@ void processCommand(char *command)
     else if (strcasecmp(cmd, "buzzer") == 0)
     {
       if (args && strcasecmp(args, "on") == 0)
-        digitalWrite(BUZZER, HIGH);
+        halDigitalWrite(BUZZER, HIGH);
       else
-        digitalWrite(BUZZER, LOW);
+        halDigitalWrite(BUZZER, LOW);
     }
     else if (strcasecmp(cmd, "ledmain") == 0)
     {
       if (args && strcasecmp(args, "on") == 0)
-        digitalWrite(LEDMAIN, HIGH);
+        halDigitalWrite(LEDMAIN, HIGH);
       else
-        digitalWrite(LEDMAIN, LOW);
+        halDigitalWrite(LEDMAIN, LOW);
     }
     else if (strcasecmp(cmd, "ledheater") == 0)
     {
       if (args && strcasecmp(args, "on") == 0)
-        digitalWrite(LEDHEATER, HIGH);
+        halDigitalWrite(LEDHEATER, HIGH);
       else
-        digitalWrite(LEDHEATER, LOW);
+        halDigitalWrite(LEDHEATER, LOW);
     }
     else if (strcasecmp(cmd, "ledwater") == 0)
     {
       if (args && strcasecmp(args, "on") == 0)
-        digitalWrite(LEDWATER, HIGH);
+        halDigitalWrite(LEDWATER, HIGH);
       else
-        digitalWrite(LEDWATER, LOW);
+        halDigitalWrite(LEDWATER, LOW);
     }
     else if (strcasecmp(cmd, "writepin") == 0)
     {
@@ -1854,9 +1950,9 @@ void processCommand(char *command)
             if (isValid)
             {
               if (strcasecmp(state, "high") == 0)
-                digitalWrite(pin, HIGH);
+                halDigitalWrite(pin, HIGH);
               else
-                digitalWrite(pin, LOW);
+                halDigitalWrite(pin, LOW);
               printlnToAll("Pin state updated.");
             }
             else
@@ -1891,7 +1987,7 @@ void processCommand(char *command)
             printToAll("Pin ");
             printToAll(args);
             printToAll(" is ");
-            printlnToAll(digitalRead(pin) == HIGH ? "HIGH" : "LOW");
+            printlnToAll(halDigitalRead(pin) == HIGH ? "HIGH" : "LOW");
           }
           else
           {
@@ -1943,7 +2039,7 @@ void processCommand(char *command)
     else if (strcasecmp(cmd, "restartreason") == 0)
     {
       printToAll("Restart Reason Code: ");
-      printlnToAll((int)esp_reset_reason());
+      printlnToAll(halResetReason());
     }
     else if (strcasecmp(cmd, "computedboiler") == 0)
     {
@@ -2016,23 +2112,22 @@ void processCommand(char *command)
 
 void printStatus()
 {
-  bool currentBrewLever = (digitalRead(BREW_SWITCH) == LOW);
-  bool currentSwitch1 = (digitalRead(THREE_WAY_SWITCH1) == HIGH);
-  bool currentSwitch2 = (digitalRead(THREE_WAY_SWITCH2) == HIGH);
-  bool currentWaterLevel = (digitalRead(WATER_DETECTOR) == LOW);
-  bool currentTwoWaySwitch = (digitalRead(TWO_WAY_SWITCH) == HIGH);
-  bool currentBoilerLevel = !detectBoilerLevel();
+  bool currentBrewLever = (halDigitalRead(BREW_SWITCH) == LOW);
+  bool currentSwitch1 = (halDigitalRead(THREE_WAY_SWITCH1) == HIGH);
+  bool currentSwitch2 = (halDigitalRead(THREE_WAY_SWITCH2) == HIGH);
+  bool currentWaterLevel = (halDigitalRead(WATER_DETECTOR) == LOW);
+  bool currentTwoWaySwitch = (halDigitalRead(TWO_WAY_SWITCH) == HIGH);
 
   printlnToAll("--- STATUS ---");
   printToAll("WiFi Channel: ");
-  printlnToAll(WiFi.channel());
+  printlnToAll(halWifiChannel());
   printToAll("WiFi RSSI: ");
-  printToAll(WiFi.RSSI());
+  printToAll(halWifiRssi());
   printlnToAll(" dBm");
   printToAll("Current State: ");
   printlnToAll(stateToString(currentState));
   printToAll("Brew Mode: ");
-  printToAll(brewMode);
+  printToAll(BREW_MODE_NAMES[brewMode]);
   printToAll(", Steam Boost: ");
   printlnToAll((enableSteamBoost ? "Enabled" : "Disabled"));
   printToAll("Boiler: ");
@@ -2067,7 +2162,19 @@ void printStatus()
   printToAll("Water Tank: ");
   printToAll(currentWaterLevel ? "EMPTY" : "OK");
   printToAll(", Boiler Empty: ");
-  printlnToAll(currentBoilerLevel ? "YES" : "NO");
+  if (levelProbe.hasResult)
+  {
+    printToAll(isBoilerEmpty ? "YES" : "NO");
+    printToAll(" (probed ");
+    printToAll((halMillis() - levelProbe.lastResult) / 1000);
+    printToAll(" s ago, every ");
+    printToAll(levelProbeInterval(halMillis()) / 1000);
+    printlnToAll(" s)");
+  }
+  else
+  {
+    printlnToAll("not probed yet");
+  }
   printlnToAll("--- SETTINGS ---");
   printToAll("Temps: Brew=");
   printToAll(tempSetBrew, 2);
@@ -2110,11 +2217,44 @@ void printStatus()
   printToAll(flowKalmanE, 2);
   printToAll(" Q=");
   printlnToAll(flowKalmanQ, 2);
+  printToAll("Scale: ");
+  printToAll(scaleFastRate ? SCALE_FAST_SPS : SCALE_SLOW_SPS);
+  if (scaleCups > 1)
+  {
+    printToAll(" SPS, ");
+    printToAll(scaleCupRate(), 1);
+    printToAll(" per cup in bursts of ");
+    printToAll(scaleCupDwell());
+  }
+  else
+  {
+    printToAll(" SPS");
+  }
+  printToAll(", measurement noise ");
+  for (int i = 0; i < scaleCups; i++)
+  {
+    if (i > 0)
+      printToAll(" / ");
+    printToAll(cupEstimates[i].filter.measurementNoise(), 4);
+  }
+  printlnToAll(" g^2");
+  if (scaleCups > 1)
+  {
+    for (int i = 0; i < scaleCups; i++)
+    {
+      printToAll("  ");
+      printScaleCup(i);
+      printToAll(cupEstimates[i].weight, 1);
+      printToAll(" g, ");
+      printToAll(cupEstimates[i].flow, 1);
+      printlnToAll(" g/s");
+    }
+  }
 #endif
   printToAll("Profiling: Mode=");
-  printToAll(profilingMode);
+  printToAll(PROFILING_MODE_NAMES[profilingMode]);
   printToAll(", Source=");
-  printlnToAll(profilingSource);
+  printlnToAll(PROFILING_SOURCE_NAMES[profilingSource]);
 
   printlnToAll("--- ACTIVE PROFILE ---");
 
@@ -2170,9 +2310,13 @@ void transitionToState(MachineState newState)
   {
     return;
   }
+  // Pending settings go to flash between states, never into a shot
+  if (settingsDirty && newState != BREWING)
+    requestSettingsCommit();
   publishData(mqtt_topic_state, stateToString(newState), true, true);
-  lastStateTransitionTime = millis();
-  digitalWrite(BUZZER, LOW);
+  reportChannels[REPORT_STATE].take(newState, halMillis());
+  lastStateTransitionTime = halMillis();
+  halDigitalWrite(BUZZER, LOW);
   if (currentState == DEBUG)
   {
     if (manualHeaterControl)
@@ -2241,7 +2385,7 @@ void handleStateEntry(MachineState newState)
     heaterPID.SetMode(AUTOMATIC);
     stableTempStartTime = 0;
 #ifdef HAS_SCALE
-    updatePcf();
+    halScaleApplyConfig();
 #endif
     break;
 
@@ -2249,15 +2393,15 @@ void handleStateEntry(MachineState newState)
     setBoilerFillValve(false);
     setPumpPower(100);
     setPump(true);
-    flushStartTime = millis();
+    flushStartTime = halMillis();
     break;
 
   case IDLE:
     setPump(false);
     setBoilerFillValve(false);
-    idleEntryTime = millis();
+    idleEntryTime = halMillis();
 #ifdef HAS_SCALE
-    updatePcf();
+    halScaleApplyConfig();
 #endif
     break;
 
@@ -2265,16 +2409,16 @@ void handleStateEntry(MachineState newState)
     setBoilerFillValve(false);
     setPump(true);
     executingProfile = currentProfile;
+    executingSegment = 0;
     currentProfileStepIndex = 0;
-    currentStepStartX = 0.0f;
-    prevStepTargetY = 0.0f;
-    shotStartTime = millis();
-    profileStartTime = millis();
+    shotStartTime = halMillis();
+    profileStartTime = halMillis();
     lowWaterGracePeriodActive = false;
     lowWaterGracePeriodStartTime = 0;
 #ifdef HAS_SCALE
     profileStartWeight = currentWeight;
 #endif
+    startShotStream();
 #ifdef HAS_PRESSURE_GAUGE
     pressurePID.SetMode(MANUAL);
 #endif
@@ -2282,16 +2426,16 @@ void handleStateEntry(MachineState newState)
     flowPID.SetMode(MANUAL);
 #endif
 #ifdef HAS_SCALE
-    updatePcf();
+    halScaleApplyConfig();
 #endif
     break;
 
   case STEAM_BOOST:
     setPump(false);
     setBoilerFillValve(false);
-    steamBoostEntryTime = millis();
+    steamBoostEntryTime = halMillis();
 #ifdef HAS_SCALE
-    updatePcf();
+    halScaleApplyConfig();
 #endif
     break;
 
@@ -2305,7 +2449,7 @@ void handleStateEntry(MachineState newState)
     setPumpPower(100);
     setPump(true);
     setBoilerFillValve(false);
-    cleaningPumpStartTime = millis();
+    cleaningPumpStartTime = halMillis();
     cleaningBeepState = 0;
     break;
 #ifdef HAS_SCALE
@@ -2323,7 +2467,17 @@ void handleStateEntry(MachineState newState)
       printlnToAll("\nStep 2: Calibration Weight");
       printToAll("Place your ");
       printToAll(calibrationWeight);
-      printlnToAll("g weight on the scale, then send 'calibratenext <weight>' (Telnet) or 'calibration_step <weight>' (MQTT/ESP-NOW).");
+      if (scaleCups > 1)
+      {
+        printToAll("g weight on cup ");
+        printToAll(calibrationCup + 1);
+        printToAll(" only");
+      }
+      else
+      {
+        printToAll("g weight on the scale");
+      }
+      printlnToAll(", then send 'calibratenext <weight>' (Telnet) or 'calibration_step <weight>' (MQTT/ESP-NOW).");
     }
     break;
 #endif
@@ -2398,8 +2552,8 @@ void triggerBeep(int duration)
 {
   if (BUZZER_ENABLE)
   {
-    digitalWrite(BUZZER, HIGH);
-    beepStopTime = millis() + duration;
+    halDigitalWrite(BUZZER, HIGH);
+    beepStopTime = halMillis() + duration;
     isBeeping = true;
   }
 }
@@ -2412,10 +2566,10 @@ void setHeater(bool on)
   if (on != heaterOn)
   {
     heaterOn = on;
-    digitalWrite(HEATER_SSR, heaterOn ? HIGH : LOW);
-    if (mqttClient.connected())
+    halDigitalWrite(HEATER_SSR, heaterOn ? HIGH : LOW);
+    if (halMqttConnected())
     {
-      publishData(mqtt_topic_heater, heaterOn ? "ON" : "OFF", false);
+      reportText(REPORT_HEATER, mqtt_topic_heater, heaterOn, heaterOn ? "ON" : "OFF", halMillis());
     }
   }
 }
@@ -2425,7 +2579,7 @@ void setBoilerFillValve(bool on)
   static bool lastFillValveState = !on;
   if (on != lastFillValveState)
   {
-    digitalWrite(PUMP_RELAY, on ? HIGH : LOW);
+    halDigitalWrite(PUMP_RELAY, on ? HIGH : LOW);
     lastFillValveState = on;
   }
 }
@@ -2435,20 +2589,21 @@ void setPump(bool on)
   if (on != pumpRunning)
   {
     pumpRunning = on;
-    digitalWrite(COFFEE_RELAY, pumpRunning ? HIGH : LOW);
-    lastPumpStateChangeTime = millis();
-    if (mqttClient.connected())
+    halDigitalWrite(COFFEE_RELAY, pumpRunning ? HIGH : LOW);
+    lastPumpStateChangeTime = halMillis();
+    if (halMqttConnected())
     {
-      publishData(mqtt_topic_pump, pumpRunning ? "ON" : "OFF", false);
+      reportText(REPORT_PUMP, mqtt_topic_pump, pumpRunning, pumpRunning ? "ON" : "OFF", halMillis());
     }
   }
 }
 
 void setPumpPower(int percentage)
 {
+  pumpPower = percentage;
 #ifdef HAS_PRESSURE_GAUGE
   int brightness = (int)(percentage * (255.0 / 100.0));
-  pumpDimmer.setBrightness(brightness);
+  halDimmerSet(brightness);
 #else
   return;
 #endif
@@ -2459,7 +2614,7 @@ void enableWaterLevelSensor(bool on)
   static bool lastEnableState = !on;
   if (on != lastEnableState)
   {
-    digitalWrite(ENABLE_LM1830, on ? HIGH : LOW);
+    halDigitalWrite(ENABLE_LM1830, on ? HIGH : LOW);
     lastEnableState = on;
   }
 }
@@ -2474,14 +2629,14 @@ void pollDigitalInputs()
   static bool lastRawLeverState = false;
   static bool lastRawWaterState = false;
 
-  bool currentRawLeverState = (digitalRead(BREW_SWITCH) == LOW);
+  bool currentRawLeverState = (halDigitalRead(BREW_SWITCH) == LOW);
 
   if (currentRawLeverState != lastRawLeverState)
   {
-    lastDebounceTimeLever = millis();
+    lastDebounceTimeLever = halMillis();
   }
 
-  if ((millis() - lastDebounceTimeLever) > debounceDelay)
+  if ((halMillis() - lastDebounceTimeLever) > debounceDelay)
   {
     if (currentRawLeverState != brewLeverLifted)
     {
@@ -2489,98 +2644,155 @@ void pollDigitalInputs()
       {
         if (currentState == BREWING || currentState == HEATING || currentState == COOLING_FLUSH)
         {
-          shotEndTime = millis();
+          shotEndTime = halMillis();
           printlnToAll("Lever down. Logging drips for 3s.");
         }
       }
       brewLeverLifted = currentRawLeverState;
-      lastLeverChangedTime = millis();
-      if (mqttClient.connected())
+      lastLeverChangedTime = halMillis();
+      if (halMqttConnected())
       {
-        publishData(mqtt_topic_lever, brewLeverLifted ? "LIFTED" : "DOWN", false);
+        reportText(REPORT_LEVER, mqtt_topic_lever, brewLeverLifted, brewLeverLifted ? "LIFTED" : "DOWN", halMillis());
       }
     }
   }
 
   lastRawLeverState = currentRawLeverState;
-  bool currentRawWaterState = (digitalRead(WATER_DETECTOR) == LOW);
+  bool currentRawWaterState = (halDigitalRead(WATER_DETECTOR) == LOW);
   if (currentRawWaterState != lastRawWaterState)
   {
-    lastDebounceTimeWater = millis();
+    lastDebounceTimeWater = halMillis();
   }
-  if ((millis() - lastDebounceTimeWater) > debounceDelay)
+  if ((halMillis() - lastDebounceTimeWater) > debounceDelay)
   {
     if (currentRawWaterState != waterLevelTripped)
     {
       waterLevelTripped = currentRawWaterState;
-      lastWaterLevelChangedTime = millis();
+      lastWaterLevelChangedTime = halMillis();
     }
   }
   lastRawWaterState = currentRawWaterState;
 
-  threeWaySwitch1High = (digitalRead(THREE_WAY_SWITCH1) == HIGH);
-  threeWaySwitch2High = (digitalRead(THREE_WAY_SWITCH2) == HIGH);
+  threeWaySwitch1High = (halDigitalRead(THREE_WAY_SWITCH1) == HIGH);
+  threeWaySwitch2High = (halDigitalRead(THREE_WAY_SWITCH2) == HIGH);
+}
+
+// ----------------------------------------------------------------
+// --- Boiler Level Probe ---
+// ----------------------------------------------------------------
+
+/**
+ * @brief Queues the LM1830 self test (checkic); serviceLevelProbe() prints
+ * the result about a second later.
+ */
+void requestLevelProbeTest()
+{
+  levelProbe.testRequested = true;
 }
 
-int checkLM1830()
+void startLevelProbe(unsigned long nowTime)
 {
-  digitalWrite(ENABLE_LM1830, LOW);
-  delay(500);
-  bool pinBefore = digitalRead(BOILER_LEVEL);
-  digitalWrite(ENABLE_LM1830, HIGH);
-  delay(500);
-  bool pinAfter = digitalRead(BOILER_LEVEL);
-  digitalWrite(ENABLE_LM1830, LOW);
-  if (pinBefore)
-  {
-    return -1;
-  }
-  if (!pinBefore && pinAfter)
-  {
-    return 1;
-  }
-  return 0;
+  isBoilerPinHigh = halDigitalRead(BOILER_LEVEL);
+  enableWaterLevelSensor(true);
+  levelProbe.phase = LEVEL_PROBE_SETTLING;
+  levelProbe.phaseStart = nowTime;
+  levelProbe.lastStart = nowTime;
+}
+
+/**
+ * @brief Time between two level readings: short while the level is likely to
+ * have moved, long while nothing draws water.
+ */
+uint32_t levelProbeInterval(unsigned long nowTime)
+{
+  if ((long)(levelProbe.fastUntil - nowTime) > 0)
+    return LEVEL_PROBE_FAST_MS;
+  if (currentState == IDLE || currentState == STANDBY)
+    return LEVEL_PROBE_SLOW_MS;
+  return LEVEL_PROBE_NORMAL_MS;
 }
 
-void periodicBoilerLevelCheck()
+/**
+ * @brief Advances the probe by at most one phase; never waits. Paused while
+ * BOILER_EMPTY refills (that state reads the pin itself) and in DEBUG, where
+ * only the self test runs.
+ */
+void serviceLevelProbe(unsigned long nowTime)
 {
   if (currentState == BOILER_EMPTY)
     return;
   if (pumpRunning)
   {
+    if (levelProbe.phase != LEVEL_PROBE_WAITING)
+    {
+      levelProbe.aborted++;
+      levelProbe.phase = LEVEL_PROBE_WAITING;
+    }
+    if (levelProbe.testRequested)
+    {
+      levelProbe.testRequested = false;
+      printlnToAll("LM1830 test skipped: the pump is running.");
+    }
     enableWaterLevelSensor(false);
+    levelProbe.fastUntil = nowTime + LEVEL_PROBE_FAST_WINDOW_MS;
     return;
   }
-  static unsigned long lm1830EnableTime = 0;
-  static bool isLm1830Enabled = false;
-  static bool previousBoilerReadingEmpty = false;
-
-  if ((!isLm1830Enabled && (millis() - lastBoilerCheckTime > BOILER_CHECK_PERIOD)) && (currentState != DEBUG))
-  {
-    isBoilerPinHigh = digitalRead(BOILER_LEVEL);
-    enableWaterLevelSensor(true);
-    isLm1830Enabled = true;
-    lm1830EnableTime = millis();
-    lastBoilerCheckTime = millis();
-  }
 
-  if ((isLm1830Enabled && (millis() - lm1830EnableTime > BOILER_CHECK_DURATION)) && (currentState != DEBUG))
+  switch (levelProbe.phase)
   {
-    bool currentBoilerReadingEmpty = !digitalRead(BOILER_LEVEL);
-
-    if (currentBoilerReadingEmpty && previousBoilerReadingEmpty)
+  case LEVEL_PROBE_WAITING:
+    if (levelProbe.testRequested)
     {
-      isBoilerEmpty = true;
+      levelProbe.testRequested = false;
+      enableWaterLevelSensor(false);
+      levelProbe.phase = LEVEL_PROBE_TEST_OFF;
+      levelProbe.phaseStart = nowTime;
     }
-    else if (!currentBoilerReadingEmpty)
+    else if (currentState != DEBUG && nowTime - levelProbe.lastStart > levelProbeInterval(nowTime))
     {
-      isBoilerEmpty = false;
+      startLevelProbe(nowTime);
     }
-
-    previousBoilerReadingEmpty = currentBoilerReadingEmpty;
-
+    break;
+  case LEVEL_PROBE_SETTLING:
+  {
+    if (nowTime - levelProbe.phaseStart <= LEVEL_PROBE_SETTLE_MS)
+      break;
+    bool readingEmpty = !halDigitalRead(BOILER_LEVEL);
+    enableWaterLevelSensor(false);
+    if (readingEmpty && levelProbe.lastReadingEmpty)
+      isBoilerEmpty = true;
+    else if (!readingEmpty)
+      isBoilerEmpty = false;
+    levelProbe.lastReadingEmpty = readingEmpty;
+    levelProbe.lastResult = nowTime;
+    levelProbe.hasResult = true;
+    levelProbe.readings++;
+    levelProbe.phase = LEVEL_PROBE_WAITING;
+    break;
+  }
+  case LEVEL_PROBE_TEST_OFF:
+    if (nowTime - levelProbe.phaseStart < LEVEL_PROBE_SETTLE_MS)
+      break;
+    levelProbe.testPinOff = halDigitalRead(BOILER_LEVEL);
+    enableWaterLevelSensor(true);
+    levelProbe.phase = LEVEL_PROBE_TEST_ON;
+    levelProbe.phaseStart = nowTime;
+    break;
+  case LEVEL_PROBE_TEST_ON:
+  {
+    if (nowTime - levelProbe.phaseStart < LEVEL_PROBE_SETTLE_MS)
+      break;
+    bool pinOn = halDigitalRead(BOILER_LEVEL);
     enableWaterLevelSensor(false);
-    isLm1830Enabled = false;
+    levelProbe.phase = LEVEL_PROBE_WAITING;
+    if (levelProbe.testPinOff)
+      printlnToAll("FAIL: IC failed (Pin high when OFF).");
+    else if (pinOn)
+      printlnToAll("OK: Pin toggled correctly.");
+    else
+      printlnToAll("Inconclusive. Pin low in both states.");
+    break;
+  }
   }
 }
 
@@ -2603,27 +2815,27 @@ void updateSensorReadings()
 
   if (!filterInitialized)
   {
-    unsigned long bootReadStartTime = millis();
+    unsigned long bootReadStartTime = halMillis();
     do
     {
       boilerTempADC = readADSADC(BOILER_TEMP);
-      if (millis() % 50 == 0)
-        delay(1);
+      if (halMillis() % 50 == 0)
+        halDelay(1);
 
-      if (millis() - bootReadStartTime > 250)
+      if (halMillis() - bootReadStartTime > 250)
       {
         break;
       }
     } while (boilerTempADC < ADC_RAILED_THRESHOLD);
 
-    bootReadStartTime = millis();
+    bootReadStartTime = halMillis();
     do
     {
       hxTempADC = readADSADC(HX_TEMP);
-      if (millis() % 50 == 0)
-        delay(1);
+      if (halMillis() % 50 == 0)
+        halDelay(1);
 
-      if (millis() - bootReadStartTime > 250)
+      if (halMillis() - bootReadStartTime > 250)
       {
         break;
       }
@@ -2657,10 +2869,27 @@ void updateSensorReadings()
 
   bool isFirstRunInSetup = (lastStateTransitionTime == 0);
 
-  if (!isFirstRunInSetup && (millis() - lastStateTransitionTime < SENSOR_READ_PAUSE_MS || millis() - lastLeverChangedTime < SENSOR_READ_PAUSE_MS || millis() - lastWaterLevelChangedTime < SENSOR_READ_PAUSE_MS || millis() - lastPumpStateChangeTime < SENSOR_READ_PAUSE_MS))
+  if (!isFirstRunInSetup && (halMillis() - lastStateTransitionTime < SENSOR_READ_PAUSE_MS || halMillis() - lastLeverChangedTime < SENSOR_READ_PAUSE_MS || halMillis() - lastWaterLevelChangedTime < SENSOR_READ_PAUSE_MS || halMillis() - lastPumpStateChangeTime < SENSOR_READ_PAUSE_MS))
+  {
+    return;
+  }
+
+  // Only advance the moving average when the acquisition engine has
+  // delivered something new since the last call.
+  static uint32_t lastSampleSeq = 0;
+  uint32_t sampleSeq = 0;
+  for (int i = 0; i < ADS_SCHEDULE_LENGTH; i++)
+  {
+    AdsSample sample;
+    halAdsGetSample(adsSchedule[i], sample);
+    sampleSeq += sample.seq;
+  }
+  if (sampleSeq == lastSampleSeq)
   {
     return;
   }
+  lastSampleSeq = sampleSeq;
+
   boilerTempTotal -= boilerTempSamples[sampleIndex];
   hxTempTotal -= hxTempSamples[sampleIndex];
 #ifdef HAS_PRESSURE_GAUGE
@@ -2705,25 +2934,15 @@ void updateSensorReadings()
 
 bool readPin(const int pin)
 {
-  return (digitalRead(pin) == HIGH);
-}
-
-bool detectBoilerLevel()
-{
-  if (pumpRunning)
-  {
-    return false;
-  }
-  enableWaterLevelSensor(true);
-  delay(500);
-  bool waterLevel = readPin(BOILER_LEVEL);
-  enableWaterLevelSensor(false);
-  return (waterLevel);
+  return (halDigitalRead(pin) == HIGH);
 }
 
+/**
+ * @brief Latest sample of an ADS1115 channel (see halAdsRead()).
+ */
 int16_t readADSADC(const int pin)
 {
-  return ads.readADC_SingleEnded(pin);
+  return halAdsRead(pin);
 }
 
 float convertADCToTemp(int16_t adc)
@@ -2732,40 +2951,7 @@ float convertADCToTemp(int16_t adc)
   {
     return 0.0;
   }
-  return linearInterpolation(remappedAdcValues, remappedTemperatureValues, LEGACY_TEMP_LOOKUP_TABLE_SIZE, (float)adc, false);
-}
-
-float linearInterpolation(float xValues[], float yValues[], int numValues, float pointX, bool trim)
-{
-  if (trim)
-  {
-    if (pointX <= xValues[0])
-      return yValues[0];
-    if (pointX >= xValues[numValues - 1])
-      return yValues[numValues - 1];
-  }
-
-  auto i = 0;
-  float rst = 0;
-  if (pointX <= xValues[0])
-  {
-    i = 0;
-    auto t = (pointX - xValues[i]) / (xValues[i + 1] - xValues[i]);
-    rst = yValues[i] * (1 - t) + yValues[i + 1] * t;
-  }
-  else if (pointX >= xValues[numValues - 1])
-  {
-    auto t = (pointX - xValues[numValues - 2]) / (xValues[numValues - 1] - xValues[numValues - 2]);
-    rst = yValues[numValues - 2] * (1 - t) + yValues[numValues - 1] * t;
-  }
-  else
-  {
-    while (pointX >= xValues[i + 1])
-      i++;
-    auto t = (pointX - xValues[i]) / (xValues[i + 1] - xValues[i]);
-    rst = yValues[i] * (1 - t) + yValues[i + 1] * t;
-  }
-  return rst;
+  return ntcLookup(NTC_TABLE, adc);
 }
 
 double feedForwardHeater(double c1, double c2, double steadyStateTempC, double ambientTempC)
@@ -2860,10 +3046,10 @@ void errorBuzzer()
   static unsigned long lastBeepTime = 0;
   const int beepInterval = 500;
 
-  if (millis() - lastBeepTime > beepInterval)
+  if (halMillis() - lastBeepTime > beepInterval)
   {
-    lastBeepTime = millis();
-    digitalWrite(BUZZER, !digitalRead(BUZZER));
+    lastBeepTime = halMillis();
+    halDigitalWrite(BUZZER, !halDigitalRead(BUZZER));
   }
 }
 
@@ -2880,12 +3066,12 @@ void waterEmptyBuzzer()
   const int SHORT_PAUSE = 150;
   const int LONG_PAUSE = 3500;
 
-  unsigned long currentTime = millis();
+  unsigned long currentTime = halMillis();
 
   switch (beepState)
   {
   case 0:
-    digitalWrite(BUZZER, HIGH);
+    halDigitalWrite(BUZZER, HIGH);
     lastStateChangeTime = currentTime;
     beepState = 1;
     break;
@@ -2893,7 +3079,7 @@ void waterEmptyBuzzer()
   case 1:
     if (currentTime - lastStateChangeTime > BEEP_DURATION)
     {
-      digitalWrite(BUZZER, LOW);
+      halDigitalWrite(BUZZER, LOW);
       lastStateChangeTime = currentTime;
       beepState = 2;
     }
@@ -2902,7 +3088,7 @@ void waterEmptyBuzzer()
   case 2:
     if (currentTime - lastStateChangeTime > SHORT_PAUSE)
     {
-      digitalWrite(BUZZER, HIGH);
+      halDigitalWrite(BUZZER, HIGH);
       lastStateChangeTime = currentTime;
       beepState = 3;
     }
@@ -2911,7 +3097,7 @@ void waterEmptyBuzzer()
   case 3:
     if (currentTime - lastStateChangeTime > BEEP_DURATION)
     {
-      digitalWrite(BUZZER, LOW);
+      halDigitalWrite(BUZZER, LOW);
       lastStateChangeTime = currentTime;
       beepState = 4;
     }
@@ -2931,84 +3117,84 @@ void ledError()
   static unsigned long lastBlinkTime = 0;
   const int blinkInterval = 500;
 
-  if (millis() - lastBlinkTime > blinkInterval)
+  if (halMillis() - lastBlinkTime > blinkInterval)
   {
-    lastBlinkTime = millis();
-    digitalWrite(LEDMAIN, !digitalRead(LEDMAIN));
-    digitalWrite(LEDHEATER, !digitalRead(LEDHEATER));
-    digitalWrite(LEDWATER, !digitalRead(LEDWATER));
+    lastBlinkTime = halMillis();
+    halDigitalWrite(LEDMAIN, !halDigitalRead(LEDMAIN));
+    halDigitalWrite(LEDHEATER, !halDigitalRead(LEDHEATER));
+    halDigitalWrite(LEDWATER, !halDigitalRead(LEDWATER));
   }
 }
 
 void ledWaterEmpty()
 {
-  digitalWrite(LEDHEATER, LOW);
-  digitalWrite(LEDMAIN, HIGH);
+  halDigitalWrite(LEDHEATER, LOW);
+  halDigitalWrite(LEDMAIN, HIGH);
 
   static unsigned long lastBlinkTime = 0;
   const int blinkInterval = 500;
 
-  if (millis() - lastBlinkTime > blinkInterval)
+  if (halMillis() - lastBlinkTime > blinkInterval)
   {
-    lastBlinkTime = millis();
-    digitalWrite(LEDWATER, !digitalRead(LEDWATER));
+    lastBlinkTime = halMillis();
+    halDigitalWrite(LEDWATER, !halDigitalRead(LEDWATER));
   }
 }
 
 void ledHeating()
 {
-  digitalWrite(LEDWATER, HIGH);
-  digitalWrite(LEDMAIN, HIGH);
+  halDigitalWrite(LEDWATER, HIGH);
+  halDigitalWrite(LEDMAIN, HIGH);
 
   static unsigned long lastBlinkTime = 0;
   const int blinkInterval = 500;
 
-  if (millis() - lastBlinkTime > blinkInterval)
+  if (halMillis() - lastBlinkTime > blinkInterval)
   {
-    lastBlinkTime = millis();
-    digitalWrite(LEDHEATER, !digitalRead(LEDHEATER));
+    lastBlinkTime = halMillis();
+    halDigitalWrite(LEDHEATER, !halDigitalRead(LEDHEATER));
   }
 }
 
 void ledIdle()
 {
-  digitalWrite(LEDWATER, HIGH);
-  digitalWrite(LEDMAIN, HIGH);
-  digitalWrite(LEDHEATER, HIGH);
+  halDigitalWrite(LEDWATER, HIGH);
+  halDigitalWrite(LEDMAIN, HIGH);
+  halDigitalWrite(LEDHEATER, HIGH);
 }
 
 void ledBrew()
 {
-  digitalWrite(LEDMAIN, HIGH);
-  digitalWrite(LEDHEATER, HIGH);
+  halDigitalWrite(LEDMAIN, HIGH);
+  halDigitalWrite(LEDHEATER, HIGH);
   if (lowWaterGracePeriodActive)
   {
     // Fast blink the water LED to warn the user they are on borrowed time!
     static unsigned long lastBlinkTime = 0;
     const int blinkInterval = 250;
 
-    if (millis() - lastBlinkTime > blinkInterval)
+    if (halMillis() - lastBlinkTime > blinkInterval)
     {
-      lastBlinkTime = millis();
-      digitalWrite(LEDWATER, !digitalRead(LEDWATER));
+      lastBlinkTime = halMillis();
+      halDigitalWrite(LEDWATER, !halDigitalRead(LEDWATER));
     }
   }
   else
   {
-    digitalWrite(LEDWATER, HIGH);
+    halDigitalWrite(LEDWATER, HIGH);
   }
 }
 
 void ledStandby()
 {
-  digitalWrite(LEDHEATER, LOW);
-  digitalWrite(LEDWATER, LOW);
+  halDigitalWrite(LEDHEATER, LOW);
+  halDigitalWrite(LEDWATER, LOW);
 
   static unsigned long lastBlinkTime = 0;
   const unsigned long BLINK_CYCLE = 5000;
   const unsigned long BLINK_ON_DURATION = 500;
 
-  unsigned long currentTime = millis();
+  unsigned long currentTime = halMillis();
 
   if (currentTime - lastBlinkTime > BLINK_CYCLE)
   {
@@ -3017,11 +3203,11 @@ void ledStandby()
 
   if (currentTime - lastBlinkTime < BLINK_ON_DURATION)
   {
-    digitalWrite(LEDMAIN, HIGH);
+    halDigitalWrite(LEDMAIN, HIGH);
   }
   else
   {
-    digitalWrite(LEDMAIN, LOW);
+    halDigitalWrite(LEDMAIN, LOW);
   }
 }
 
@@ -3031,12 +3217,13 @@ void ledStandby()
 
 void runHeaterPID()
 {
-  static unsigned long pwmWindowStartTime = millis();
+  StageScope stage(STAGE_HEATER_PID);
+  static unsigned long pwmWindowStartTime = halMillis();
   static double lastPidSetpoint = 0;
-  bool heatingModeCoffee = strcmp(brewMode, "STEAM");
+  bool heatingModeCoffee = brewMode != BREW_STEAM;
   if (manualHeaterControl)
   {
-    unsigned long now = millis();
+    unsigned long now = halMillis();
     unsigned long heaterOnTime_ms = (manualHeaterPercentage / 100.0) * PWM_WINDOW_SIZE;
 
     if (now - pwmWindowStartTime >= PWM_WINDOW_SIZE)
@@ -3130,12 +3317,14 @@ void runHeaterPID()
 
   if (!heaterShouldRun)
   {
+    heaterOutput = 0.0;
     setHeater(false);
     return;
   }
 
   if (bypassPID)
   {
+    heaterOutput = 100.0;
     setHeater(true);
   }
   else
@@ -3162,29 +3351,23 @@ void runHeaterPID()
       }
 
       total_output = ff_output + pidOutput;
-      if (computedOutput && mqttClient.connected())
+      if (computedOutput && halMqttConnected())
       {
-        char termBuffer[10];
-        dtostrf(heaterPID.GetPIntegrator(), 4, 3, termBuffer);
-        publishData(mqtt_topic_pterm, termBuffer, false, false);
-        dtostrf(heaterPID.GetIIntegrator(), 4, 3, termBuffer);
-        publishData(mqtt_topic_iterm, termBuffer, false, false);
-        dtostrf(heaterPID.GetDIntegrator(), 4, 3, termBuffer);
-        publishData(mqtt_topic_dterm, termBuffer, false, false);
+        unsigned long now = halMillis();
+        reportNumber(REPORT_P_TERM, mqtt_topic_pterm, heaterPID.GetPIntegrator(), 3, now);
+        reportNumber(REPORT_I_TERM, mqtt_topic_iterm, heaterPID.GetIIntegrator(), 3, now);
+        reportNumber(REPORT_D_TERM, mqtt_topic_dterm, heaterPID.GetDIntegrator(), 3, now);
       }
     }
     total_output = constrain(total_output, 0, 100);
+    heaterOutput = total_output;
 
-    static unsigned long lastPidOutputPublish = 0;
-    if (mqttClient.connected() && (millis() - lastPidOutputPublish >= 1000))
+    if (halMqttConnected())
     {
-      char termBuffer[10];
-      dtostrf(total_output, 4, 3, termBuffer);
-      publishData(mqtt_topic_pidoutput, termBuffer, false, true);
-      lastPidOutputPublish = millis();
+      reportNumber(REPORT_PID_OUTPUT, mqtt_topic_pidoutput, total_output, 3, halMillis());
     }
 
-    unsigned long now = millis();
+    unsigned long now = halMillis();
     unsigned long heaterOnTime_ms = (total_output / 100.0) * PWM_WINDOW_SIZE;
 
     if (now - pwmWindowStartTime >= PWM_WINDOW_SIZE)
@@ -3204,7 +3387,7 @@ void runHeaterPID()
 
 bool isStable()
 {
-  bool heatingModeCoffee = strcmp(brewMode, "STEAM");
+  bool heatingModeCoffee = brewMode != BREW_STEAM;
 
   if (!heatingModeCoffee)
   {
@@ -3224,10 +3407,10 @@ bool isStable()
     {
       if (stableTempStartTime == 0)
       {
-        stableTempStartTime = millis();
+        stableTempStartTime = halMillis();
       }
 
-      if (millis() - stableTempStartTime >= TEMP_STABILITY_DURATION_MS)
+      if (halMillis() - stableTempStartTime >= TEMP_STABILITY_DURATION_MS)
       {
         return true;
       }
@@ -3243,10 +3426,12 @@ bool isStable()
 
 void runPumpProfile()
 {
+  StageScope stage(STAGE_PUMP_PROFILE);
   float currentTargetY = 0.0f;
   bool usePID = false;
+  pumpTarget = 0.0f;
 
-  if (strcmp(profilingMode, "manual") == 0)
+  if (profilingMode == PROFILING_MANUAL)
   {
     setPumpPower(100);
 #ifdef HAS_PRESSURE_GAUGE
@@ -3257,19 +3442,19 @@ void runPumpProfile()
 #endif
     return;
   }
-  else if (strcmp(profilingMode, "flat") == 0)
+  else if (profilingMode == PROFILING_FLAT)
   {
     currentTargetY = profilingFlatValue;
     usePID = true;
   }
-  else if (strcmp(profilingMode, "profile") == 0)
+  else if (profilingMode == PROFILING_PROFILE)
   {
     float currentX = 0.0f;
     usePID = false;
 
-    if (!executingProfile->isTargetWeight) // Target is Time
+    if (!compiledProfile.segments[executingSegment].isTargetWeight) // Target is Time
     {
-      currentX = (millis() - profileStartTime) / 1000.0f;
+      currentX = (halMillis() - profileStartTime) / 1000.0f;
       usePID = true;
     }
 #ifdef HAS_SCALE
@@ -3285,20 +3470,18 @@ void runPumpProfile()
       currentTargetY = getTargetAt(currentX);
 
       // --- CHAINING LOGIC ---
-      int nextId = executingProfile->nextProfileId;
-      if (currentProfileStepIndex >= executingProfile->numSteps &&
-          nextId >= 0 &&
-          nextId < MAX_PROFILES &&
-          profiles[nextId].numSteps > 0) // <-- CRITICAL: Ensure target is not empty
+      // The chain was validated when compiled; just move to the next segment
+      if (currentProfileStepIndex >= compiledProfile.segments[executingSegment].numSteps &&
+          executingSegment + 1 < compiledProfile.numSegments)
       {
         printlnToAll("Profile segment complete. Chaining to next...");
 
-        executingProfile = &profiles[executingProfile->nextProfileId];
+        executingSegment++;
+        executingProfile = &profiles[compiledProfile.segments[executingSegment].profileId];
 
         // Reset trackers for the next segment
         currentProfileStepIndex = 0;
-        currentStepStartX = 0.0f;
-        profileStartTime = millis();
+        profileStartTime = halMillis();
 #ifdef HAS_SCALE
         profileStartWeight = currentWeight;
 #endif
@@ -3309,25 +3492,14 @@ void runPumpProfile()
   }
 
   bool hasFutureNonZero = false;
-  if (strcmp(profilingMode, "profile") == 0)
+  if (profilingMode == PROFILING_PROFILE)
   {
-    if (executingProfile->nextProfileId >= 0)
-    {
-      hasFutureNonZero = true; // Assume chained profiles keep it running
-    }
-    else
-    {
-      for (int i = currentProfileStepIndex; i < executingProfile->numSteps; i++)
-      {
-        if (executingProfile->steps[i].setpoint >= 0.1f)
-        {
-          hasFutureNonZero = true;
-          break;
-        }
-      }
-    }
+    const CompiledSegment &segment = compiledProfile.segments[executingSegment];
+    // Assume chained profiles keep it running
+    hasFutureNonZero = segment.declaresNext || currentProfileStepIndex <= segment.lastNonZeroStep;
   }
 
+  pumpTarget = currentTargetY;
   if (currentTargetY < 0.1f)
   {
     setPumpPower(0);
@@ -3341,7 +3513,7 @@ void runPumpProfile()
     pumpOutput = 0;
 #endif
 
-    if (!hasFutureNonZero && (millis() - shotStartTime > 5000))
+    if (!hasFutureNonZero && (halMillis() - shotStartTime > 5000))
     {
       setPump(false);
     }
@@ -3354,8 +3526,7 @@ void runPumpProfile()
     pumpSetpoint = (double)currentTargetY;
     bool controlActive = false;
 
-    // Flat mode resolves global strings; Profile mode uses the executing boolean
-    bool activeIsFlow = (strcmp(profilingMode, "flat") == 0) ? (strcmp(profilingSource, "flow") == 0) : executingProfile->isSourceFlow;
+    bool activeIsFlow = activeSourceIsFlow();
 
 #ifdef HAS_PRESSURE_GAUGE
     if (!activeIsFlow) // Source is Pressure
@@ -3418,48 +3589,129 @@ void runPumpProfile()
 }
 
 /**
- * @brief Calculates the current target setpoint for the pump based on the active profile.
- * Optimized for sequential, real-time execution during a shot.
+ * @brief Whether the pump is regulated on flow (true) or pressure (false).
+ * Flat mode uses the global source; profile mode uses the executing segment.
+ */
+bool activeSourceIsFlow()
+{
+  if (profilingMode == PROFILING_FLAT)
+  {
+    return profilingSource == SOURCE_FLOW;
+  }
+  return compiledProfile.segments[executingSegment].isSourceFlow;
+}
+
+/**
+ * @brief Calculates the current target setpoint for the pump based on the executing
+ * segment of the compiled profile. X may move backwards (weight), so the step is
+ * found with a binary search rather than by walking forward.
  *
  * @param currentX The current progress of the shot (elapsed time in seconds OR total weight in grams).
  * @return The calculated target setpoint (Pressure in bar OR Flow in g/s).
  */
 float getTargetAt(float currentX)
 {
-  if (executingProfile->numSteps == 0)
+  const CompiledSegment &segment = compiledProfile.segments[executingSegment];
+  if (segment.numSteps == 0)
     return 0.0f;
 
-  while (currentProfileStepIndex < executingProfile->numSteps)
+  int low = 0;
+  int high = segment.numSteps;
+  while (low < high)
+  {
+    int mid = (low + high) >> 1;
+    if (currentX >= segment.advanceX[mid])
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  currentProfileStepIndex = low;
+
+  if (low >= segment.numSteps)
+    return segment.finalY;
+
+  float ratio = (currentX - segment.startX[low]) * segment.invDuration[low];
+  ratio = constrain(ratio, 0.0f, 1.0f);
+  return segment.startY[low] + ratio * segment.deltaY[low];
+}
+
+/**
+ * @brief Flattens the active profile and its nextProfileId chain into
+ * compiledProfile. Chains stop at empty or invalid targets and at the first
+ * profile that was already visited, so a loop can't run forever.
+ */
+void compileActiveProfile()
+{
+  bool visited[MAX_PROFILES] = {false};
+  float carryY = 0.0f; // Ramps continue from the previous segment's final target
+  int id = currentProfileIndex;
+
+  compiledProfile.numSegments = 0;
+  while (compiledProfile.numSegments < MAX_PROFILES)
   {
-    ProfileStep &step = executingProfile->steps[currentProfileStepIndex];
+    const EspressoProfile &source = profiles[id];
+    CompiledSegment &segment = compiledProfile.segments[compiledProfile.numSegments++];
+    visited[id] = true;
 
-    float stepDuration = step.trigger;
-    float stepEndX = currentStepStartX + stepDuration;
+    segment.profileId = id;
+    segment.numSteps = min((int)source.numSteps, MAX_PROFILE_STEPS);
+    segment.isTargetWeight = source.isTargetWeight;
+    segment.isSourceFlow = source.isSourceFlow;
+    segment.declaresNext = source.nextProfileId >= 0;
+    segment.lastNonZeroStep = -1;
 
-    if (currentX >= stepEndX - 0.001f)
+    float x = 0.0f;
+    float prevY = carryY;
+    for (int i = 0; i < segment.numSteps; i++)
     {
-      currentProfileStepIndex++;
-      currentStepStartX = stepEndX;
-      prevStepTargetY = step.setpoint;
-      continue;
+      ProfileStep step = source.steps[i]; // Copy out of the packed struct
+      float duration = max(0.0f, step.trigger);
+
+      segment.startX[i] = x;
+      x += duration;
+      segment.advanceX[i] = x - 0.001f;
+
+      if (source.isStepped || duration <= 0.001f)
+      {
+        segment.startY[i] = step.setpoint;
+        segment.deltaY[i] = 0.0f;
+        segment.invDuration[i] = 0.0f;
+      }
+      else
+      {
+        segment.startY[i] = prevY;
+        segment.deltaY[i] = step.setpoint - prevY;
+        segment.invDuration[i] = 1.0f / duration;
+      }
+      if (step.setpoint >= 0.1f)
+      {
+        segment.lastNonZeroStep = i;
+      }
+      prevY = step.setpoint;
     }
+    segment.finalY = prevY;
+    carryY = prevY;
 
-    if (executingProfile->isStepped)
+    int nextId = source.nextProfileId;
+    if (nextId < 0 || nextId >= MAX_PROFILES || profiles[nextId].numSteps == 0)
     {
-      return step.setpoint;
+      break;
     }
-    else
+    if (visited[nextId])
     {
-      if (stepDuration <= 0.001f)
-        return step.setpoint;
-
-      float ratio = (currentX - currentStepStartX) / stepDuration;
-      ratio = constrain(ratio, 0.0f, 1.0f);
-      return prevStepTargetY + ratio * (step.setpoint - prevStepTargetY);
+      printToAll("Warning: profile chain loops back to ID ");
+      printToAll(nextId);
+      printlnToAll(", stopping the chain there.");
+      break;
     }
+    id = nextId;
   }
-
-  return prevStepTargetY;
+  // A recompile during a shot keeps the running segment where possible
+  if (executingSegment >= compiledProfile.numSegments)
+  {
+    executingSegment = compiledProfile.numSegments - 1;
+  }
+  executingProfile = &profiles[compiledProfile.segments[executingSegment].profileId];
 }
 
 void updateTempSwitch()
@@ -3469,11 +3721,11 @@ void updateTempSwitch()
 
   float targetTemp = 92.0;
 
-  if (digitalRead(THREE_WAY_SWITCH1) == HIGH)
+  if (halDigitalRead(THREE_WAY_SWITCH1) == HIGH)
   {
     targetTemp = 90.0;
   }
-  else if (digitalRead(THREE_WAY_SWITCH2) == HIGH)
+  else if (halDigitalRead(THREE_WAY_SWITCH2) == HIGH)
   {
     targetTemp = 94.0;
   }
@@ -3499,27 +3751,27 @@ void updateTempSwitch()
 
 void updateBrewMode()
 {
-  static char lastBrewMode[7] = "";
+  static int lastBrewMode = -1;
   static bool lastSteamBoostState = !enableSteamBoost;
 
   if (!ignoreBrewSwitch)
   {
-    if (digitalRead(TWO_WAY_SWITCH) == HIGH)
+    if (halDigitalRead(TWO_WAY_SWITCH) == HIGH)
     {
-      strcpy(brewMode, "STEAM");
+      brewMode = BREW_STEAM;
       enableSteamBoost = true;
     }
     else
     {
-      strcpy(brewMode, "COFFEE");
+      brewMode = BREW_COFFEE;
       enableSteamBoost = false;
     }
   }
 
-  if (strcmp(brewMode, lastBrewMode) != 0)
+  if (brewMode != lastBrewMode)
   {
-    publishData(mqtt_topic_brew_mode, brewMode, true);
-    strcpy(lastBrewMode, brewMode);
+    publishData(mqtt_topic_brew_mode, BREW_MODE_NAMES[brewMode], true);
+    lastBrewMode = brewMode;
     if (currentState == IDLE)
     {
       transitionToState(HEATING);
@@ -3537,7 +3789,7 @@ bool standbyTimoutReached()
 {
   if (currentState == IDLE && idleEntryTime > 0)
   {
-    if (millis() - idleEntryTime >= STANDBY_TIMEOUT_MS)
+    if (halMillis() - idleEntryTime >= STANDBY_TIMEOUT_MS)
     {
       return true;
     }
@@ -3557,7 +3809,7 @@ bool isProgrammaticFlushActive()
     return false;
   }
 
-  if (millis() >= programmaticFlushEndTime)
+  if (halMillis() >= programmaticFlushEndTime)
   {
     programmaticFlushEndTime = 0;
     printlnToAll("Programmatic flush finished.");
@@ -3591,9 +3843,9 @@ void startProgrammaticFlush(unsigned long duration)
     return;
   }
 
-  unsigned long newEndTime = millis() + duration;
+  unsigned long newEndTime = halMillis() + duration;
 
-  if (programmaticFlushEndTime > millis())
+  if (programmaticFlushEndTime > halMillis())
   {
     printlnToAll("Flush already in progress. Extending duration.");
   }
@@ -3611,578 +3863,1410 @@ void startProgrammaticFlush(unsigned long duration)
 // --- Settings & Configuration ---
 // ----------------------------------------------------------------
 
+// --- Settings Cache ---
+// The save functions only mark what changed; commitSettings() writes it.
+
+void markSettingsDirty(volatile bool &flag)
+{
+  settingsCacheStats.changes++;
+  if (flag)
+    settingsCacheStats.coalesced++;
+  flag = true;
+  settingsDirty = true;
+  lastSettingChangeTime = halMillis();
+}
+
 void saveProfile(int index)
 {
   if (index < 0 || index >= MAX_PROFILES)
     return;
-
-  preferences.begin("espresso-app", false);
-  char key[10];
-  sprintf(key, "p_%d", index);
-
-  size_t bytesWritten = preferences.putBytes(key, &profiles[index], sizeof(EspressoProfile));
-
-  preferences.end();
-
-  if (bytesWritten != sizeof(EspressoProfile))
-  {
-    printToAll("ERROR: Failed to save profile ");
-    printToAll(index);
-    printlnToAll(". NVS Partition might be full!");
-  }
-  else
-  {
-    printToAll("Saved profile index: ");
-    printlnToAll(index);
-  }
+  markSettingsDirty(profileDirty[index]);
 }
 
 void saveSettings(const char *key)
 {
-  preferences.begin("espresso-app", false);
-
-  // --- Network & MQTT ---
-  if (strcasecmp(key, "mqtt_server") == 0)
-    preferences.putString("mqttServer", mqtt_server);
-  else if (strcasecmp(key, "mqtt_port") == 0)
-    preferences.putInt("mqttPort", mqtt_port);
-  else if (strcasecmp(key, "mqtt_user") == 0)
-    preferences.putString("mqttUser", mqtt_user);
-  else if (strcasecmp(key, "mqtt_password") == 0)
-    preferences.putString("mqttPass", mqtt_password);
+  const SettingDescriptor *setting = findSetting(SETTINGS, settingIndex, key);
+  if (setting == nullptr || setting->nvsKey == nullptr)
+    return;
+  size_t index = setting - SETTINGS;
+  if (setting->override != nullptr)
+    storedOverride[index] = *setting->override;
+  markSettingsDirty(settingDirty[index]);
+}
 
-  // --- Temperatures & Modes ---
-  else if (strcasecmp(key, "tempsetbrew") == 0)
-  {
-    preferences.putFloat("tempSetBrew", tempSetBrew);
-    // We also save whether we are ignoring the physical switch
-    preferences.putBool("ignoreTempSw", ignoreTempSwitch);
-  }
-  else if (strcasecmp(key, "tempsetsteam") == 0)
-    preferences.putFloat("tempSetSteam", tempSetSteam);
-  else if (strcasecmp(key, "tempsetsteamboost") == 0)
-    preferences.putFloat("tempSetSteamB", tempSetSteamBoost);
-  else if (strcasecmp(key, "steamboost") == 0 || strcasecmp(key, "enablesteamboost") == 0)
-  {
-    preferences.putBool("steamBoost", enableSteamBoost);
-  }
-  else if (strcasecmp(key, "brewmode") == 0)
-  {
-    preferences.putString("brewMode", brewMode);
-    preferences.putBool("ignoreBrewSw", ignoreBrewSwitch);
-  }
+#ifdef HAS_SCALE
+void saveScaleCalibration()
+{
+  markSettingsDirty(scaleCalibrationDirty);
+}
+#endif
 
-  // --- Temperature PID ---
-  else if (strcasecmp(key, "kp_temperature") == 0)
-    preferences.putDouble("kp_temperature", kp_temperature);
-  else if (strcasecmp(key, "ki_temperature") == 0)
-    preferences.putDouble("ki_temperature", ki_temperature);
-  else if (strcasecmp(key, "kd_temperature") == 0)
-    preferences.putDouble("kd_temperature", kd_temperature);
+void saveReportPolicy()
+{
+  markSettingsDirty(reportPolicyDirty);
+}
 
-#ifdef HAS_PRESSURE_GAUGE
-  // --- Pressure PID ---
-  else if (strcasecmp(key, "kp_pressure") == 0)
-    preferences.putDouble("kp_pressure", kp_pressure);
-  else if (strcasecmp(key, "ki_pressure") == 0)
-    preferences.putDouble("ki_pressure", ki_pressure);
-  else if (strcasecmp(key, "kd_pressure") == 0)
-    preferences.putDouble("kd_pressure", kd_pressure);
-#endif
+void saveActiveProfileIndex()
+{
+  markSettingsDirty(activeProfileIndexDirty);
+}
 
-#ifdef HAS_SCALE
-  // --- Flow PID ---
-  else if (strcasecmp(key, "kp_flow") == 0)
-    preferences.putDouble("kp_flow", kp_flow);
-  else if (strcasecmp(key, "ki_flow") == 0)
-    preferences.putDouble("ki_flow", ki_flow);
-  else if (strcasecmp(key, "kd_flow") == 0)
-    preferences.putDouble("kd_flow", kd_flow);
-
-  // --- Kalman Filters ---
-  else if (strcasecmp(key, "flow_kalman_me") == 0)
-    preferences.putFloat("flowKalmanMe", flowKalmanMe);
-  else if (strcasecmp(key, "flow_kalman_e") == 0)
-    preferences.putFloat("flowKalmanE", flowKalmanE);
-  else if (strcasecmp(key, "flow_kalman_q") == 0)
-    preferences.putFloat("flowKalmanQ", flowKalmanQ);
-  else if (strcasecmp(key, "weight_kalman_me") == 0)
-    preferences.putFloat("weightKalmanMe", weightKalmanMe);
-  else if (strcasecmp(key, "weight_kalman_e") == 0)
-    preferences.putFloat("weightKalmanE", weightKalmanE);
-  else if (strcasecmp(key, "weight_kalman_q") == 0)
-    preferences.putFloat("weightKalmanQ", weightKalmanQ);
-
-  // --- Scale Calibration ---
-  else if (strcasecmp(key, "scale_cal") == 0)
-  {
-    preferences.putLong("scaleOffset", COMBINED_OFFSET);
-    preferences.putFloat("scaleScale", COMBINED_SCALE);
-  }
-#endif
+/**
+ * @brief Commits once no setting changed for SETTINGS_COMMIT_QUIET_MS. A shot
+ * is never interrupted by a flash write; its changes wait for the transition
+ * out of BREWING.
+ */
+void serviceSettingsCache(unsigned long nowTime)
+{
+  if (settingsDirty && currentState != BREWING && nowTime - lastSettingChangeTime >= SETTINGS_COMMIT_QUIET_MS)
+    requestSettingsCommit();
+}
 
-  // --- Profiling Logic ---
-  else if (strcasecmp(key, "profiling_mode") == 0)
-    preferences.putString("profMode", profilingMode);
-  else if (strcasecmp(key, "profiling_source") == 0)
-    preferences.putString("profSource", profilingSource);
-  else if (strcasecmp(key, "profiling_target") == 0)
-    preferences.putString("profTarget", profilingTarget);
-  else if (strcasecmp(key, "profiling_flat_value") == 0)
-    preferences.putFloat("profFlatVal", profilingFlatValue);
-  else if (strcasecmp(key, "active_profile_id") == 0)
-    preferences.putInt("curIdx", currentProfileIndex);
+/**
+ * @brief Drops every pending change (the flash is about to be erased).
+ */
+void clearSettingsCache()
+{
+  settingsDirty = false;
+  for (size_t i = 0; i < SETTING_COUNT; i++)
+    settingDirty[i] = false;
+  for (int i = 0; i < MAX_PROFILES; i++)
+    profileDirty[i] = false;
+  scaleCalibrationDirty = false;
+  reportPolicyDirty = false;
+  activeProfileIndexDirty = false;
+  legacySettingsStored = false;
+}
 
-  preferences.end();
+/**
+ * @brief Counts one NVS write; put* returns the bytes written, 0 on failure.
+ */
+size_t countNvsWrite(size_t written)
+{
+  settingsCacheStats.writes++;
+  if (written == 0)
+    settingsCacheStats.failedWrites++;
+  return written;
 }
 
-void loadSettings()
+/**
+ * @brief Counts one NVS read of the boot load.
+ */
+template <typename T>
+T countNvsRead(T value)
 {
-  printlnToAll("Loading settings from flash memory...");
-  preferences.begin("espresso-app", true);
+  settingsCacheStats.bootReads++;
+  return value;
+}
 
-  // --- Load Connection Settings ---
-  if (preferences.getString("mqttServer", mqtt_server, sizeof(mqtt_server)) == 0)
-    mqtt_server[0] = '\0';
-  if (preferences.getString("mqttUser", mqtt_user, sizeof(mqtt_user)) == 0)
-    mqtt_user[0] = '\0';
-  if (preferences.getString("mqttPass", mqtt_password, sizeof(mqtt_password)) == 0)
-    mqtt_password[0] = '\0';
-  mqtt_port = preferences.getInt("mqttPort", 1883);
-  enableSteamBoost = preferences.getBool("steamBoost", true);
+// --- Settings Image ---
 
-  if (preferences.isKey("tempSetBrew"))
+uint32_t reportPolicyRecord(int signal)
+{
+  return settingKeyHash(REPORT_SIGNAL_NAMES[signal], REPORT_POLICY_RECORD);
+}
+
+/**
+ * @brief Stores an encoded image (preferences open for writing). A size of 0
+ * means it did not fit and counts as a failed write.
+ */
+void writeImage(const char *key, const uint8_t *buffer, size_t size)
+{
+  if (size == 0)
   {
-    tempSetBrew = preferences.getFloat("tempSetBrew", 94.0);
-    ignoreTempSwitch = true;
-    printlnToAll("Loaded Brew Temp from Flash.");
+    settingsCacheStats.failedWrites++;
+    printToAll("ERROR: The ");
+    printToAll(key);
+    printlnToAll(" image does not fit its buffer.");
+    return;
   }
-  else
+  if (countNvsWrite(preferences.putBytes(key, buffer, size)) != size)
   {
-    ignoreTempSwitch = false;
-    printlnToAll("No saved Brew Temp. Defaulting to Switch.");
+    printToAll("ERROR: Failed to save the ");
+    printToAll(key);
+    printlnToAll(" image. NVS Partition might be full!");
   }
+}
 
-  updateCalculatedBoilerTemp();
-  tempSetSteam = preferences.getFloat("tempSetSteam", 136.0);
-  tempSetSteamBoost = preferences.getFloat("tempSetSteamB", 124.0);
-
-  kp_temperature = preferences.getDouble("kp_temperature", 0.16);
-  ki_temperature = preferences.getDouble("ki_temperature", 0.0000261);
-  kd_temperature = preferences.getDouble("kd_temperature", 0);
-#ifdef HAS_PRESSURE_GAUGE
+/**
+ * @brief Reads an image into settingsImageBuffer (preferences open). Returns
+ * its length, 0 if there is none.
+ */
+size_t readImage(const char *key, size_t maxLength)
+{
+  return countNvsRead(preferences.getBytes(key, settingsImageBuffer, maxLength));
+}
 
-  kp_pressure = preferences.getDouble("kp_pressure", 0.05);
-  ki_pressure = preferences.getDouble("ki_pressure", 22);
-  kd_pressure = preferences.getDouble("kd_pressure", 0.0);
-#endif
-#ifdef HAS_SCALE
-  kp_flow = preferences.getDouble("kp_flow", 1.0);
-  ki_flow = preferences.getDouble("ki_flow", 0.5);
-  kd_flow = preferences.getDouble("kd_flow", 0.0);
-  flowKalmanMe = preferences.getFloat("flowKalmanMe", 30.0);
-  flowKalmanE = preferences.getFloat("flowKalmanE", 2.0);
-  flowKalmanQ = preferences.getFloat("flowKalmanQ", 0.1);
-  weightKalmanMe = preferences.getFloat("weightKalmanMe", 8.0);
-  weightKalmanE = preferences.getFloat("weightKalmanE", 2.0);
-  weightKalmanQ = preferences.getFloat("weightKalmanQ", 0.1);
-#endif
-  if (preferences.isKey("brewMode"))
+size_t buildSettingsImage()
+{
+  ImageWriter image(settingsCommitBuffer, SETTINGS_IMAGE_MAX);
+  image.begin(SETTINGS_IMAGE_MAGIC, SETTINGS_IMAGE_VERSION);
+  for (size_t i = 0; i < SETTING_COUNT; i++)
   {
-    preferences.getString("brewMode", brewMode, sizeof(brewMode));
-    ignoreBrewSwitch = true;
-    printlnToAll("Loaded Brew Mode from Flash.");
+    const SettingDescriptor &setting = SETTINGS[i];
+    if (setting.nvsKey == nullptr)
+      continue;
+    uint32_t key = settingKeyHash(setting.key);
+    if (setting.type == SETTING_TEXT)
+      image.text(key, (const char *)setting.value);
+    else if (setting.type == SETTING_CHOICE)
+      image.text(key, setting.choices[*(uint8_t *)setting.value]);
+    else
+      image.record(key, setting.value, settingValueSize(setting));
+    // Whether the physical switch is overridden survives a reboot as well
+    if (setting.override != nullptr)
+      image.record(settingKeyHash(setting.overrideNvsKey), &storedOverride[i], sizeof(bool));
   }
-  else
+#ifdef HAS_SCALE
+  int32_t offset = COMBINED_OFFSET;
+  image.record(SCALE_OFFSET_RECORD, &offset, sizeof(offset));
+  image.record(SCALE_SCALE_RECORD, &COMBINED_SCALE, sizeof(COMBINED_SCALE));
+  for (int i = 0; i < SCALE_CUPS_MAX; i++)
   {
-    ignoreBrewSwitch = false;
-    printlnToAll("No saved Brew Mode. Defaulting to Switch.");
-    updateBrewMode();
+    if (CUP_SCALE[i] == 0)
+      continue; // never calibrated
+    offset = CUP_OFFSET[i];
+    image.record(CUP_OFFSET_RECORDS[i], &offset, sizeof(offset));
+    image.record(CUP_SCALE_RECORDS[i], &CUP_SCALE[i], sizeof(CUP_SCALE[i]));
   }
-
-#ifdef HAS_PRESSURE_GAUGE
-  if (preferences.getString("profMode", profilingMode, sizeof(profilingMode)) == 0)
-    strcpy(profilingMode, "manual");
-  if (preferences.getString("profSource", profilingSource, sizeof(profilingSource)) == 0)
-    strcpy(profilingSource, "pressure");
-  if (preferences.getString("profTarget", profilingTarget, sizeof(profilingTarget)) == 0)
-    strcpy(profilingTarget, "time");
-  profilingFlatValue = preferences.getFloat("profFlatVal", 100.0);
-#elif defined(HAS_SCALE)
-  if (preferences.getString("profMode", profilingMode, sizeof(profilingMode)) == 0)
-    strcpy(profilingMode, "manual");
-  if (preferences.getString("profSource", profilingSource, sizeof(profilingSource)) == 0)
-    strcpy(profilingSource, "flow");
-  if (preferences.getString("profTarget", profilingTarget, sizeof(profilingTarget)) == 0)
-    strcpy(profilingTarget, "weight");
-#else
-  if (preferences.getString("profMode", profilingMode, sizeof(profilingMode)) == 0)
-    strcpy(profilingMode, "manual");
-  profilingSource[0] = '\0';
-  profilingTarget[0] = '\0';
 #endif
-#ifdef HAS_SCALE
-  COMBINED_OFFSET = preferences.getLong("scaleOffset", 0);
-  COMBINED_SCALE = preferences.getFloat("scaleScale", 1.0);
-#endif
-  currentProfileIndex = preferences.getInt("curIdx", 0);
-  if (currentProfileIndex >= MAX_PROFILES)
-    currentProfileIndex = 0;
-
-  bool foundAny = false;
-  size_t expectedSize = sizeof(EspressoProfile);
+  for (int i = 0; i < REPORT_SIGNAL_COUNT; i++)
+    image.record(reportPolicyRecord(i), &reportChannels[i].policy, sizeof(ReportPolicy));
+  uint8_t activeIndex = currentProfileIndex;
+  image.record(ACTIVE_PROFILE_RECORD, &activeIndex, sizeof(activeIndex));
+  return image.end();
+}
 
-  for (int i = 0; i < MAX_PROFILES; i++)
+/**
+ * @brief Reads a settings-image value into the setting. A number stored with
+ * the other float width is converted. Returns false if the record does not
+ * fit the setting or the value is out of range.
+ */
+bool decodeSettingValue(const SettingDescriptor &setting, const uint8_t *data, uint8_t length)
+{
+  switch (setting.type)
   {
-    char key[10];
-    sprintf(key, "p_%d", i);
-
-    size_t storedSize = preferences.getBytesLength(key);
-
-    if (storedSize == 0)
+  case SETTING_FLOAT:
+  case SETTING_DOUBLE:
+  {
+    double number;
+    if (length == sizeof(float))
     {
-      profiles[i].numSteps = 0;
-      profiles[i].nextProfileId = -1;
-      continue;
+      float narrow;
+      memcpy(&narrow, data, sizeof(narrow));
+      number = narrow;
     }
+    else if (length == sizeof(double))
+      memcpy(&number, data, sizeof(number));
+    else
+      return false;
+    if (setting.type == SETTING_FLOAT)
+      *(float *)setting.value = number;
+    else
+      *(double *)setting.value = number;
+    break;
+  }
+  case SETTING_INT:
+    if (length != sizeof(int32_t))
+      return false;
+    memcpy(setting.value, data, length);
+    break;
+  case SETTING_BOOL:
+    if (length != sizeof(bool))
+      return false;
+    *(bool *)setting.value = data[0] != 0;
+    return true;
+  case SETTING_TEXT:
+    if (length >= setting.size)
+      return false;
+    memcpy(setting.value, data, length);
+    ((char *)setting.value)[length] = '\0';
+    return true;
+  case SETTING_CHOICE:
+  {
+    char name[16];
+    if (length >= sizeof(name))
+      return false;
+    memcpy(name, data, length);
+    name[length] = '\0';
+    return parseSetting(setting, name);
+  }
+  default:
+    return false;
+  }
+  double value = settingValue(setting);
+  return value >= setting.minValue && value <= setting.maxValue;
+}
 
-    if (storedSize == expectedSize)
+void readSettingRecord(uint32_t key, const uint8_t *data, uint8_t length)
+{
+  const SettingDescriptor *setting = findSettingByHash(SETTINGS, settingIndex, key);
+  if (setting != nullptr && setting->nvsKey != nullptr)
+  {
+    if (!decodeSettingValue(*setting, data, length))
+      resetSetting(*setting);
+    return;
+  }
+  for (size_t i = 0; i < SETTING_COUNT; i++)
+  {
+    if (SETTINGS[i].override != nullptr && key == settingKeyHash(SETTINGS[i].overrideNvsKey) && length == 1)
     {
-      preferences.getBytes(key, &profiles[i], expectedSize);
-      profiles[i].id = i;
-      if (profiles[i].numSteps > 0)
-        foundAny = true;
+      *SETTINGS[i].override = data[0] != 0;
+      return;
     }
-    else
+  }
+#ifdef HAS_SCALE
+  if (key == SCALE_OFFSET_RECORD && length == sizeof(int32_t))
+  {
+    int32_t offset;
+    memcpy(&offset, data, sizeof(offset));
+    COMBINED_OFFSET = offset;
+    return;
+  }
+  if (key == SCALE_SCALE_RECORD && length == sizeof(float))
+  {
+    memcpy(&COMBINED_SCALE, data, sizeof(COMBINED_SCALE));
+    return;
+  }
+  for (int i = 0; i < SCALE_CUPS_MAX; i++)
+  {
+    if (key == CUP_OFFSET_RECORDS[i] && length == sizeof(int32_t))
     {
-      printToAll("Warning: Profile ");
-      printToAll(i);
-      printToAll(" size mismatch. Stored: ");
-      printToAll(storedSize);
-      printToAll(", Expected: ");
-      printlnToAll(expectedSize);
-
-      profiles[i].numSteps = 0;
-      profiles[i].nextProfileId = -1;
+      int32_t offset;
+      memcpy(&offset, data, sizeof(offset));
+      CUP_OFFSET[i] = offset;
+      return;
+    }
+    if (key == CUP_SCALE_RECORDS[i] && length == sizeof(float))
+    {
+      memcpy(&CUP_SCALE[i], data, sizeof(CUP_SCALE[i]));
+      return;
     }
   }
-  if (!foundAny)
+#endif
+  if (key == ACTIVE_PROFILE_RECORD && length == 1)
   {
-    currentProfileIndex = 0;
-    profiles[0].id = 0;
-    strcpy(profiles[0].name, "Standard Profile");
-    profiles[0].isStepped = false;
-    profiles[0].isTargetWeight = false;
-    profiles[0].isSourceFlow = false;
-    profiles[0].nextProfileId = -1;
-    profiles[0].numSteps = 1;
-    profiles[0].steps[0] = {30.0, 9.0};
+    currentProfileIndex = data[0];
+    return;
   }
+  for (int i = 0; i < REPORT_SIGNAL_COUNT; i++)
+  {
+    if (key == reportPolicyRecord(i) && length == sizeof(ReportPolicy))
+    {
+      memcpy(&reportChannels[i].policy, data, sizeof(ReportPolicy));
+      return;
+    }
+  }
+  // Anything else was written by other firmware and is skipped
+}
 
-  currentProfile = &profiles[currentProfileIndex];
+/**
+ * @brief Loads the settings image (preferences open). Returns false if there
+ * is none or it fails its CRC.
+ */
+bool readSettingsImage()
+{
+  size_t length = readImage(SETTINGS_IMAGE_KEY, SETTINGS_IMAGE_MAX);
+  if (length == 0)
+    return false;
+  ImageReader image(settingsImageBuffer, length, SETTINGS_IMAGE_MAGIC);
+  if (!image.valid())
+  {
+    printlnToAll("Warning: Settings image failed its CRC check, ignoring it.");
+    return false;
+  }
+  if (image.version() > SETTINGS_IMAGE_VERSION)
+    printlnToAll("Note: Settings image is from newer firmware, settings it added are skipped.");
 
-  printToAll("Profile loaded: ");
-  printToAll(currentProfile->name);
-  printToAll(" (");
-  printToAll(currentProfile->numSteps);
-  printlnToAll(" steps)");
-  preferences.end();
-  printlnToAll("Settings loaded.");
+  uint32_t key;
+  const uint8_t *data;
+  uint8_t dataLength;
+  while (image.next(key, data, dataLength))
+    readSettingRecord(key, data, dataLength);
+  return true;
 }
 
-void publishAllProfiles()
+/**
+ * @brief Serializes a profile field by field, independent of the layout of
+ * EspressoProfile: flags, next profile, name length, name, step count and
+ * (trigger, setpoint) per step.
+ */
+size_t encodeProfile(const EspressoProfile &profile, uint8_t *out)
 {
-  char idxStr[5];
-  itoa(currentProfileIndex, idxStr, 10);
-  publishData(mqtt_topic_active_profile_id, idxStr, true, true);
+  size_t nameLength = strnlen(profile.name, sizeof(profile.name) - 1);
+  uint8_t steps = min((int)profile.numSteps, MAX_PROFILE_STEPS);
+  size_t length = 0;
+  out[length++] = (profile.isStepped ? PROFILE_FLAG_STEPPED : 0) |
+                  (profile.isTargetWeight ? PROFILE_FLAG_TARGET_WEIGHT : 0) |
+                  (profile.isSourceFlow ? PROFILE_FLAG_SOURCE_FLOW : 0);
+  out[length++] = (uint8_t)profile.nextProfileId;
+  out[length++] = nameLength;
+  memcpy(out + length, profile.name, nameLength);
+  length += nameLength;
+  out[length++] = steps;
+  for (int j = 0; j < steps; j++)
+  {
+    float trigger = profile.steps[j].trigger;
+    float setpoint = profile.steps[j].setpoint;
+    memcpy(out + length, &trigger, sizeof(trigger));
+    memcpy(out + length + sizeof(trigger), &setpoint, sizeof(setpoint));
+    length += sizeof(trigger) + sizeof(setpoint);
+  }
+  return length;
+}
+
+/**
+ * @brief Reads a profile record written with the given image version. A
+ * change of the record layout gets a new PROFILE_IMAGE_VERSION and a case
+ * here; the older cases stay, so stored profiles survive firmware upgrades.
+ * Version 0 is the raw EspressoProfile blob of the per-key layout.
+ */
+bool decodeProfile(uint16_t version, const uint8_t *data, size_t length, EspressoProfile &profile)
+{
+  switch (version)
+  {
+  case 0:
+    if (length != sizeof(EspressoProfile))
+      return false;
+    memcpy(&profile, data, length);
+    profile.name[sizeof(profile.name) - 1] = '\0';
+    profile.numSteps = min((int)profile.numSteps, MAX_PROFILE_STEPS);
+    return true;
+  case 1:
+  {
+    if (length < 4 || length < 4 + (size_t)data[2])
+      return false;
+    size_t nameLength = data[2];
+    size_t position = 3 + nameLength;
+    uint8_t steps = data[position++];
+    if (length < position + steps * 2 * sizeof(float))
+      return false;
+    profile.isStepped = data[0] & PROFILE_FLAG_STEPPED;
+    profile.isTargetWeight = data[0] & PROFILE_FLAG_TARGET_WEIGHT;
+    profile.isSourceFlow = data[0] & PROFILE_FLAG_SOURCE_FLOW;
+    profile.nextProfileId = (int8_t)data[1];
+    size_t keep = min(nameLength, sizeof(profile.name) - 1);
+    memcpy(profile.name, data + 3, keep);
+    profile.name[keep] = '\0';
+    profile.numSteps = min((int)steps, MAX_PROFILE_STEPS);
+    for (int j = 0; j < profile.numSteps; j++)
+    {
+      float trigger, setpoint;
+      memcpy(&trigger, data + position, sizeof(trigger));
+      memcpy(&setpoint, data + position + sizeof(trigger), sizeof(setpoint));
+      profile.steps[j] = {trigger, setpoint};
+      position += sizeof(trigger) + sizeof(setpoint);
+    }
+    return true;
+  }
+  default:
+    return false; // written by newer firmware
+  }
+}
 
+size_t buildProfileImage(uint8_t *buffer)
+{
+  ImageWriter image(buffer, PROFILE_IMAGE_MAX);
+  image.begin(PROFILE_IMAGE_MAGIC, PROFILE_IMAGE_VERSION);
+  uint8_t record[PROFILE_RECORD_MAX];
   for (int i = 0; i < MAX_PROFILES; i++)
   {
     if (profiles[i].numSteps > 0)
-    {
-      JsonDocument doc;
-      doc["id"] = i;
-      doc["n"] = profiles[i].name;
-      doc["m"] = profiles[i].isStepped ? 1 : 0;
-      doc["tw"] = profiles[i].isTargetWeight ? 1 : 0;
-      doc["sf"] = profiles[i].isSourceFlow ? 1 : 0;
-      doc["nxt"] = profiles[i].nextProfileId;
-
-      JsonArray steps = doc["s"].to<JsonArray>();
-      for (int j = 0; j < profiles[i].numSteps; j++)
-      {
-        JsonArray step = steps.add<JsonArray>();
-        step.add(profiles[i].steps[j].setpoint);
-        step.add(profiles[i].steps[j].trigger);
-      }
-
-      char jsonBuffer[1024];
-      serializeJson(doc, jsonBuffer, sizeof(jsonBuffer));
+      image.record(i, record, encodeProfile(profiles[i], record));
+  }
+  return image.end();
+}
 
-      publishData(mqtt_topic_profile_data, jsonBuffer, true, true);
+/**
+ * @brief Loads the profile image (preferences open). Returns false if there
+ * is none or it fails its CRC.
+ */
+bool readProfileImage()
+{
+  size_t length = readImage(PROFILE_IMAGE_KEY, PROFILE_IMAGE_MAX);
+  if (length == 0)
+    return false;
+  ImageReader image(settingsImageBuffer, length, PROFILE_IMAGE_MAGIC);
+  if (!image.valid())
+  {
+    printlnToAll("Warning: Profile image failed its CRC check, ignoring it.");
+    return false;
+  }
 
-      delay(100);
+  uint32_t index;
+  const uint8_t *data;
+  uint8_t dataLength;
+  while (image.next(index, data, dataLength))
+  {
+    if (index < MAX_PROFILES && decodeProfile(image.version(), data, dataLength, profiles[index]))
+    {
+      profiles[index].id = index;
+      continue;
     }
+    printToAll("Warning: Profile ");
+    printToAll((int)index);
+    printToAll(" could not be read from image version ");
+    printlnToAll((int)image.version());
   }
+  return true;
 }
 
-void publishSingleSetting(const char *key, bool forceFlush)
-{
-  char msgBuffer[20];
+// --- Per-key layout of older firmware ---
 
-  // --- Temperatures ---
-  if (strcasecmp(key, "tempsetbrew") == 0)
+/**
+ * @brief Loads one table entry from its own NVS key (preferences open).
+ * Falls back to the default when the stored value is out of range.
+ */
+void loadLegacySetting(const SettingDescriptor &setting)
+{
+  const char *key = setting.nvsKey;
+  switch (setting.type)
   {
-    dtostrf(tempSetBrew, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_temp_brew, msgBuffer, true, forceFlush);
-  }
-  else if (strcasecmp(key, "tempsetsteam") == 0)
+  case SETTING_FLOAT:
+    *(float *)setting.value = countNvsRead(preferences.getFloat(key, setting.defaultValue));
+    break;
+  case SETTING_DOUBLE:
+    *(double *)setting.value = countNvsRead(preferences.getDouble(key, setting.defaultValue));
+    break;
+  case SETTING_INT:
+    *(int32_t *)setting.value = countNvsRead(preferences.getInt(key, (int32_t)setting.defaultValue));
+    break;
+  case SETTING_BOOL:
+    *(bool *)setting.value = countNvsRead(preferences.getBool(key, setting.defaultValue != 0));
+    break;
+  case SETTING_TEXT:
+    if (countNvsRead(preferences.getString(key, (char *)setting.value, setting.size)) == 0)
+      ((char *)setting.value)[0] = '\0';
+    break;
+  case SETTING_CHOICE:
   {
-    dtostrf(tempSetSteam, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_temp_steam, msgBuffer, true, forceFlush, true, false);
+    char name[16];
+    if (countNvsRead(preferences.getString(key, name, sizeof(name))) > 0)
+      parseSetting(setting, name);
+    break;
   }
-  else if (strcasecmp(key, "tempsetsteamboost") == 0)
-  {
-    dtostrf(tempSetSteamBoost, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_temp_steam_boost, msgBuffer, true, forceFlush, true, false);
-
-    // --- Modes ---
+  default:
+    break;
   }
-  else if (strcasecmp(key, "brewmode") == 0)
+  double value = settingValue(setting);
+  if (setting.type != SETTING_TEXT && !(value >= setting.minValue && value <= setting.maxValue))
+    resetSetting(setting);
+}
+
+/**
+ * @brief Reads the per-key settings (preferences open). Returns true if any
+ * key was found.
+ */
+bool loadLegacySettings()
+{
+  bool found = false;
+  for (size_t i = 0; i < SETTING_COUNT; i++)
   {
-    publishData(mqtt_topic_brew_mode, brewMode, true, forceFlush);
+    const SettingDescriptor &setting = SETTINGS[i];
+    if (setting.nvsKey == nullptr)
+      continue;
+    bool stored = countNvsRead(preferences.isKey(setting.nvsKey));
+    if (stored)
+    {
+      loadLegacySetting(setting);
+      found = true;
+    }
+    // A stored value overrides the switch unless "auto" was saved since
+    if (setting.override != nullptr)
+      *setting.override = countNvsRead(preferences.getBool(setting.overrideNvsKey, stored));
   }
-  else if (strcasecmp(key, "steamboost") == 0 || strcasecmp(key, "enablesteamboost") == 0)
+#ifdef HAS_SCALE
+  if (countNvsRead(preferences.isKey("scaleOffset")))
   {
-    publishData(mqtt_topic_steam_boost, enableSteamBoost ? "true" : "false", true, forceFlush);
-
-    // --- PID ---
+    COMBINED_OFFSET = countNvsRead(preferences.getLong("scaleOffset", 0));
+    COMBINED_SCALE = countNvsRead(preferences.getFloat("scaleScale", SCALE_UNCALIBRATED));
+    found = true;
   }
-  else if (strcasecmp(key, "kp") == 0 || strcasecmp(key, "kp_temperature") == 0)
+#endif
+  ReportPolicy policies[REPORT_LEGACY_SIGNAL_COUNT];
+  if (countNvsRead(preferences.getBytesLength("reportPolicy")) == sizeof(policies) &&
+      countNvsRead(preferences.getBytes("reportPolicy", policies, sizeof(policies))) == sizeof(policies))
   {
-    dtostrf(kp_temperature, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_kp_temperature, msgBuffer, true, forceFlush, true, false);
+    for (int i = 0; i < REPORT_LEGACY_SIGNAL_COUNT; i++)
+      reportChannels[i].policy = policies[i];
+    found = true;
   }
-  else if (strcasecmp(key, "ki") == 0 || strcasecmp(key, "ki_temperature") == 0)
+  if (countNvsRead(preferences.isKey("curIdx")))
   {
-    dtostrf(ki_temperature, 4, 8, msgBuffer);
-    publishData(mqtt_topic_set_ki_temperature, msgBuffer, true, forceFlush, true, false);
+    currentProfileIndex = countNvsRead(preferences.getInt("curIdx", 0));
+    found = true;
   }
-  else if (strcasecmp(key, "kd") == 0 || strcasecmp(key, "kd_temperature") == 0)
+  return found;
+}
+
+/**
+ * @brief Reads the per-key profiles p_0..p_19 (preferences open). Returns
+ * true if any was found.
+ */
+bool loadLegacyProfiles()
+{
+  bool found = false;
+  uint8_t blob[sizeof(EspressoProfile)];
+  for (int i = 0; i < MAX_PROFILES; i++)
   {
-    dtostrf(kd_temperature, 4, 2, msgBuffer);
-    publishData(mqtt_topic_set_kd_temperature, msgBuffer, true, forceFlush, true, false);
-    // --- Pump PIDs (MQTT ONLY) ---
-#ifdef HAS_PRESSURE_GAUGE
+    char key[10];
+    sprintf(key, "p_%d", i);
+
+    size_t storedSize = countNvsRead(preferences.getBytesLength(key));
+    if (storedSize == 0)
+      continue;
+
+    if (storedSize == sizeof(blob) && countNvsRead(preferences.getBytes(key, blob, sizeof(blob))) == sizeof(blob) &&
+        decodeProfile(0, blob, sizeof(blob), profiles[i]))
+    {
+      profiles[i].id = i;
+      found = true;
+    }
+    else
+    {
+      printToAll("Warning: Profile ");
+      printToAll(i);
+      printToAll(" size mismatch. Stored: ");
+      printToAll(storedSize);
+      printToAll(", Expected: ");
+      printlnToAll(sizeof(blob));
+    }
   }
+  return found;
+}
 
-  else if (strcasecmp(key, "kp_pressure") == 0)
+void removeLegacyKey(const char *key)
+{
+  if (preferences.isKey(key))
+    preferences.remove(key);
+}
+
+/**
+ * @brief Deletes the per-key layout once the images hold its values
+ * (preferences open for writing).
+ */
+void removeLegacySettings()
+{
+  for (size_t i = 0; i < SETTING_COUNT; i++)
   {
-    dtostrf(kp_pressure, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_kp_pressure, msgBuffer, true, forceFlush, true, false);
+    if (SETTINGS[i].nvsKey != nullptr)
+      removeLegacyKey(SETTINGS[i].nvsKey);
+    if (SETTINGS[i].override != nullptr)
+      removeLegacyKey(SETTINGS[i].overrideNvsKey);
   }
-  else if (strcasecmp(key, "ki_pressure") == 0)
+  removeLegacyKey("scaleOffset");
+  removeLegacyKey("scaleScale");
+  removeLegacyKey("reportPolicy");
+  removeLegacyKey("curIdx");
+  for (int i = 0; i < MAX_PROFILES; i++)
   {
-    dtostrf(ki_pressure, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_ki_pressure, msgBuffer, true, forceFlush, true, false);
+    char key[10];
+    sprintf(key, "p_%d", i);
+    removeLegacyKey(key);
   }
-  else if (strcasecmp(key, "kd_pressure") == 0)
+  printlnToAll("Removed the per-key settings of older firmware.");
+}
+
+// --- Commit & Load ---
+
+bool takeDirty(volatile bool &flag)
+{
+  bool dirty = flag;
+  flag = false;
+  return dirty;
+}
+
+/**
+ * @brief Encodes the images holding a dirty entry and hands them to the
+ * comms side to write (see halRequestSettingsCommit()). Runs on the control
+ * task, which owns the settings and profiles. A flag is cleared as its image
+ * is encoded, so a change made later is written by the next commit. Does
+ * nothing while the previous snapshot is still being written.
+ */
+void requestSettingsCommit()
+{
+  if (!settingsDirty || settingsCommitBusy)
+    return;
+  settingsDirty = false;
+
+  SettingsCommit &commit = settingsCommit;
+  commit.settingsChanged = false;
+  for (size_t i = 0; i < SETTING_COUNT; i++)
+  {
+    if (takeDirty(settingDirty[i]))
+      commit.settingsChanged = true;
+  }
+  if (takeDirty(scaleCalibrationDirty))
+    commit.settingsChanged = true;
+  if (takeDirty(reportPolicyDirty))
+    commit.settingsChanged = true;
+  if (takeDirty(activeProfileIndexDirty))
+    commit.settingsChanged = true;
+  commit.profilesChanged = false;
+  for (int i = 0; i < MAX_PROFILES; i++)
   {
-    dtostrf(kd_pressure, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_kd_pressure, msgBuffer, true, forceFlush, true, false);
-#endif
-#ifdef HAS_SCALE
+    commit.savedProfiles[i] = takeDirty(profileDirty[i]);
+    if (commit.savedProfiles[i])
+      commit.profilesChanged = true;
   }
-  else if (strcasecmp(key, "kp_flow") == 0)
+  if (commit.settingsChanged)
+    commit.settingsSize = buildSettingsImage();
+  if (commit.profilesChanged)
+    commit.profilesSize = buildProfileImage(settingsImageBuffer);
+
+  settingsCommitBusy = true;
+  halRequestSettingsCommit();
+}
+
+/**
+ * @brief Waits until the snapshot handed to the comms side is written.
+ * Returns false on timeout.
+ */
+bool waitForSettingsCommit(uint32_t timeoutMs)
+{
+  unsigned long start = halMillis();
+  while (settingsCommitBusy)
   {
-    dtostrf(kp_flow, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_kp_flow, msgBuffer, true, forceFlush, true, false);
+    if (halMillis() - start >= timeoutMs)
+      return false;
+    halDelay(10);
   }
-  else if (strcasecmp(key, "ki_flow") == 0)
+  return true;
+}
+
+/**
+ * @brief Commits every pending change and waits until it is written, e.g.
+ * before a restart. Returns false on timeout.
+ */
+bool flushSettingsCommit(uint32_t timeoutMs)
+{
+  unsigned long start = halMillis();
+  while (settingsDirty || settingsCommitBusy)
   {
-    dtostrf(ki_flow, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_ki_flow, msgBuffer, true, forceFlush, true, false);
+    requestSettingsCommit();
+    if (!settingsCommitBusy)
+      break;
+    if (halMillis() - start >= timeoutMs)
+      return false;
+    halDelay(10);
   }
-  else if (strcasecmp(key, "kd_flow") == 0)
-  {
-    dtostrf(kd_flow, 4, 3, msgBuffer);
-    publishData(mqtt_topic_set_kd_flow, msgBuffer, true, forceFlush, true, false);
+  return true;
+}
 
-    // --- Kalman Filters (MQTT ONLY) ---
-  }
-  else if (strcasecmp(key, "flow_kalman_me") == 0)
+/**
+ * @brief Writes the snapshot from requestSettingsCommit() in one NVS
+ * session. Runs on the comms side and reads nothing but the snapshot.
+ */
+void commitSettings()
+{
+  if (!settingsCommitBusy)
+    return;
+  const SettingsCommit &commit = settingsCommit;
+  unsigned long startUs = halMicros();
+  uint32_t writesBefore = settingsCacheStats.writes;
+  uint32_t failedBefore = settingsCacheStats.failedWrites;
+
+  preferences.begin("espresso-app", false);
+  if (commit.settingsChanged)
+    writeImage(SETTINGS_IMAGE_KEY, settingsCommitBuffer, commit.settingsSize);
+  if (commit.profilesChanged)
+    writeImage(PROFILE_IMAGE_KEY, settingsImageBuffer, commit.profilesSize);
+  bool written = settingsCacheStats.failedWrites == failedBefore;
+  if (legacySettingsStored && written)
   {
-    dtostrf(flowKalmanMe, 4, 2, msgBuffer);
-    publishData(mqtt_topic_set_flow_kalman_me, msgBuffer, true, forceFlush, true, false);
+    removeLegacySettings();
+    legacySettingsStored = false;
   }
-  else if (strcasecmp(key, "flow_kalman_e") == 0)
+  preferences.end();
+
+  for (int i = 0; i < MAX_PROFILES && written; i++)
   {
-    dtostrf(flowKalmanE, 4, 2, msgBuffer);
-    publishData(mqtt_topic_set_flow_kalman_e, msgBuffer, true, forceFlush, true, false);
+    if (commit.savedProfiles[i])
+    {
+      printToAll("Saved profile index: ");
+      printlnToAll(i);
+    }
   }
-  else if (strcasecmp(key, "flow_kalman_q") == 0)
+
+  uint32_t elapsedUs = halMicros() - startUs;
+  uint32_t writes = settingsCacheStats.writes - writesBefore;
+  settingsCacheStats.commits++;
+  settingsCacheStats.lastCommitWrites = writes;
+  settingsCacheStats.lastCommitUs = elapsedUs;
+  if (elapsedUs > settingsCacheStats.maxCommitUs)
+    settingsCacheStats.maxCommitUs = elapsedUs;
+  settingsCacheStats.totalCommitUs += elapsedUs;
+
+  char line[64];
+  snprintf(line, sizeof(line), "Settings committed: %lu NVS writes in %lu.%lu ms", (unsigned long)writes,
+           (unsigned long)(elapsedUs / 1000), (unsigned long)(elapsedUs % 1000 / 100));
+  printlnToAll(line);
+  settingsCommitBusy = false;
+}
+
+/**
+ * @brief Drops the snapshot unwritten (native replay, where the recorded run
+ * wrote it outside the trace).
+ */
+void discardSettingsCommit()
+{
+  settingsCommitBusy = false;
+}
+
+void printSettingsCacheStats()
+{
+  const SettingsCacheStats &stats = settingsCacheStats;
+  char line[96];
+  printlnToAll("--- Settings Cache ---");
+  snprintf(line, sizeof(line), "Boot load: %lu NVS reads in %lu us (%s)", (unsigned long)stats.bootReads,
+           (unsigned long)stats.bootLoadUs, stats.bootSource != nullptr ? stats.bootSource : "-");
+  printlnToAll(line);
+  snprintf(line, sizeof(line), "Changes: %lu (%lu coalesced before a commit)", (unsigned long)stats.changes,
+           (unsigned long)stats.coalesced);
+  printlnToAll(line);
+  snprintf(line, sizeof(line), "Commits: %lu, NVS writes: %lu (%lu failed)", (unsigned long)stats.commits,
+           (unsigned long)stats.writes, (unsigned long)stats.failedWrites);
+  printlnToAll(line);
+  uint32_t averageUs = stats.commits > 0 ? stats.totalCommitUs / stats.commits : 0;
+  snprintf(line, sizeof(line), "Commit time: last %lu us (%lu writes), avg %lu us, max %lu us",
+           (unsigned long)stats.lastCommitUs, (unsigned long)stats.lastCommitWrites, (unsigned long)averageUs,
+           (unsigned long)stats.maxCommitUs);
+  printlnToAll(line);
+  printlnToAll(settingsCommitBusy ? "A commit is being written."
+               : settingsDirty    ? "Changes waiting for the next commit."
+                                  : "Nothing waiting.");
+}
+
+/**
+ * @brief Sets a stored setting to its default.
+ */
+void resetSetting(const SettingDescriptor &setting)
+{
+  switch (setting.type)
   {
-    dtostrf(flowKalmanQ, 4, 2, msgBuffer);
-    publishData(mqtt_topic_set_flow_kalman_q, msgBuffer, true, forceFlush, true, false);
+  case SETTING_FLOAT:
+    *(float *)setting.value = setting.defaultValue;
+    break;
+  case SETTING_DOUBLE:
+    *(double *)setting.value = setting.defaultValue;
+    break;
+  case SETTING_INT:
+    *(int32_t *)setting.value = (int32_t)setting.defaultValue;
+    break;
+  case SETTING_BOOL:
+    *(bool *)setting.value = setting.defaultValue != 0;
+    break;
+  case SETTING_TEXT:
+    ((char *)setting.value)[0] = '\0';
+    break;
+  case SETTING_CHOICE:
+    *(uint8_t *)setting.value = (uint8_t)setting.defaultValue;
+    break;
+  default:
+    break;
   }
-  else if (strcasecmp(key, "weight_kalman_me") == 0)
+}
+
+/**
+ * @brief Marks everything stored dirty, so the next commit writes both
+ * images (first boot, or migrating the per-key layout).
+ */
+void markAllSettingsDirty()
+{
+  for (size_t i = 0; i < SETTING_COUNT; i++)
+    settingDirty[i] = SETTINGS[i].nvsKey != nullptr;
+  for (int i = 0; i < MAX_PROFILES; i++)
+    profileDirty[i] = profiles[i].numSteps > 0;
+  scaleCalibrationDirty = true;
+  reportPolicyDirty = true;
+  activeProfileIndexDirty = true;
+  settingsDirty = true;
+  lastSettingChangeTime = halMillis();
+}
+
+/**
+ * @brief Loads settings and profiles: the two images when they exist, else
+ * the per-key layout of older firmware, which the next commit migrates.
+ * Whatever is not stored keeps its default.
+ */
+void loadSettings()
+{
+  printlnToAll("Loading settings from flash memory...");
+  unsigned long startUs = halMicros();
+  settingsCacheStats.bootReads = 0;
+
+  for (size_t i = 0; i < SETTING_COUNT; i++)
   {
-    dtostrf(weightKalmanMe, 4, 2, msgBuffer);
-    publishData(mqtt_topic_set_weight_kalman_me, msgBuffer, true, forceFlush, true, false);
+    if (SETTINGS[i].nvsKey == nullptr)
+      continue;
+    resetSetting(SETTINGS[i]);
+    if (SETTINGS[i].override != nullptr)
+      *SETTINGS[i].override = false;
   }
-  else if (strcasecmp(key, "weight_kalman_e") == 0)
+#ifdef HAS_SCALE
+  COMBINED_OFFSET = 0;
+  COMBINED_SCALE = SCALE_UNCALIBRATED;
+  for (int i = 0; i < SCALE_CUPS_MAX; i++)
   {
-    dtostrf(weightKalmanE, 4, 2, msgBuffer);
-    publishData(mqtt_topic_set_weight_kalman_e, msgBuffer, true, forceFlush, true, false);
+    CUP_OFFSET[i] = 0;
+    CUP_SCALE[i] = 0;
   }
-  else if (strcasecmp(key, "weight_kalman_q") == 0)
-  {
-    dtostrf(weightKalmanQ, 4, 2, msgBuffer);
-    publishData(mqtt_topic_set_weight_kalman_q, msgBuffer, true, forceFlush, true, false);
 #endif
-    // --- Profiling ---
+  for (int i = 0; i < REPORT_SIGNAL_COUNT; i++)
+    reportChannels[i].policy = DEFAULT_REPORT_POLICIES[i];
+  currentProfileIndex = 0;
+  for (int i = 0; i < MAX_PROFILES; i++)
+  {
+    profiles[i].numSteps = 0;
+    profiles[i].nextProfileId = -1;
   }
-  else if (strcasecmp(key, "prof_mode") == 0 || strcasecmp(key, "profiling_mode") == 0)
+
+  preferences.begin("espresso-app", true);
+  bool haveSettingsImage = readSettingsImage();
+  bool haveProfileImage = readProfileImage();
+  bool foundLegacy = false;
+  if (!haveSettingsImage)
   {
-    publishData(mqtt_topic_set_profiling_mode, profilingMode, true, forceFlush);
+    foundLegacy = loadLegacySettings();
+    if (!haveProfileImage && loadLegacyProfiles())
+      foundLegacy = true;
   }
-  else if (strcasecmp(key, "prof_src") == 0 || strcasecmp(key, "profiling_source") == 0)
+  preferences.end();
+  uint32_t elapsedUs = halMicros() - startUs;
+
+  for (size_t i = 0; i < SETTING_COUNT; i++)
   {
-    publishData(mqtt_topic_set_profiling_source, profilingSource, true, forceFlush);
+    if (SETTINGS[i].override != nullptr)
+      storedOverride[i] = *SETTINGS[i].override;
   }
-  else if (strcasecmp(key, "prof_trg") == 0 || strcasecmp(key, "profiling_target") == 0)
+  settingsCacheStats.bootLoadUs = elapsedUs;
+  settingsCacheStats.bootSource = haveSettingsImage ? "image" : foundLegacy ? "per-key layout" : "defaults";
+  if (!haveSettingsImage)
   {
-    publishData(mqtt_topic_set_profiling_target, profilingTarget, true, forceFlush);
+    if (foundLegacy)
+      printlnToAll("Settings of older firmware found, they move to the settings image.");
+    legacySettingsStored = foundLegacy;
+    markAllSettingsDirty();
   }
-  else if (strcasecmp(key, "prof_flat") == 0 || strcasecmp(key, "profiling_flat_value") == 0)
+
+  updateCalculatedBoilerTemp();
+  printlnToAll(ignoreTempSwitch ? "Brew Temp set by setting." : "Brew Temp follows the 3-way switch.");
+  printlnToAll(ignoreBrewSwitch ? "Brew Mode set by setting." : "Brew Mode follows the switch.");
+  if (!ignoreBrewSwitch)
+    updateBrewMode();
+  applyShotStreamRate();
+
+  int firstProfile = -1;
+  for (int i = MAX_PROFILES - 1; i >= 0; i--)
   {
-    dtostrf(profilingFlatValue, 4, 1, msgBuffer);
-    publishData(mqtt_topic_profile_flat, msgBuffer, true, forceFlush);
+    if (profiles[i].numSteps > 0)
+      firstProfile = i;
   }
-  else if (strcasecmp(key, "active_profile_id") == 0)
+  // The active index and the profiles live in different images
+  if (currentProfileIndex >= MAX_PROFILES || profiles[currentProfileIndex].numSteps == 0)
+    currentProfileIndex = firstProfile >= 0 ? firstProfile : 0;
+  if (firstProfile < 0)
   {
-    itoa(currentProfileIndex, msgBuffer, 10);
-    publishData(mqtt_topic_active_profile_id, msgBuffer, true, forceFlush);
+    currentProfileIndex = 0;
+    profiles[0].id = 0;
+    strcpy(profiles[0].name, "Standard Profile");
+    profiles[0].isStepped = false;
+    profiles[0].isTargetWeight = false;
+    profiles[0].isSourceFlow = false;
+    profiles[0].nextProfileId = -1;
+    profiles[0].numSteps = 1;
+    profiles[0].steps[0] = {30.0, 9.0};
   }
-  else if (strcasecmp(key, "mqtt_server") == 0)
+
+  currentProfile = &profiles[currentProfileIndex];
+  compileActiveProfile();
+
+  printToAll("Profile loaded: ");
+  printToAll(currentProfile->name);
+  printToAll(" (");
+  printToAll(currentProfile->numSteps);
+  printlnToAll(" steps)");
+
+  char line[80];
+  snprintf(line, sizeof(line), "Settings loaded (%s): %lu NVS reads in %lu.%lu ms",
+           settingsCacheStats.bootSource, (unsigned long)settingsCacheStats.bootReads,
+           (unsigned long)(elapsedUs / 1000), (unsigned long)(elapsedUs % 1000 / 100));
+  printlnToAll(line);
+}
+
+/**
+ * @brief Queues every profile and the active index for publishing; the
+ * snapshot is taken at the next telemetry tick (see serviceResync()).
+ */
+void publishAllProfiles()
+{
+  profileSyncPending = true;
+}
+
+/**
+ * @brief Publishes the profile snapshot, one profile per packet. Runs on the
+ * comms side and reads nothing but the snapshot; paced with delays, so never
+ * inside the control loop.
+ */
+void publishProfileSync()
+{
+  if (!profileSyncBusy)
+    return;
+
+  char idxStr[5];
+  itoa(profileSyncActiveIndex, idxStr, 10);
+  publishData(mqtt_topic_active_profile_id, idxStr, true, true);
+
+  ImageReader image(profileSyncBuffer, profileSyncSize, PROFILE_IMAGE_MAGIC);
+  uint32_t index;
+  const uint8_t *data;
+  uint8_t dataLength;
+  EspressoProfile profile;
+  while (image.valid() && image.next(index, data, dataLength))
   {
-    publishData(mqtt_topic_mqtt_server, mqtt_server, true, forceFlush);
+    if (!decodeProfile(image.version(), data, dataLength, profile))
+      continue;
+    JsonDocument doc;
+    doc["id"] = index;
+    doc["n"] = profile.name;
+    doc["m"] = profile.isStepped ? 1 : 0;
+    doc["tw"] = profile.isTargetWeight ? 1 : 0;
+    doc["sf"] = profile.isSourceFlow ? 1 : 0;
+    doc["nxt"] = profile.nextProfileId;
+
+    JsonArray steps = doc["s"].to<JsonArray>();
+    for (int j = 0; j < profile.numSteps; j++)
+    {
+      JsonArray step = steps.add<JsonArray>();
+      step.add(profile.steps[j].setpoint);
+      step.add(profile.steps[j].trigger);
+    }
+
+    char jsonBuffer[1024];
+    serializeJson(doc, jsonBuffer, sizeof(jsonBuffer));
+
+    publishData(mqtt_topic_profile_data, jsonBuffer, true, true);
+
+    halDelay(100);
   }
-  else if (strcasecmp(key, "mqtt_port") == 0)
+  profileSyncBusy = false;
+}
+
+/**
+ * @brief Drops the profile snapshot unpublished (native replay, where the
+ * recorded run published it outside the trace).
+ */
+void discardProfileSync()
+{
+  profileSyncBusy = false;
+}
+
+/**
+ * @brief Publish hook of profile_data; every profile goes out in its own packet.
+ */
+void publishProfileData(bool forceFlush)
+{
+  publishAllProfiles();
+}
+
+void publishActiveProfileIndex(bool forceFlush)
+{
+  char idxStr[5];
+  itoa(currentProfileIndex, idxStr, 10);
+  publishData(mqtt_topic_active_profile_id, idxStr, true, forceFlush);
+}
+
+void publishSingleSetting(const char *key, bool forceFlush)
+{
+  const SettingDescriptor *setting = findSetting(SETTINGS, settingIndex, key);
+  if (setting == nullptr || (setting->topic == nullptr && setting->publish == nullptr))
   {
-    itoa(mqtt_port, msgBuffer, 10);
-    publishData(mqtt_topic_mqtt_port, msgBuffer, true, forceFlush);
+    printToAll("Warning: Unknown setting requested: ");
+    printlnToAll(key);
+    return;
   }
-  else if (strcasecmp(key, "mqtt_user") == 0)
+  publishSetting(*setting, forceFlush);
+}
+
+void publishSetting(const SettingDescriptor &setting, bool forceFlush)
+{
+  if (setting.publish != nullptr)
   {
-    publishData(mqtt_topic_mqtt_user, mqtt_user, true, forceFlush);
+    setting.publish(forceFlush);
+    return;
   }
-  else if (strcasecmp(key, "mqtt_pass") == 0 || strcasecmp(key, "mqtt_password") == 0)
+  char msgBuffer[41];
+  publishData(*setting.topic, formatSetting(setting, msgBuffer, sizeof(msgBuffer)), true, forceFlush, true,
+              (setting.flags & SETTING_TO_SCREEN) != 0);
+}
+
+/**
+ * @brief Whether the full settings sync publishes this entry.
+ */
+bool settingIsSynced(const SettingDescriptor &setting)
+{
+  return (setting.topic != nullptr || setting.publish != nullptr) && !(setting.flags & SETTING_ON_REQUEST);
+}
+
+/**
+ * @brief Starts a full settings sync, which serviceResync() publishes a batch
+ * per telemetry tick.
+ */
+void publishSettings()
+{
+  printlnToAll("Publishing settings to MQTT...");
+  static unsigned long lastPublishTime = 0;
+  if (halMillis() - lastPublishTime < 5000)
+    return;
+  lastPublishTime = halMillis();
+
+  if (!halMqttConnected())
+    return;
+
+  // Screen entries share ESP-NOW packets; the last one sends what is left
+  settingsSyncLastToScreen = 0;
+  for (size_t i = 0; i < SETTING_COUNT; i++)
   {
-    publishData(mqtt_topic_mqtt_pass, mqtt_password, true, forceFlush);
+    if (settingIsSynced(SETTINGS[i]) && (SETTINGS[i].flags & SETTING_TO_SCREEN))
+      settingsSyncLastToScreen = i;
   }
-  else if (strcasecmp(key, "profile") == 0 || strcasecmp(key, "profile_data") == 0)
+  settingsSyncNext = 0;
+}
+
+/**
+ * @brief The current value as a number: choice index, 0 / 1 for flags, 0 for
+ * text and actions.
+ */
+double settingValue(const SettingDescriptor &setting)
+{
+  switch (setting.type)
+  {
+  case SETTING_FLOAT:
+    return *(float *)setting.value;
+  case SETTING_DOUBLE:
+    return *(double *)setting.value;
+  case SETTING_INT:
+    return *(int32_t *)setting.value;
+  case SETTING_BOOL:
+    return *(bool *)setting.value ? 1 : 0;
+  case SETTING_CHOICE:
+    return *(uint8_t *)setting.value;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Parses value into the setting. Leaves it unchanged and returns false
+ * if value is malformed or out of range.
+ */
+bool parseSetting(const SettingDescriptor &setting, const char *value)
+{
+  char *end = nullptr;
+  double number = 0;
+  switch (setting.type)
   {
-    publishAllProfiles();
+  case SETTING_FLOAT:
+  case SETTING_DOUBLE:
+    number = strtod(value, &end);
+    break;
+  case SETTING_INT:
+    number = strtol(value, &end, 10);
+    break;
+  case SETTING_BOOL:
+    if (strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0)
+      number = 1;
+    else if (strcasecmp(value, "false") != 0 && strcmp(value, "0") != 0)
+      return false;
+    *(bool *)setting.value = number != 0;
+    return true;
+  case SETTING_TEXT:
+    if (strlen(value) >= setting.size)
+      return false;
+    strlcpy((char *)setting.value, value, setting.size);
+    return true;
+  case SETTING_CHOICE:
+    for (uint8_t i = 0; i < setting.size; i++)
+    {
+      if (strcasecmp(value, setting.choices[i]) == 0)
+      {
+        *(uint8_t *)setting.value = i;
+        return true;
+      }
+    }
+    return false;
+  default:
+    return false;
   }
+  if (end == value || *end != '\0' || !(number >= setting.minValue && number <= setting.maxValue))
+    return false;
+  if (setting.type == SETTING_FLOAT)
+    *(float *)setting.value = number;
+  else if (setting.type == SETTING_DOUBLE)
+    *(double *)setting.value = number;
   else
+    *(int32_t *)setting.value = number;
+  return true;
+}
+
+const char *formatSetting(const SettingDescriptor &setting, char *buffer, size_t size)
+{
+  switch (setting.type)
+  {
+  case SETTING_FLOAT:
+  case SETTING_DOUBLE:
+    dtostrf(settingValue(setting), 4, setting.decimals, buffer);
+    return buffer;
+  case SETTING_INT:
+    snprintf(buffer, size, "%ld", (long)*(int32_t *)setting.value);
+    return buffer;
+  case SETTING_BOOL:
+    return *(bool *)setting.value ? "true" : "false";
+  case SETTING_TEXT:
+    return (const char *)setting.value;
+  case SETTING_CHOICE:
+    return setting.choices[*(uint8_t *)setting.value];
+  default:
+    return "";
+  }
+}
+
+// --- Setting Hooks ---
+
+void brewTempChanged(double previous)
+{
+  updateCalculatedBoilerTemp();
+  if (currentState == IDLE && abs(tempSetBrew - previous) > 0.1)
   {
-    printToAll("Warning: Unknown setting requested: ");
-    printlnToAll(key);
+    transitionToState(HEATING);
   }
 }
 
-void publishSettings()
+void steamBoostChanged(double previous)
 {
-  printlnToAll("Publishing settings to MQTT...");
-  static unsigned long lastPublishTime = 0;
-  if (millis() - lastPublishTime < 5000)
-    return;
-  lastPublishTime = millis();
+  // Choosing steam boost by hand takes the brew switch out of the loop
+  ignoreBrewSwitch = true;
+}
 
-  if (!mqttClient.connected())
-    return;
+#ifdef HAS_PRESSURE_GAUGE
+void pressureTuningsChanged(double previous)
+{
+  pressurePID.SetTunings(kp_pressure, ki_pressure, kd_pressure);
+}
+#endif
 
-  publishSingleSetting("mqtt_server", false);
-  publishSingleSetting("mqtt_port", false);
-  publishSingleSetting("mqtt_user", false);
-  publishSingleSetting("mqtt_pass", true);
+#ifdef HAS_SCALE
+void flowTuningsChanged(double previous)
+{
+  flowPID.SetTunings(kp_flow, ki_flow, kd_flow);
+}
 
-  publishAllProfiles();
+void weightFlowTuningChanged(double previous)
+{
+  // flow_kalman_me counts samples at 10 SPS; keep the same span of time at
+  // each cup's actual rate
+  float noiseWindow = flowKalmanMe * scaleCupRate() / SCALE_SLOW_SPS;
+  for (int i = 0; i < SCALE_CUPS_MAX; i++)
+    cupEstimates[i].filter.configure(flowKalmanQ, weightKalmanQ, weightKalmanMe, weightKalmanE, flowKalmanE,
+                                     noiseWindow);
+}
 
-  publishSingleSetting("tempsetbrew", false);
-  publishSingleSetting("tempsetsteam", false);
-  publishSingleSetting("tempsetsteamboost", false);
-  publishSingleSetting("brewmode", false);
-  publishSingleSetting("steamboost", true);
+void scaleCupsChanged(double previous)
+{
+  applyScaleCups();
+}
 
-  publishSingleSetting("kp", false);
-  publishSingleSetting("ki", false);
-  publishSingleSetting("kd", true);
+void tareScaleAction(char *value)
+{
+  if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+    tareScale();
+}
 
-  publishSingleSetting("prof_mode", false);
-  publishSingleSetting("prof_src", false);
-  publishSingleSetting("prof_trg", false);
-  publishSingleSetting("prof_flat", true);
+void calibrateScaleAction(char *value)
+{
+  startCalibration();
+}
 
-  publishSingleSetting("kp_pressure", false);
-  publishSingleSetting("ki_pressure", false);
-  publishSingleSetting("kd_pressure", true);
+void calibrationStepAction(char *value)
+{
+  handleCalibrationStep(atof(value));
+}
+#endif
 
-  publishSingleSetting("kp_flow", false);
-  publishSingleSetting("ki_flow", false);
-  publishSingleSetting("kd_flow", true);
+void shotStreamChanged(double previous)
+{
+  applyShotStreamRate();
+}
 
-#ifdef HAS_SCALE
-  publishSingleSetting("weight_kalman_me", false);
-  publishSingleSetting("weight_kalman_e", false);
-  publishSingleSetting("weight_kalman_q", true);
+void activeProfileAction(char *value)
+{
+  int newIndex = atoi(value);
+  if (newIndex < 0 || newIndex >= MAX_PROFILES)
+    return;
+  currentProfileIndex = newIndex;
+  currentProfile = &profiles[currentProfileIndex];
+  compileActiveProfile();
 
-  publishSingleSetting("flow_kalman_me", false);
-  publishSingleSetting("flow_kalman_e", false);
-  publishSingleSetting("flow_kalman_q", true);
-#endif
+  // Reset shot tracking
+  currentProfileStepIndex = 0;
 
-  printlnToAll("Full settings sync complete.");
+  printToAll("Active profile switched to ID: ");
+  printlnToAll(currentProfileIndex);
+  saveActiveProfileIndex();
+  publishActiveProfileIndex(true);
 }
 
-void startNetworkServices()
+/**
+ * @brief profile_data=<json>: stores, replaces or (empty name) deletes one
+ * profile slot and echoes it back.
+ */
+void profileDataAction(char *value)
 {
-#ifdef HAS_SCREEN
-  printlnToAll("Initializing ESP-NOW...");
-  if (esp_now_init() != ESP_OK)
+  printlnToAll("Parsing profile update...");
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, value);
+
+  if (!error)
   {
-    printlnToAll("Error initializing ESP-NOW");
-    return;
-  }
-  esp_wifi_set_ps(WIFI_PS_NONE);
-  esp_now_register_recv_cb(OnDataRecv);
-  esp_now_register_send_cb(OnDataSent);
-#endif
-  mqttClient.onConnect(onMqttConnect);
-  mqttClient.onDisconnect(onMqttDisconnect);
-  mqttClient.onMessage(onMqttMessage);
+    int id = doc["id"] | -1;
+
+    if (id >= 0 && id < MAX_PROFILES)
+    {
+      const char *newName = doc["n"] | "";
+
+      if (strlen(newName) == 0)
+      {
+        profiles[id].id = id;
+        profiles[id].numSteps = 0;
+        profiles[id].name[0] = '\0';
+        profiles[id].isStepped = false;
+        if (id == currentProfileIndex)
+        {
+          printlnToAll("Active profile deleted! Searching for new active profile...");
+
+          int newIndex = 0;
+          bool foundNew = false;
+
+          for (int i = 0; i < MAX_PROFILES; i++)
+          {
+            if (i == id)
+              continue;
+
+            if (strlen(profiles[i].name) > 0)
+            {
+              newIndex = i;
+              foundNew = true;
+              break;
+            }
+          }
+
+          if (foundNew)
+          {
+            printToAll("Switching to first available profile: ID ");
+            printlnToAll(newIndex);
+          }
+          else
+          {
+            printlnToAll("No other profiles found. Reverting to ID 0 (Default).");
+          }
+
+          currentProfileIndex = newIndex;
+          currentProfile = &profiles[currentProfileIndex];
+
+          saveActiveProfileIndex();
+          publishActiveProfileIndex(true);
+        }
+      }
+      else
+      {
+        profiles[id].id = id;
+        strlcpy(profiles[id].name, newName, sizeof(profiles[id].name));
+        profiles[id].isStepped = (doc["m"] == 1);
+        profiles[id].isTargetWeight = (doc["tw"] == 1);
+        profiles[id].isSourceFlow = (doc["sf"] == 1);
+        profiles[id].nextProfileId = doc["nxt"] | -1;
+
+        JsonArray steps = doc["s"];
+        profiles[id].numSteps = 0;
+        for (JsonVariant step : steps)
+        {
+          if (profiles[id].numSteps >= MAX_PROFILE_STEPS)
+            break;
+          profiles[id].steps[profiles[id].numSteps].setpoint = step[0].as<float>();
+          profiles[id].steps[profiles[id].numSteps].trigger = step[1].as<float>();
+          profiles[id].numSteps++;
+        }
+        printlnToAll("Profile slot updated.");
+      }
+      if (id == currentProfileIndex)
+      {
+        currentProfile = &profiles[currentProfileIndex];
+      }
+      // Any slot may be part of the active chain
+      compileActiveProfile();
+      saveProfile(id);
+      JsonDocument outDoc;
+      outDoc["id"] = profiles[id].id;
+      outDoc["n"] = profiles[id].name;
+      outDoc["m"] = profiles[id].isStepped ? 1 : 0;
+      outDoc["tw"] = profiles[id].isTargetWeight ? 1 : 0;
+      outDoc["sf"] = profiles[id].isSourceFlow ? 1 : 0;
+      outDoc["nxt"] = profiles[id].nextProfileId;
+
+      JsonArray outSteps = outDoc["s"].to<JsonArray>();
+      for (int i = 0; i < profiles[id].numSteps; i++)
+      {
+        JsonArray step = outSteps.add<JsonArray>();
+        step.add(profiles[id].steps[i].setpoint);
+        step.add(profiles[id].steps[i].trigger);
+      }
 
-  mqttClient.setServer(mqtt_server, mqtt_port);
-  if (strcmp(mqtt_user, "") != 0)
+      char outBuffer[1024];
+      serializeJson(outDoc, outBuffer, sizeof(outBuffer));
+
+      printlnToAll("Syncing updated profile to network...");
+      publishData(mqtt_topic_profile_data, outBuffer, true);
+    }
+    else
+    {
+      printlnToAll("Error: Invalid Profile ID in JSON");
+    }
+  }
+  else
   {
-    mqttClient.setCredentials(mqtt_user, mqtt_password);
+    printlnToAll("JSON Error");
   }
-  mqttClient.setClientId(mqtt_client_id);
-  if (strcmp(mqtt_server, "") != 0)
+}
+
+void startCleaningAction(char *value)
+{
+  if ((strcmp(value, "true") == 0 || strcmp(value, "1") == 0) &&
+      (currentState == IDLE || (currentState == HEATING && hxTemp >= 80.0)))
   {
-    printlnToAll("Connecting to MQTT broker...");
-    mqttClient.connect();
+    cleaningRepetitionCounter = 0;
+    cleaningStateToResume = IDLE;
+    transitionToState(CLEANING_START);
   }
-  else
+}
+
+void reportPolicyAction(char *value)
+{
+  if (applyReportPolicy(value))
   {
-    printlnToAll("MQTT server not set. Skipping initial connection.");
+    saveReportPolicy();
+    printReportStats();
   }
+}
 
-  ArduinoOTA.setHostname(ota_hostname);
-  ArduinoOTA.setPassword(ota_password);
-  ArduinoOTA.begin();
-  printlnToAll("OTA Ready");
+/**
+ * @brief request=true (or empty) publishes every setting, request=<key> one.
+ */
+void requestAction(char *value)
+{
+  if (strcasecmp(value, "true") == 0 || strlen(value) == 0)
+    publishSettings();
+  else
+    publishSingleSetting(value, true);
 }
 
 void publishState()
@@ -4193,320 +5277,541 @@ void publishState()
   publishData(mqtt_topic_heater, heaterOn ? "ON" : "OFF", false, true);
 }
 
-void generateSparseMap()
+/**
+ * @brief Whether the per-topic telemetry goes to MQTT. In "frame" mode it only
+ * goes to the screen and MQTT gets the packed frame instead.
+ */
+bool telemetryTopicsToMqtt()
 {
-  printlnToAll("Generating sparse map for interpolation on boot...");
+  return telemetryMode != TELEMETRY_FRAME;
+}
 
-  for (int i = 0; i < LEGACY_TEMP_LOOKUP_TABLE_SIZE; i++)
-  {
-    int old_adc_val = i;
-    float temp_times_10 = LEGACY_TEMP_LOOKUP_TABLE[i];
+bool profilingIsManual()
+{
+  return profilingMode == PROFILING_MANUAL;
+}
 
-    float v_out_old = (float)old_adc_val * (VCC_OLD / OLD_ADC_MAX);
-    float r_thermistor = (R_SERIES_OHMS_OLD * (VCC_OLD - v_out_old)) / v_out_old;
+/**
+ * @brief Offers value to the signal's report channel; true if it is to be
+ * published now.
+ */
+bool reportDue(ReportSignal signal, float value, unsigned long now)
+{
+  ReportChannel &channel = reportChannels[signal];
+  uint32_t minInterval = channel.policy.minIntervalMs;
+  if (minInterval > 0 && currentState != BREWING && minInterval < telemetryPeriodMs)
+    minInterval = telemetryPeriodMs;
+  return channel.offer(value, now, minInterval);
+}
 
-    float v_out_new = VCC_NEW * (R_SERIES_OHMS_NEW / (r_thermistor + R_SERIES_OHMS_NEW));
-    float new_adc_val = (v_out_new / V_REF_NEW) * NEW_ADC_MAX;
+void reportNumber(ReportSignal signal, const char *topic, float value, int decimals, unsigned long now)
+{
+  if (!reportDue(signal, value, now))
+    return;
+  char msgBuffer[16];
+  dtostrf(value, 4, decimals, msgBuffer);
+  publishData(topic, msgBuffer, false, false, telemetryTopicsToMqtt());
+}
 
-    remappedAdcValues[i] = new_adc_val;
-    remappedTemperatureValues[i] = temp_times_10 / 10.0;
-  }
-  printlnToAll("Sparse map generation complete.");
+/**
+ * @brief Reports a discrete signal; code is what the channel compares, text
+ * what gets published.
+ */
+void reportText(ReportSignal signal, const char *topic, int code, const char *text, unsigned long now)
+{
+  if (reportDue(signal, code, now))
+    publishData(topic, text, signal == REPORT_STATE, true, telemetryTopicsToMqtt());
 }
-#ifdef HAS_SCALE
-// =================================================================
-// --- SCALE (ADS1232) FUNCTIONS ---
-// =================================================================
 
 /**
- * @brief Interrupt Service Routine (ISR) for the ADS1232.
- * Sets a flag when new data is ready to be read.
+ * @brief Parses "<signal>:<abs>,<rel>,<min_ms>,<max_ms>" or "defaults".
  */
-void IRAM_ATTR dataReadyISR()
+bool applyReportPolicy(char *value)
+{
+  if (strcasecmp(value, "defaults") == 0)
+  {
+    for (int i = 0; i < REPORT_SIGNAL_COUNT; i++)
+      reportChannels[i].policy = DEFAULT_REPORT_POLICIES[i];
+    return true;
+  }
+  char *separator = strchr(value, ':');
+  if (separator != NULL)
+  {
+    *separator = '\0';
+    ReportPolicy policy;
+    unsigned long minMs, maxMs;
+    if (sscanf(separator + 1, "%f,%f,%lu,%lu", &policy.absoluteBand, &policy.relativeBand, &minMs, &maxMs) == 4 &&
+        policy.absoluteBand >= 0 && policy.relativeBand >= 0)
+    {
+      policy.minIntervalMs = minMs;
+      policy.maxIntervalMs = maxMs;
+      for (int i = 0; i < REPORT_SIGNAL_COUNT; i++)
+      {
+        if (strcasecmp(value, REPORT_SIGNAL_NAMES[i]) == 0)
+        {
+          reportChannels[i].policy = policy;
+          return true;
+        }
+      }
+    }
+  }
+  printlnToAll("Invalid report_policy. Use <signal>:<abs>,<rel>,<min_ms>,<max_ms> or defaults.");
+  return false;
+}
+
+void printReportStats()
 {
-  portENTER_CRITICAL_ISR(&scaleMux);
-  newDataReady = true;
-  portEXIT_CRITICAL_ISR(&scaleMux);
+  char line[96];
+  uint32_t totalSent = 0;
+  uint32_t totalSuppressed = 0;
+  printlnToAll("--- Report-by-exception ---");
+  snprintf(line, sizeof(line), "  %-12s %8s %8s %8s %7s %8s %8s", "Signal", "Band", "Rel", "Min ms", "Max ms", "Sent",
+           "Held");
+  printlnToAll(line);
+  for (int i = 0; i < REPORT_SIGNAL_COUNT; i++)
+  {
+    const ReportChannel &channel = reportChannels[i];
+    snprintf(line, sizeof(line), "  %-12s %8.3f %8.3f %8lu %7lu %8lu %8lu", REPORT_SIGNAL_NAMES[i],
+             channel.policy.absoluteBand, channel.policy.relativeBand, (unsigned long)channel.policy.minIntervalMs,
+             (unsigned long)channel.policy.maxIntervalMs, (unsigned long)channel.sent, (unsigned long)channel.suppressed);
+    printlnToAll(line);
+    totalSent += channel.sent;
+    totalSuppressed += channel.suppressed;
+  }
+  snprintf(line, sizeof(line), "  Sent %lu, held back %lu (%.1f %%)", (unsigned long)totalSent,
+           (unsigned long)totalSuppressed,
+           totalSent + totalSuppressed > 0 ? 100.0 * totalSuppressed / (totalSent + totalSuppressed) : 0.0);
+  printlnToAll(line);
 }
 
 /**
- * @brief Sends the current pcfState byte to the PCF8574 I2C expander.
+ * @brief Publishes every signal of this tick as one frame (layout in
+ * telemetry_frame.h). The sequence number lets a consumer spot dropped frames.
  */
-void updatePcf()
+void publishTelemetryFrame(unsigned long nowTime)
+{
+  char frame[192];
+  FrameWriter writer(frame, sizeof(frame));
+  writer.begin();
+  writer.uint(TELEMETRY_FRAME_VERSION);
+  writer.uint(telemetrySequence++);
+  writer.uint(nowTime);
+  writer.fixed(boilerTemp, 2);
+  writer.fixed(hxTemp, 2);
+#ifdef HAS_PRESSURE_GAUGE
+  writer.fixed(pressure, 2);
+#else
+  writer.null();
+#endif
+#ifdef HAS_SCALE
+  writer.fixed(currentWeight, 1);
+  writer.fixed(flowRate, 1);
+#else
+  writer.null();
+  writer.null();
+#endif
+  writer.text(stateToString(currentState));
+  writer.flag(brewLeverLifted);
+  writer.flag(pumpRunning);
+  writer.flag(heaterOn);
+  writer.fixed(heaterOutput, 2);
+  writer.fixed(heaterPID.GetPIntegrator(), 3);
+  writer.fixed(heaterPID.GetIIntegrator(), 3);
+  writer.fixed(heaterPID.GetDIntegrator(), 3);
+  const char *payload = writer.end();
+  if (payload != nullptr)
+    publishData(mqtt_topic_telemetry, payload, false, false, true, false);
+}
+
+void applyShotStreamRate()
 {
-  Wire.setClock(100000);
-  Wire.beginTransmission(PCF8574_ADDRESS);
-  Wire.write(pcfState);
+  if (shotStreamHz > 0 && shotStreamHz < SHOT_STREAM_MIN_HZ)
+    shotStreamHz = SHOT_STREAM_MIN_HZ;
+  rateGroups[GROUP_SHOT_STREAM].periodMs = shotStreamHz > 0 ? 1000 / shotStreamHz : SHOT_STREAM_IDLE_PERIOD_MS;
+}
 
-  byte error = Wire.endTransmission();
-  Wire.setClock(400000);
+/**
+ * @brief Called on BREWING entry. A shot that is still in its drip time is
+ * closed first.
+ */
+void startShotStream()
+{
+  unsigned long now = halMillis();
+  if (shotStream.active)
+    finishShotStream(now);
+  if (shotStreamHz == 0)
+    return;
+  uint32_t shot = shotStream.shot + 1;
+  shotStream = {};
+  shotStream.active = true;
+  shotStream.shot = shot;
+  shotStream.startMs = now;
+  shotStream.publishDropsAtStart = halPublishDropCount();
+}
 
-  if (error != 0)
+/**
+ * @brief Publishes the batched samples as one frame.
+ */
+void flushShotStream()
+{
+  if (shotStream.batched == 0)
+    return;
+  char frame[224];
+  FrameWriter writer(frame, sizeof(frame));
+  writer.begin();
+  writer.uint(SHOT_STREAM_VERSION);
+  writer.uint(shotStream.shot);
+  writer.uint(shotStream.seq++);
+  writer.uint(shotStream.batch[0].timeMs);
+  unsigned long previous = shotStream.batch[0].timeMs;
+  for (int i = 0; i < shotStream.batched; i++)
+  {
+    const ShotSample &sample = shotStream.batch[i];
+    writer.uint(sample.timeMs - previous);
+    previous = sample.timeMs;
+#ifdef HAS_PRESSURE_GAUGE
+    writer.fixed(sample.pressure, 2);
+#else
+    writer.null();
+#endif
+#ifdef HAS_SCALE
+    writer.fixed(sample.flow, 2);
+    writer.fixed(sample.weight, 1);
+#else
+    writer.null();
+    writer.null();
+#endif
+    writer.uint(sample.pumpPower);
+    writer.fixed(sample.target, 1);
+    writer.fixed(sample.hx, 2);
+  }
+  shotStream.batched = 0;
+  const char *payload = writer.end();
+  if (payload == nullptr)
   {
-    printToAll("FAILED! Error Code: ");
-    printlnToAll(error);
+    shotStream.overflows++;
+    return;
   }
+  publishData(mqtt_topic_shot_stream, payload, false, true);
+  shotStream.frames++;
+  shotStream.bytes += strlen(payload);
+}
+
+/**
+ * @brief Sends what is left and reports throughput and drops for the shot.
+ */
+void finishShotStream(unsigned long nowTime)
+{
+  flushShotStream();
+  shotStream.active = false;
+
+  uint32_t durationMs = nowTime - shotStream.startMs;
+  uint32_t publishDrops = halPublishDropCount() - shotStream.publishDropsAtStart;
+  float seconds = durationMs / 1000.0f;
+  char stats[256];
+  snprintf(stats, sizeof(stats),
+           "{\"shot\":%lu,\"duration_ms\":%lu,\"hz\":%d,\"samples\":%lu,\"missed\":%lu,\"frames\":%lu,"
+           "\"bytes\":%lu,\"bytes_per_s\":%.0f,\"overflows\":%lu,\"publish_drops\":%lu}",
+           (unsigned long)shotStream.shot, (unsigned long)durationMs, shotStreamHz, (unsigned long)shotStream.samples,
+           (unsigned long)shotStream.missed, (unsigned long)shotStream.frames, (unsigned long)shotStream.bytes,
+           seconds > 0 ? shotStream.bytes / seconds : 0.0f, (unsigned long)shotStream.overflows,
+           (unsigned long)publishDrops);
+  publishData(mqtt_topic_shot_stream_stats, stats, false, false, true, false);
+
+  char line[128];
+  snprintf(line, sizeof(line), "Shot stream: %lu samples in %.1f s (%.1f Hz), %lu missed, %lu frames, %lu bytes, %lu dropped.",
+           (unsigned long)shotStream.samples, seconds, seconds > 0 ? shotStream.samples / seconds : 0.0f,
+           (unsigned long)shotStream.missed, (unsigned long)shotStream.frames, (unsigned long)shotStream.bytes,
+           (unsigned long)(publishDrops + shotStream.overflows));
+  printlnToAll(line);
 }
 
+#ifdef HAS_SCALE
+// =================================================================
+// --- SCALE (ADS1232) FUNCTIONS ---
+// =================================================================
+
 /**
- * @brief Reads the 24-bit raw data from the ADS1232.
+ * @brief Non-blocking function to be called from the main loop()
+ * to read the scale and calculate the final weight.
  */
-long readADCScale()
+void handleScale()
 {
-  if (digitalRead(ADS_DOUT_PIN) == HIGH)
-    return -2;
-  long reading = 0;
-  portENTER_CRITICAL(&scaleMux);
-  for (int i = 0; i < 24; i++)
+  if (scaleJob.done != nullptr && halMillis() - scaleJob.startTime > SCALE_JOB_TIMEOUT_MS)
+  {
+    finishScaleJob(false);
+  }
+
+  updateScaleRate();
+
+  // Every conversion since the last step, oldest first
+  ScaleSample sample;
+  bool filtered = false;
+  float newRawWeight = 0.0f;
+  while (halScaleTakeSample(sample))
+  {
+    if (!scaleSampleSettled(sample))
+    {
+      continue;
+    }
+    // An input no cup uses, e.g. just after scale_cups changed
+    int cup = scaleCupForChannel(sample.channel);
+    if (cup < 0)
+    {
+      continue;
+    }
+    loadCellValue = sample.raw;
+    if (scaleJob.done != nullptr)
+    {
+      feedScaleJob(cup, sample.raw);
+      continue;
+    }
+    newRawWeight = (float)(sample.raw - scaleCupOffset(cup)) / scaleCupScale(cup);
+    filterScaleSample(cupEstimates[cup], newRawWeight, sample.timestampUs);
+    filtered = true;
+  }
+  if (!filtered)
+  {
+    return;
+  }
+  currentWeight = 0.0;
+  for (int i = 0; i < scaleCups; i++)
+  {
+    currentWeight += cupEstimates[i].weight;
+  }
+  calculateFlowRate();
+
+  if (sendRawDebugData)
+  {
+    char msgBuffer[10];
+
+    dtostrf(newRawWeight, 4, 1, msgBuffer);
+    publishData("raw_weight", msgBuffer, false, false, false, true);
+
+    dtostrf(currentWeight, 4, 1, msgBuffer);
+    publishData("filtered_weight", msgBuffer, false, true, false, true);
+  }
+  bool postShotDrip = false;
+  if (shotEndTime != 0)
   {
-    digitalWrite(ADS_SCLK_PIN, HIGH);
-    delayMicroseconds(1);
-    reading <<= 1;
-    if (digitalRead(ADS_DOUT_PIN))
+    if (halMillis() - shotEndTime < SHOT_POST_DRIP_DURATION_MS)
+    {
+      postShotDrip = true;
+    }
+    else
     {
-      reading |= 1;
+      shotEndTime = 0;
     }
-    digitalWrite(ADS_SCLK_PIN, LOW);
-    delayMicroseconds(1);
   }
-  digitalWrite(ADS_SCLK_PIN, HIGH);
-  delayMicroseconds(1);
-  digitalWrite(ADS_SCLK_PIN, LOW);
-  portEXIT_CRITICAL(&scaleMux);
+  bool publishDue = halMillis() - lastScalePublishTime >= SCALE_PUBLISH_PERIOD_MS;
+  if (publishDue &&
+      ((brewLeverLifted && (currentState == BREWING || currentState == HEATING || currentState == IDLE)) || postShotDrip))
+  {
+    char msgBuffer[10];
+    lastScalePublishTime = halMillis();
+
+    dtostrf(currentWeight, 4, 1, msgBuffer);
+    publishData(mqtt_topic_weight, msgBuffer, false, false, false, true);
+
+    dtostrf(flowRate, 4, 1, msgBuffer);
+    publishData(mqtt_topic_flow_rate, msgBuffer, false, true, false, true);
+  }
+}
+
+/**
+ * @brief Switches the ADS1232 to 80 SPS for a shot and its post-drip
+ * window and back to 10 SPS after, then starts the settling discard.
+ */
+void updateScaleRate()
+{
+  bool postShotDrip = shotEndTime != 0 && halMillis() - shotEndTime < SHOT_POST_DRIP_DURATION_MS;
+  bool wantFast = brewLeverLifted || postShotDrip;
+  if (wantFast == scaleFastRate)
+  {
+    return;
+  }
+  scaleFastRate = wantFast;
+  halScaleSetSpeed(wantFast);
+  if (scaleCups > 1)
+  {
+    halScaleSetDwell(scaleCupDwell());
+  }
+  halScaleApplyConfig();
+
+  int sps = wantFast ? SCALE_FAST_SPS : SCALE_SLOW_SPS;
+  scaleSettleUntilUs = halMicros() + SCALE_SETTLE_CONVERSIONS * (1000000UL / sps);
+  scaleSpeedDiscard = SCALE_SPEED_DISCARD;
+  for (int i = 0; i < SCALE_CUPS_MAX; i++)
+  {
+    cupEstimates[i].filter.scaleMeasurementNoise(wantFast ? SCALE_FAST_NOISE_RATIO : 1.0f / SCALE_FAST_NOISE_RATIO);
+  }
+  weightFlowTuningChanged(0);
+}
 
-  if (reading & 0x800000)
+/**
+ * @brief False for samples the converter produced while settling after a
+ * rate switch.
+ */
+bool scaleSampleSettled(const ScaleSample &sample)
+{
+  if (scaleSpeedDiscard == 0)
   {
-    reading |= 0xFF000000;
+    return true;
   }
-  if (reading == 0x7FFFFF)
+  if ((int32_t)(sample.timestampUs - scaleSettleUntilUs) >= 0)
   {
-    updatePcf();
-    return -1;
+    scaleSpeedDiscard--;
   }
+  return false;
+}
+
+/**
+ * @brief Cup a conversion from this input belongs to, or -1 if no cup uses
+ * the input.
+ */
+int scaleCupForChannel(uint8_t channel)
+{
+  if (scaleCups == 1)
+    return channel == SCALE_CHANNEL ? 0 : -1;
+  return channel >= 1 && channel <= SCALE_CUPS_MAX ? channel - 1 : -1;
+}
+
+long scaleCupOffset(int cup)
+{
+  return scaleCups == 1 || CUP_SCALE[cup] == 0 ? COMBINED_OFFSET : CUP_OFFSET[cup];
+}
 
-  return reading;
+float scaleCupScale(int cup)
+{
+  return scaleCups == 1 || CUP_SCALE[cup] == 0 ? COMBINED_SCALE : CUP_SCALE[cup];
 }
 
-// --- PCF8574 Helper Functions ---
+/**
+ * @brief Scatter in counts below which a cup's job window counts as settled.
+ */
+float scaleSettleLimitCounts(int cup)
+{
+  float scale = scaleCupScale(cup);
+  return scale == SCALE_UNCALIBRATED ? SCALE_SETTLE_STDDEV_COUNTS : SCALE_SETTLE_STDDEV_G * fabsf(scale);
+}
 
-void setGain(uint8_t gain)
+/**
+ * @brief Stores a tare result. A split cup tared for the first time takes
+ * the combined scale factor along until it is weighed itself.
+ */
+void setScaleCupOffset(int cup, long offset)
 {
-  if (gain == 128)
+  if (scaleCups == 1)
   {
-    bitSet(pcfState, PCF_GAIN1_BIT);
-    bitSet(pcfState, PCF_GAIN0_BIT);
-  }
-  else
-  {
-    bitClear(pcfState, PCF_GAIN1_BIT);
-    bitClear(pcfState, PCF_GAIN0_BIT);
+    COMBINED_OFFSET = offset;
+    return;
   }
+  if (CUP_SCALE[cup] == 0)
+    CUP_SCALE[cup] = COMBINED_SCALE;
+  CUP_OFFSET[cup] = offset;
 }
-void setSpeed(bool high_speed)
+
+void setScaleCupScale(int cup, float scale)
 {
-  if (high_speed)
-    bitSet(pcfState, PCF_SPEED_BIT);
+  if (scaleCups == 1)
+    COMBINED_SCALE = scale;
   else
-    bitClear(pcfState, PCF_SPEED_BIT);
+    CUP_SCALE[cup] = scale;
 }
-void powerDown(bool power_down)
+
+/**
+ * @brief Burst length per input for split cups at the current rate, see
+ * Split-Cup Scheduling.
+ */
+uint8_t scaleCupDwell()
 {
-  if (power_down)
-    bitClear(pcfState, PCF_PDWN_BIT);
-  else
-    bitSet(pcfState, PCF_PDWN_BIT);
+  int sps = scaleFastRate ? SCALE_FAST_SPS : SCALE_SLOW_SPS;
+  int dwell = (int)(SCALE_CUP_GAP_MS * sps / 1000) - 2 * SCALE_SETTLE_CONVERSIONS;
+  return max(dwell, SCALE_MIN_DWELL);
 }
-void selectChannelScale(uint8_t channel)
+
+/**
+ * @brief Samples per second each cup gets at the current rate.
+ */
+float scaleCupRate()
 {
-  if (channel == 2)
-    bitSet(pcfState, PCF_A0_BIT);
-  else
-    bitClear(pcfState, PCF_A0_BIT);
+  float sps = scaleFastRate ? SCALE_FAST_SPS : SCALE_SLOW_SPS;
+  if (scaleCups == 1)
+    return sps;
+  int dwell = scaleCupDwell();
+  return sps * dwell / (scaleCups * (dwell + SCALE_SETTLE_CONVERSIONS));
 }
 
 /**
- * @brief Non-blocking function to be called from the main loop()
- * to read the scale and calculate the final weight.
+ * @brief Sets the converter up for scale_cups: one input, or both in turn.
+ * The estimators start over, as the inputs now weigh something else.
  */
-void handleScale()
+void applyScaleCups()
 {
-
-  if (newDataReady)
+  if (scaleCups > 1)
   {
-    long raw_data = readADCScale();
-    portENTER_CRITICAL(&scaleMux);
-    newDataReady = false;
-    portEXIT_CRITICAL(&scaleMux);
-    if (raw_data == -2 || raw_data == -1)
-    {
-      return;
-    }
-    loadCellValue = raw_data;
-    float newRawWeight = (float)(raw_data - COMBINED_OFFSET) / COMBINED_SCALE;
-
-    if (isFirstScaleReading)
-    {
-      lastRawWeight = newRawWeight;
-      currentWeight = weightKalmanFilter.updateEstimate(newRawWeight);
-      calculateFlowRate();
-      isFirstScaleReading = false;
-      isWeightPending = false;
-    }
-    else if (isWeightPending)
-    {
-
-      float confirmDelta = abs(newRawWeight - pendingWeight);
-
-      if (confirmDelta < SPIKE_THRESHOLD_G)
-      {
-        currentWeight = weightKalmanFilter.updateEstimate(pendingWeight);
-        currentWeight = weightKalmanFilter.updateEstimate(newRawWeight);
-        calculateFlowRate();
-        lastRawWeight = newRawWeight;
-        isWeightPending = false;
-      }
-      else
-      {
-        float revertDelta = abs(newRawWeight - lastRawWeight);
-        if (revertDelta < SPIKE_THRESHOLD_G)
-        {
-          currentWeight = weightKalmanFilter.updateEstimate(newRawWeight);
-          calculateFlowRate();
-          lastRawWeight = newRawWeight;
-          isWeightPending = false;
-        }
-        else
-        {
-          pendingWeight = newRawWeight;
-          isWeightPending = true;
-        }
-      }
-    }
-    else
-    {
-      float delta = abs(newRawWeight - lastRawWeight);
-
-      if (delta < SPIKE_THRESHOLD_G)
-      {
-        currentWeight = weightKalmanFilter.updateEstimate(newRawWeight);
-        calculateFlowRate();
-        lastRawWeight = newRawWeight;
-        isWeightPending = false;
-      }
-      else
-      {
-        pendingWeight = newRawWeight;
-        isWeightPending = true;
-      }
-    }
-
-    if (sendRawDebugData)
-    {
-      char msgBuffer[10];
-
-      dtostrf(newRawWeight, 4, 1, msgBuffer);
-      publishData("raw_weight", msgBuffer, false, false, false, true);
-
-      dtostrf(currentWeight, 4, 1, msgBuffer);
-      publishData("filtered_weight", msgBuffer, false, true, false, true);
-    }
-    bool postShotDrip = false;
-    if (shotEndTime != 0)
-    {
-      if (millis() - shotEndTime < SHOT_POST_DRIP_DURATION_MS)
-      {
-        postShotDrip = true;
-      }
-      else
-      {
-        shotEndTime = 0;
-      }
-    }
-    if ((brewLeverLifted && (currentState == BREWING || currentState == HEATING || currentState == IDLE)) || postShotDrip)
-    {
-      char msgBuffer[10];
-
-      dtostrf(currentWeight, 4, 1, msgBuffer);
-      publishData(mqtt_topic_weight, msgBuffer, false, false, false, true);
-
-      dtostrf(flowRate, 4, 1, msgBuffer);
-      publishData(mqtt_topic_flow_rate, msgBuffer, false, true, false, true);
-    }
-
-    portENTER_CRITICAL(&scaleMux);
-    newDataReady = false;
-    portEXIT_CRITICAL(&scaleMux);
+    halScaleSetDwell(scaleCupDwell());
+  }
+  else
+  {
+    halScaleSetDwell(0);
+    halScaleSelectChannel(SCALE_CHANNEL);
   }
+  halScaleApplyConfig();
+  weightFlowTuningChanged(0);
+  resetWeightFilter();
 }
 
 /**
- * @brief Reads a stable combined value from both channels by averaging.
- * This is a BLOCKING function and detaches the ISR.
- * @param times The number of reading cycles to average.
- * @return The averaged combined ADC value as a long.
+ * @brief Runs one scale sample through the cup's spike gate into its weight
+ * and flow estimator. A sample more than SPIKE_THRESHOLD_G away from the
+ * predicted weight is held back until the next sample either confirms it
+ * as a real step or reverts, marking it a spike.
  */
-long getStableCombinedReadingADS1232(int times)
+void filterScaleSample(CupEstimate &cup, float newRawWeight, uint32_t timestampUs)
 {
-  detachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN));
-
-  long total = 0;
-
-  printlnToAll("  Settling and reading scale channel...");
-  selectChannelScale(SCALE_CHANNEL);
-  updatePcf();
-
-  for (int i = 0; i < 4; i++)
+  WeightFlowFilter &filter = cup.filter;
+  if (!filter.isStarted())
   {
-    unsigned long waitStart = millis();
-    while (digitalRead(ADS_DOUT_PIN) == HIGH)
-    {
-      if (millis() - waitStart > 1000)
-      {
-        printlnToAll("Scale Error: DOUT stuck HIGH (Setup)");
-        attachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN), dataReadyISR, FALLING);
-        return 0; // Escape the loop
-      }
-    }
-    readADCScale();
+    filter.reset(newRawWeight, timestampUs);
+    cup.isWeightPending = false;
   }
-
-  for (int i = 0; i < times; i++)
+  else if (cup.isWeightPending && abs(newRawWeight - cup.pendingWeight) < SPIKE_THRESHOLD_G)
   {
-    unsigned long waitStart = millis();
-    while (digitalRead(ADS_DOUT_PIN) == HIGH)
+    filter.predict(cup.pendingTimestampUs);
+    filter.step(cup.pendingWeight);
+    filter.predict(timestampUs);
+    filter.update(newRawWeight);
+    cup.isWeightPending = false;
+  }
+  else
+  {
+    filter.predict(timestampUs);
+    if (abs(filter.innovation(newRawWeight)) < SPIKE_THRESHOLD_G)
     {
-      if (millis() - waitStart > 1000)
-      {
-        printlnToAll("Scale Error: DOUT stuck HIGH (Reading)");
-        attachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN), dataReadyISR, FALLING);
-        return 0;
-      }
+      filter.update(newRawWeight);
+      cup.isWeightPending = false;
     }
-    long val = readADCScale();
-    if (val == -1)
+    else
     {
-      i--;
-      continue;
+      cup.pendingWeight = newRawWeight;
+      cup.pendingTimestampUs = timestampUs;
+      cup.isWeightPending = true;
     }
-    total += val;
   }
-
-  long avg = total / times;
-  printToAll("  Avg ADC: ");
-  printlnToAll(avg);
-  attachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN), dataReadyISR, FALLING);
-  return avg;
+  cup.weight = filter.weight();
 }
 
+/**
+ * @brief Takes each cup's flow from its estimator while a shot (or its
+ * post-drip window) runs, and their sum as flowRate; all read 0 otherwise.
+ */
 void calculateFlowRate()
 {
-  unsigned long currentTime = millis();
-  unsigned long timeDelta = currentTime - previousTimeForFlowCalc;
-  static bool resetKalman = false;
   bool postShotDrip = false;
   if (shotEndTime != 0)
   {
-    if (millis() - shotEndTime < SHOT_POST_DRIP_DURATION_MS)
+    if (halMillis() - shotEndTime < SHOT_POST_DRIP_DURATION_MS)
     {
       postShotDrip = true;
     }
@@ -4517,68 +5822,193 @@ void calculateFlowRate()
   }
 
   bool isShotActive = brewLeverLifted || postShotDrip;
+  flowRate = 0.0f;
+  for (int i = 0; i < scaleCups; i++)
+  {
+    CupEstimate &cup = cupEstimates[i];
+    cup.flow = isShotActive ? max(0.0f, cup.filter.flow()) : 0.0f;
+    flowRate += cup.flow;
+  }
 
-  if (!isShotActive && !resetKalman)
+  if (sendRawDebugData)
   {
-    flowRate = 0.0f;
+    char msgBuffer[10];
+    dtostrf(flowRate, 4, 1, msgBuffer);
+    publishData("filtered_flow", msgBuffer, false, true, false, true);
+  }
+}
 
-    flowKalmanFilter.setEstimateError(flowKalmanE);
-    flowKalmanFilter.reset();
-    resetKalman = true;
+/**
+ * @brief Starts a background job on the scale stream; done runs from
+ * handleScale() when it finishes. Returns false if another job is running.
+ */
+bool startScaleJob(const char *name, void (*done)(const ScaleJob &job))
+{
+  if (scaleJob.done != nullptr)
+  {
+    printToAll("Scale busy with ");
+    printToAll(scaleJob.name);
+    printlnToAll(", try again when it finished.");
+    return false;
   }
-  else if (isShotActive)
+  scaleJob = {};
+  scaleJob.name = name;
+  scaleJob.done = done;
+  scaleJob.startTime = halMillis();
+  for (int i = 0; i < SCALE_CUPS_MAX; i++)
+    scaleJob.cups[i].discard = SCALE_JOB_DISCARD;
+  // Split cups keep alternating the inputs and fill both windows at once
+  if (scaleCups == 1)
+  {
+    halScaleSelectChannel(SCALE_CHANNEL);
+    halScaleApplyConfig();
+  }
+  return true;
+}
+
+/**
+ * @brief Adds a raw sample to the cup's window of the running job and
+ * finishes the job once every cup's full window is quiet enough.
+ */
+void feedScaleJob(int cup, long raw)
+{
+  ScaleJobWindow &job = scaleJob.cups[cup];
+  if (job.discard > 0)
   {
+    job.discard--;
+    return;
+  }
+  job.window[job.next] = raw;
+  job.next = (job.next + 1) % SCALE_SETTLE_WINDOW;
+  if (job.count < SCALE_SETTLE_WINDOW)
+    job.count++;
+
+  double mean = 0;
+  for (int i = 0; i < job.count; i++)
+    mean += job.window[i];
+  mean /= job.count;
+  double squares = 0;
+  for (int i = 0; i < job.count; i++)
+    squares += (job.window[i] - mean) * (job.window[i] - mean);
+  job.average = lround(mean);
+  job.stddevCounts = job.count > 1 ? sqrt(squares / (job.count - 1)) : 0;
+  job.quiet = job.count == SCALE_SETTLE_WINDOW && job.stddevCounts < scaleSettleLimitCounts(cup);
+
+  for (int i = 0; i < scaleCups; i++)
+  {
+    if (!scaleJob.cups[i].quiet)
+      return;
+  }
+  finishScaleJob(true);
+}
+
+void finishScaleJob(bool settled)
+{
+  void (*done)(const ScaleJob &job) = scaleJob.done;
+  scaleJob.done = nullptr;
+  scaleJob.settled = settled;
+  done(scaleJob);
+}
 
-    float rawFlowRate = 0.0f;
-    if (timeDelta > 0)
+/**
+ * @brief Whether a finished job's average can be used; reports a job that
+ * timed out.
+ */
+bool scaleJobUsable(const ScaleJob &job)
+{
+  for (int i = 0; i < scaleCups; i++)
+  {
+    if (job.cups[i].count == 0)
     {
-      float weightDelta = currentWeight - previousWeightForFlowCalc;
-      rawFlowRate = (weightDelta / (float)timeDelta) * 1000.0f;
-      rawFlowRate = max(0.0f, rawFlowRate);
+      printToAll("Scale Error: no samples for the ");
+      printToAll(job.name);
+      if (scaleCups > 1)
+      {
+        printToAll(" on cup ");
+        printToAll(i + 1);
+      }
+      printlnToAll(", nothing changed.");
+      return false;
+    }
+  }
+  for (int i = 0; i < scaleCups; i++)
+  {
+    const ScaleJobWindow &window = job.cups[i];
+    if (!job.settled && !window.quiet)
+    {
+      printToAll("Warning: ");
+      printScaleCup(i);
+      printToAll("Scale did not settle (noise ");
+      printToAll(window.stddevCounts, 1);
+      printlnToAll(" counts), using the average.");
     }
-    resetKalman = false;
-    flowRate = flowKalmanFilter.updateEstimate(rawFlowRate);
-    previousTimeForFlowCalc = currentTime;
-    previousWeightForFlowCalc = currentWeight;
+    printToAll("  ");
+    printScaleCup(i);
+    printToAll("Avg ADC: ");
+    printlnToAll(window.average);
   }
+  return true;
+}
 
-  if (sendRawDebugData)
+/**
+ * @brief Prefixes a cup's line with "Cup N " when the scale is split.
+ */
+void printScaleCup(int cup)
+{
+  if (scaleCups == 1)
+    return;
+  printToAll("Cup ");
+  printToAll(cup + 1);
+  printToAll(" ");
+}
+
+void resetWeightFilter()
+{
+  for (int i = 0; i < SCALE_CUPS_MAX; i++)
   {
-    char msgBuffer[10];
-    dtostrf(flowRate, 4, 1, msgBuffer);
-    publishData("filtered_flow", msgBuffer, false, true, false, true);
+    CupEstimate &cup = cupEstimates[i];
+    cup.filter.stop();
+    cup.weight = 0.0f;
+    cup.flow = 0.0f;
+    cup.isWeightPending = false;
+    cup.pendingWeight = 0.0f;
   }
+  currentWeight = 0.0;
+  flowRate = 0.0f;
 }
 
 /**
- * @brief A blocking function to be called from Telnet for tare-ing the scale.
+ * @brief Starts a tare in the background; the weight reads 0 until it is done.
  */
 void tareScale()
 {
+  if (!startScaleJob("tare", tareDone))
+    return;
   printlnToAll("Starting scale tare...");
-  weightKalmanFilter.reset();
-  flowKalmanFilter.reset();
-  weightKalmanFilter.setEstimateError(weightKalmanE);
-  flowKalmanFilter.setEstimateError(flowKalmanE);
-  currentWeight = 0.0;
-  flowRate = 0.0f;
-  lastRawWeight = 0.0;
-  isFirstScaleReading = true;
-  previousWeightForFlowCalc = 0.0;
-  previousTimeForFlowCalc = millis();
+  resetWeightFilter();
   publishData(mqtt_topic_weight, "0.0", false, true);
+  if (scaleCups > 1)
+  {
+    for (int i = 0; i < scaleCups; i++)
+      publishData(mqtt_topic_cup_weight[i], "0.0", false, false, true, false);
+  }
+}
 
-  isFirstScaleReading = true;
-  isWeightPending = false;
-  pendingWeight = 0.0;
-  lastRawWeight = 0.0;
-
-  long offset_value = getStableCombinedReadingADS1232(16);
-  COMBINED_OFFSET = offset_value;
-
-  printToAll("Scale tare complete. New offset: ");
-  printlnToAll(COMBINED_OFFSET);
+void tareDone(const ScaleJob &job)
+{
+  if (scaleJobUsable(job))
+  {
+    for (int i = 0; i < scaleCups; i++)
+    {
+      setScaleCupOffset(i, job.cups[i].average);
+      printScaleCup(i);
+      printToAll("Scale tare complete. New offset: ");
+      printlnToAll(scaleCupOffset(i));
+    }
+  }
+  resetWeightFilter();
 }
+
 /**
  * @brief Prepares the machine for calibration.
  * Can be called from any input source.
@@ -4591,24 +6021,20 @@ void startCalibration()
     return;
   }
   calibrationReturnState = currentState;
+  calibrationCup = 0;
   transitionToState(CALIBRATION_EMPTY);
 }
 
 /**
- * @brief Performs the next step (tare or weigh) in the calibration process.
- * Can be called from any input source.
+ * @brief Starts the next step (tare or weigh) of the calibration; it
+ * completes in the background. Can be called from any input source.
  */
 void handleCalibrationStep(float weight)
 {
   if (currentState == CALIBRATION_EMPTY)
   {
-    printlnToAll("Taring... This will take a few seconds.");
-
-    long offset_value = getStableCombinedReadingADS1232(16);
-    COMBINED_OFFSET = offset_value;
-    printToAll("Tare complete. New offset: ");
-    printlnToAll(COMBINED_OFFSET);
-    transitionToState(CALIBRATION_TEST_WEIGHT);
+    if (startScaleJob("calibration tare", calibrationEmptyDone))
+      printlnToAll("Taring... This will take a few seconds.");
   }
   else if (currentState == CALIBRATION_TEST_WEIGHT)
   {
@@ -4623,27 +6049,54 @@ void handleCalibrationStep(float weight)
     printToAll(calibrationWeight);
     printlnToAll("g");
 
-    printlnToAll("Weighing... This will take a few seconds.");
-
-    long reading_with_weight = getStableCombinedReadingADS1232(16);
-    float scale_value = (float)(reading_with_weight - COMBINED_OFFSET) / calibrationWeight;
-    COMBINED_SCALE = scale_value;
-    saveSettings("scale_cal");
-    printToAll("Weighing complete. New scale value: ");
-    printlnToAll(scale_value, 4);
-    printlnToAll("----------------------------------------------------");
-    printlnToAll("Calibration complete! Returning to HEATING state.");
-
-    updatePcf();
-    newDataReady = false;
-
-    transitionToState(calibrationReturnState);
+    if (startScaleJob("calibration weighing", calibrationWeightDone))
+      printlnToAll("Weighing... This will take a few seconds.");
   }
   else
   {
     printlnToAll("Error: 'next' command ignored. Not in calibration mode.");
   }
 }
+
+void calibrationEmptyDone(const ScaleJob &job)
+{
+  // Calibration may have been left (error, water empty) meanwhile
+  if (currentState != CALIBRATION_EMPTY || !scaleJobUsable(job))
+    return;
+  for (int i = 0; i < scaleCups; i++)
+  {
+    setScaleCupOffset(i, job.cups[i].average);
+    printScaleCup(i);
+    printToAll("Tare complete. New offset: ");
+    printlnToAll(scaleCupOffset(i));
+  }
+  transitionToState(CALIBRATION_TEST_WEIGHT);
+}
+
+void calibrationWeightDone(const ScaleJob &job)
+{
+  if (currentState != CALIBRATION_TEST_WEIGHT || !scaleJobUsable(job))
+    return;
+  int cup = calibrationCup;
+  float scale_value = (float)(job.cups[cup].average - scaleCupOffset(cup)) / calibrationWeight;
+  setScaleCupScale(cup, scale_value);
+  saveScaleCalibration();
+  printScaleCup(cup);
+  printToAll("Weighing complete. New scale value: ");
+  printlnToAll(scale_value, 4);
+  // The same weight goes on the next cup
+  if (cup + 1 < scaleCups)
+  {
+    calibrationCup++;
+    handleStateEntry(CALIBRATION_TEST_WEIGHT);
+    return;
+  }
+  printlnToAll("----------------------------------------------------");
+  printlnToAll("Calibration complete! Returning to HEATING state.");
+
+  resetWeightFilter();
+  transitionToState(calibrationReturnState);
+}
 #endif
 // ----------------------------------------------------------------
 // --- CORE EXECUTION (SETUP & LOOP) ---
@@ -4651,78 +6104,51 @@ void handleCalibrationStep(float weight)
 
 void setup()
 {
-  delay(1000);
+  halTraceBegin();
+  halDelay(1000);
   printlnToAll("Configuring digital input pins...");
   for (const int pin : digitalInputs)
   {
-    pinMode(pin, INPUT);
+    halPinMode(pin, INPUT);
   }
-  pinMode(D0, OUTPUT);
-  pinMode(ADS_SCLK_PIN, INPUT_PULLUP);
-  pinMode(ADS_DOUT_PIN, OUTPUT);
-  digitalWrite(D0, HIGH);
+  halPinMode(D0, OUTPUT);
+  halPinMode(ADS_SCLK_PIN, INPUT_PULLUP);
+  halPinMode(ADS_DOUT_PIN, OUTPUT);
+  halDigitalWrite(D0, HIGH);
   printlnToAll("Configuring digital output pins...");
   for (const int pin : startupOutputPins)
   {
-    pinMode(pin, OUTPUT);
-    digitalWrite(pin, LOW);
+    halPinMode(pin, OUTPUT);
+    halDigitalWrite(pin, LOW);
   }
 
-  pinMode(LEDMAIN, OUTPUT);
-  digitalWrite(LEDMAIN, HIGH);
+  halPinMode(LEDMAIN, OUTPUT);
+  halDigitalWrite(LEDMAIN, HIGH);
+  // The first level reading settles while the rest starts up
+  startLevelProbe(halMillis());
 
-  generateSparseMap();
   loadSettings();
   updateCalculatedBoilerTemp();
   printlnToAll("Initializing ADS1115...");
-  Wire.begin(A4, A5);
-  Wire.setTimeOut(150);
-  if (!ads.begin())
+  if (!halAdsBegin(adsSchedule, ADS_SCHEDULE_LENGTH))
   {
     printlnToAll("Failed to initialize ADS1115. Check wiring.");
   }
   else
   {
     printlnToAll("ADS1115 initialized successfully.");
-    ads.setGain(GAIN_ONE);
+    if (!halAdsWaitForSamples(500))
+    {
+      printlnToAll("Warning: ADS1115 channels not delivering samples.");
+    }
   }
 #ifdef HAS_SCALE
   printlnToAll("Initializing Scale (ADS1232)...");
-  Wire.setClock(400000);
-
-  pinMode(ADS_SCLK_PIN, OUTPUT);
-  digitalWrite(ADS_SCLK_PIN, LOW);
-  pinMode(ADS_DOUT_PIN, INPUT_PULLUP);
-
-  powerDown(true);
-  delay(100);
-  setSpeed(false);
-  setGain(128);
-  selectChannelScale(SCALE_CHANNEL);
-  bitClear(pcfState, PCF_TEMP_BIT);
-  updatePcf();
-  delay(100);
-  powerDown(true);
-  updatePcf();
-  delay(100);
-  powerDown(false);
-  updatePcf();
-
-  attachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN), dataReadyISR, FALLING);
+  halScaleBegin();
+  applyScaleCups();
   printlnToAll("Scale initialized.");
 #endif
-  pinMode(ZERO_CROSS_PIN, INPUT);
-  pinMode(PUMP_TRIAC_PIN, OUTPUT);
-
-#ifdef HAS_PRESSURE_GAUGE
-  DimmableLight::setSyncPin(ZERO_CROSS_PIN);
-  DimmableLight::setSyncPullup(false);
-  DimmableLight::setSyncDir(RISING);
-  DimmableLight::begin();
-#else
-  pinMode(PUMP_TRIAC_PIN, OUTPUT);
-  digitalWrite(PUMP_TRIAC_PIN, HIGH);
-#endif
+  halDimmerBegin();
 
   heaterPID.SetSampleTime(1000);
   heaterPID.SetOutputLimits(-100, 100);
@@ -4739,47 +6165,16 @@ void setup()
   flowPID.SetSampleTime(50);
   flowPID.SetOutputLimits(50, 100);
   flowPID.SetMode(AUTOMATIC);
-  flowKalmanFilter.setMeasurementError(flowKalmanMe);
-  flowKalmanFilter.setEstimateError(flowKalmanE);
-  flowKalmanFilter.setProcessNoise(flowKalmanQ);
-  weightKalmanFilter.setMeasurementError(weightKalmanMe);
-  weightKalmanFilter.setEstimateError(weightKalmanE);
-  weightKalmanFilter.setProcessNoise(weightKalmanQ);
+  weightFlowTuningChanged(0);
 #endif
 
-  wm.setConfigPortalBlocking(false);
-  wm.setTimeout(0);
-
-  if (wm.autoConnect("MaraX-Setup"))
-  {
-    printToAll("Connected to WiFi: ");
-    printlnToAll(WiFi.SSID());
-    isOnline = true;
-    WiFi.mode(WIFI_AP_STA);
-  }
-  else
-  {
-    printlnToAll("WiFi not connected. Running in offline mode (AP might be active in background).");
-    isOnline = false;
-  }
-
-  if (!isOnline)
+  if (!halNetworkBegin(mqtt_server, mqtt_port, mqtt_user, mqtt_password))
   {
     printlnToAll("Offline Mode: Reverting to physical switches.");
     ignoreTempSwitch = false;
     ignoreBrewSwitch = false;
   }
 
-  if (isOnline)
-  {
-    startNetworkServices();
-  }
-
-  telnetServer.begin();
-  printToAll("Telnet server started. Connect to ");
-  printToAll(WiFi.localIP());
-  printlnToAll(" on port 23.");
-  printlnToAll("Type 'help' for a list of commands.");
   pollDigitalInputs();
   updateBrewMode();
   updateTempSwitch();
@@ -4789,12 +6184,11 @@ void setup()
 #endif
 
   waterLevelTripped = !readPin(WATER_DETECTOR);
-  isBoilerEmpty = !detectBoilerLevel();
-  lastBoilerCheckTime = millis();
+  serviceLevelProbe(halMillis()); // takes the first level reading if it settled
   setPumpPower(100);
 
   printlnToAll("Detecting initial state...");
-  if (digitalRead(BREW_SWITCH) == LOW)
+  if (halDigitalRead(BREW_SWITCH) == LOW)
   {
     transitionToState(DEBUG);
     allStop();
@@ -4815,66 +6209,76 @@ void setup()
   {
     transitionToState(INIT);
   }
+
+  halStartTasks();
 }
 
-void loop()
+/**
+ * @brief Runs queued telnet commands. Called from the control task so commands
+ * never race the state machine.
+ */
+void drainCommandQueue()
 {
-  unsigned long nowTime = millis();
-
-  wm.process();
-
-  if (WiFi.status() == WL_CONNECTED)
+  char line[128];
+  while (halReadCommand(line, sizeof(line)))
   {
-    if (!isOnline)
+    if (line[0] != '\0')
     {
-      printlnToAll("WiFi Connected!");
-      isOnline = true;
-      startNetworkServices();
+      processCommand(line);
     }
+    printToAll("> ");
   }
-  else
+}
+
+/**
+ * @brief Applies settings received over MQTT / ESP-NOW. The transports only
+ * queue them, so gains, profiles and NVS change here, between two control
+ * steps, and never under the PID or the profile engine.
+ */
+void drainSettingQueue()
+{
+  static char message[INBOUND_SETTING_MAX_LENGTH + 1];
+  while (halReadSetting(message, sizeof(message)))
   {
-    if (isOnline)
-    {
-      printlnToAll("WiFi Lost!");
-      isOnline = false;
-    }
+    handleIncomingSetting(message);
+    halSettingApplied();
   }
+}
+
+void controlStep()
+{
+  halStageBegin(STAGE_COMMANDS);
+  scheduler.step();
+  halStageBegin(STAGE_END);
+}
 
+/**
+ * @brief Every step: commands, inputs, sensors, the state machine with the
+ * heater and pump control.
+ */
+void runControlGroup(unsigned long nowTime)
+{
   if (isBeeping && nowTime >= beepStopTime)
   {
-    digitalWrite(BUZZER, LOW);
+    halDigitalWrite(BUZZER, LOW);
     isBeeping = false;
   }
-  if (isOnline)
-  {
-    ArduinoOTA.handle();
-  }
-#ifdef HAS_SCREEN
-  if (nowTime - lastEspNowSendTime > ESP_NOW_SEND_INTERVAL_MS)
-  {
-    sendEspNowBuffer();
-    lastEspNowSendTime = nowTime;
-  }
-  if (pendingScreenSync)
-  {
-    pendingScreenSync = false;
-    printlnToAll("Syncing all settings and state to new screen.");
-    publishSettings();
-    publishState();
-  }
-#endif
 
-  handleTelnet();
+  drainCommandQueue();
+  drainSettingQueue();
+  halStageBegin(STAGE_INPUTS);
   pollDigitalInputs();
+  halStageBegin(STAGE_SENSORS);
   updateSensorReadings();
 #ifdef HAS_SCALE
+  halStageBegin(STAGE_SCALE);
   handleScale();
 #endif
-  periodicBoilerLevelCheck();
+  halStageBegin(STAGE_SWITCHES);
   updateBrewMode();
   updateTempSwitch();
 
+  halStageBegin(STAGE_STATE_MACHINE);
   bool errorState = false;
   if (currentState != DEBUG)
   {
@@ -4929,14 +6333,16 @@ void loop()
   switch (currentState)
   {
   case INIT:
-    transitionToState(HEATING);
+    // Heat only once the first level reading is in
+    if (levelProbe.hasResult)
+      transitionToState(HEATING);
     break;
   case ERROR:
     errorBuzzer();
     ledError();
     if (!checkCriticalSensorFailure() && !errorState)
     {
-      digitalWrite(BUZZER, LOW);
+      halDigitalWrite(BUZZER, LOW);
       transitionToState(HEATING);
       break;
     }
@@ -4946,7 +6352,7 @@ void loop()
     ledWaterEmpty();
     if (!errorState)
     {
-      digitalWrite(BUZZER, LOW);
+      halDigitalWrite(BUZZER, LOW);
       if (cleaningStateToResume != IDLE)
       {
         printlnToAll("Water refilled. Resuming cleaning cycle.");
@@ -4977,6 +6383,9 @@ void loop()
 
     if (waterDetected)
     {
+      // serviceLevelProbe() is paused in this state, so clear the flag
+      // here or the check above keeps errorState set and the refill never ends
+      isBoilerEmpty = false;
       if (boilerFullTimestamp == 0)
       {
         boilerFullTimestamp = nowTime;
@@ -5018,7 +6427,7 @@ void loop()
     setPump(false);
     if ((nowTime - lastStateTransitionTime > 10000) && isStable())
     {
-      bool heatingModeCoffee = strcmp(brewMode, "STEAM");
+      bool heatingModeCoffee = brewMode != BREW_STEAM;
 
       if (heatingModeCoffee)
       {
@@ -5049,7 +6458,7 @@ void loop()
   {
     runHeaterPID();
     ledIdle();
-    bool heatingModeCoffee = strcmp(brewMode, "STEAM");
+    bool heatingModeCoffee = brewMode != BREW_STEAM;
     if (heatingModeCoffee && abs(pidInput - pidSetpoint) > TEMP_STABILITY_TOLERANCE && nowTime - coolingFlushEndTime > 60000)
     {
       printlnToAll("Temperature unstable. Returning to HEATING state.");
@@ -5162,14 +6571,14 @@ void loop()
       cleaningBeepState = 1;
       cleaningBeepTimer = nowTime;
       if (BUZZER_ENABLE)
-        digitalWrite(BUZZER, HIGH);
+        halDigitalWrite(BUZZER, HIGH);
     }
 
     if (cleaningBeepState == 1)
     {
       if (nowTime - cleaningBeepTimer >= BEEP_DURATION_MS)
       {
-        digitalWrite(BUZZER, LOW);
+        halDigitalWrite(BUZZER, LOW);
         cleaningBeepTimer = nowTime;
         if (cleaningRepetitionCounter == 4)
         {
@@ -5186,7 +6595,7 @@ void loop()
       if (nowTime - cleaningBeepTimer >= BEEP_PAUSE_MS)
       {
         if (BUZZER_ENABLE)
-          digitalWrite(BUZZER, HIGH);
+          halDigitalWrite(BUZZER, HIGH);
         cleaningBeepTimer = nowTime;
         cleaningBeepState = 3;
       }
@@ -5195,7 +6604,7 @@ void loop()
     {
       if (nowTime - cleaningBeepTimer >= BEEP_DURATION_MS)
       {
-        digitalWrite(BUZZER, LOW);
+        halDigitalWrite(BUZZER, LOW);
         cleaningBeepState = 4;
       }
     }
@@ -5203,7 +6612,7 @@ void loop()
     if (!brewLeverLifted)
     {
       setPump(false);
-      digitalWrite(BUZZER, LOW);
+      halDigitalWrite(BUZZER, LOW);
       cleaningRepetitionCounter++;
 
       if (cleaningRepetitionCounter >= TOTAL_CLEANING_REPETITIONS)
@@ -5253,28 +6662,82 @@ void loop()
     }
     break;
   }
+}
 
-  static unsigned long lastPrintTime = 0;
-  if (nowTime - lastPrintTime > 1000)
+void runShotStreamGroup(unsigned long nowTime)
+{
+  if (!shotStream.active)
+    return;
+  halStageBegin(STAGE_PUBLISH);
+  if (currentState != BREWING && shotStream.endMs == 0)
+    shotStream.endMs = nowTime;
+  if (shotStream.endMs != 0 && nowTime - shotStream.endMs >= SHOT_POST_DRIP_DURATION_MS)
   {
+    finishShotStream(nowTime);
+    return;
+  }
 
-    char msgBuffer[10];
-    dtostrf(boilerTemp, 4, 2, msgBuffer);
-    publishData(mqtt_topic_boiler_temp, msgBuffer, false, false);
-    dtostrf(hxTemp, 4, 2, msgBuffer);
-    publishData(mqtt_topic_hx_temp, msgBuffer, false, false);
+  uint32_t periodMs = rateGroups[GROUP_SHOT_STREAM].periodMs;
+  if (shotStream.samples > 0 && nowTime - shotStream.lastSampleMs >= 2 * periodMs)
+    shotStream.missed += (nowTime - shotStream.lastSampleMs) / periodMs - 1;
+  shotStream.lastSampleMs = nowTime;
+  shotStream.samples++;
+
+  ShotSample &sample = shotStream.batch[shotStream.batched++];
+  sample.timeMs = nowTime;
+  sample.pressure = pressure;
+#ifdef HAS_SCALE
+  sample.flow = flowRate;
+  sample.weight = currentWeight;
+#endif
+  sample.target = pumpTarget;
+  sample.hx = hxTemp;
+  sample.pumpPower = pumpRunning ? constrain(pumpPower, 0, 100) : 0;
+  if (shotStream.batched == SHOT_STREAM_BATCH)
+    flushShotStream();
+}
+
+void runLevelProbeGroup(unsigned long nowTime)
+{
+  halStageBegin(STAGE_BOILER_CHECK);
+  serviceLevelProbe(nowTime);
+}
+
+void runTelemetryGroup(unsigned long nowTime)
+{
+  halStageBegin(STAGE_PUBLISH);
+  serviceResync();
+  if (reportResyncPending)
+  {
+    reportResyncPending = false;
+    for (int i = 0; i < REPORT_SIGNAL_COUNT; i++)
+      reportChannels[i].invalidate();
+  }
+  reportNumber(REPORT_BOILER_TEMP, mqtt_topic_boiler_temp, boilerTemp, 2, nowTime);
+  reportNumber(REPORT_HX_TEMP, mqtt_topic_hx_temp, hxTemp, 2, nowTime);
 #ifdef HAS_PRESSURE_GAUGE
-    dtostrf(pressure, 4, 2, msgBuffer);
-    publishData(mqtt_topic_pressure, msgBuffer, false, false);
+  reportNumber(REPORT_PRESSURE, mqtt_topic_pressure, pressure, 2, nowTime);
 #endif
 #ifdef HAS_SCALE
-    dtostrf(currentWeight, 4, 1, msgBuffer);
-    publishData(mqtt_topic_weight, msgBuffer, false, false);
-    dtostrf(flowRate, 4, 1, msgBuffer);
-    publishData(mqtt_topic_flow_rate, msgBuffer, false, false);
+  reportNumber(REPORT_WEIGHT, mqtt_topic_weight, currentWeight, 1, nowTime);
+  reportNumber(REPORT_FLOW_RATE, mqtt_topic_flow_rate, flowRate, 1, nowTime);
+  if (scaleCups > 1)
+  {
+    reportNumber(REPORT_CUP1_WEIGHT, mqtt_topic_cup_weight[0], cupEstimates[0].weight, 1, nowTime);
+    reportNumber(REPORT_CUP1_FLOW, mqtt_topic_cup_flow_rate[0], cupEstimates[0].flow, 1, nowTime);
+    reportNumber(REPORT_CUP2_WEIGHT, mqtt_topic_cup_weight[1], cupEstimates[1].weight, 1, nowTime);
+    reportNumber(REPORT_CUP2_FLOW, mqtt_topic_cup_flow_rate[1], cupEstimates[1].flow, 1, nowTime);
+  }
 #endif
-    publishState();
+  reportText(REPORT_STATE, mqtt_topic_state, currentState, stateToString(currentState), nowTime);
+  reportText(REPORT_LEVER, mqtt_topic_lever, brewLeverLifted, brewLeverLifted ? "LIFTED" : "DOWN", nowTime);
+  reportText(REPORT_PUMP, mqtt_topic_pump, pumpRunning, pumpRunning ? "ON" : "OFF", nowTime);
+  reportText(REPORT_HEATER, mqtt_topic_heater, heaterOn, heaterOn ? "ON" : "OFF", nowTime);
 
-    lastPrintTime = nowTime;
+  if (telemetryMode != TELEMETRY_TOPICS && halMqttConnected() && nowTime - lastTelemetryFrame >= telemetryPeriodMs)
+  {
+    lastTelemetryFrame = nowTime;
+    publishTelemetryFrame(nowTime);
   }
+  serviceSettingsCache(nowTime);
 }
@@ -0,0 +1,2635 @@
+// =================================================================
+// --- ESP32 HARDWARE ABSTRACTION LAYER ---
+// =================================================================
+// Implements hal.h on the Arduino Nano ESP32: FreeRTOS tasks, WiFi/MQTT/
+// ESP-NOW/OTA/telnet, the ADS1115 acquisition engine, the ADS1232 scale
+// readout, the triac dimmer and NVS storage.
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <ESPmDNS.h>
+#include <WiFiUdp.h>
+#include <ArduinoOTA.h>
+#include <Wire.h>
+#include <Adafruit_ADS1X15.h>
+#include <AsyncMqttClient.h>
+#include <Preferences.h>
+#include <DNSServer.h>
+#include <WebServer.h>
+#include <WiFiManager.h>
+#include <nvs_flash.h>
+#ifdef HAS_SCREEN
+#include <esp_now.h>
+#endif
+#include <esp_pm.h>
+#include <esp_wifi.h>
+#include <esp_wifi_types.h>
+#include <esp_heap_caps.h>
+#include <soc/gpio_reg.h>
+#include <freertos/semphr.h>
+#ifdef HAS_PRESSURE_GAUGE
+#include "dimmable_light.h"
+#endif
+#include "hal.h"
+#include "input_trace.h"
+#include "mpsc_queue.h"
+#include "spsc_queue.h"
+#include "stage_profiler.h"
+
+// =================================================================
+// --- NETWORK & COMMUNICATION CONFIGURATION ---
+// =================================================================
+const char *mqtt_client_id = "MaraXV2CustomEspresso";
+
+// Settings Control Topic
+const char *mqtt_topic_set = "espresso/settings/set";
+
+// --- OTA (Over-the-Air Updates) ---
+const char *ota_hostname = "esp32-arduino";
+const char *ota_password = "1234";
+
+// --- Global Connection State ---
+bool isOnline = false;
+WiFiManager wm;
+
+// --- Broker settings (owned by firmware.cpp) ---
+const char *mqtt_server = "";
+int mqtt_port = 1883;
+const char *mqtt_user = "";
+const char *mqtt_password = "";
+
+// =================================================================
+// --- SYSTEM & LIBRARY OBJECTS ---
+// =================================================================
+WiFiServer telnetServer(23);
+WiFiClient telnetClient;
+AsyncMqttClient mqttClient;
+Adafruit_ADS1115 ads;
+#ifdef HAS_PRESSURE_GAUGE
+DimmableLight pumpDimmer(PUMP_TRIAC_PIN);
+#endif
+#ifdef HAS_SCREEN
+typedef struct struct_message
+{
+  char payload[250];
+} struct_message;
+typedef struct struct_pairing
+{
+  uint8_t id;
+  uint8_t macAddr[6];
+  uint8_t channel;
+  char identifier[10];
+} struct_pairing;
+const char *espIdentifier = "espresso";
+struct_message myData;
+struct_pairing pairingData;
+uint8_t screenMacAddress[6];
+bool isScreenPaired = false;
+int myChannel = 0;
+esp_now_peer_info_t peerInfo;
+#define PAIR_REQUEST 1
+#define PAIR_RESPONSE 2
+
+// --- ESP-NOW Transmit Ring ---
+// publishDataNow() appends key=value pairs straight into the open frame at
+// the tail of a ring of preallocated frames. A frame closes when the next
+// pair does not fit, on espNowSendNow, or at the ESP_NOW_SEND_INTERVAL_MS
+// flush. One frame is in flight at a time; OnDataSent (WiFi task) retires
+// it and sends the next closed frame from the callback, so a burst drains
+// at link speed without the comms task waiting. A frame the screen did not
+// acknowledge is sent again, up to ESPNOW_MAX_RETRIES times. Every frame
+// starts with seq=<n> so the screen can tell gaps from repeats.
+// The pairing response and the espnow console broadcast wait in a slot of
+// their own and go out ahead of the ring through the same sender, so only one
+// send is ever outstanding and every OnDataSent belongs to it.
+const int MAX_ESPNOW_BUFFER = 250;
+const int ESPNOW_RING_FRAMES = 8;
+const int ESPNOW_MAX_RETRIES = 2;
+const unsigned long ESP_NOW_SEND_INTERVAL_MS = 250;
+static unsigned long lastEspNowSendTime = 0;
+
+struct EspNowFrame
+{
+  struct_message message; // sent from here as is, no copy
+  uint8_t attempts;
+};
+EspNowFrame espNowRing[ESPNOW_RING_FRAMES];
+volatile uint8_t espNowHead = 0; // oldest closed frame, in flight if espNowInFlight is ESPNOW_SEND_RING
+volatile uint8_t espNowTail = 0; // open frame, comms task only
+int espNowFillLength = 0;        // bytes in the open frame, comms task only
+uint16_t espNowSequence = 0;
+portMUX_TYPE espNowMux = portMUX_INITIALIZER_UNLOCKED;
+
+enum EspNowSend : uint8_t
+{
+  ESPNOW_SEND_NONE,
+  ESPNOW_SEND_RING,
+  ESPNOW_SEND_PAIRING,
+  ESPNOW_SEND_BROADCAST,
+};
+volatile EspNowSend espNowInFlight = ESPNOW_SEND_NONE;
+volatile uint8_t espNowCallbacksDue = 0; // a send to every peer completes once per peer
+struct_pairing pairingResponse;          // filled by OnDataRecv (WiFi task)
+volatile bool pairingResponsePending = false;
+struct_message broadcastMessage; // filled by halEspNowBroadcast (control task)
+volatile bool broadcastPending = false;
+
+struct EspNowStats
+{
+  uint32_t frames;    // closed and queued (comms task)
+  uint32_t dropped;   // ring full or pair too long (comms task)
+  uint8_t highWater;  // most closed frames waiting (comms task)
+  uint32_t delivered; // acknowledged (WiFi task)
+  uint32_t bytes;     // payload bytes acknowledged (WiFi task)
+  uint32_t retries;   // resent after a failed delivery (WiFi task)
+  uint32_t failed;    // given up after ESPNOW_MAX_RETRIES (WiFi task)
+};
+EspNowStats espNowStats = {};
+uint32_t espNowWindowStart = 0;
+uint32_t espNowWindowBytes = 0;
+volatile bool pendingScreenSync = false;
+#endif
+
+#ifdef HAS_SCALE
+// =================================================================
+// --- SCALE (ADS1232) CONFIGURATION & GLOBALS ---
+// =================================================================
+// --- I2C Configuration ---
+const int PCF8574_ADDRESS = 0x38;
+
+// --- PCF8574 Pin Mapping ---
+const byte PCF_PDWN_BIT = 7;
+const byte PCF_SPEED_BIT = 4;
+const byte PCF_GAIN0_BIT = 6;
+const byte PCF_GAIN1_BIT = 5;
+const byte PCF_TEMP_BIT = 0;
+const byte PCF_A0_BIT = 2;
+
+portMUX_TYPE scaleMux = portMUX_INITIALIZER_UNLOCKED;
+byte pcfState = 0;
+
+// --- ADS1232 Sample Ring ---
+// dataReadyISR() stamps each conversion and wakes scaleTask, which clocks it
+// out and pushes it to scaleSamples. The control task drains the ring in
+// order, so a slow control step delays samples but never loses them.
+const uint32_t SCALE_TASK_STACK_SIZE = 3072;
+const UBaseType_t SCALE_TASK_PRIORITY = 5; // above ads and control
+const BaseType_t SCALE_TASK_CORE = 1;
+const uint32_t SCALE_TASK_IDLE_MS = 250; // wake up now and then while powered down
+const size_t SCALE_RING_SIZE = 32;       // 400 ms at 80 SPS
+
+SpscQueue<ScaleSample, SCALE_RING_SIZE> scaleSamples;
+TaskHandle_t scaleTaskHandle = NULL;
+volatile uint32_t scaleReadyUs = 0;
+volatile bool scaleReadoutActive = false; // DOUT toggles while bits are clocked out
+
+struct ScaleRingStats
+{
+  uint32_t samples;
+  uint32_t missed;    // conversions overwritten before scaleTask read them
+  uint32_t ringDrops; // ring full, the control task fell 32 samples behind
+  uint32_t switches;  // input channel changes
+  uint32_t settling;  // conversions dropped while settling after a switch
+  float sampleRate;   // samples per second into the ring
+  uint32_t windowSamples;
+  unsigned long windowStart;
+};
+ScaleRingStats scaleRingStats = {};
+
+// --- ADS1232 Input Switching ---
+// A0 is not part of pcfState: pcfWrite() sets it from scaleChannel, which
+// halScaleSelectChannel() stages and scaleTask flips itself after each burst
+// of scaleDwell conversions, right after reading the last one, so the
+// settling starts at once. Whenever the written channel changes, conversions
+// stamped within SCALE_SWITCH_SETTLE_CONVERSIONS periods are read and dropped.
+// pcfMutex serialises the expander writes of the control task and scaleTask.
+const int SCALE_SWITCH_SETTLE_CONVERSIONS = 4;
+const uint32_t SCALE_SLOW_PERIOD_US = 100000; // 10 SPS
+const uint32_t SCALE_FAST_PERIOD_US = 12500;  // 80 SPS
+
+SemaphoreHandle_t pcfMutex = NULL;
+volatile uint8_t scaleChannel = 2;        // staged or, while interleaving, converting
+volatile uint8_t scaleWrittenChannel = 0; // last sent to the expander
+volatile uint8_t scaleDwell = 0;
+int scaleBurstCount = 0;
+volatile uint32_t scaleSwitchSettleUs = 0;
+volatile bool scaleSettling = false;
+
+// --- ADS1232 Readout ---
+// SCLK and DOUT are driven through the GPIO set/clear and input registers,
+// resolved once in halScaleBegin(). Interrupts are masked only around each
+// SCLK high pulse, not the whole 25-clock frame: the ADS1232 accepts any
+// low time between clocks and only enters standby after SCLK stays high for
+// milliseconds, so the zero-cross and triac ISRs may run between two bits.
+// A frame that took longer than SCALE_READ_MAX_US may straddle the next
+// conversion and is discarded.
+const uint32_t SCALE_SCLK_HALF_NS = 200; // SCLK high / low, datasheet min 100 ns
+const uint32_t SCALE_READ_MAX_US = 2000;
+uint32_t scaleSclkMask = 0;
+uint32_t scaleDoutMask = 0;
+uint32_t scaleSclkSetReg = 0;
+uint32_t scaleSclkClearReg = 0;
+uint32_t scaleDoutInReg = 0;
+uint32_t scaleHalfCycles = 0;
+
+struct ScaleReadStats
+{
+  uint32_t reads;
+  uint32_t late;            // discarded, frame took longer than SCALE_READ_MAX_US
+  uint64_t totalCycles;     // whole frame, for the average
+  uint32_t maxCycles;       // whole frame
+  uint32_t maxMaskedCycles; // longest stretch with interrupts masked
+};
+ScaleReadStats scaleReadStats = {};
+#endif
+
+// =================================================================
+// --- ADS1115 ACQUISITION ENGINE ---
+// =================================================================
+// A dedicated task walks adsSchedule: it starts a conversion, sleeps until
+// data-ready, reads the result and immediately starts the next slot, so no
+// other code ever waits on the ADC. With HAS_ADS_ALERT the ALERT/RDY pin wakes
+// the task (and oversampled channels run in continuous mode); without it the
+// task sleeps for the nominal conversion time and checks the OS bit.
+// The I2C bus is shared with the PCF8574; Wire serialises transactions.
+struct AdsChannelConfig
+{
+  adsGain_t gain;
+  uint16_t dataRate;         // RATE_ADS1115_xxxSPS register value
+  uint16_t samplesPerSecond; // Must match dataRate
+  uint8_t oversample;        // Conversions averaged into one published sample
+};
+
+struct AdsChannelStats
+{
+  uint32_t samples;
+  uint32_t droppedConversions; // Overwritten before read, or timed out
+  float sampleRate;            // Published samples per second
+  uint32_t windowSamples;
+  unsigned long windowStart;
+};
+
+AdsChannelConfig adsChannelConfigs[ADS_CHANNEL_COUNT] = {
+    {GAIN_ONE, RATE_ADS1115_64SPS, 64, 1},   // BOILER_TEMP: slow, low noise
+    {GAIN_ONE, RATE_ADS1115_64SPS, 64, 1},   // HX_TEMP: slow, low noise
+    {GAIN_ONE, RATE_ADS1115_128SPS, 128, 1}, // Unused, one-shot via readadc
+    {GAIN_ONE, RATE_ADS1115_860SPS, 860, 4}, // PRESSURE: fast, oversampled
+};
+const uint16_t ADS_MUX_BY_CHANNEL[ADS_CHANNEL_COUNT] = {
+    ADS1X15_REG_CONFIG_MUX_SINGLE_0,
+    ADS1X15_REG_CONFIG_MUX_SINGLE_1,
+    ADS1X15_REG_CONFIG_MUX_SINGLE_2,
+    ADS1X15_REG_CONFIG_MUX_SINGLE_3,
+};
+
+const int ADS_MAX_SCHEDULE_LENGTH = 8;
+uint8_t adsSchedule[ADS_MAX_SCHEDULE_LENGTH];
+int adsScheduleLength = 0;
+
+const uint32_t ADS_TASK_STACK_SIZE = 4096;
+const UBaseType_t ADS_TASK_PRIORITY = 4;
+const BaseType_t ADS_TASK_CORE = 1;
+const uint32_t ADS_CONVERSION_TIMEOUT_MARGIN_MS = 10;
+
+AdsSample adsSamples[ADS_CHANNEL_COUNT];
+AdsChannelStats adsStats[ADS_CHANNEL_COUNT];
+portMUX_TYPE adsSampleMux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t adsTaskHandle = NULL;
+volatile int8_t adsOneShotChannel = -1; // Unscheduled channel requested by halAdsRead()
+
+// =================================================================
+// --- TASKS & INTER-TASK QUEUES ---
+// =================================================================
+// The control task (core 1) owns sensors, scale, state machine and PIDs and
+// runs at a fixed period. The comms task (core 0) owns WiFi, MQTT, ESP-NOW,
+// OTA and telnet. They only talk through the lock-free queues below, so a
+// slow broker can never stretch the control period.
+const uint32_t COMMS_TASK_PERIOD_MS = 2;
+const uint32_t CONTROL_TASK_STACK_SIZE = 8192;
+const uint32_t COMMS_TASK_STACK_SIZE = 8192;
+const UBaseType_t CONTROL_TASK_PRIORITY = 3;
+const UBaseType_t COMMS_TASK_PRIORITY = 2;
+const BaseType_t CONTROL_TASK_CORE = 1;
+const BaseType_t COMMS_TASK_CORE = 0;
+
+TaskHandle_t controlTaskHandle = NULL;
+TaskHandle_t commsTaskHandle = NULL;
+
+// --- Outbound publishes (control -> comms) ---
+const int MAX_QUEUED_TOPIC_LEN = 64;
+const int MAX_QUEUED_PAYLOAD_LEN = 512;
+struct OutboundMessage
+{
+  char topic[MAX_QUEUED_TOPIC_LEN];
+  char payload[MAX_QUEUED_PAYLOAD_LEN];
+  bool retained;
+  bool espNowSendNow;
+  bool sendToMqtt;
+  bool sendToESP;
+};
+SpscQueue<OutboundMessage, 32> outboundQueue;
+uint32_t outboundDropCount = 0;
+
+// --- Telnet command lines (comms -> control) ---
+struct ConsoleCommand
+{
+  char line[128];
+};
+SpscQueue<ConsoleCommand, 8> commandQueue;
+
+// --- Resync requests (comms -> control), RESYNC_* bits ---
+std::atomic<uint8_t> resyncRequests(0);
+
+// --- Settings from MQTT / ESP-NOW (AsyncTCP + WiFi tasks -> control) ---
+struct InboundSetting
+{
+  uint32_t receivedUs;
+  char message[INBOUND_SETTING_MAX_LENGTH + 1];
+};
+MpscQueue<InboundSetting, 8> settingQueue;
+std::atomic<uint32_t> settingDropCount(0);
+uint32_t settingTakenUs = 0;       // control task
+StageHistogram settingLatency;     // control task, receipt to applied
+
+// --- Console output (control -> comms) ---
+SpscQueue<char, 2048> consoleQueue;
+uint32_t consoleDropCount = 0;
+
+class ConsoleQueuePrint : public Print
+{
+public:
+  size_t write(uint8_t c) override
+  {
+    if (!consoleQueue.push((char)c))
+    {
+      consoleDropCount++;
+      return 0;
+    }
+    return 1;
+  }
+};
+ConsoleQueuePrint consoleQueuePrint;
+
+// --- Console output (any other context) ---
+class TelnetPrint : public Print
+{
+public:
+  size_t write(uint8_t c) override
+  {
+    if (telnetClient && telnetClient.connected())
+    {
+      return telnetClient.write(c);
+    }
+    return 0;
+  }
+  size_t write(const uint8_t *buffer, size_t size) override
+  {
+    if (telnetClient && telnetClient.connected())
+    {
+      return telnetClient.write(buffer, size);
+    }
+    return 0;
+  }
+};
+TelnetPrint telnetPrint;
+
+// --- Work deferred from the control task to the comms task ---
+volatile bool pendingProfilesPublish = false;
+volatile bool pendingSettingsCommit = false;
+volatile bool pendingTelnetDisconnect = false;
+volatile bool pendingMqttReconnect = false;
+volatile bool pendingMqttConnected = false; // set on the AsyncTCP task
+
+// =================================================================
+// --- INPUT TRACE ---
+// =================================================================
+// While armed, setup() and then the control task record every HAL input
+// into a byte ring (PSRAM when available); the comms task streams it to one
+// TCP client on TRACE_PORT, e.g. nc <ip> 2323 > shot.trace. If no client
+// keeps up, whole records are dropped and a TRACE_GAP marks the spot.
+const char *TRACE_NAMESPACE = "trace";
+const uint16_t TRACE_PORT = 2323;
+const size_t TRACE_BUFFER_SIZE = 256 * 1024;        // PSRAM
+const size_t TRACE_FALLBACK_BUFFER_SIZE = 16 * 1024; // internal RAM
+const size_t TRACE_SEND_CHUNK = 1024;
+
+WiFiServer traceServer(TRACE_PORT);
+WiFiClient traceClient;
+uint8_t *traceBuffer = nullptr;
+size_t traceBufferSize = 0; // power of two
+std::atomic<size_t> traceHead(0); // next byte to send (comms task)
+std::atomic<size_t> traceTail(0); // next byte to write (producers, under traceMux)
+portMUX_TYPE traceMux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool traceRecording = false;
+volatile TaskHandle_t traceTask = NULL;
+bool traceGapPending = false;
+uint32_t traceDroppedRecords = 0;
+
+void traceWrite(const uint8_t *header, size_t headerLength, const void *payload, size_t payloadLength);
+TraceEncoder traceEncoder(traceWrite);
+
+/**
+ * @brief True while recording and called from the recording context.
+ */
+inline bool traceContext()
+{
+  return traceRecording && xTaskGetCurrentTaskHandle() == traceTask;
+}
+
+// =================================================================
+// --- LOOP PROFILER ---
+// =================================================================
+// Each task times its own stages in CPU cycles of its core and rolls a
+// window every PERF_WINDOW_MS; the finished windows are shared under
+// perfMux for the perf command (control task) and the metrics publish
+// (comms task).
+enum CommsStage : uint8_t
+{
+  COMMS_WIFI,
+  COMMS_OTA,
+  COMMS_OUTBOUND,
+  COMMS_TELNET,
+  COMMS_TRACE,
+  COMMS_DEFERRED,
+  COMMS_ESPNOW,
+  COMMS_END,
+  COMMS_STAGE_COUNT = COMMS_END
+};
+
+const char *const COMMS_STAGE_NAMES[COMMS_STAGE_COUNT] = {
+    "wifi manager", "OTA", "outbound queues", "telnet", "trace stream", "deferred publish", "ESP-NOW flush"};
+
+#ifdef HAS_LOOP_PROFILER
+const char *mqtt_topic_perf = "espresso/status/perf";
+
+StageProfiler<STAGE_COUNT> controlProfiler;     // control task
+StageProfiler<COMMS_STAGE_COUNT> commsProfiler; // comms task
+uint32_t controlWindowStart = 0;
+uint32_t commsWindowStart = 0;
+StageSummary controlSummaries[STAGE_COUNT + 1]; // under perfMux
+StageSummary commsSummaries[COMMS_STAGE_COUNT + 1];
+portMUX_TYPE perfMux = portMUX_INITIALIZER_UNLOCKED;
+char perfJson[1536];
+
+void commsStageBegin(CommsStage stage);
+void publishPerfMetrics();
+#else
+inline void commsStageBegin(CommsStage stage) {}
+#endif
+
+// =================================================================
+// --- FORWARD DECLARATIONS ---
+// =================================================================
+void publishDataNow(const char *topic, const char *payload, bool retained, bool espNowSendNow, bool sendToMqtt, bool sendToESP);
+void handleTelnet();
+void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total);
+void queueSetting(const char *message, size_t len);
+void onMqttConnect(bool sessionPresent);
+void onMqttDisconnect(AsyncMqttClientDisconnectReason reason);
+#ifdef HAS_SCREEN
+void OnDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len);
+void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status);
+void closeEspNowFrame();
+void sendNextEspNowFrame();
+#endif
+void startNetworkServices();
+void adsTask(void *parameter);
+void IRAM_ATTR adsReadyISR();
+bool adsBegin(const uint8_t *schedule, int scheduleLength);
+bool adsCopySample(int channel, AdsSample &sample);
+int16_t adsReadChannel(int channel);
+bool adsWaitForSamples(unsigned long timeoutMs);
+bool adsWaitForConversion(uint32_t periodUs, uint32_t &missed);
+void adsPublishSample(uint8_t channel, int32_t sum, uint8_t count);
+bool isAdsChannelScheduled(int channel);
+#ifdef HAS_SCALE
+void IRAM_ATTR dataReadyISR();
+void scaleTask(void *parameter);
+bool pcfApply();
+bool pcfWrite();
+void pcfLock();
+void pcfUnlock();
+void scaleSwitchChannel();
+void scaleResolvePins();
+long scaleReadConversion();
+#endif
+bool isControlTask();
+void traceCopyIn(size_t &tail, const void *data, size_t length);
+void handleTraceClient();
+void controlTask(void *parameter);
+void commsTask(void *parameter);
+void commsStep();
+void drainOutboundQueues();
+
+// =================================================================
+// --- CLOCK & GPIO ---
+// =================================================================
+unsigned long halMillis()
+{
+  unsigned long now = millis();
+  if (traceContext())
+    traceEncoder.millis(now);
+  return now;
+}
+
+unsigned long halMicros()
+{
+  unsigned long now = micros();
+  if (traceContext())
+    traceEncoder.micros(now);
+  return now;
+}
+
+void halDelay(unsigned long ms)
+{
+  delay(ms);
+}
+
+void halPinMode(int pin, int mode)
+{
+  pinMode(pin, mode);
+}
+
+int halDigitalRead(int pin)
+{
+  int level = digitalRead(pin);
+  if (traceContext())
+    traceEncoder.digitalRead(pin, level);
+  return level;
+}
+
+void halDigitalWrite(int pin, int level)
+{
+  if (traceContext())
+    traceEncoder.digitalWrite(pin, level);
+  digitalWrite(pin, level);
+}
+
+// =================================================================
+// --- PERSISTENT STORAGE ---
+// =================================================================
+/**
+ * @brief Preferences-backed store. Results are recorded while tracing (sizes
+ * as 32-bit values, so traces read the same on the host).
+ */
+class PreferencesStorage : public HalStorage
+{
+public:
+  bool begin(const char *name, bool readOnly) override { return traced(prefs.begin(name, readOnly)); }
+  void end() override { prefs.end(); }
+  bool clear() override { return traced(prefs.clear()); }
+  bool isKey(const char *key) override { return traced(prefs.isKey(key)); }
+  bool remove(const char *key) override { return traced(prefs.remove(key)); }
+
+  size_t putBool(const char *key, bool value) override { return tracedSize(prefs.putBool(key, value)); }
+  size_t putInt(const char *key, int32_t value) override { return tracedSize(prefs.putInt(key, value)); }
+  size_t putLong(const char *key, int32_t value) override { return tracedSize(prefs.putLong(key, value)); }
+  size_t putFloat(const char *key, float value) override { return tracedSize(prefs.putFloat(key, value)); }
+  size_t putDouble(const char *key, double value) override { return tracedSize(prefs.putDouble(key, value)); }
+  size_t putString(const char *key, const char *value) override { return tracedSize(prefs.putString(key, value)); }
+  size_t putBytes(const char *key, const void *value, size_t len) override { return tracedSize(prefs.putBytes(key, value, len)); }
+
+  bool getBool(const char *key, bool defaultValue) override { return traced(prefs.getBool(key, defaultValue)); }
+  int32_t getInt(const char *key, int32_t defaultValue) override { return traced(prefs.getInt(key, defaultValue)); }
+  int32_t getLong(const char *key, int32_t defaultValue) override { return traced(prefs.getLong(key, defaultValue)); }
+  float getFloat(const char *key, float defaultValue) override { return traced(prefs.getFloat(key, defaultValue)); }
+  double getDouble(const char *key, double defaultValue) override { return traced(prefs.getDouble(key, defaultValue)); }
+  size_t getString(const char *key, char *value, size_t maxLen) override
+  {
+    return tracedSize(prefs.getString(key, value, maxLen), value);
+  }
+  size_t getBytesLength(const char *key) override { return tracedSize(prefs.getBytesLength(key)); }
+  size_t getBytes(const char *key, void *buf, size_t maxLen) override
+  {
+    return tracedSize(prefs.getBytes(key, buf, maxLen), buf);
+  }
+
+private:
+  Preferences prefs;
+
+  template <typename T>
+  T traced(T result)
+  {
+    if (traceContext())
+      traceEncoder.storage(&result, sizeof(result));
+    return result;
+  }
+
+  size_t tracedSize(size_t result, const void *data = nullptr)
+  {
+    if (traceContext())
+    {
+      uint32_t size = result;
+      traceEncoder.storage(&size, sizeof(size), data, result);
+    }
+    return result;
+  }
+};
+
+HalStorage &halStorage()
+{
+  static PreferencesStorage storage;
+  return storage;
+}
+
+void halEraseAllStorage()
+{
+  nvs_flash_erase();
+  nvs_flash_init();
+}
+
+// =================================================================
+// --- CONSOLE & PUBLISHING ---
+// =================================================================
+Print &halConsole()
+{
+  if (isControlTask())
+  {
+    return consoleQueuePrint;
+  }
+  return telnetPrint;
+}
+
+bool halReadCommand(char *line, size_t size)
+{
+  ConsoleCommand *command = commandQueue.front();
+  if (command == nullptr)
+  {
+    if (traceContext())
+      traceEncoder.command(false, nullptr);
+    return false;
+  }
+  strlcpy(line, command->line, size);
+  commandQueue.release();
+  if (traceContext())
+    traceEncoder.command(true, line);
+  return true;
+}
+
+/**
+ * @brief Hands a received setting to the control task. Called from the
+ * AsyncTCP task (MQTT) and the WiFi task (ESP-NOW).
+ */
+void queueSetting(const char *message, size_t len)
+{
+  if (len == 0)
+  {
+    return;
+  }
+  size_t ticket;
+  InboundSetting *setting = settingQueue.claim(ticket);
+  if (setting == nullptr)
+  {
+    settingDropCount.fetch_add(1, std::memory_order_relaxed);
+    halConsole().println("Busy, setting dropped.");
+    return;
+  }
+  len = min(len, INBOUND_SETTING_MAX_LENGTH);
+  memcpy(setting->message, message, len);
+  setting->message[len] = '\0';
+  setting->receivedUs = micros();
+  settingQueue.commit(ticket);
+}
+
+bool halReadSetting(char *message, size_t size)
+{
+  InboundSetting *setting = settingQueue.front();
+  if (setting == nullptr)
+  {
+    if (traceContext())
+      traceEncoder.record(TRACE_SETTING, nullptr, 0);
+    return false;
+  }
+  strlcpy(message, setting->message, size);
+  settingTakenUs = setting->receivedUs;
+  settingQueue.release();
+  if (traceContext())
+    traceEncoder.record(TRACE_SETTING, message, strlen(message));
+  return true;
+}
+
+void halSettingApplied()
+{
+  settingLatency.add(micros() - settingTakenUs);
+}
+
+void halQueuePrintStats(Print &out)
+{
+  out.println("--- Queues ---");
+  out.print("Settings in (MQTT/ESP-NOW): ");
+  out.print((unsigned long)settingLatency.count);
+  out.print(" applied, ");
+  out.print((unsigned long)settingDropCount.load(std::memory_order_relaxed));
+  out.println(" dropped");
+  if (settingLatency.count > 0)
+  {
+    StageSummary latency = settingLatency.summarize(1.0f);
+    out.print("  receipt to applied: min ");
+    out.print(latency.minUs / 1000.0f, 1);
+    out.print(" / avg ");
+    out.print(latency.avgUs / 1000.0f, 1);
+    out.print(" / p99 ");
+    out.print(latency.p99Us / 1000.0f, 1);
+    out.print(" / max ");
+    out.print(latency.maxUs / 1000.0f, 1);
+    out.println(" ms");
+  }
+  out.print("Publishes out: ");
+  out.print(outboundDropCount);
+  out.println(" dropped");
+  out.print("Console out: ");
+  out.print(consoleDropCount);
+  out.println(" bytes dropped");
+#ifdef HAS_SCREEN
+  EspNowStats stats = espNowStats;
+  uint32_t now = millis();
+  float seconds = (now - espNowWindowStart) / 1000.0f;
+  out.print("ESP-NOW out: ");
+  out.print((unsigned long)stats.frames);
+  out.print(" frames, ");
+  out.print((unsigned long)stats.delivered);
+  out.print(" delivered (");
+  out.print((unsigned long)stats.bytes);
+  out.print(" bytes), ");
+  out.print((unsigned long)stats.retries);
+  out.print(" retries, ");
+  out.print((unsigned long)stats.failed);
+  out.print(" failed, ");
+  out.print((unsigned long)stats.dropped);
+  out.println(" dropped");
+  out.print("  ring high-water ");
+  out.print(stats.highWater);
+  out.print(" / ");
+  out.print(ESPNOW_RING_FRAMES - 1);
+  out.print(" frames, ");
+  out.print(seconds > 0 ? (stats.bytes - espNowWindowBytes) / seconds : 0.0f, 0);
+  out.println(" B/s since last report");
+  espNowWindowStart = now;
+  espNowWindowBytes = stats.bytes;
+#endif
+}
+
+void halCloseConsole()
+{
+  pendingTelnetDisconnect = true;
+}
+
+void halRequestProfilesSync()
+{
+  pendingProfilesPublish = true;
+}
+
+void halRequestSettingsCommit()
+{
+  pendingSettingsCommit = true;
+}
+
+void halPublish(const char *topic, const char *payload, bool retained, bool espNowSendNow, bool sendToMqtt, bool sendToESP)
+{
+  if (traceContext())
+    traceEncoder.publish(topic, payload, retained, espNowSendNow, sendToMqtt, sendToESP);
+  if (!isControlTask())
+  {
+    publishDataNow(topic, payload, retained, espNowSendNow, sendToMqtt, sendToESP);
+    return;
+  }
+
+  OutboundMessage *msg = outboundQueue.claim();
+  if (msg == nullptr)
+  {
+    outboundDropCount++;
+    return;
+  }
+  strlcpy(msg->topic, topic, sizeof(msg->topic));
+  strlcpy(msg->payload, payload, sizeof(msg->payload));
+  msg->retained = retained;
+  msg->espNowSendNow = espNowSendNow;
+  msg->sendToMqtt = sendToMqtt;
+  msg->sendToESP = sendToESP;
+  outboundQueue.commit();
+}
+
+uint32_t halPublishDropCount()
+{
+  uint32_t drops = outboundDropCount;
+  if (traceContext())
+    traceEncoder.value(TRACE_PUBLISH_DROPS, drops);
+  return drops;
+}
+
+uint8_t halTakeResyncRequest()
+{
+  uint8_t requests = resyncRequests.exchange(0);
+  if (traceContext())
+    traceEncoder.value(TRACE_RESYNC, requests);
+  return requests;
+}
+
+/**
+ * @brief Sends a publish right away. Comms task only (and setup() before the
+ * tasks start): it appends to the open ESP-NOW frame without a lock.
+ */
+void publishDataNow(const char *topic, const char *payload, bool retained, bool espNowSendNow, bool sendToMqtt, bool sendToESP)
+{
+  if (sendToMqtt && isOnline)
+  {
+    if (mqttClient.connected())
+    {
+      mqttClient.publish(topic, 0, retained, payload);
+    }
+  }
+#ifdef HAS_SCREEN
+  if (!sendToESP)
+  {
+    return;
+  }
+  if (!isScreenPaired)
+  {
+    return;
+  }
+
+  const char *keyStart = strrchr(topic, '/');
+
+  if (keyStart == NULL)
+  {
+    keyStart = topic;
+  }
+  else
+  {
+    keyStart = keyStart + 1;
+  }
+  int keyLen = strlen(keyStart);
+  int valLen = strlen(payload);
+  int neededSpace = 1 + keyLen + 1 + valLen; // |key=value
+
+  if (espNowFillLength + neededSpace >= MAX_ESPNOW_BUFFER - 1)
+  {
+    closeEspNowFrame();
+  }
+
+  EspNowFrame &frame = espNowRing[espNowTail];
+  char *out = frame.message.payload;
+  if (espNowFillLength == 0)
+  {
+    frame.attempts = 0;
+    espNowFillLength = snprintf(out, MAX_ESPNOW_BUFFER, "seq=%u", (unsigned)espNowSequence++);
+  }
+  if (espNowFillLength + neededSpace >= MAX_ESPNOW_BUFFER - 1)
+  {
+    espNowStats.dropped++; // a single pair larger than a frame
+    return;
+  }
+  out += espNowFillLength;
+  *out++ = '|';
+  memcpy(out, keyStart, keyLen);
+  out += keyLen;
+  *out++ = '=';
+  memcpy(out, payload, valLen);
+  out += valLen;
+  *out = '\0';
+  espNowFillLength = out - frame.message.payload;
+  if (espNowSendNow)
+  {
+    closeEspNowFrame();
+  }
+#endif
+}
+
+void handleTelnet()
+{
+  if (telnetServer.hasClient())
+  {
+    if (telnetClient && telnetClient.connected())
+    {
+      telnetClient.println("\nAnother client is connecting, disconnecting you.");
+      telnetClient.stop();
+    }
+    telnetClient = telnetServer.available();
+    if (telnetClient)
+    {
+      telnetClient.println("\nWelcome to the ESP32 Telnet Serial Monitor!");
+      telnetClient.println("--------------------------------------------");
+
+      // --- TELNET NEGOTIATION ---
+      telnetClient.write(255); // IAC (Interpret As Command)
+      telnetClient.write(251); // WILL
+      telnetClient.write(1);   // ECHO
+      telnetClient.write(255); // IAC
+      telnetClient.write(251); // WILL
+      telnetClient.write(3);   // SUPPRESS GO AHEAD
+
+      telnetClient.print("> ");
+    }
+  }
+
+  static char telnetBuffer[sizeof(ConsoleCommand::line)];
+  static int telnetIndex = 0;
+  while (telnetClient && telnetClient.connected() && telnetClient.available())
+  {
+    const char IAC = 255;
+    char c = telnetClient.read();
+
+    // --- TELNET COMMAND HANDLING ---
+    if (c == IAC)
+    {
+      if (telnetClient.available() >= 2)
+      {
+        telnetClient.read();
+        telnetClient.read();
+      }
+    }
+
+    // --- BACKSPACE HANDLING ---
+    else if (c == 8 || c == 127)
+    {
+      if (telnetIndex > 0)
+      {
+        telnetIndex--;
+        telnetBuffer[telnetIndex] = '\0'; // Null-terminate just in case
+
+        // Visual backspace for the user's terminal
+        telnetClient.write('\b');
+        telnetClient.write(' ');
+        telnetClient.write('\b');
+      }
+    }
+
+    // --- COMMAND EXECUTION on NEWLINE ---
+    else if (c == '\r') // Only trigger on Carriage Return
+    {
+      telnetBuffer[telnetIndex] = '\0'; // Null-terminate the char array
+
+      // Move cursor to next line for the user
+      telnetClient.println();
+
+      // Commands run in the control task, which prints the next prompt
+      // once the command's output has been queued.
+      ConsoleCommand command;
+      strlcpy(command.line, telnetBuffer, sizeof(command.line));
+      if (!commandQueue.push(command))
+      {
+        telnetClient.println("Busy, command dropped.");
+        telnetClient.print("> ");
+      }
+
+      // Reset buffer
+      telnetIndex = 0;
+      telnetBuffer[0] = '\0';
+    }
+
+    // --- IGNORE NEWLINE (The second half of Enter) ---
+    else if (c == '\n')
+    {
+      // Do nothing. This prevents the double prompt.
+    }
+
+    else if (isPrintable(c))
+    {
+      if (telnetIndex < sizeof(telnetBuffer) - 1)
+      {
+        telnetBuffer[telnetIndex] = c;
+        telnetIndex++;
+        telnetBuffer[telnetIndex] = '\0';
+
+        telnetClient.write(c);
+      }
+    }
+  }
+}
+
+// =================================================================
+// --- MQTT & ESP-NOW ---
+// =================================================================
+bool halIsOnline()
+{
+  if (traceContext())
+    traceEncoder.value(TRACE_ONLINE, isOnline);
+  return isOnline;
+}
+
+bool halMqttConnected()
+{
+  bool connected = mqttClient.connected();
+  if (traceContext())
+    traceEncoder.value(TRACE_MQTT_CONNECTED, connected);
+  return connected;
+}
+
+void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)
+{
+  if (len > INBOUND_SETTING_MAX_LENGTH)
+  {
+    halConsole().println("Error: MQTT message too large for the setting queue.");
+    return;
+  }
+  char logBuf[128];
+  snprintf(logBuf, sizeof(logBuf), "MQTT received on %s: %.*s", topic, (int)min(len, (size_t)80), payload);
+  halConsole().println(logBuf);
+  queueSetting(payload, len);
+}
+
+void onMqttConnect(bool sessionPresent)
+{
+  halConsole().println("MQTT connected!");
+
+  mqttClient.subscribe(mqtt_topic_set, 0); // 0 = QoS 0
+  // Publishing from here would append to the ESP-NOW ring beside the comms task
+  pendingMqttConnected = true;
+}
+
+void onMqttDisconnect(AsyncMqttClientDisconnectReason reason)
+{
+  halConsole().print("Disconnected from MQTT. Reason: ");
+  halConsole().println((int)reason);
+}
+
+#ifdef HAS_SCREEN
+void OnDataRecv(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
+{
+  Print &console = halConsole();
+  if (len == sizeof(struct_pairing))
+  {
+    memcpy(&pairingData, incomingData, sizeof(pairingData));
+    if (pairingData.id == PAIR_REQUEST && strcmp(pairingData.identifier, espIdentifier) == 0)
+    {
+      if (isScreenPaired && memcmp(mac_addr, screenMacAddress, 6) != 0)
+      {
+        console.println("New pairing request received. Dropping old screen.");
+        esp_err_t del_status = esp_now_del_peer(screenMacAddress);
+        if (del_status != ESP_OK)
+        {
+          console.println("Warning: Failed to delete old peer. Continuing anyway...");
+        }
+      }
+      else if (isScreenPaired)
+      {
+        console.println("Pairing request from already-paired screen. Re-syncing.");
+      }
+      else
+      {
+        console.println("Pairing request received from a new screen.");
+      }
+      memcpy(screenMacAddress, mac_addr, 6);
+      int screenChannel = pairingData.channel;
+
+      memset(&peerInfo, 0, sizeof(peerInfo));
+      memcpy(peerInfo.peer_addr, screenMacAddress, 6);
+      peerInfo.channel = 0;
+      peerInfo.ifidx = WIFI_IF_STA;
+      peerInfo.encrypt = false;
+      if (esp_now_add_peer(&peerInfo) != ESP_OK)
+      {
+        if (esp_now_mod_peer(&peerInfo) != ESP_OK)
+        {
+          console.println("Failed to add or modify new screen as peer.");
+          return;
+        }
+        console.println("Screen peer modified successfully.");
+      }
+      else
+      {
+        console.println("Screen peer added successfully.");
+      }
+
+      pairingData.id = PAIR_RESPONSE;
+      pairingData.channel = 0;
+      WiFi.macAddress(pairingData.macAddr);
+      strcpy(pairingData.identifier, espIdentifier);
+      portENTER_CRITICAL(&espNowMux);
+      pairingResponse = pairingData;
+      pairingResponsePending = true;
+      portEXIT_CRITICAL(&espNowMux);
+      sendNextEspNowFrame();
+
+      isScreenPaired = true;
+      pendingScreenSync = true;
+    }
+  }
+
+  else if (len == sizeof(struct_message))
+  {
+
+    if (!isScreenPaired || memcmp(mac_addr, screenMacAddress, 6) != 0)
+    {
+      console.println("Data received from unknown/unpaired MAC. Ignoring.");
+      return;
+    }
+
+    memcpy(&myData, incomingData, sizeof(myData));
+    myData.payload[sizeof(myData.payload) - 1] = '\0';
+    // k1=v1|k2=v2 stays one message, handleIncomingSetting() applies it as a whole
+    queueSetting(myData.payload, strlen(myData.payload));
+  }
+}
+
+void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+  // Only one send is outstanding (sendNextEspNowFrame()), so this is its
+  // completion; a send to every peer completes once per peer.
+  EspNowSend kind = espNowInFlight;
+  if (kind == ESPNOW_SEND_NONE)
+    return;
+  if (espNowCallbacksDue > 1)
+  {
+    espNowCallbacksDue--;
+    return;
+  }
+  bool retire = true;
+  if (kind == ESPNOW_SEND_RING)
+  {
+    EspNowFrame &frame = espNowRing[espNowHead];
+    if (status == ESP_NOW_SEND_SUCCESS)
+    {
+      espNowStats.delivered++;
+      espNowStats.bytes += strlen(frame.message.payload);
+    }
+    else if (frame.attempts <= ESPNOW_MAX_RETRIES)
+    {
+      espNowStats.retries++;
+      retire = false;
+    }
+    else
+    {
+      espNowStats.failed++;
+    }
+  }
+  portENTER_CRITICAL(&espNowMux);
+  if (kind == ESPNOW_SEND_RING && retire)
+    espNowHead = (espNowHead + 1) % ESPNOW_RING_FRAMES;
+  espNowCallbacksDue = 0;
+  espNowInFlight = ESPNOW_SEND_NONE;
+  portEXIT_CRITICAL(&espNowMux);
+  sendNextEspNowFrame();
+}
+
+/**
+ * @brief Sends the pairing response, the broadcast or else the oldest closed
+ * frame, unless a send is already outstanding. Called by the comms task and
+ * from the ESP-NOW callbacks.
+ */
+void sendNextEspNowFrame()
+{
+  uint8_t peers = 0;
+  if (broadcastPending)
+  {
+    esp_now_peer_num_t peerNum;
+    if (esp_now_get_peer_num(&peerNum) == ESP_OK)
+      peers = peerNum.total_num;
+  }
+
+  EspNowSend kind = ESPNOW_SEND_NONE;
+  portENTER_CRITICAL(&espNowMux);
+  if (espNowInFlight == ESPNOW_SEND_NONE)
+  {
+    if (pairingResponsePending)
+      kind = ESPNOW_SEND_PAIRING;
+    else if (broadcastPending && peers > 0)
+      kind = ESPNOW_SEND_BROADCAST;
+    else if (espNowHead != espNowTail)
+      kind = ESPNOW_SEND_RING;
+    if (kind == ESPNOW_SEND_PAIRING)
+      pairingResponsePending = false;
+    if (kind == ESPNOW_SEND_BROADCAST || (broadcastPending && peers == 0))
+      broadcastPending = false; // a broadcast without peers goes nowhere
+    espNowInFlight = kind;
+    espNowCallbacksDue = kind == ESPNOW_SEND_BROADCAST ? peers : 1;
+  }
+  uint8_t index = espNowHead;
+  portEXIT_CRITICAL(&espNowMux);
+
+  esp_err_t result;
+  switch (kind)
+  {
+  case ESPNOW_SEND_PAIRING:
+    result = esp_now_send(screenMacAddress, (uint8_t *)&pairingResponse, sizeof(pairingResponse));
+    break;
+  case ESPNOW_SEND_BROADCAST:
+    result = esp_now_send(NULL, (uint8_t *)&broadcastMessage, sizeof(broadcastMessage));
+    break;
+  case ESPNOW_SEND_RING:
+    espNowRing[index].attempts++;
+    result = esp_now_send(screenMacAddress, (uint8_t *)&espNowRing[index].message, sizeof(struct_message));
+    break;
+  default:
+    return;
+  }
+  if (result != ESP_OK)
+  {
+    // Not taken by the driver, so no callback follows. A ring frame stays
+    // at the head and the next comms step tries again, or drops it once the
+    // attempts are used up; a pairing response or broadcast is dropped.
+    portENTER_CRITICAL(&espNowMux);
+    if (kind == ESPNOW_SEND_RING)
+    {
+      if (espNowRing[index].attempts > ESPNOW_MAX_RETRIES)
+      {
+        espNowHead = (espNowHead + 1) % ESPNOW_RING_FRAMES;
+        espNowStats.failed++;
+      }
+      else
+      {
+        espNowStats.retries++;
+      }
+    }
+    espNowCallbacksDue = 0;
+    espNowInFlight = ESPNOW_SEND_NONE;
+    portEXIT_CRITICAL(&espNowMux);
+  }
+}
+
+/**
+ * @brief Queues the open frame for sending. If the ring is full the frame
+ * is dropped; newer values follow with the next publish anyway.
+ */
+void closeEspNowFrame()
+{
+  if (espNowFillLength == 0)
+    return;
+  espNowFillLength = 0;
+  if (!isScreenPaired)
+    return;
+
+  uint8_t next = (espNowTail + 1) % ESPNOW_RING_FRAMES;
+  portENTER_CRITICAL(&espNowMux);
+  bool full = next == espNowHead;
+  if (!full)
+    espNowTail = next;
+  uint8_t waiting = (espNowTail - espNowHead + ESPNOW_RING_FRAMES) % ESPNOW_RING_FRAMES;
+  portEXIT_CRITICAL(&espNowMux);
+
+  if (full)
+  {
+    espNowStats.dropped++;
+  }
+  else
+  {
+    espNowStats.frames++;
+    if (waiting > espNowStats.highWater)
+      espNowStats.highWater = waiting;
+  }
+  sendNextEspNowFrame();
+}
+#endif
+
+int halEspNowBroadcast(const char *payload)
+{
+#ifdef HAS_SCREEN
+  // Sent by the comms task ahead of the ring, see sendNextEspNowFrame()
+  int32_t result = ESP_OK;
+  portENTER_CRITICAL(&espNowMux);
+  if (broadcastPending)
+  {
+    result = ESP_ERR_ESPNOW_NO_MEM; // the previous one is still waiting
+  }
+  else
+  {
+    strlcpy(broadcastMessage.payload, payload, sizeof(broadcastMessage.payload));
+    broadcastPending = true;
+  }
+  portEXIT_CRITICAL(&espNowMux);
+#else
+  int32_t result = ESP_ERR_NOT_SUPPORTED;
+#endif
+  if (traceContext())
+    traceEncoder.value(TRACE_ESPNOW_SEND, result);
+  return result;
+}
+
+void startNetworkServices()
+{
+#ifdef HAS_SCREEN
+  halConsole().println("Initializing ESP-NOW...");
+  if (esp_now_init() != ESP_OK)
+  {
+    halConsole().println("Error initializing ESP-NOW");
+    return;
+  }
+  esp_wifi_set_ps(WIFI_PS_NONE);
+  esp_now_register_recv_cb(OnDataRecv);
+  esp_now_register_send_cb(OnDataSent);
+#endif
+  mqttClient.onConnect(onMqttConnect);
+  mqttClient.onDisconnect(onMqttDisconnect);
+  mqttClient.onMessage(onMqttMessage);
+
+  mqttClient.setServer(mqtt_server, mqtt_port);
+  if (strcmp(mqtt_user, "") != 0)
+  {
+    mqttClient.setCredentials(mqtt_user, mqtt_password);
+  }
+  mqttClient.setClientId(mqtt_client_id);
+  if (strcmp(mqtt_server, "") != 0)
+  {
+    halConsole().println("Connecting to MQTT broker...");
+    mqttClient.connect();
+  }
+  else
+  {
+    halConsole().println("MQTT server not set. Skipping initial connection.");
+  }
+
+  ArduinoOTA.setHostname(ota_hostname);
+  ArduinoOTA.setPassword(ota_password);
+  ArduinoOTA.begin();
+  halConsole().println("OTA Ready");
+
+  if (traceBuffer != nullptr)
+  {
+    traceServer.begin();
+    halConsole().print("Input trace streaming on port ");
+    halConsole().println(TRACE_PORT);
+  }
+}
+
+bool halNetworkBegin(const char *mqttServer, int mqttPort, const char *mqttUser, const char *mqttPassword)
+{
+  mqtt_server = mqttServer;
+  mqtt_port = mqttPort;
+  mqtt_user = mqttUser;
+  mqtt_password = mqttPassword;
+
+  wm.setConfigPortalBlocking(false);
+  wm.setTimeout(0);
+
+  if (wm.autoConnect("MaraX-Setup"))
+  {
+    halConsole().print("Connected to WiFi: ");
+    halConsole().println(WiFi.SSID());
+    isOnline = true;
+    WiFi.mode(WIFI_AP_STA);
+  }
+  else
+  {
+    halConsole().println("WiFi not connected. Running in offline mode (AP might be active in background).");
+    isOnline = false;
+  }
+
+  if (isOnline)
+  {
+    startNetworkServices();
+  }
+
+  telnetServer.begin();
+  halConsole().print("Telnet server started. Connect to ");
+  halConsole().print(WiFi.localIP());
+  halConsole().println(" on port 23.");
+  halConsole().println("Type 'help' for a list of commands.");
+  if (traceContext())
+    traceEncoder.value(TRACE_NETWORK_BEGIN, isOnline);
+  return isOnline;
+}
+
+void halMqttConfigure(const char *mqttServer, int mqttPort, const char *mqttUser, const char *mqttPassword)
+{
+  mqtt_server = mqttServer;
+  mqtt_port = mqttPort;
+  mqtt_user = mqttUser;
+  mqtt_password = mqttPassword;
+  if (isControlTask())
+  {
+    pendingMqttReconnect = true;
+    return;
+  }
+
+  mqttClient.setServer(mqtt_server, mqtt_port);
+  if (strcmp(mqtt_user, "") != 0)
+  {
+    mqttClient.setCredentials(mqtt_user, mqtt_password);
+  }
+  else
+  {
+    mqttClient.setCredentials(nullptr, nullptr);
+  }
+  mqttClient.connect();
+}
+
+// =================================================================
+// --- ADS1115 ACQUISITION ENGINE ---
+// =================================================================
+bool halAdsBegin(const uint8_t *schedule, int scheduleLength)
+{
+  bool ok = adsBegin(schedule, scheduleLength);
+  if (traceContext())
+    traceEncoder.value(TRACE_ADS_BEGIN, ok);
+  return ok;
+}
+
+bool adsBegin(const uint8_t *schedule, int scheduleLength)
+{
+  adsScheduleLength = min(scheduleLength, ADS_MAX_SCHEDULE_LENGTH);
+  memcpy(adsSchedule, schedule, adsScheduleLength);
+
+  Wire.begin(A4, A5);
+  Wire.setTimeOut(150);
+  if (!ads.begin())
+  {
+    return false;
+  }
+  ads.setGain(GAIN_ONE);
+
+  unsigned long now = millis();
+  for (int i = 0; i < ADS_CHANNEL_COUNT; i++)
+  {
+    adsStats[i].windowStart = now;
+  }
+  xTaskCreatePinnedToCore(adsTask, "ads", ADS_TASK_STACK_SIZE, NULL, ADS_TASK_PRIORITY, &adsTaskHandle, ADS_TASK_CORE);
+#ifdef HAS_ADS_ALERT
+  pinMode(ADS_ALERT_PIN, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(ADS_ALERT_PIN), adsReadyISR, FALLING);
+#endif
+  return true;
+}
+
+void IRAM_ATTR adsReadyISR()
+{
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  if (adsTaskHandle != NULL)
+  {
+    vTaskNotifyGiveFromISR(adsTaskHandle, &higherPriorityTaskWoken);
+  }
+  portYIELD_FROM_ISR(higherPriorityTaskWoken);
+}
+
+/**
+ * @brief Sleeps until the running conversion has finished.
+ * @param periodUs Nominal conversion time of the current data rate.
+ * @param missed Set to the number of conversions that completed unread.
+ * @return false if the conversion never signalled ready.
+ */
+bool adsWaitForConversion(uint32_t periodUs, uint32_t &missed)
+{
+  missed = 0;
+  const uint32_t periodMs = (periodUs + 999) / 1000;
+#ifdef HAS_ADS_ALERT
+  uint32_t notifications = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(periodMs + ADS_CONVERSION_TIMEOUT_MARGIN_MS));
+  if (notifications == 0)
+  {
+    return false;
+  }
+  missed = notifications - 1;
+  return true;
+#else
+  vTaskDelay(pdMS_TO_TICKS(periodMs));
+  unsigned long start = millis();
+  while (!ads.conversionComplete())
+  {
+    if (millis() - start > ADS_CONVERSION_TIMEOUT_MARGIN_MS)
+    {
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  return true;
+#endif
+}
+
+void adsPublishSample(uint8_t channel, int32_t sum, uint8_t count)
+{
+  // Normalise to GAIN_ONE counts so the rest of the firmware is gain agnostic
+  float fullScale;
+  switch (adsChannelConfigs[channel].gain)
+  {
+  case GAIN_TWOTHIRDS:
+    fullScale = 6.144f;
+    break;
+  case GAIN_TWO:
+    fullScale = 2.048f;
+    break;
+  case GAIN_FOUR:
+    fullScale = 1.024f;
+    break;
+  case GAIN_EIGHT:
+    fullScale = 0.512f;
+    break;
+  case GAIN_SIXTEEN:
+    fullScale = 0.256f;
+    break;
+  default:
+    fullScale = 4.096f;
+    break;
+  }
+  float counts = (float)sum / count * (fullScale / 4.096f);
+  int16_t raw = (int16_t)constrain(lroundf(counts), -32768L, 32767L);
+  uint32_t now = micros();
+
+  portENTER_CRITICAL(&adsSampleMux);
+  adsSamples[channel].raw = raw;
+  adsSamples[channel].timestampUs = now;
+  adsSamples[channel].seq++;
+  portEXIT_CRITICAL(&adsSampleMux);
+
+  AdsChannelStats &stats = adsStats[channel];
+  stats.samples++;
+  stats.windowSamples++;
+  unsigned long elapsed = millis() - stats.windowStart;
+  if (elapsed >= 1000)
+  {
+    stats.sampleRate = stats.windowSamples * 1000.0f / elapsed;
+    stats.windowSamples = 0;
+    stats.windowStart += elapsed;
+  }
+}
+
+void adsTask(void *parameter)
+{
+  int slot = 0;
+  for (;;)
+  {
+    uint8_t channel = adsSchedule[slot];
+    bool isOneShot = false;
+    int8_t requested = adsOneShotChannel;
+    if (requested >= 0)
+    {
+      channel = requested;
+      isOneShot = true;
+    }
+
+    const AdsChannelConfig &config = adsChannelConfigs[channel];
+    uint8_t conversions = isOneShot ? 1 : max((uint8_t)1, config.oversample);
+    uint32_t periodUs = 1000000UL / config.samplesPerSecond;
+#ifdef HAS_ADS_ALERT
+    bool continuous = conversions > 1;
+#else
+    // The OS bit only reports completion in single-shot mode
+    bool continuous = false;
+#endif
+
+    ads.setGain(config.gain);
+    ads.setDataRate(config.dataRate);
+    ads.startADCReading(ADS_MUX_BY_CHANNEL[channel], continuous);
+#ifdef HAS_ADS_ALERT
+    // Discard ready edges that belonged to the previous slot
+    ulTaskNotifyTake(pdTRUE, 0);
+#endif
+
+    int32_t sum = 0;
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < conversions; i++)
+    {
+      uint32_t missed = 0;
+      if (!continuous && i > 0)
+      {
+        ads.startADCReading(ADS_MUX_BY_CHANNEL[channel], false);
+      }
+      if (!adsWaitForConversion(periodUs, missed))
+      {
+        adsStats[channel].droppedConversions++;
+        break;
+      }
+      adsStats[channel].droppedConversions += missed;
+      sum += ads.getLastConversionResults();
+      count++;
+    }
+
+    if (count > 0)
+    {
+      adsPublishSample(channel, sum, count);
+    }
+
+    if (isOneShot)
+    {
+      adsOneShotChannel = -1;
+    }
+    else
+    {
+      slot = (slot + 1) % adsScheduleLength;
+    }
+  }
+}
+
+bool halAdsGetSample(int channel, AdsSample &sample)
+{
+  bool ok = adsCopySample(channel, sample);
+  if (traceContext())
+    traceEncoder.adsSample(channel, ok, sample);
+  return ok;
+}
+
+bool adsCopySample(int channel, AdsSample &sample)
+{
+  portENTER_CRITICAL(&adsSampleMux);
+  sample = adsSamples[channel];
+  portEXIT_CRITICAL(&adsSampleMux);
+  return sample.seq != 0;
+}
+
+bool isAdsChannelScheduled(int channel)
+{
+  for (int i = 0; i < adsScheduleLength; i++)
+  {
+    if (adsSchedule[i] == channel)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+int16_t halAdsRead(int channel)
+{
+  int16_t raw = adsReadChannel(channel);
+  if (traceContext())
+    traceEncoder.value(TRACE_ADS_READ, raw);
+  return raw;
+}
+
+int16_t adsReadChannel(int channel)
+{
+  AdsSample sample;
+  if (channel < 0 || channel >= ADS_CHANNEL_COUNT)
+  {
+    return 0;
+  }
+  if (!isAdsChannelScheduled(channel) && adsTaskHandle != NULL)
+  {
+    adsCopySample(channel, sample);
+    uint32_t seqBefore = sample.seq;
+    adsOneShotChannel = channel;
+    unsigned long start = millis();
+    while (millis() - start < 100)
+    {
+      adsCopySample(channel, sample);
+      if (sample.seq != seqBefore)
+      {
+        break;
+      }
+      delay(1);
+    }
+  }
+  adsCopySample(channel, sample);
+  return sample.raw;
+}
+
+bool halAdsWaitForSamples(unsigned long timeoutMs)
+{
+  bool ready = adsWaitForSamples(timeoutMs);
+  if (traceContext())
+    traceEncoder.value(TRACE_ADS_WAIT, ready);
+  return ready;
+}
+
+bool adsWaitForSamples(unsigned long timeoutMs)
+{
+  unsigned long start = millis();
+  while (millis() - start < timeoutMs)
+  {
+    bool allReady = true;
+    for (int i = 0; i < adsScheduleLength; i++)
+    {
+      AdsSample sample;
+      if (!adsCopySample(adsSchedule[i], sample))
+      {
+        allReady = false;
+        break;
+      }
+    }
+    if (allReady)
+    {
+      return true;
+    }
+    delay(1);
+  }
+  return false;
+}
+
+void halAdsPrintStats(Print &out)
+{
+  out.println("--- ADS1115 Acquisition ---");
+#ifdef HAS_ADS_ALERT
+  out.println("Mode: ALERT/RDY interrupt");
+#else
+  out.println("Mode: polled (no ALERT/RDY)");
+#endif
+  uint32_t now = micros();
+  for (int i = 0; i < ADS_CHANNEL_COUNT; i++)
+  {
+    AdsSample sample;
+    bool hasSample = adsCopySample(i, sample);
+    out.print("  CH");
+    out.print(i);
+    out.print(isAdsChannelScheduled(i) ? " " : " (on demand) ");
+    out.print(adsChannelConfigs[i].samplesPerSecond);
+    out.print(" SPS x");
+    out.print(adsChannelConfigs[i].oversample);
+    out.print(": ");
+    out.print(adsStats[i].sampleRate, 1);
+    out.print(" Hz, samples ");
+    out.print(adsStats[i].samples);
+    out.print(", dropped ");
+    out.print(adsStats[i].droppedConversions);
+    if (hasSample)
+    {
+      out.print(", last ");
+      out.print(sample.raw);
+      out.print(" (");
+      out.print((now - sample.timestampUs) / 1000);
+      out.print(" ms ago)");
+    }
+    out.println("");
+  }
+#ifdef HAS_SCALE
+  ScaleReadStats stats = scaleReadStats;
+  float cyclesPerUs = ESP.getCpuFreqMHz();
+  ScaleRingStats ring = scaleRingStats;
+  out.println("--- ADS1232 Readout ---");
+  out.print("Samples: ");
+  out.print((unsigned long)ring.samples);
+  out.print(" at ");
+  out.print(ring.sampleRate, 1);
+  out.print(" Hz, missed conversions ");
+  out.print((unsigned long)ring.missed);
+  out.print(", ring drops ");
+  out.print((unsigned long)ring.ringDrops);
+  out.print(" (");
+  out.print((unsigned long)scaleSamples.size());
+  out.print(" / ");
+  out.print((unsigned long)SCALE_RING_SIZE);
+  out.println(" queued)");
+  out.print("Input switches: ");
+  out.print((unsigned long)ring.switches);
+  out.print(", dropped while settling: ");
+  out.println((unsigned long)ring.settling);
+  out.print("Reads: ");
+  out.print((unsigned long)stats.reads);
+  out.print(", discarded as late: ");
+  out.println((unsigned long)stats.late);
+  if (stats.reads > 0)
+  {
+    out.print("  frame avg ");
+    out.print(stats.totalCycles / stats.reads / cyclesPerUs, 1);
+    out.print(" / max ");
+    out.print(stats.maxCycles / cyclesPerUs, 1);
+    out.print(" us, interrupts masked max ");
+    out.print(stats.maxMaskedCycles / cyclesPerUs, 2);
+    out.println(" us");
+  }
+#endif
+}
+
+// =================================================================
+// --- SCALE (ADS1232) ---
+// =================================================================
+#ifdef HAS_SCALE
+/**
+ * @brief Interrupt Service Routine (ISR) for the ADS1232.
+ * Stamps the finished conversion and wakes scaleTask to read it.
+ */
+void IRAM_ATTR dataReadyISR()
+{
+  if (scaleReadoutActive)
+    return;
+  scaleReadyUs = micros();
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  if (scaleTaskHandle != NULL)
+  {
+    vTaskNotifyGiveFromISR(scaleTaskHandle, &higherPriorityTaskWoken);
+  }
+  portYIELD_FROM_ISR(higherPriorityTaskWoken);
+}
+
+void scaleTask(void *parameter)
+{
+  for (;;)
+  {
+    uint32_t pending = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SCALE_TASK_IDLE_MS));
+    if (pending == 0)
+    {
+      continue;
+    }
+    // Each edge is one conversion; only the newest can still be read
+    scaleRingStats.missed += pending - 1;
+    ScaleSample sample;
+    sample.timestampUs = scaleReadyUs;
+    sample.channel = scaleWrittenChannel;
+    scaleReadoutActive = true;
+    long raw = scaleReadConversion();
+    scaleReadoutActive = false;
+    if (raw == -2 || raw == -1)
+    {
+      continue;
+    }
+    if (scaleSettling)
+    {
+      if ((int32_t)(sample.timestampUs - scaleSwitchSettleUs) < 0)
+      {
+        scaleRingStats.settling++;
+        continue;
+      }
+      scaleSettling = false;
+    }
+    sample.raw = raw;
+    bool queued = scaleSamples.push(sample);
+    if (scaleDwell > 0 && ++scaleBurstCount >= scaleDwell)
+    {
+      scaleSwitchChannel();
+    }
+    if (!queued)
+    {
+      scaleRingStats.ringDrops++;
+      continue;
+    }
+
+    ScaleRingStats &stats = scaleRingStats;
+    stats.samples++;
+    stats.windowSamples++;
+    unsigned long elapsed = millis() - stats.windowStart;
+    if (elapsed >= 1000)
+    {
+      stats.sampleRate = stats.windowSamples * 1000.0f / elapsed;
+      stats.windowSamples = 0;
+      stats.windowStart += elapsed;
+    }
+  }
+}
+
+bool halScaleBegin()
+{
+  Wire.setClock(400000);
+
+  pinMode(ADS_SCLK_PIN, OUTPUT);
+  digitalWrite(ADS_SCLK_PIN, LOW);
+  pinMode(ADS_DOUT_PIN, INPUT_PULLUP);
+  scaleResolvePins();
+  pcfMutex = xSemaphoreCreateMutex();
+
+  halScalePowerDown(true);
+  delay(100);
+  halScaleSetSpeed(false);
+  halScaleSetGain(128);
+  bitClear(pcfState, PCF_TEMP_BIT);
+  bool ok = pcfApply();
+  delay(100);
+  halScalePowerDown(true);
+  pcfApply();
+  delay(100);
+  halScalePowerDown(false);
+  pcfApply();
+
+  scaleRingStats.windowStart = millis();
+  xTaskCreatePinnedToCore(scaleTask, "scale", SCALE_TASK_STACK_SIZE, NULL, SCALE_TASK_PRIORITY, &scaleTaskHandle, SCALE_TASK_CORE);
+  attachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN), dataReadyISR, FALLING);
+  if (traceContext())
+    traceEncoder.value(TRACE_SCALE_BEGIN, ok);
+  return ok;
+}
+
+bool halScaleTakeSample(ScaleSample &sample)
+{
+  bool ok = scaleSamples.pop(sample);
+  if (traceContext())
+    traceEncoder.scaleSample(ok, sample);
+  return ok;
+}
+
+bool halScaleIsReady()
+{
+  bool ready = digitalRead(ADS_DOUT_PIN) == LOW;
+  if (traceContext())
+    traceEncoder.value(TRACE_SCALE_IS_READY, ready);
+  return ready;
+}
+
+void halScaleSetInterruptEnabled(bool enabled)
+{
+  if (enabled)
+  {
+    attachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN), dataReadyISR, FALLING);
+  }
+  else
+  {
+    detachInterrupt(digitalPinToInterrupt(ADS_DOUT_PIN));
+  }
+}
+
+bool halScaleApplyConfig()
+{
+  bool ok = pcfApply();
+  if (traceContext())
+    traceEncoder.value(TRACE_SCALE_APPLY, ok);
+  return ok;
+}
+
+void halScaleSetDwell(uint8_t dwell)
+{
+  pcfLock();
+  scaleDwell = dwell;
+  scaleBurstCount = 0;
+  pcfUnlock();
+}
+
+/**
+ * @brief Sends the current pcfState byte to the PCF8574 I2C expander.
+ */
+bool pcfApply()
+{
+  pcfLock();
+  bool ok = pcfWrite();
+  pcfUnlock();
+  return ok;
+}
+
+void pcfLock()
+{
+  if (pcfMutex != NULL)
+    xSemaphoreTake(pcfMutex, portMAX_DELAY);
+}
+
+void pcfUnlock()
+{
+  if (pcfMutex != NULL)
+    xSemaphoreGive(pcfMutex);
+}
+
+/**
+ * @brief Writes pcfState with A0 for scaleChannel and starts the settling
+ * window if that changed the input. The caller holds pcfMutex.
+ */
+bool pcfWrite()
+{
+  byte state = pcfState;
+  if (scaleChannel == 2)
+    bitSet(state, PCF_A0_BIT);
+  else
+    bitClear(state, PCF_A0_BIT);
+
+  Wire.setClock(100000);
+  Wire.beginTransmission(PCF8574_ADDRESS);
+  Wire.write(state);
+
+  byte error = Wire.endTransmission();
+  Wire.setClock(400000);
+
+  if (error != 0)
+  {
+    halConsole().print("FAILED! Error Code: ");
+    halConsole().println(error);
+    return false;
+  }
+  if (scaleChannel != scaleWrittenChannel)
+  {
+    uint32_t period = bitRead(pcfState, PCF_SPEED_BIT) ? SCALE_FAST_PERIOD_US : SCALE_SLOW_PERIOD_US;
+    scaleSwitchSettleUs = micros() + SCALE_SWITCH_SETTLE_CONVERSIONS * period;
+    scaleSettling = true;
+    scaleWrittenChannel = scaleChannel;
+    scaleRingStats.switches++;
+  }
+  return true;
+}
+
+/**
+ * @brief Moves the converter to the other input at the end of a burst.
+ * Runs in scaleTask.
+ */
+void scaleSwitchChannel()
+{
+  pcfLock();
+  if (scaleDwell > 0)
+  {
+    scaleChannel = scaleChannel == 1 ? 2 : 1;
+    scaleBurstCount = 0;
+    pcfWrite();
+  }
+  pcfUnlock();
+}
+
+/**
+ * @brief Looks up the GPIO registers and masks behind the SCLK and DOUT
+ * board pins (the Nano ESP32 numbers its pins apart from the GPIOs).
+ */
+void scaleResolvePins()
+{
+#ifdef BOARD_HAS_PIN_REMAP
+  int sclk = digitalPinToGPIONumber(ADS_SCLK_PIN);
+  int dout = digitalPinToGPIONumber(ADS_DOUT_PIN);
+#else
+  int sclk = ADS_SCLK_PIN;
+  int dout = ADS_DOUT_PIN;
+#endif
+  scaleSclkMask = 1UL << (sclk & 31);
+  scaleSclkSetReg = sclk < 32 ? GPIO_OUT_W1TS_REG : GPIO_OUT1_W1TS_REG;
+  scaleSclkClearReg = sclk < 32 ? GPIO_OUT_W1TC_REG : GPIO_OUT1_W1TC_REG;
+  scaleDoutMask = 1UL << (dout & 31);
+  scaleDoutInReg = dout < 32 ? GPIO_IN_REG : GPIO_IN1_REG;
+  scaleHalfCycles = (ESP.getCpuFreqMHz() * SCALE_SCLK_HALF_NS + 999) / 1000;
+}
+
+inline void scaleWaitCycles(uint32_t start, uint32_t cycles)
+{
+  while (ESP.getCycleCount() - start < cycles)
+  {
+  }
+}
+
+/**
+ * @brief Reads the 24-bit raw data from the ADS1232, plus the 25th clock
+ * that forces DOUT high until the next conversion. Runs in scaleTask.
+ */
+long scaleReadConversion()
+{
+  if ((REG_READ(scaleDoutInReg) & scaleDoutMask) != 0)
+    return -2;
+  uint32_t frameStart = ESP.getCycleCount();
+  uint32_t maxMasked = 0;
+  long reading = 0;
+  for (int bit = 0; bit < 25; bit++)
+  {
+    portENTER_CRITICAL(&scaleMux);
+    uint32_t high = ESP.getCycleCount();
+    REG_WRITE(scaleSclkSetReg, scaleSclkMask);
+    scaleWaitCycles(high, scaleHalfCycles);
+    bool one = (REG_READ(scaleDoutInReg) & scaleDoutMask) != 0;
+    REG_WRITE(scaleSclkClearReg, scaleSclkMask);
+    uint32_t low = ESP.getCycleCount();
+    portEXIT_CRITICAL(&scaleMux);
+    if (bit < 24)
+      reading = (reading << 1) | (one ? 1 : 0);
+    if (low - high > maxMasked)
+      maxMasked = low - high;
+    scaleWaitCycles(low, scaleHalfCycles);
+  }
+  uint32_t frameCycles = ESP.getCycleCount() - frameStart;
+
+  scaleReadStats.reads++;
+  scaleReadStats.totalCycles += frameCycles;
+  if (frameCycles > scaleReadStats.maxCycles)
+    scaleReadStats.maxCycles = frameCycles;
+  if (maxMasked > scaleReadStats.maxMaskedCycles)
+    scaleReadStats.maxMaskedCycles = maxMasked;
+  if (frameCycles > SCALE_READ_MAX_US * ESP.getCpuFreqMHz())
+  {
+    scaleReadStats.late++;
+    return -1;
+  }
+
+  if (reading & 0x800000)
+  {
+    reading |= 0xFF000000;
+  }
+  if (reading == 0x7FFFFF)
+  {
+    pcfApply();
+    return -1;
+  }
+
+  return reading;
+}
+
+// --- PCF8574 Helper Functions ---
+
+void halScaleSetGain(uint8_t gain)
+{
+  if (gain == 128)
+  {
+    bitSet(pcfState, PCF_GAIN1_BIT);
+    bitSet(pcfState, PCF_GAIN0_BIT);
+  }
+  else
+  {
+    bitClear(pcfState, PCF_GAIN1_BIT);
+    bitClear(pcfState, PCF_GAIN0_BIT);
+  }
+}
+void halScaleSetSpeed(bool highSpeed)
+{
+  if (highSpeed)
+    bitSet(pcfState, PCF_SPEED_BIT);
+  else
+    bitClear(pcfState, PCF_SPEED_BIT);
+}
+void halScalePowerDown(bool powerDown)
+{
+  if (powerDown)
+    bitClear(pcfState, PCF_PDWN_BIT);
+  else
+    bitSet(pcfState, PCF_PDWN_BIT);
+}
+void halScaleSelectChannel(uint8_t channel)
+{
+  pcfLock();
+  scaleChannel = channel;
+  pcfUnlock();
+}
+#endif
+
+// =================================================================
+// --- PUMP TRIAC DIMMER ---
+// =================================================================
+void halDimmerBegin()
+{
+  pinMode(ZERO_CROSS_PIN, INPUT);
+  pinMode(PUMP_TRIAC_PIN, OUTPUT);
+
+#ifdef HAS_PRESSURE_GAUGE
+  DimmableLight::setSyncPin(ZERO_CROSS_PIN);
+  DimmableLight::setSyncPullup(false);
+  DimmableLight::setSyncDir(RISING);
+  DimmableLight::begin();
+#else
+  pinMode(PUMP_TRIAC_PIN, OUTPUT);
+  digitalWrite(PUMP_TRIAC_PIN, HIGH);
+#endif
+}
+
+void halDimmerSet(uint8_t brightness)
+{
+  if (traceContext())
+    traceEncoder.value(TRACE_DIMMER, brightness);
+#ifdef HAS_PRESSURE_GAUGE
+  pumpDimmer.setBrightness(brightness);
+#endif
+}
+
+// =================================================================
+// --- INPUT TRACE ---
+// =================================================================
+void halTraceBegin()
+{
+  Preferences prefs;
+  prefs.begin(TRACE_NAMESPACE, false);
+  bool armed = prefs.getBool("armed", false);
+  if (armed)
+  {
+    prefs.remove("armed"); // one boot per arm, a crash loop must not keep recording
+  }
+  prefs.end();
+  if (!armed)
+  {
+    return;
+  }
+
+  traceBufferSize = TRACE_BUFFER_SIZE;
+  traceBuffer = (uint8_t *)heap_caps_malloc(traceBufferSize, MALLOC_CAP_SPIRAM);
+  if (traceBuffer == nullptr)
+  {
+    traceBufferSize = TRACE_FALLBACK_BUFFER_SIZE;
+    traceBuffer = (uint8_t *)malloc(traceBufferSize);
+  }
+  if (traceBuffer == nullptr)
+  {
+    traceBufferSize = 0;
+    return;
+  }
+  traceTask = xTaskGetCurrentTaskHandle();
+  traceEncoder.begin();
+  traceRecording = true;
+}
+
+void halTraceArm()
+{
+  Preferences prefs;
+  prefs.begin(TRACE_NAMESPACE, false);
+  prefs.putBool("armed", true);
+  prefs.end();
+  ESP.restart();
+}
+
+void halTraceStop()
+{
+  traceRecording = false;
+}
+
+void halTracePrintStats(Print &out)
+{
+  out.println("--- Input Trace ---");
+  if (traceBuffer == nullptr)
+  {
+    out.println("Not recording. 'trace start' restarts and records from boot.");
+    return;
+  }
+  size_t tail = traceTail.load(std::memory_order_acquire);
+  size_t head = traceHead.load(std::memory_order_acquire);
+  out.print("State: ");
+  out.println(traceRecording ? "recording" : "stopped");
+  out.print("Recorded: ");
+  out.print(tail / 1024);
+  out.print(" KB, buffered ");
+  out.print((tail - head) / 1024);
+  out.print(" of ");
+  out.print(traceBufferSize / 1024);
+  out.println(" KB");
+  out.print("Dropped records: ");
+  out.println(traceDroppedRecords);
+  out.print("Client on port ");
+  out.print(TRACE_PORT);
+  out.println(traceClient && traceClient.connected() ? ": connected" : ": none");
+}
+
+/**
+ * @brief TraceSink for traceEncoder. Several tasks may record (settings come
+ * from the comms side), so the ring is written under a spinlock.
+ */
+void traceWrite(const uint8_t *header, size_t headerLength, const void *payload, size_t payloadLength)
+{
+  if (traceBuffer == nullptr)
+  {
+    return;
+  }
+  const uint8_t gap[2] = {TRACE_GAP, 0};
+  portENTER_CRITICAL(&traceMux);
+  size_t tail = traceTail.load(std::memory_order_relaxed);
+  size_t used = tail - traceHead.load(std::memory_order_acquire);
+  size_t needed = headerLength + payloadLength + (traceGapPending ? sizeof(gap) : 0);
+  if (used + needed > traceBufferSize)
+  {
+    traceDroppedRecords++;
+    traceGapPending = true;
+  }
+  else
+  {
+    if (traceGapPending)
+    {
+      traceCopyIn(tail, gap, sizeof(gap));
+      traceGapPending = false;
+    }
+    traceCopyIn(tail, header, headerLength);
+    traceCopyIn(tail, payload, payloadLength);
+    traceTail.store(tail, std::memory_order_release);
+  }
+  portEXIT_CRITICAL(&traceMux);
+}
+
+void traceCopyIn(size_t &tail, const void *data, size_t length)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (length > 0)
+  {
+    size_t offset = tail & (traceBufferSize - 1);
+    size_t chunk = min(length, traceBufferSize - offset);
+    memcpy(traceBuffer + offset, bytes, chunk);
+    bytes += chunk;
+    length -= chunk;
+    tail += chunk;
+  }
+}
+
+/**
+ * @brief Streams the ring to the trace client. Called from the comms task.
+ * Only the first client gets the file header, so connect once per boot.
+ */
+void handleTraceClient()
+{
+  if (traceBuffer == nullptr)
+  {
+    return;
+  }
+  if (traceServer.hasClient())
+  {
+    if (traceClient && traceClient.connected())
+    {
+      traceServer.available().stop();
+    }
+    else
+    {
+      traceClient = traceServer.available();
+    }
+  }
+  if (!traceClient || !traceClient.connected())
+  {
+    return;
+  }
+
+  size_t head = traceHead.load(std::memory_order_relaxed);
+  size_t tail = traceTail.load(std::memory_order_acquire);
+  while (head != tail)
+  {
+    size_t offset = head & (traceBufferSize - 1);
+    size_t chunk = min(min(tail - head, traceBufferSize - offset), TRACE_SEND_CHUNK);
+    size_t sent = traceClient.write(traceBuffer + offset, chunk);
+    if (sent == 0)
+    {
+      break;
+    }
+    head += sent;
+  }
+  traceHead.store(head, std::memory_order_release);
+
+  if (!traceRecording && head == tail)
+  {
+    traceClient.stop(); // the whole trace is out, let the receiver finish
+  }
+}
+
+// =================================================================
+// --- LOOP PROFILER ---
+// =================================================================
+#ifdef HAS_LOOP_PROFILER
+/**
+ * @brief Copies a finished window out under perfMux.
+ */
+template <int N>
+void rollProfiler(StageProfiler<N> &profiler, StageSummary *shared)
+{
+  StageSummary summaries[N + 1];
+  profiler.roll(summaries, ESP.getCpuFreqMHz());
+  portENTER_CRITICAL(&perfMux);
+  memcpy(shared, summaries, sizeof(summaries));
+  portEXIT_CRITICAL(&perfMux);
+}
+
+ControlStage halStageBegin(ControlStage stage)
+{
+  ControlStage previous = (ControlStage)controlProfiler.mark(stage, ESP.getCycleCount());
+  if (stage == STAGE_END && millis() - controlWindowStart >= PERF_WINDOW_MS)
+  {
+    controlWindowStart = millis();
+    rollProfiler(controlProfiler, controlSummaries);
+  }
+  return previous;
+}
+
+void commsStageBegin(CommsStage stage)
+{
+  commsProfiler.mark(stage, ESP.getCycleCount());
+  if (stage == COMMS_END && millis() - commsWindowStart >= PERF_WINDOW_MS)
+  {
+    commsWindowStart = millis();
+    rollProfiler(commsProfiler, commsSummaries);
+    publishPerfMetrics();
+  }
+}
+
+/**
+ * @brief Appends "name":[passes,min,avg,p99,max] (us) for every stage that ran.
+ */
+size_t appendPerfJson(size_t len, const char *const *names, const StageSummary *summaries, int count)
+{
+  for (int i = 0; i <= count && len < sizeof(perfJson); i++)
+  {
+    const StageSummary &summary = summaries[i];
+    if (summary.count == 0)
+      continue;
+    len += snprintf(perfJson + len, sizeof(perfJson) - len, "%s\"%s\":[%lu,%.1f,%.1f,%.1f,%.1f]",
+                    perfJson[len - 1] == '{' ? "" : ",", i < count ? names[i] : "total",
+                    (unsigned long)summary.count, summary.minUs, summary.avgUs, summary.p99Us, summary.maxUs);
+  }
+  return len;
+}
+
+/**
+ * @brief Publishes both tasks' last windows to MQTT. Runs on the comms task,
+ * outside the control loop it measures.
+ */
+void publishPerfMetrics()
+{
+  if (!isOnline || !mqttClient.connected())
+  {
+    return;
+  }
+  StageSummary control[STAGE_COUNT + 1];
+  StageSummary comms[COMMS_STAGE_COUNT + 1];
+  portENTER_CRITICAL(&perfMux);
+  memcpy(control, controlSummaries, sizeof(control));
+  memcpy(comms, commsSummaries, sizeof(comms));
+  portEXIT_CRITICAL(&perfMux);
+
+  size_t len = snprintf(perfJson, sizeof(perfJson), "{\"window_ms\":%lu,\"control\":{", (unsigned long)PERF_WINDOW_MS);
+  len = appendPerfJson(len, CONTROL_STAGE_NAMES, control, STAGE_COUNT);
+  if (len < sizeof(perfJson))
+  {
+    len += snprintf(perfJson + len, sizeof(perfJson) - len, "},\"comms\":{");
+  }
+  len = appendPerfJson(len, COMMS_STAGE_NAMES, comms, COMMS_STAGE_COUNT);
+  if (len + 3 > sizeof(perfJson))
+  {
+    halConsole().println("Error: perf metrics too large for buffer.");
+    return;
+  }
+  strcat(perfJson, "}}");
+  publishDataNow(mqtt_topic_perf, perfJson, false, false, true, false);
+}
+#endif
+
+void halPerfPrintStats(Print &out)
+{
+#ifdef HAS_LOOP_PROFILER
+  StageSummary control[STAGE_COUNT + 1];
+  StageSummary comms[COMMS_STAGE_COUNT + 1];
+  portENTER_CRITICAL(&perfMux);
+  memcpy(control, controlSummaries, sizeof(control));
+  memcpy(comms, commsSummaries, sizeof(comms));
+  portEXIT_CRITICAL(&perfMux);
+
+  out.print("--- Control Task (core ");
+  out.print(CONTROL_TASK_CORE);
+  out.print(", every ");
+  out.print(CONTROL_PERIOD_MS);
+  out.print(" ms, last ");
+  out.print(PERF_WINDOW_MS / 1000);
+  out.println(" s) ---");
+  printStageSummaries(out, CONTROL_STAGE_NAMES, control, STAGE_COUNT);
+  out.print("--- Comms Task (core ");
+  out.print(COMMS_TASK_CORE);
+  out.print(", last ");
+  out.print(PERF_WINDOW_MS / 1000);
+  out.println(" s) ---");
+  printStageSummaries(out, COMMS_STAGE_NAMES, comms, COMMS_STAGE_COUNT);
+#else
+  out.println("Built without HAS_LOOP_PROFILER.");
+#endif
+}
+
+// =================================================================
+// --- SYSTEM ---
+// =================================================================
+void halRestart()
+{
+  ESP.restart();
+}
+
+void halMacAddress(char *buffer, size_t size)
+{
+  strlcpy(buffer, WiFi.macAddress().c_str(), size);
+  if (traceContext())
+    traceEncoder.record(TRACE_MAC_ADDRESS, buffer, strlen(buffer));
+}
+
+int halWifiChannel()
+{
+  int32_t channel = WiFi.channel();
+  if (traceContext())
+    traceEncoder.value(TRACE_WIFI_CHANNEL, channel);
+  return channel;
+}
+
+int halWifiRssi()
+{
+  int32_t rssi = WiFi.RSSI();
+  if (traceContext())
+    traceEncoder.value(TRACE_WIFI_RSSI, rssi);
+  return rssi;
+}
+
+int halResetReason()
+{
+  int32_t reason = (int)esp_reset_reason();
+  if (traceContext())
+    traceEncoder.value(TRACE_RESET_REASON, reason);
+  return reason;
+}
+
+/**
+ * @brief True when called from the control task. Output produced there is
+ * queued for the comms task instead of touching the network directly.
+ */
+bool isControlTask()
+{
+  return controlTaskHandle != NULL && xTaskGetCurrentTaskHandle() == controlTaskHandle;
+}
+
+bool halIsControlContext()
+{
+  bool control = isControlTask();
+  if (traceContext())
+    traceEncoder.value(TRACE_CONTROL_CONTEXT, control);
+  return control;
+}
+
+void halStartTasks()
+{
+  xTaskCreatePinnedToCore(controlTask, "control", CONTROL_TASK_STACK_SIZE, NULL, CONTROL_TASK_PRIORITY, &controlTaskHandle, CONTROL_TASK_CORE);
+  xTaskCreatePinnedToCore(commsTask, "comms", COMMS_TASK_STACK_SIZE, NULL, COMMS_TASK_PRIORITY, &commsTaskHandle, COMMS_TASK_CORE);
+}
+
+void loop()
+{
+  // All work happens in controlTask and commsTask.
+  vTaskDelete(NULL);
+}
+
+void controlTask(void *parameter)
+{
+  // setup() recorded from the Arduino loop task, the control task takes over
+  traceTask = xTaskGetCurrentTaskHandle();
+  TickType_t lastWakeTime = xTaskGetTickCount();
+  for (;;)
+  {
+    if (traceRecording)
+      traceEncoder.record(TRACE_STEP, nullptr, 0);
+    controlStep();
+    vTaskDelayUntil(&lastWakeTime, pdMS_TO_TICKS(CONTROL_PERIOD_MS));
+  }
+}
+
+void commsTask(void *parameter)
+{
+  for (;;)
+  {
+    commsStep();
+    vTaskDelay(pdMS_TO_TICKS(COMMS_TASK_PERIOD_MS));
+  }
+}
+
+/**
+ * @brief Forwards everything the control task queued (publishes and console
+ * output) to MQTT, ESP-NOW and telnet. Called from the comms task.
+ */
+void drainOutboundQueues()
+{
+  OutboundMessage *msg;
+  while ((msg = outboundQueue.front()) != nullptr)
+  {
+    publishDataNow(msg->topic, msg->payload, msg->retained, msg->espNowSendNow, msg->sendToMqtt, msg->sendToESP);
+    outboundQueue.release();
+  }
+
+  char chunk[128];
+  size_t len = 0;
+  char c;
+  while (consoleQueue.pop(c))
+  {
+    chunk[len++] = c;
+    if (len == sizeof(chunk))
+    {
+      if (telnetClient && telnetClient.connected())
+        telnetClient.write((const uint8_t *)chunk, len);
+      len = 0;
+    }
+  }
+  if (len > 0 && telnetClient && telnetClient.connected())
+  {
+    telnetClient.write((const uint8_t *)chunk, len);
+  }
+}
+
+void commsStep()
+{
+  unsigned long nowTime = millis();
+
+  commsStageBegin(COMMS_WIFI);
+  wm.process();
+
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    if (!isOnline)
+    {
+      halConsole().println("WiFi Connected!");
+      isOnline = true;
+      startNetworkServices();
+    }
+  }
+  else
+  {
+    if (isOnline)
+    {
+      halConsole().println("WiFi Lost!");
+      isOnline = false;
+    }
+  }
+
+  commsStageBegin(COMMS_OTA);
+  if (isOnline)
+  {
+    ArduinoOTA.handle();
+  }
+
+  commsStageBegin(COMMS_OUTBOUND);
+  drainOutboundQueues();
+
+  if (pendingTelnetDisconnect)
+  {
+    pendingTelnetDisconnect = false;
+    telnetClient.stop();
+  }
+  commsStageBegin(COMMS_TELNET);
+  handleTelnet();
+  commsStageBegin(COMMS_TRACE);
+  handleTraceClient();
+
+  commsStageBegin(COMMS_DEFERRED);
+  if (pendingProfilesPublish)
+  {
+    pendingProfilesPublish = false;
+    publishProfileSync();
+  }
+  if (pendingSettingsCommit)
+  {
+    pendingSettingsCommit = false;
+    commitSettings();
+  }
+  if (pendingMqttReconnect)
+  {
+    pendingMqttReconnect = false;
+    halMqttConfigure(mqtt_server, mqtt_port, mqtt_user, mqtt_password);
+  }
+  // The control task owns what a resync publishes, so it runs there
+  if (pendingMqttConnected)
+  {
+    pendingMqttConnected = false;
+    resyncRequests |= RESYNC_MQTT;
+  }
+#ifdef HAS_SCREEN
+  commsStageBegin(COMMS_ESPNOW);
+  if (nowTime - lastEspNowSendTime > ESP_NOW_SEND_INTERVAL_MS)
+  {
+    closeEspNowFrame();
+    lastEspNowSendTime = nowTime;
+  }
+  sendNextEspNowFrame();
+  if (pendingScreenSync)
+  {
+    pendingScreenSync = false;
+    resyncRequests |= RESYNC_SCREEN;
+  }
+#endif
+  commsStageBegin(COMMS_END);
+}
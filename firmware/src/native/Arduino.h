@@ -0,0 +1,195 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+/*
+ * Minimal Arduino core for the host build (env:native).
+ *
+ * Provides just enough of the Arduino API for firmware.cpp and the local
+ * libraries (PID_v1, SimpleKalmanFilter) to compile unchanged. Timing calls
+ * are routed to the simulated clock in hal_native.cpp.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define RISING 0x01
+#define FALLING 0x02
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define IRAM_ATTR
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+
+// --- Arduino Nano ESP32 pin names (Arduino numbering) ---
+enum
+{
+  D0 = 0, D1, D2, D3, D4, D5, D6, D7, D8, D9, D10, D11, D12, D13,
+  A0 = 14, A1, A2, A3, A4, A5, A6, A7
+};
+const int NUM_DIGITAL_PINS = 22;
+
+// --- Timing (simulated clock, see hal_native.cpp) ---
+// Like the core functions on the machine, these bypass the HAL and are not
+// part of an input trace; the firmware itself uses halMillis()/halMicros().
+uint64_t simNowMicros();
+void halDelay(unsigned long ms);
+
+inline unsigned long millis() { return (unsigned long)(simNowMicros() / 1000); }
+inline unsigned long micros() { return (unsigned long)simNowMicros(); }
+inline void delay(unsigned long ms) { halDelay(ms); }
+inline void yield() {}
+
+// --- String helpers from the ESP32 core ---
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+  size_t len = strlen(src);
+  if (size > 0)
+  {
+    size_t copy = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = '\0';
+  }
+  return len;
+}
+#endif
+
+inline bool isPrintable(int c)
+{
+  return c >= 32 && c < 127;
+}
+
+inline char *dtostrf(double value, signed char width, unsigned char precision, char *buffer)
+{
+  sprintf(buffer, "%*.*f", width, precision, value);
+  return buffer;
+}
+
+inline char *itoa(int value, char *buffer, int base)
+{
+  if (base == 10)
+  {
+    sprintf(buffer, "%d", value);
+  }
+  else
+  {
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    char tmp[33];
+    unsigned int v = (unsigned int)value;
+    int i = 0;
+    do
+    {
+      tmp[i++] = digits[v % base];
+      v /= base;
+    } while (v != 0);
+    int j = 0;
+    while (i > 0)
+    {
+      buffer[j++] = tmp[--i];
+    }
+    buffer[j] = '\0';
+  }
+  return buffer;
+}
+
+// --- Print ---
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--)
+    {
+      n += write(*buffer++);
+    }
+    return n;
+  }
+  size_t write(const char *str)
+  {
+    return str == nullptr ? 0 : write((const uint8_t *)str, strlen(str));
+  }
+
+  size_t print(const char *str) { return write(str); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long long)n, base); }
+  size_t print(long n, int base = DEC) { return print((long long)n, base); }
+  size_t print(unsigned long n, int base = DEC) { return print((unsigned long long)n, base); }
+  size_t print(long long n, int base = DEC)
+  {
+    if (n < 0 && base == DEC)
+    {
+      return print('-') + print((unsigned long long)(-n), base);
+    }
+    return print((unsigned long long)n, base);
+  }
+  size_t print(unsigned long long n, int base = DEC)
+  {
+    char buf[65];
+    char *p = &buf[sizeof(buf) - 1];
+    *p = '\0';
+    if (base < 2)
+    {
+      base = DEC;
+    }
+    do
+    {
+      int digit = n % base;
+      *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+      n /= base;
+    } while (n != 0);
+    return write(p);
+  }
+  size_t print(double n, int digits = 2)
+  {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return write(buf);
+  }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T &value)
+  {
+    size_t n = print(value);
+    return n + println();
+  }
+  template <typename T>
+  size_t println(const T &value, int format)
+  {
+    size_t n = print(value, format);
+    return n + println();
+  }
+};
+
+#endif // NATIVE_ARDUINO_H
@@ -0,0 +1,2 @@
+// Pre-1.0 Arduino header name, still probed by PID_v1 when ARDUINO is unset.
+#include "Arduino.h"
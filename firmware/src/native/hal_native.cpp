@@ -0,0 +1,1192 @@
+// =================================================================
+// --- HOST HARDWARE ABSTRACTION LAYER ---
+// =================================================================
+// Implements hal.h for env:native. Time is virtual and only moves when the
+// runner (or a blocking call such as halDelay()) advances it; sensors,
+// switches and the scale are whatever the simulation sets through sim.h.
+// Everything runs in one thread, so there is no control/comms split.
+//
+// An input trace (include/input_trace.h) can be recorded from any run, or
+// replayed: the firmware's inputs then come from the trace instead of the
+// simulation, and its outputs are compared with the recorded ones.
+
+#include <map>
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdarg.h>
+#include <time.h>
+
+#include "hal.h"
+#include "input_trace.h"
+#include "sim.h"
+#include "stage_profiler.h"
+
+// =================================================================
+// --- SIMULATION STATE ---
+// =================================================================
+// Polling a sensor that has nothing new costs simulated time, so wait loops
+// in the firmware terminate the same way they do against real hardware.
+const uint32_t SIM_ADS_POLL_US = 100;
+const uint32_t SIM_SCALE_POLL_US = 1000;
+
+uint64_t simMicros = 0;
+SimPlantHook plantHook = nullptr;
+
+const int SIM_PIN_COUNT = 64;
+int pinModes[SIM_PIN_COUNT];
+int inputLevels[SIM_PIN_COUNT];
+int outputLevels[SIM_PIN_COUNT];
+
+AdsSample adsSamples[ADS_CHANNEL_COUNT];
+uint8_t adsSchedule[8];
+int adsScheduleLength = 0;
+
+const size_t SIM_SCALE_RING_SIZE = 32; // as on the ESP32
+const int SIM_SCALE_SETTLE_CONVERSIONS = 4;
+const uint32_t SIM_SCALE_SLOW_PERIOD_US = 100000;
+const uint32_t SIM_SCALE_FAST_PERIOD_US = 12500;
+std::deque<ScaleSample> scaleSamples;
+bool scaleHighSpeed = false;
+uint8_t scaleChannel = 2;        // staged, or converting while interleaving
+uint8_t scaleWrittenChannel = 2; // the input the converter is on
+uint8_t scaleDwell = 0;
+int scaleBurstCount = 0;
+uint64_t scaleSwitchSettleUs = 0;
+
+uint8_t dimmerBrightness = 255;
+
+SimPublishHook publishHook = nullptr;
+bool simOnline = false;
+uint8_t resyncRequests = 0;
+bool consoleEcho = true;
+std::deque<std::string> commandLines;
+std::deque<std::string> settingMessages;
+uint64_t settingTakenUs = 0;
+StageHistogram settingLatency;
+
+// =================================================================
+// --- INPUT TRACE ---
+// =================================================================
+// --- Recording ---
+const char *traceRecordPath = nullptr;
+FILE *traceFile = nullptr;
+size_t traceFileBytes = 0;
+int traceSuspended = 0; // > 0 while running what the machine runs on the comms side
+
+void traceFileWrite(const uint8_t *header, size_t headerLength, const void *payload, size_t payloadLength);
+TraceEncoder traceEncoder(traceFileWrite);
+
+// --- Replay ---
+std::vector<uint8_t> replayData;
+size_t replayInputPos = 0;
+size_t replayOutputPos = 0;
+bool replayActive = false;
+bool replayStopped = false;     // diverged, hit a gap or ran out mid-step
+bool replayHaveMillis = false;
+uint32_t replayFirstMillis = 0;
+TraceDecoder traceDecoder;
+SimReplayResult replayResult;
+
+void replayCompareOutput(const uint8_t *header, size_t headerLength, const void *payload, size_t payloadLength);
+TraceEncoder outputEncoder(replayCompareOutput);
+
+// =================================================================
+// --- LOOP PROFILER ---
+// =================================================================
+// Stages are timed in thread CPU time (ns), windows in simulated time.
+#ifdef HAS_LOOP_PROFILER
+StageProfiler<STAGE_COUNT> stageProfiler;
+uint64_t stageWindowStartUs = 0;
+bool stageWindowed = true;
+#endif
+StageSummary stageSummaries[STAGE_COUNT + 1];
+
+bool traceRecordingNow()
+{
+  return traceFile != nullptr && traceSuspended == 0;
+}
+
+bool replayComparing()
+{
+  return replayActive && !replayStopped;
+}
+
+void replayStop(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Takes the next input record of the trace if the firmware is being
+ * replayed and it is of the expected type.
+ */
+bool replayInput(uint8_t type, TraceRecord &record);
+
+/**
+ * @brief Input hook for a plain value: the recorded value while replaying,
+ * otherwise the live one (recorded if a trace is being written).
+ */
+template <typename T>
+T tracedValue(uint8_t type, T live)
+{
+  TraceRecord record;
+  if (replayInput(type, record))
+  {
+    return traceDecoder.value(record, live);
+  }
+  if (traceRecordingNow())
+  {
+    traceEncoder.value(type, live);
+  }
+  return live;
+}
+
+/**
+ * @brief Output hooks write to the trace or compare against it.
+ */
+TraceEncoder *outputTrace()
+{
+  if (traceRecordingNow())
+    return &traceEncoder;
+  if (replayComparing())
+    return &outputEncoder;
+  return nullptr;
+}
+
+// =================================================================
+// --- CLOCK ---
+// =================================================================
+void simSetPlantHook(SimPlantHook hook)
+{
+  plantHook = hook;
+}
+
+void simAdvanceMicros(uint32_t us)
+{
+  simMicros += us;
+  if (plantHook != nullptr)
+  {
+    plantHook(us);
+  }
+}
+
+uint64_t simNowMicros()
+{
+  return simMicros;
+}
+
+unsigned long halMillis()
+{
+  uint32_t now = (uint32_t)(simMicros / 1000);
+  TraceRecord record;
+  if (replayInput(TRACE_MILLIS, record))
+  {
+    now = traceDecoder.millis(record);
+    if (!replayHaveMillis)
+    {
+      replayFirstMillis = now;
+      replayHaveMillis = true;
+    }
+    replayResult.recordedMs = now - replayFirstMillis;
+    // Keeps the untraced clock (Arduino millis(), stats) in step
+    simMicros = (uint64_t)now * 1000;
+  }
+  else if (traceRecordingNow())
+  {
+    traceEncoder.millis(now);
+  }
+  return now;
+}
+
+unsigned long halMicros()
+{
+  uint32_t now = (uint32_t)simMicros;
+  TraceRecord record;
+  if (replayInput(TRACE_MICROS, record))
+  {
+    now = traceDecoder.micros(record);
+  }
+  else if (traceRecordingNow())
+  {
+    traceEncoder.micros(now);
+  }
+  return now;
+}
+
+void halDelay(unsigned long ms)
+{
+  simAdvanceMicros(ms * 1000);
+}
+
+// =================================================================
+// --- GPIO ---
+// =================================================================
+void halPinMode(int pin, int mode)
+{
+  if (pin >= 0 && pin < SIM_PIN_COUNT)
+  {
+    pinModes[pin] = mode;
+  }
+}
+
+int halDigitalRead(int pin)
+{
+  int level = LOW;
+  if (pin >= 0 && pin < SIM_PIN_COUNT)
+  {
+    // Like the ESP32, reading an output returns the level being driven
+    level = pinModes[pin] == OUTPUT ? outputLevels[pin] : inputLevels[pin];
+  }
+  TraceRecord record;
+  if (replayInput(TRACE_DIGITAL_READ, record))
+  {
+    if (record.length < 2 || record.payload[0] != (uint8_t)pin)
+    {
+      replayStop("read pin %d, recorded pin %d", pin, record.length > 0 ? record.payload[0] : -1);
+      return level;
+    }
+    return record.payload[1];
+  }
+  if (traceRecordingNow())
+  {
+    traceEncoder.digitalRead(pin, level);
+  }
+  return level;
+}
+
+void halDigitalWrite(int pin, int level)
+{
+  TraceEncoder *trace = outputTrace();
+  if (trace != nullptr)
+  {
+    trace->digitalWrite(pin, level);
+  }
+  if (pin >= 0 && pin < SIM_PIN_COUNT)
+  {
+    outputLevels[pin] = level ? HIGH : LOW;
+  }
+}
+
+void simSetInput(int pin, int level)
+{
+  if (pin >= 0 && pin < SIM_PIN_COUNT)
+  {
+    inputLevels[pin] = level ? HIGH : LOW;
+  }
+}
+
+int simGetOutput(int pin)
+{
+  if (pin < 0 || pin >= SIM_PIN_COUNT)
+  {
+    return LOW;
+  }
+  return outputLevels[pin];
+}
+
+// =================================================================
+// --- ADS1115 ---
+// =================================================================
+bool halAdsBegin(const uint8_t *schedule, int scheduleLength)
+{
+  adsScheduleLength = min(scheduleLength, (int)sizeof(adsSchedule));
+  memcpy(adsSchedule, schedule, adsScheduleLength);
+  return tracedValue(TRACE_ADS_BEGIN, true);
+}
+
+bool halAdsGetSample(int channel, AdsSample &sample)
+{
+  TraceRecord record;
+  if (replayInput(TRACE_ADS_SAMPLE, record))
+  {
+    return traceDecoder.adsSample(record, sample);
+  }
+  bool ok = false;
+  memset(&sample, 0, sizeof(sample));
+  if (channel >= 0 && channel < ADS_CHANNEL_COUNT)
+  {
+    sample = adsSamples[channel];
+    ok = sample.seq != 0;
+  }
+  if (traceRecordingNow())
+  {
+    traceEncoder.adsSample(channel, ok, sample);
+  }
+  return ok;
+}
+
+int16_t halAdsRead(int channel)
+{
+  int16_t raw = 0;
+  if (channel >= 0 && channel < ADS_CHANNEL_COUNT)
+  {
+    simAdvanceMicros(SIM_ADS_POLL_US);
+    raw = adsSamples[channel].raw;
+  }
+  return tracedValue(TRACE_ADS_READ, raw);
+}
+
+bool halAdsWaitForSamples(unsigned long timeoutMs)
+{
+  bool ready = true;
+  for (int i = 0; i < adsScheduleLength; i++)
+  {
+    if (adsSamples[adsSchedule[i]].seq == 0)
+    {
+      ready = false;
+    }
+  }
+  return tracedValue(TRACE_ADS_WAIT, ready);
+}
+
+void halAdsPrintStats(Print &out)
+{
+  out.println("--- ADS1115 Acquisition ---");
+  out.println("Mode: simulated");
+  for (int i = 0; i < ADS_CHANNEL_COUNT; i++)
+  {
+    out.print("  CH");
+    out.print(i);
+    out.print(": samples ");
+    out.print(adsSamples[i].seq);
+    out.print(", last ");
+    out.println(adsSamples[i].raw);
+  }
+}
+
+void simSetAdsRaw(int channel, int16_t raw)
+{
+  if (channel < 0 || channel >= ADS_CHANNEL_COUNT)
+  {
+    return;
+  }
+  adsSamples[channel].raw = raw;
+  adsSamples[channel].timestampUs = (uint32_t)simMicros;
+  adsSamples[channel].seq++;
+}
+
+// =================================================================
+// --- ADS1232 SCALE ---
+// =================================================================
+bool halScaleBegin()
+{
+  return tracedValue(TRACE_SCALE_BEGIN, true);
+}
+
+bool halScaleTakeSample(ScaleSample &sample)
+{
+  TraceRecord record;
+  if (replayInput(TRACE_SCALE_SAMPLE, record))
+  {
+    return traceDecoder.scaleSample(record, sample);
+  }
+  bool ok = !scaleSamples.empty();
+  if (ok)
+  {
+    sample = scaleSamples.front();
+    scaleSamples.pop_front();
+  }
+  if (traceRecordingNow())
+  {
+    traceEncoder.scaleSample(ok, sample);
+  }
+  return ok;
+}
+
+bool halScaleIsReady()
+{
+  if (scaleSamples.empty())
+  {
+    simAdvanceMicros(SIM_SCALE_POLL_US);
+  }
+  return tracedValue(TRACE_SCALE_IS_READY, !scaleSamples.empty());
+}
+
+void halScaleSetInterruptEnabled(bool enabled) {}
+void halScaleSetGain(uint8_t gain) {}
+void halScalePowerDown(bool powerDown) {}
+void halScaleSelectChannel(uint8_t channel)
+{
+  scaleChannel = channel;
+}
+
+void halScaleSetDwell(uint8_t dwell)
+{
+  scaleDwell = dwell;
+  scaleBurstCount = 0;
+}
+
+/**
+ * @brief Moves the converter to the staged input; like the ADS1232, it then
+ * needs a few conversions before its output is valid.
+ */
+void scaleWriteChannel()
+{
+  if (scaleChannel == scaleWrittenChannel)
+    return;
+  scaleWrittenChannel = scaleChannel;
+  uint32_t period = scaleHighSpeed ? SIM_SCALE_FAST_PERIOD_US : SIM_SCALE_SLOW_PERIOD_US;
+  scaleSwitchSettleUs = simMicros + SIM_SCALE_SETTLE_CONVERSIONS * period;
+}
+
+void halScaleSetSpeed(bool highSpeed)
+{
+  scaleHighSpeed = highSpeed;
+}
+
+bool halScaleApplyConfig()
+{
+  scaleWriteChannel();
+  return tracedValue(TRACE_SCALE_APPLY, true);
+}
+
+bool simScaleHighSpeed()
+{
+  return scaleHighSpeed;
+}
+
+void simPushScaleReading(long input1, long input2)
+{
+  if (simMicros < scaleSwitchSettleUs)
+  {
+    return;
+  }
+  ScaleSample sample;
+  sample.raw = (int32_t)(scaleWrittenChannel == 1 ? input1 : input2);
+  sample.timestampUs = (uint32_t)simMicros;
+  sample.channel = scaleWrittenChannel;
+  if (scaleSamples.size() < SIM_SCALE_RING_SIZE)
+  {
+    scaleSamples.push_back(sample);
+  }
+  if (scaleDwell > 0 && ++scaleBurstCount >= scaleDwell)
+  {
+    scaleChannel = scaleWrittenChannel == 1 ? 2 : 1;
+    scaleBurstCount = 0;
+    scaleWriteChannel();
+  }
+}
+
+// =================================================================
+// --- PUMP TRIAC DIMMER ---
+// =================================================================
+void halDimmerBegin()
+{
+  dimmerBrightness = 255;
+}
+
+void halDimmerSet(uint8_t brightness)
+{
+  TraceEncoder *trace = outputTrace();
+  if (trace != nullptr)
+  {
+    trace->value(TRACE_DIMMER, brightness);
+  }
+  dimmerBrightness = brightness;
+}
+
+uint8_t simGetDimmerBrightness()
+{
+  return dimmerBrightness;
+}
+
+// =================================================================
+// --- PERSISTENT STORAGE ---
+// =================================================================
+/**
+ * @brief In-memory key/value store. Every run starts from defaults. Results
+ * go through the trace like on the machine (sizes as 32-bit values).
+ */
+class MemoryStorage : public HalStorage
+{
+public:
+  bool begin(const char *name, bool readOnly) override
+  {
+    current = &namespaces[name];
+    return traced(true);
+  }
+  void end() override { current = nullptr; }
+  bool clear() override
+  {
+    bool ok = current != nullptr;
+    if (ok)
+      current->clear();
+    return traced(ok);
+  }
+  bool isKey(const char *key) override { return traced(current != nullptr && current->count(key) > 0); }
+  bool remove(const char *key) override { return traced(current != nullptr && current->erase(key) > 0); }
+
+  size_t putBool(const char *key, bool value) override { return tracedSize(put(key, &value, sizeof(value))); }
+  size_t putInt(const char *key, int32_t value) override { return tracedSize(put(key, &value, sizeof(value))); }
+  size_t putLong(const char *key, int32_t value) override { return tracedSize(put(key, &value, sizeof(value))); }
+  size_t putFloat(const char *key, float value) override { return tracedSize(put(key, &value, sizeof(value))); }
+  size_t putDouble(const char *key, double value) override { return tracedSize(put(key, &value, sizeof(value))); }
+  size_t putString(const char *key, const char *value) override { return tracedSize(put(key, value, strlen(value) + 1)); }
+  size_t putBytes(const char *key, const void *value, size_t len) override { return tracedSize(put(key, value, len)); }
+
+  bool getBool(const char *key, bool defaultValue) override { return traced(get(key, defaultValue)); }
+  int32_t getInt(const char *key, int32_t defaultValue) override { return traced(get(key, defaultValue)); }
+  int32_t getLong(const char *key, int32_t defaultValue) override { return traced(get(key, defaultValue)); }
+  float getFloat(const char *key, float defaultValue) override { return traced(get(key, defaultValue)); }
+  double getDouble(const char *key, double defaultValue) override { return traced(get(key, defaultValue)); }
+  size_t getString(const char *key, char *value, size_t maxLen) override
+  {
+    return tracedSize(copyOut(key, value, maxLen), value, maxLen);
+  }
+  size_t getBytesLength(const char *key) override
+  {
+    const std::vector<uint8_t> *entry = find(key);
+    return tracedSize(entry == nullptr ? 0 : entry->size());
+  }
+  size_t getBytes(const char *key, void *buf, size_t maxLen) override
+  {
+    return tracedSize(copyOut(key, buf, maxLen), buf, maxLen);
+  }
+
+  void eraseAll() { namespaces.clear(); }
+
+private:
+  typedef std::map<std::string, std::vector<uint8_t>> Namespace;
+  std::map<std::string, Namespace> namespaces;
+  Namespace *current = nullptr;
+
+  size_t put(const char *key, const void *value, size_t len)
+  {
+    if (current == nullptr)
+      return 0;
+    const uint8_t *bytes = (const uint8_t *)value;
+    (*current)[key].assign(bytes, bytes + len);
+    return len;
+  }
+
+  const std::vector<uint8_t> *find(const char *key) const
+  {
+    if (current == nullptr)
+      return nullptr;
+    Namespace::const_iterator it = current->find(key);
+    return it == current->end() ? nullptr : &it->second;
+  }
+
+  size_t copyOut(const char *key, void *buf, size_t maxLen) const
+  {
+    const std::vector<uint8_t> *entry = find(key);
+    if (entry == nullptr || entry->size() > maxLen)
+      return 0;
+    memcpy(buf, entry->data(), entry->size());
+    return entry->size();
+  }
+
+  template <typename T>
+  T traced(T result)
+  {
+    TraceRecord record;
+    if (replayInput(TRACE_STORAGE, record))
+      return traceDecoder.value(record, result);
+    if (traceRecordingNow())
+      traceEncoder.storage(&result, sizeof(result));
+    return result;
+  }
+
+  /**
+   * @brief Like traced() for a size, plus the bytes copied into data.
+   */
+  size_t tracedSize(size_t result, void *data = nullptr, size_t maxLen = 0)
+  {
+    TraceRecord record;
+    if (replayInput(TRACE_STORAGE, record))
+    {
+      uint32_t size = traceDecoder.value(record, (uint32_t)0);
+      if (data != nullptr && record.length > sizeof(size))
+        memcpy(data, record.payload + sizeof(size), min((size_t)record.length - sizeof(size), maxLen));
+      return size;
+    }
+    if (traceRecordingNow())
+    {
+      uint32_t size = result;
+      traceEncoder.storage(&size, sizeof(size), data, result);
+    }
+    return result;
+  }
+
+  template <typename T>
+  T get(const char *key, T defaultValue) const
+  {
+    const std::vector<uint8_t> *entry = find(key);
+    if (entry == nullptr || entry->size() != sizeof(T))
+      return defaultValue;
+    T value;
+    memcpy(&value, entry->data(), sizeof(T));
+    return value;
+  }
+};
+
+MemoryStorage memoryStorage;
+
+HalStorage &halStorage()
+{
+  return memoryStorage;
+}
+
+void halEraseAllStorage()
+{
+  memoryStorage.eraseAll();
+}
+
+// =================================================================
+// --- MESSAGE TRANSPORTS ---
+// =================================================================
+class StdoutPrint : public Print
+{
+public:
+  size_t write(uint8_t c) override
+  {
+    if (consoleEcho && c != '\r')
+    {
+      putchar(c);
+    }
+    return 1;
+  }
+};
+StdoutPrint stdoutPrint;
+
+bool halNetworkBegin(const char *mqttServer, int mqttPort, const char *mqttUser, const char *mqttPassword)
+{
+  halConsole().println(simOnline ? "Native build: network simulated as online." : "Native build: network simulated as offline.");
+  if (simOnline)
+    resyncRequests |= RESYNC_MQTT; // the broker accepts at once
+  return tracedValue(TRACE_NETWORK_BEGIN, simOnline);
+}
+
+void halMqttConfigure(const char *mqttServer, int mqttPort, const char *mqttUser, const char *mqttPassword) {}
+
+bool halIsOnline()
+{
+  return tracedValue(TRACE_ONLINE, simOnline);
+}
+
+bool halMqttConnected()
+{
+  return tracedValue(TRACE_MQTT_CONNECTED, simOnline);
+}
+
+void halPublish(const char *topic, const char *payload, bool retained, bool espNowSendNow, bool sendToMqtt, bool sendToESP)
+{
+  TraceEncoder *trace = outputTrace();
+  if (trace != nullptr)
+  {
+    trace->publish(topic, payload, retained, espNowSendNow, sendToMqtt, sendToESP);
+  }
+  if (publishHook != nullptr)
+  {
+    publishHook(topic, payload);
+  }
+}
+
+uint32_t halPublishDropCount()
+{
+  return tracedValue(TRACE_PUBLISH_DROPS, (uint32_t)0);
+}
+
+int halEspNowBroadcast(const char *payload)
+{
+  return tracedValue(TRACE_ESPNOW_SEND, (int32_t)0);
+}
+
+Print &halConsole()
+{
+  return stdoutPrint;
+}
+
+bool halReadCommand(char *line, size_t size)
+{
+  TraceRecord record;
+  if (replayInput(TRACE_COMMAND, record))
+  {
+    if (record.length == 0)
+    {
+      return false;
+    }
+    size_t length = min((size_t)record.length - 1, size - 1);
+    memcpy(line, record.payload + 1, length);
+    line[length] = '\0';
+    return true;
+  }
+
+  bool available = !commandLines.empty();
+  if (available)
+  {
+    strlcpy(line, commandLines.front().c_str(), size);
+    commandLines.pop_front();
+  }
+  if (traceRecordingNow())
+  {
+    traceEncoder.command(available, line);
+  }
+  return available;
+}
+
+bool halReadSetting(char *message, size_t size)
+{
+  TraceRecord record;
+  if (replayInput(TRACE_SETTING, record))
+  {
+    if (record.length == 0)
+    {
+      return false;
+    }
+    size_t length = min((size_t)record.length, size - 1);
+    memcpy(message, record.payload, length);
+    message[length] = '\0';
+    replayResult.settings++;
+    return true;
+  }
+
+  bool available = !settingMessages.empty();
+  if (available)
+  {
+    strlcpy(message, settingMessages.front().c_str(), size);
+    settingMessages.pop_front();
+    settingTakenUs = simMicros;
+  }
+  if (traceRecordingNow())
+  {
+    traceEncoder.record(TRACE_SETTING, available ? message : nullptr, available ? strlen(message) : 0);
+  }
+  return available;
+}
+
+void halSettingApplied()
+{
+  settingLatency.add((uint32_t)(simMicros - settingTakenUs));
+}
+
+void halQueuePrintStats(Print &out)
+{
+  out.println("--- Queues ---");
+  out.print("Settings in: ");
+  out.print((unsigned long)settingLatency.count);
+  out.println(" applied (simulated, no latency)");
+}
+
+void simQueueSetting(const char *message)
+{
+  if (message[0] != '\0')
+  {
+    settingMessages.push_back(message);
+  }
+}
+
+void halCloseConsole() {}
+
+uint8_t halTakeResyncRequest()
+{
+  uint8_t requests = resyncRequests;
+  resyncRequests = 0;
+  return tracedValue(TRACE_RESYNC, requests);
+}
+
+void halRequestProfilesSync()
+{
+  // The machine publishes these from the comms side, so they are not traced
+  if (replayActive)
+  {
+    discardProfileSync();
+    return;
+  }
+  traceSuspended++;
+  publishProfileSync();
+  traceSuspended--;
+}
+
+void halRequestSettingsCommit()
+{
+  // The machine commits from the comms side, so it is not traced
+  if (replayActive)
+  {
+    discardSettingsCommit();
+    return;
+  }
+  traceSuspended++;
+  commitSettings();
+  traceSuspended--;
+}
+
+void simSetPublishHook(SimPublishHook hook)
+{
+  publishHook = hook;
+}
+
+void simSetOnline(bool online)
+{
+  simOnline = online;
+}
+
+void simQueueCommand(const char *line)
+{
+  commandLines.push_back(line);
+}
+
+void simSetConsoleEcho(bool echo)
+{
+  consoleEcho = echo;
+}
+
+// =================================================================
+// --- SYSTEM ---
+// =================================================================
+bool halIsControlContext()
+{
+  return tracedValue(TRACE_CONTROL_CONTEXT, false);
+}
+
+void halStartTasks() {}
+
+void halRestart()
+{
+  halConsole().println("Native build: restart requested, exiting.");
+  exit(0);
+}
+
+void halMacAddress(char *buffer, size_t size)
+{
+  TraceRecord record;
+  if (replayInput(TRACE_MAC_ADDRESS, record))
+  {
+    size_t length = min((size_t)record.length, size - 1);
+    memcpy(buffer, record.payload, length);
+    buffer[length] = '\0';
+    return;
+  }
+  strlcpy(buffer, "00:00:00:00:00:00", size);
+  if (traceRecordingNow())
+  {
+    traceEncoder.record(TRACE_MAC_ADDRESS, buffer, strlen(buffer));
+  }
+}
+
+int halWifiChannel()
+{
+  return tracedValue(TRACE_WIFI_CHANNEL, (int32_t)0);
+}
+
+int halWifiRssi()
+{
+  return tracedValue(TRACE_WIFI_RSSI, (int32_t)0);
+}
+
+int halResetReason()
+{
+  return tracedValue(TRACE_RESET_REASON, (int32_t)0);
+}
+
+// =================================================================
+// --- INPUT TRACE: RECORDING ---
+// =================================================================
+void simTraceRecord(const char *path)
+{
+  traceRecordPath = path;
+}
+
+void halTraceBegin()
+{
+  if (traceRecordPath == nullptr || replayActive)
+  {
+    return;
+  }
+  traceFile = fopen(traceRecordPath, "wb");
+  if (traceFile == nullptr)
+  {
+    fprintf(stderr, "Cannot open %s\n", traceRecordPath);
+    return;
+  }
+  traceFileBytes = 0;
+  traceEncoder.begin();
+}
+
+void halTraceArm()
+{
+  halConsole().println("Native build: record with --record FILE.");
+}
+
+void halTraceStop()
+{
+  if (traceFile != nullptr)
+  {
+    fclose(traceFile);
+    traceFile = nullptr;
+  }
+}
+
+void halTracePrintStats(Print &out)
+{
+  out.println("--- Input Trace ---");
+  if (replayActive)
+  {
+    out.println("State: replaying");
+    return;
+  }
+  out.print("State: ");
+  out.println(traceFile != nullptr ? "recording" : "off");
+  out.print("Recorded: ");
+  out.print((unsigned long)(traceFileBytes / 1024));
+  out.println(" KB");
+}
+
+void simTraceStep()
+{
+  if (traceRecordingNow())
+  {
+    traceEncoder.record(TRACE_STEP, nullptr, 0);
+  }
+}
+
+void traceFileWrite(const uint8_t *header, size_t headerLength, const void *payload, size_t payloadLength)
+{
+  fwrite(header, 1, headerLength, traceFile);
+  if (payloadLength > 0)
+  {
+    fwrite(payload, 1, payloadLength, traceFile);
+  }
+  traceFileBytes += headerLength + payloadLength;
+}
+
+// =================================================================
+// --- INPUT TRACE: REPLAY ---
+// =================================================================
+bool simReplayOpen(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    replayData.insert(replayData.end(), chunk, chunk + n);
+  }
+  fclose(file);
+
+  if (replayData.size() < TRACE_FILE_HEADER_SIZE || memcmp(replayData.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+  {
+    fprintf(stderr, "%s is not an input trace\n", path);
+    return false;
+  }
+  if (replayData[sizeof(TRACE_MAGIC)] != TRACE_VERSION)
+  {
+    fprintf(stderr, "%s has trace version %d, expected %d\n", path, replayData[sizeof(TRACE_MAGIC)], TRACE_VERSION);
+    return false;
+  }
+  memset(&replayResult, 0, sizeof(replayResult));
+  replayResult.traceBytes = replayData.size();
+  replayInputPos = TRACE_FILE_HEADER_SIZE;
+  replayOutputPos = TRACE_FILE_HEADER_SIZE;
+  replayActive = true;
+  return true;
+}
+
+void replayStop(const char *format, ...)
+{
+  if (replayStopped)
+  {
+    return;
+  }
+  replayStopped = true;
+  replayResult.diverged = true;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(replayResult.divergence, sizeof(replayResult.divergence), format, args);
+  va_end(args);
+}
+
+bool replayInput(uint8_t type, TraceRecord &record)
+{
+  if (!replayActive || replayStopped)
+  {
+    return false;
+  }
+  for (;;)
+  {
+    size_t pos = replayInputPos;
+    TraceRecord next;
+    if (!traceReadRecord(replayData.data(), replayData.size(), pos, next))
+    {
+      // The end of the trace, or a record cut short when the recorder stopped
+      replayStopped = true;
+      return false;
+    }
+    if (next.type >= TRACE_OUTPUT)
+    {
+      replayInputPos = pos;
+      continue;
+    }
+    if (next.type == TRACE_GAP)
+    {
+      replayStopped = true;
+      replayResult.gap = true;
+      return false;
+    }
+    if (next.type != type)
+    {
+      replayStop("firmware read input type %d, trace has type %d", type, next.type);
+      return false;
+    }
+    replayInputPos = pos;
+    replayResult.inputs++;
+    record = next;
+    return true;
+  }
+}
+
+bool simReplayNextStep()
+{
+  if (replayStopped)
+  {
+    return false;
+  }
+  // Any input left before the step record means the firmware read fewer
+  // inputs in the last step than the machine did, which replayInput() reports
+  TraceRecord record;
+  if (!replayInput(TRACE_STEP, record))
+  {
+    return false;
+  }
+  replayResult.steps++;
+  return true;
+}
+
+void describeOutput(uint8_t type, const uint8_t *payload, size_t length, char *text, size_t size)
+{
+  if (type == TRACE_DIGITAL_WRITE && length >= 2)
+    snprintf(text, size, "pin %d %s", payload[0], payload[1] ? "HIGH" : "LOW");
+  else if (type == TRACE_DIMMER && length >= 1)
+    snprintf(text, size, "dimmer %d", payload[0]);
+  else if (type == TRACE_PUBLISH && length >= 5)
+  {
+    uint32_t crc;
+    memcpy(&crc, payload, 4);
+    snprintf(text, size, "publish %.*s (crc %08x)", (int)(length - 5), (const char *)payload + 5, crc);
+  }
+  else
+    snprintf(text, size, "record type %d", type);
+}
+
+void noteOutputDiff(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void noteOutputDiff(const char *format, ...)
+{
+  if (replayResult.diffCount < SIM_REPLAY_MAX_DIFFS)
+  {
+    char *line = replayResult.diffs[replayResult.diffCount];
+    int used = snprintf(line, sizeof(replayResult.diffs[0]), "step %lu: ", replayResult.steps);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line + used, sizeof(replayResult.diffs[0]) - used, format, args);
+    va_end(args);
+  }
+  replayResult.diffCount++;
+}
+
+/**
+ * @brief TraceSink for outputEncoder: compares an output of the replayed
+ * firmware with the next recorded output.
+ */
+void replayCompareOutput(const uint8_t *header, size_t headerLength, const void *payload, size_t payloadLength)
+{
+  char replayed[96];
+  describeOutput(header[0], (const uint8_t *)payload, payloadLength, replayed, sizeof(replayed));
+  TraceRecord record;
+  while (traceReadRecord(replayData.data(), replayData.size(), replayOutputPos, record))
+  {
+    if (record.type < TRACE_OUTPUT)
+    {
+      continue;
+    }
+    if (record.type == header[0] && record.length == payloadLength &&
+        memcmp(record.payload, payload, payloadLength) == 0)
+    {
+      replayResult.outputsMatched++;
+      return;
+    }
+    char recorded[96];
+    describeOutput(record.type, record.payload, record.length, recorded, sizeof(recorded));
+    replayResult.outputsDiffering++;
+    noteOutputDiff("recorded %s, replayed %s", recorded, replayed);
+    return;
+  }
+  replayResult.outputsExtra++;
+  noteOutputDiff("replayed %s past the end of the trace", replayed);
+}
+
+const SimReplayResult &simReplayFinish()
+{
+  // Outputs recorded up to where the inputs stopped that never came out
+  TraceRecord record;
+  while (replayOutputPos < replayInputPos &&
+         traceReadRecord(replayData.data(), replayData.size(), replayOutputPos, record))
+  {
+    if (record.type >= TRACE_OUTPUT)
+    {
+      replayResult.outputsMissing++;
+    }
+  }
+  replayActive = false;
+  return replayResult;
+}
+
+// =================================================================
+// --- LOOP PROFILER ---
+// =================================================================
+#ifdef HAS_LOOP_PROFILER
+uint32_t cpuNowNs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (uint32_t)((uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+
+ControlStage halStageBegin(ControlStage stage)
+{
+  ControlStage previous = (ControlStage)stageProfiler.mark(stage, cpuNowNs());
+  if (stage == STAGE_END && stageWindowed && simMicros - stageWindowStartUs >= PERF_WINDOW_MS * 1000ull)
+  {
+    stageProfiler.roll(stageSummaries, 1000.0f);
+    stageWindowStartUs = simMicros;
+  }
+  return previous;
+}
+
+void simProfileWholeRun()
+{
+  stageWindowed = false;
+  stageProfiler.reset();
+}
+
+const StageSummary *simStageSummaries()
+{
+  if (!stageWindowed)
+  {
+    stageProfiler.roll(stageSummaries, 1000.0f);
+  }
+  return stageSummaries;
+}
+#else
+void simProfileWholeRun() {}
+
+const StageSummary *simStageSummaries()
+{
+  return stageSummaries;
+}
+#endif
+
+void halPerfPrintStats(Print &out)
+{
+#ifdef HAS_LOOP_PROFILER
+  out.print("--- Control Loop (CPU time, last ");
+  out.print(PERF_WINDOW_MS / 1000);
+  out.println(" s simulated) ---");
+  printStageSummaries(out, CONTROL_STAGE_NAMES, stageSummaries, STAGE_COUNT);
+#else
+  out.println("Built without HAS_LOOP_PROFILER.");
+#endif
+}
@@ -0,0 +1,103 @@
+// =================================================================
+// --- HYDRAULIC DIGITAL TWIN ---
+// =================================================================
+// See hydraulic_twin.h for the model.
+
+#include <Arduino.h>
+
+#include "hydraulic_twin.h"
+
+// The stiffest path (OPV against the line compliance) has a time constant of
+// about 0.1 s, so 1 ms steps keep explicit Euler well inside its stable range.
+const double HYD_MAX_STEP_S = 0.001;
+
+void HydraulicTwin::newShot(double grind)
+{
+  grindScale = grind;
+  headspaceMl = 0;
+  puckMl = 0;
+  cupG = 0;
+  cupFlowGps = 0;
+}
+
+double HydraulicTwin::puckResistance() const
+{
+  double swell = 0.6 + 0.4 * (1.0 - exp(-puckMl / HYD_PUCK_SWELL_ML));
+  double erosion = 1.0 / (1.0 + puckMl / HYD_PUCK_EROSION_ML);
+  return HYD_PUCK_BAR_S_PER_ML * grindScale * swell * erosion;
+}
+
+/**
+ * @brief Pump delivery (ml/s) against a pressure for a triac brightness.
+ */
+double HydraulicTwin::pumpCurve(uint8_t dimmer, double bar) const
+{
+  // Leading-edge phase cut at angle a keeps (1 - a/pi + sin(2a)/2pi) of the power
+  double angle = M_PI * (1.0 - dimmer / 255.0);
+  double powerFraction = 1.0 - angle / M_PI + sin(2.0 * angle) / (2.0 * M_PI);
+  double voltage = sqrt(max(0.0, powerFraction));
+  if (voltage < HYD_PUMP_STALL_VOLTAGE)
+  {
+    return 0.0;
+  }
+  double flow = HYD_PUMP_MAX_FLOW_MLPS * voltage * (1.0 - bar / (HYD_PUMP_MAX_BAR * voltage));
+  return max(0.0, flow); // the pump's check valve stops back flow
+}
+
+void HydraulicTwin::step(const HydraulicInputs &in, double dtS)
+{
+  while (dtS > 0)
+  {
+    double h = min(dtS, HYD_MAX_STEP_S);
+    integrate(in, h);
+    dtS -= h;
+  }
+}
+
+void HydraulicTwin::integrate(const HydraulicInputs &in, double dtS)
+{
+  pumpingToBoiler = in.pumpOn && in.fillValveOpen;
+  if (pumpingToBoiler)
+  {
+    // Refill: the brew path is isolated and vents down
+    pumpFlowMlps = pumpCurve(in.dimmer, HYD_BOILER_BAR);
+    pressureBar -= pressureBar * dtS / HYD_VENT_TAU_S;
+    cupFlowGps = 0;
+    return;
+  }
+
+  pumpFlowMlps = in.pumpOn ? pumpCurve(in.dimmer, pressureBar) : 0.0;
+  cupFlowGps = 0;
+
+  if (!in.leverLifted)
+  {
+    // Flushing through the bare group, or vented through the three-way valve
+    double outFlow = pressureBar / HYD_FLUSH_BAR_S_PER_ML;
+    pressureBar += (pumpFlowMlps - outFlow) / HYD_LINE_ML_PER_BAR * dtS;
+    if (!in.pumpOn)
+    {
+      pressureBar -= pressureBar * dtS / HYD_VENT_TAU_S;
+    }
+    pressureBar = max(0.0, pressureBar);
+    return;
+  }
+
+  if (headspaceMl < HYD_HEADSPACE_ML)
+  {
+    headspaceMl += pumpFlowMlps * dtS;
+    pressureBar = 0;
+    return;
+  }
+
+  double puckFlow = pressureBar / puckResistance();
+  double opvFlow = max(0.0, pressureBar - HYD_OPV_BAR) * HYD_OPV_MLPS_PER_BAR;
+  pressureBar += (pumpFlowMlps - puckFlow - opvFlow) / HYD_LINE_ML_PER_BAR * dtS;
+  pressureBar = max(0.0, pressureBar);
+
+  puckMl += puckFlow * dtS;
+  if (puckMl > HYD_PUCK_ABSORB_ML)
+  {
+    cupFlowGps = puckFlow;
+    cupG += puckFlow * dtS;
+  }
+}
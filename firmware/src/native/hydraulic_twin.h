@@ -0,0 +1,86 @@
+#ifndef HYDRAULIC_TWIN_H
+#define HYDRAULIC_TWIN_H
+
+#include <stdint.h>
+
+/*
+ * Host-side hydraulic model: vibratory pump, brew path, puck and cup.
+ *
+ *  - Pump: linear flow-vs-pressure curve. Phase-angle control from the triac
+ *    dimmer scales the RMS voltage, which scales both ends of the curve; below
+ *    a minimum voltage the piston stalls.
+ *  - Brew path: water first fills the headspace above the puck at no
+ *    pressure. After that, pressure builds in the line compliance and is
+ *    relieved by the puck, the OPV and (lever down) the group vent.
+ *  - Puck: Darcy flow P / R. R rises while the coffee swells and falls as it
+ *    erodes, both as a function of the water that has passed through it.
+ *    Nothing reaches the cup until the puck has absorbed its share.
+ *  - Cup: collects the puck outflow (1 g per ml).
+ */
+
+// --- Pump (vibratory, at full mains voltage) ---
+const double HYD_PUMP_MAX_FLOW_MLPS = 10.0; // at 0 bar
+const double HYD_PUMP_MAX_BAR = 15.0;       // dead-headed
+const double HYD_PUMP_STALL_VOLTAGE = 0.35; // fraction of mains RMS
+
+// --- Brew path ---
+const double HYD_LINE_ML_PER_BAR = 0.6; // hoses, HX and trapped air
+const double HYD_HEADSPACE_ML = 12.0;
+const double HYD_OPV_BAR = 11.0;
+const double HYD_OPV_MLPS_PER_BAR = 5.0;
+const double HYD_FLUSH_BAR_S_PER_ML = 0.3; // group without portafilter
+const double HYD_VENT_TAU_S = 0.3;         // lever down, three-way valve open
+const double HYD_BOILER_BAR = 1.0;         // back pressure while refilling
+
+// --- Puck (18 g dose, medium grind) ---
+const double HYD_PUCK_BAR_S_PER_ML = 6.0;
+const double HYD_PUCK_SWELL_ML = 8.0;
+const double HYD_PUCK_EROSION_ML = 150.0;
+const double HYD_PUCK_ABSORB_ML = 20.0;
+
+/**
+ * @brief Actuators acting on the model during one step.
+ */
+struct HydraulicInputs
+{
+  bool pumpOn;
+  uint8_t dimmer; // 0..255 from the pump triac
+  bool fillValveOpen;
+  bool leverLifted;
+};
+
+class HydraulicTwin
+{
+public:
+  /**
+   * @brief Fresh puck (resistance scaled by grind) and an empty cup.
+   */
+  void newShot(double grind);
+
+  /**
+   * @brief Advances the model. Long steps are split internally.
+   */
+  void step(const HydraulicInputs &in, double dtS);
+
+  double pressure() const { return pressureBar; }
+  double pumpFlow() const { return pumpFlowMlps; }
+  bool pumpToBoiler() const { return pumpingToBoiler; }
+  double cupWeight() const { return cupG; }
+  double cupFlow() const { return cupFlowGps; }
+  double puckResistance() const;
+
+private:
+  double grindScale = 1.0;
+  double pressureBar = 0;
+  double headspaceMl = 0;
+  double puckMl = 0;
+  double cupG = 0;
+  double pumpFlowMlps = 0;
+  double cupFlowGps = 0;
+  bool pumpingToBoiler = false;
+
+  double pumpCurve(uint8_t dimmer, double bar) const;
+  void integrate(const HydraulicInputs &in, double dtS);
+};
+
+#endif // HYDRAULIC_TWIN_H
@@ -0,0 +1,879 @@
+// =================================================================
+// --- HOST SIMULATION RUNNER ---
+// =================================================================
+// Runs the real firmware (setup() + controlStep()) against the host HAL at
+// the same 10 ms control period as the control task on the machine.
+//  - Boiler and HX temperatures come from the thermal twin (thermal_twin.h),
+//    driven by the heater SSR, pump and fill valve the firmware switches.
+//  - Pressure, pump flow and the cup on the scale come from the hydraulic
+//    twin (hydraulic_twin.h), driven by the pump relay and triac dimmer.
+//
+//   pio run -e native && .pio/build/native/program --seconds 900 --shot 600:30
+//
+// Options:
+//   --seconds N       Simulated run time (default 60)
+//   --boiler C        Initial boiler temperature (default 20)
+//   --hx C            Initial HX temperature (default: same as boiler)
+//   --water G         Initial boiler water (default: just above the probe)
+//   --shot T:D        Lift the lever at T s for D s (repeatable)
+//   --steam T:D       Open the steam valve at T s for D s (repeatable)
+//   --steam-mode      Two-way switch in the steam position
+//   --split-cups      Two cups, each on its own load cell, that share the shot
+//                     evenly; sets scale_cups=2
+//   --library FILE    Pull a shot with every profile in FILE, one
+//                     profile_data JSON per line, then stop (see below)
+//   --repeat N        Shots per library profile (default 1)
+//   --grind X         Puck resistance relative to a medium grind (default 1)
+//   --puck-spread F   Random +-F change of puck resistance per shot (default 0)
+//   --seed N          Seed for sensor noise and puck spread (default 1)
+//   --csv FILE        Write a 1 Hz trace of the plant and firmware state
+//   --online          Pretend WiFi/MQTT are connected
+//   --cmd "LINE"      Queue a telnet command after setup (repeatable)
+//   --setting "K=V"   Queue a setting as if sent over MQTT (repeatable)
+//   --trace           Print every publish with its timestamp
+//   --quiet           Hide the firmware console
+//   --record FILE     Write an input trace of the run (see input_trace.h)
+//   --replay FILE     Run the firmware on a recorded trace instead of the
+//                     simulation, compare its outputs and time each stage
+//
+// Library mode selects each profile and lifts the lever. It lowers the lever
+// at the end of the profile's own steps, when the firmware stops the pump or
+// after SIM_MAX_SHOT_S, and rests SIM_SHOT_REST_S between shots. Start hot to
+// skip the heat-up, e.g.
+//
+//   program --quiet --boiler 120 --hx 93 --library profiles.jsonl --repeat 100
+//
+// A replay reads every HAL input from the trace, so its result depends only on
+// the trace and the firmware. It exits 0 if every output matched.
+//
+//   program --quiet --replay shot.trace
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hal.h"
+#include "sim.h"
+#include "ntc_table.h"
+#include "pressure_sensor.h"
+#include "thermal_twin.h"
+#include "hydraulic_twin.h"
+
+// --- Provided by firmware.cpp ---
+void setup();
+int getPinByName(const char *pinName);
+float convertADCToTemp(int16_t adc);
+bool activeSourceIsFlow();
+bool profilingIsManual();
+extern float tempSetBrew;
+extern double pumpSetpoint;
+#ifdef HAS_SCALE
+extern float flowRate;
+#endif
+
+const uint32_t CONTROL_PERIOD_US = CONTROL_PERIOD_MS * 1000;
+const uint32_t PLANT_PERIOD_US = 10000;
+const uint32_t SCALE_PERIOD_US = 100000;     // ADS1232 at 10 SPS
+const uint32_t SCALE_FAST_PERIOD_US = 12500; // ADS1232 at 80 SPS
+const uint32_t CSV_PERIOD_US = 1000000;
+
+// Analog input channels for ADS1115 (see firmware.cpp)
+const int SIM_BOILER_TEMP = 0;
+const int SIM_HX_TEMP = 1;
+const int SIM_PRESSURE = 3;
+
+// --- Sensors ---
+const long SCALE_EMPTY_RAW = 1000;
+const float SIM_SCALE_COUNTS_PER_G = 420.0f; // stored as the scale calibration
+const double SIM_SCALE_NOISE_G = 0.05;
+const double SIM_PRESSURE_NOISE_BAR = 0.03;
+
+// --- Scenarios and metrics ---
+const double SIM_READY_BAND_C = 0.5;
+const double SIM_RECOVERY_HOLD_S = 30.0;
+const double SIM_MAX_SHOT_S = 60.0;
+const double SIM_SHOT_REST_S = 30.0;
+const int MAX_SIM_EVENTS = 32;
+const int SIM_FLOW_HISTORY = 8000;     // control steps, longer than any shot
+const int MAX_LIBRARY_PROFILES = 20; // MAX_PROFILES in firmware.cpp
+const int MAX_LIBRARY_LINE = 2048;
+
+struct BenchPins
+{
+  int boilerLevel;
+  int enableLm1830;
+  int heaterSsr;
+  int pumpRelay;
+  int coffeeRelay;
+  int brewSwitch;
+};
+BenchPins pins;
+
+struct SimEvent
+{
+  double startS;
+  double durationS;
+};
+
+/**
+ * @brief Error statistics of one controlled quantity against its target.
+ */
+struct TrackingError
+{
+  double sumSquares;
+  double maxAbs;
+  long samples;
+
+  void add(double error)
+  {
+    sumSquares += error * error;
+    maxAbs = max(maxAbs, fabs(error));
+    samples++;
+  }
+  void merge(const TrackingError &other)
+  {
+    sumSquares += other.sumSquares;
+    maxAbs = max(maxAbs, other.maxAbs);
+    samples += other.samples;
+  }
+  double rms() const { return samples > 0 ? sqrt(sumSquares / samples) : 0.0; }
+};
+
+struct ShotResult
+{
+  int profileId; // -1 outside library mode
+  double startS;
+  double endS;
+  double yieldG;
+  TrackingError pressure;
+  TrackingError flow;
+  double minHxC;
+  double lastOutOfBandS;
+  double flowLagMs; // -1 if not measured
+  double flowLagRms;
+};
+
+struct LibraryProfile
+{
+  int id;
+  char name[65];
+  bool isTargetWeight;
+  double length; // sum of the step triggers (seconds or grams)
+  int shots;
+  double yieldSumG;
+  double timeSumS;
+  TrackingError pressure;
+  TrackingError flow;
+};
+
+SimEvent shots[MAX_SIM_EVENTS];
+int shotCount = 0;
+SimEvent steams[MAX_SIM_EVENTS];
+int steamCount = 0;
+
+LibraryProfile library[MAX_LIBRARY_PROFILES];
+int libraryCount = 0;
+
+// Firmware flow estimate and true cup flow, one pair per step with the lever up
+float shotTrueFlow[SIM_FLOW_HISTORY];
+float shotEstimatedFlow[SIM_FLOW_HISTORY];
+int shotFlowSamples = 0;
+
+ThermalTwin twin;
+HydraulicTwin hydraulics;
+bool steamValveOpen = false;
+bool leverLifted = false;
+bool splitCups = false;
+bool tracePublishes = false;
+char lastState[32] = "";
+uint64_t heaterOnUs = 0;
+uint32_t plantElapsedUs = 0;
+uint32_t scaleElapsedUs = 0;
+uint32_t noiseState = 1;
+
+// =================================================================
+// --- HELPERS ---
+// =================================================================
+/**
+ * @brief ADC code whose converted temperature is closest to tempC.
+ */
+int16_t adcForTemperature(float tempC)
+{
+  int lo = 0, hi = NTC_ADC_MAX;
+  bool decreasing = convertADCToTemp(0) > convertADCToTemp(NTC_ADC_MAX);
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    float t = convertADCToTemp(mid);
+    if (decreasing ? (t > tempC) : (t < tempC))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (int16_t)lo;
+}
+
+int16_t adcForPressure(double bar)
+{
+  double voltage = PRESSURE_VOLTAGE_MIN + bar * (PRESSURE_VOLTAGE_MAX - PRESSURE_VOLTAGE_MIN) / PRESSURE_BAR_MAX;
+  return (int16_t)constrain(voltage / NTC_V_REF * NTC_ADC_MAX, 0.0, (double)NTC_ADC_MAX);
+}
+
+/**
+ * @brief Uniform in [0, 1) from a xorshift generator, so runs are repeatable.
+ */
+double noiseUniform()
+{
+  noiseState ^= noiseState << 13;
+  noiseState ^= noiseState >> 17;
+  noiseState ^= noiseState << 5;
+  return (noiseState >> 8) / 16777216.0;
+}
+
+double noiseGaussian(double sigma)
+{
+  double u1 = max(noiseUniform(), 1e-12);
+  double u2 = noiseUniform();
+  return sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+bool eventActive(const SimEvent *events, int count, double nowS)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (nowS >= events[i].startS && nowS < events[i].startS + events[i].durationS)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseEvent(const char *arg, SimEvent *events, int &count)
+{
+  SimEvent event;
+  if (count >= MAX_SIM_EVENTS || sscanf(arg, "%lf:%lf", &event.startS, &event.durationS) != 2)
+  {
+    return false;
+  }
+  events[count++] = event;
+  return true;
+}
+
+/**
+ * @brief Queues every profile in a JSON-lines file as a profile_data setting.
+ * Only "id" and "n" are picked out here; the firmware parses the rest.
+ */
+bool loadLibrary(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == nullptr)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  static char line[MAX_LIBRARY_LINE];
+  static char command[MAX_LIBRARY_LINE + 32];
+  while (fgets(line, sizeof(line), file) != nullptr)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    const char *idField = strstr(line, "\"id\":");
+    if (line[0] == '\0' || line[0] == '#' || idField == nullptr)
+      continue;
+    if (libraryCount >= MAX_LIBRARY_PROFILES)
+    {
+      fprintf(stderr, "Only the first %d profiles of %s are used\n", MAX_LIBRARY_PROFILES, path);
+      break;
+    }
+
+    LibraryProfile &profile = library[libraryCount++];
+    memset(&profile, 0, sizeof(profile));
+    profile.id = atoi(idField + 5);
+    const char *nameField = strstr(line, "\"n\":\"");
+    if (nameField != nullptr)
+    {
+      nameField += 5;
+      size_t len = min(strcspn(nameField, "\""), sizeof(profile.name) - 1);
+      memcpy(profile.name, nameField, len);
+      profile.name[len] = '\0';
+    }
+    profile.isTargetWeight = strstr(line, "\"tw\":1") != nullptr;
+    const char *steps = strstr(line, "\"s\":[");
+    if (steps != nullptr)
+    {
+      // Steps are [setpoint, trigger] pairs
+      float setpoint, trigger;
+      int used;
+      steps += 5;
+      while (sscanf(steps, " [%f , %f ] %n", &setpoint, &trigger, &used) == 2)
+      {
+        profile.length += max(0.0f, trigger);
+        steps += used;
+        if (*steps == ',')
+          steps++;
+      }
+    }
+
+    snprintf(command, sizeof(command), "set profile_data=%s", line);
+    simQueueCommand(command);
+  }
+  fclose(file);
+  simQueueCommand("set profiling_mode=profile");
+  return libraryCount > 0;
+}
+
+// =================================================================
+// --- PLANT ---
+// =================================================================
+/**
+ * @brief Thermal and hydraulic twins plus the bench: the LM1830 only answers
+ * while it is enabled and the boiler is filled up to the probe.
+ */
+void benchPlant(uint32_t dtUs)
+{
+  if (simGetOutput(pins.heaterSsr) == HIGH)
+  {
+    heaterOnUs += dtUs;
+  }
+
+  plantElapsedUs += dtUs;
+  if (plantElapsedUs >= PLANT_PERIOD_US)
+  {
+    double dtS = plantElapsedUs / 1e6;
+    plantElapsedUs = 0;
+
+    HydraulicInputs flowIn;
+    flowIn.pumpOn = simGetOutput(pins.coffeeRelay) == HIGH;
+    flowIn.dimmer = simGetDimmerBrightness();
+    flowIn.fillValveOpen = simGetOutput(pins.pumpRelay) == HIGH;
+    flowIn.leverLifted = leverLifted;
+    hydraulics.step(flowIn, dtS);
+
+    ThermalInputs heatIn;
+    heatIn.heaterOn = simGetOutput(pins.heaterSsr) == HIGH;
+    heatIn.brewFlowGps = hydraulics.pumpToBoiler() ? 0.0 : hydraulics.pumpFlow();
+    heatIn.refillFlowGps = hydraulics.pumpToBoiler() ? hydraulics.pumpFlow() : 0.0;
+    heatIn.steamValveOpen = steamValveOpen;
+    twin.step(heatIn, dtS);
+
+    simSetAdsRaw(SIM_BOILER_TEMP, adcForTemperature(twin.boilerSensorTemp()));
+    simSetAdsRaw(SIM_HX_TEMP, adcForTemperature(twin.hxSensorTemp()));
+    simSetAdsRaw(SIM_PRESSURE, adcForPressure(hydraulics.pressure() + noiseGaussian(SIM_PRESSURE_NOISE_BAR)));
+  }
+
+  bool waterAtProbe = twin.boilerWater() >= TWIN_BOILER_FULL_WATER_G;
+  simSetInput(pins.boilerLevel, simGetOutput(pins.enableLm1830) == HIGH && waterAtProbe);
+
+  uint32_t scalePeriodUs = simScaleHighSpeed() ? SCALE_FAST_PERIOD_US : SCALE_PERIOD_US;
+  scaleElapsedUs += dtUs;
+  if (scaleElapsedUs >= scalePeriodUs)
+  {
+    scaleElapsedUs %= scalePeriodUs;
+    if (splitCups)
+    {
+      double cup1 = hydraulics.cupWeight() / 2 + noiseGaussian(SIM_SCALE_NOISE_G);
+      double cup2 = hydraulics.cupWeight() / 2 + noiseGaussian(SIM_SCALE_NOISE_G);
+      simPushScaleReading(SCALE_EMPTY_RAW + lround(cup1 * SIM_SCALE_COUNTS_PER_G),
+                          SCALE_EMPTY_RAW + lround(cup2 * SIM_SCALE_COUNTS_PER_G));
+    }
+    else
+    {
+      // Both cells wired together on input 2, nothing on input 1
+      double grams = hydraulics.cupWeight() + noiseGaussian(SIM_SCALE_NOISE_G);
+      simPushScaleReading(SCALE_EMPTY_RAW, SCALE_EMPTY_RAW + lround(grams * SIM_SCALE_COUNTS_PER_G));
+    }
+  }
+}
+
+void onPublish(const char *topic, const char *payload)
+{
+  if (strcmp(topic, "espresso/status/state") == 0)
+  {
+    strlcpy(lastState, payload, sizeof(lastState));
+  }
+  if (tracePublishes)
+  {
+    printf("[%10.3f] %s = %s\n", simNowMicros() / 1e6, topic, payload);
+  }
+}
+
+// =================================================================
+// --- REPORTING ---
+// =================================================================
+void printTime(const char *label, double seconds)
+{
+  if (seconds < 0)
+    printf("%-22s never\n", label);
+  else
+    printf("%-22s %.1f s\n", label, seconds);
+}
+
+/**
+ * @brief One line per shot. Recovery counts once the HX has stayed within
+ * SIM_READY_BAND_C for SIM_RECOVERY_HOLD_S, up to settledUntilS.
+ */
+void printShot(int index, const ShotResult &shot, double settledUntilS)
+{
+  printf("Shot %d", index + 1);
+  if (shot.profileId >= 0)
+    printf(" [profile %d]", shot.profileId);
+  printf(": %.1f s, %.1f g", shot.endS - shot.startS, shot.yieldG);
+  if (shot.pressure.samples > 0)
+    printf(", pressure rms %.2f max %.2f bar", shot.pressure.rms(), shot.pressure.maxAbs);
+  if (shot.flow.samples > 0)
+    printf(", flow rms %.2f max %.2f g/s", shot.flow.rms(), shot.flow.maxAbs);
+  if (shot.flowLagMs >= 0)
+    printf(", flow lag %.0f ms (rms %.2f g/s)", shot.flowLagMs, shot.flowLagRms);
+  printf(", HX low %.1f C", shot.minHxC);
+  if (settledUntilS - shot.lastOutOfBandS >= SIM_RECOVERY_HOLD_S)
+    printf(", recovered in %.1f s\n", max(0.0, shot.lastOutOfBandS - shot.endS));
+  else
+    printf(", not recovered\n");
+}
+
+/**
+ * @brief How far the firmware's flow estimate trails the true cup flow: the
+ * time from the true flow first reaching half its peak to the estimate
+ * doing the same, plus the rms error over the shot.
+ */
+void measureFlowLag(ShotResult &shot)
+{
+  shot.flowLagMs = -1;
+  float peak = 0;
+  double sumSquares = 0;
+  for (int i = 0; i < shotFlowSamples; i++)
+  {
+    peak = max(peak, shotTrueFlow[i]);
+    double error = shotEstimatedFlow[i] - shotTrueFlow[i];
+    sumSquares += error * error;
+  }
+  if (peak <= 0)
+    return;
+  int trueRise = -1;
+  int estimateRise = -1;
+  for (int i = 0; i < shotFlowSamples && estimateRise < 0; i++)
+  {
+    if (trueRise < 0 && shotTrueFlow[i] >= peak / 2)
+      trueRise = i;
+    if (trueRise >= 0 && shotEstimatedFlow[i] >= peak / 2)
+      estimateRise = i;
+  }
+  if (estimateRise < 0)
+    return;
+  shot.flowLagMs = (estimateRise - trueRise) * (double)CONTROL_PERIOD_MS;
+  shot.flowLagRms = sqrt(sumSquares / shotFlowSamples);
+}
+
+void addToLibrary(const ShotResult &shot)
+{
+  for (int i = 0; i < libraryCount; i++)
+  {
+    LibraryProfile &profile = library[i];
+    if (profile.id == shot.profileId)
+    {
+      profile.shots++;
+      profile.yieldSumG += shot.yieldG;
+      profile.timeSumS += shot.endS - shot.startS;
+      profile.pressure.merge(shot.pressure);
+      profile.flow.merge(shot.flow);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief --replay: runs the firmware on a recorded trace and reports the
+ * output comparison and where the control step spends its time.
+ */
+int runReplay(const char *path)
+{
+  if (!simReplayOpen(path))
+  {
+    return 2;
+  }
+  simProfileWholeRun();
+  clock_t wallStart = clock();
+  setup();
+  while (simReplayNextStep())
+  {
+    controlStep();
+  }
+  double wallS = (double)(clock() - wallStart) / CLOCKS_PER_SEC;
+  const SimReplayResult &result = simReplayFinish();
+
+  printf("\n--- Replay summary ---\n");
+  printf("%-22s %s (%.1f KB)\n", "Trace:", path, result.traceBytes / 1024.0);
+  printf("%-22s %lu over %.1f s recorded (%.0fx real time)\n", "Control steps:", result.steps,
+         result.recordedMs / 1000.0, wallS > 0 ? result.recordedMs / 1000.0 / wallS : 0.0);
+  printf("%-22s %lu (%lu settings)\n", "Inputs replayed:", result.inputs, result.settings);
+  printf("%-22s %lu matched, %lu differ, %lu missing, %lu extra\n", "Outputs:", result.outputsMatched,
+         result.outputsDiffering, result.outputsMissing, result.outputsExtra);
+  for (int i = 0; i < min(result.diffCount, SIM_REPLAY_MAX_DIFFS); i++)
+    printf("  %s\n", result.diffs[i]);
+  if (result.diffCount > SIM_REPLAY_MAX_DIFFS)
+    printf("  ... %d more\n", result.diffCount - SIM_REPLAY_MAX_DIFFS);
+
+  bool identical = !result.diverged && result.diffCount == 0 && result.outputsMissing == 0;
+  if (result.diverged)
+    printf("%-22s diverged at step %lu: %s\n", "Result:", result.steps, result.divergence);
+  else if (identical)
+    printf("%-22s identical%s\n", "Result:", result.gap ? " up to a recorder gap" : "");
+  else
+    printf("%-22s outputs differ\n", "Result:");
+
+  const StageSummary *stages = simStageSummaries();
+  printf("\n%-16s %8s %8s %8s %8s %8s %6s\n", "Stage (CPU)", "Steps", "Min us", "Avg us", "P99 us", "Max us", "Share");
+  double stepTotalUs = (double)stages[STAGE_COUNT].count * stages[STAGE_COUNT].avgUs;
+  for (int stage = 0; stage <= STAGE_COUNT; stage++)
+  {
+    const StageSummary &summary = stages[stage];
+    if (summary.count == 0)
+      continue;
+    printf("%-16s %8lu %8.2f %8.2f %8.2f %8.1f %5.1f%%\n", stage < STAGE_COUNT ? CONTROL_STAGE_NAMES[stage] : "whole step",
+           (unsigned long)summary.count, summary.minUs, summary.avgUs, summary.p99Us, summary.maxUs,
+           stepTotalUs > 0 ? 100.0 * summary.count * summary.avgUs / stepTotalUs : 0.0);
+  }
+  return identical ? 0 : 1;
+}
+
+// =================================================================
+// --- MAIN ---
+// =================================================================
+int main(int argc, char **argv)
+{
+  double seconds = 60;
+  bool secondsSet = false;
+  double boilerStartC = TWIN_INLET_TEMP;
+  double hxStartC = 0;
+  bool hxSet = false;
+  double waterG = TWIN_BOILER_FULL_WATER_G + 10.0;
+  bool steamMode = false;
+  const char *csvPath = nullptr;
+  const char *libraryPath = nullptr;
+  int repeat = 1;
+  double grind = 1.0;
+  double puckSpread = 0.0;
+  const char *recordPath = nullptr;
+  const char *replayPath = nullptr;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+    {
+      seconds = atof(argv[++i]);
+      secondsSet = true;
+    }
+    else if (strcmp(argv[i], "--boiler") == 0 && i + 1 < argc)
+      boilerStartC = atof(argv[++i]);
+    else if (strcmp(argv[i], "--hx") == 0 && i + 1 < argc)
+    {
+      hxStartC = atof(argv[++i]);
+      hxSet = true;
+    }
+    else if (strcmp(argv[i], "--water") == 0 && i + 1 < argc)
+      waterG = atof(argv[++i]);
+    else if (strcmp(argv[i], "--shot") == 0 && i + 1 < argc && parseEvent(argv[i + 1], shots, shotCount))
+      i++;
+    else if (strcmp(argv[i], "--steam") == 0 && i + 1 < argc && parseEvent(argv[i + 1], steams, steamCount))
+      i++;
+    else if (strcmp(argv[i], "--steam-mode") == 0)
+      steamMode = true;
+    else if (strcmp(argv[i], "--split-cups") == 0)
+    {
+      splitCups = true;
+      simQueueSetting("scale_cups=2");
+    }
+    else if (strcmp(argv[i], "--library") == 0 && i + 1 < argc)
+      libraryPath = argv[++i];
+    else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      repeat = max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--grind") == 0 && i + 1 < argc)
+      grind = atof(argv[++i]);
+    else if (strcmp(argv[i], "--puck-spread") == 0 && i + 1 < argc)
+      puckSpread = atof(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+      noiseState = max(1u, (uint32_t)strtoul(argv[++i], nullptr, 10));
+    else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+      csvPath = argv[++i];
+    else if (strcmp(argv[i], "--online") == 0)
+      simSetOnline(true);
+    else if (strcmp(argv[i], "--cmd") == 0 && i + 1 < argc)
+      simQueueCommand(argv[++i]);
+    else if (strcmp(argv[i], "--setting") == 0 && i + 1 < argc)
+      simQueueSetting(argv[++i]);
+    else if (strcmp(argv[i], "--trace") == 0)
+      tracePublishes = true;
+    else if (strcmp(argv[i], "--quiet") == 0)
+      simSetConsoleEcho(false);
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+      recordPath = argv[++i];
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+      replayPath = argv[++i];
+    else
+    {
+      fprintf(stderr, "Unknown or malformed option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (!hxSet)
+    hxStartC = boilerStartC;
+  if (replayPath != nullptr)
+    return runReplay(replayPath);
+
+  FILE *csv = nullptr;
+  if (csvPath != nullptr)
+  {
+    csv = fopen(csvPath, "w");
+    if (csv == nullptr)
+    {
+      fprintf(stderr, "Cannot open %s\n", csvPath);
+      return 2;
+    }
+    fprintf(csv, "time_s,boiler_c,hx_c,boiler_sensor_c,hx_sensor_c,water_g,heater,pump,fill,steam,"
+                 "dimmer,pressure_bar,pump_mlps,cup_g,cup_gps,target,state\n");
+  }
+
+  pins.boilerLevel = getPinByName("boiler_level");
+  pins.enableLm1830 = getPinByName("enable_lm1830");
+  pins.heaterSsr = getPinByName("heater_ssr");
+  pins.pumpRelay = getPinByName("pump_relay");
+  pins.coffeeRelay = getPinByName("coffee_relay");
+  pins.brewSwitch = getPinByName("brew_switch");
+
+  // Lever down, water tank full, switches in their rest position
+  simSetInput(pins.brewSwitch, HIGH);
+  simSetInput(getPinByName("water_detector"), HIGH);
+  simSetInput(getPinByName("two_way_switch"), steamMode ? HIGH : LOW);
+
+  // A calibrated scale, so weights and flows come out in grams. Split cups
+  // have the same cells and start from this calibration too.
+  HalStorage &storage = halStorage();
+  storage.begin("espresso-app", false);
+  storage.putLong("scaleOffset", SCALE_EMPTY_RAW);
+  storage.putFloat("scaleScale", SIM_SCALE_COUNTS_PER_G);
+  storage.end();
+
+  if (libraryPath != nullptr && !loadLibrary(libraryPath))
+  {
+    return 2;
+  }
+  if (libraryCount > 0 && !secondsSet)
+  {
+    seconds = 1e9; // until the library is done
+  }
+
+  twin.reset(boilerStartC, hxStartC, waterG);
+  hydraulics.newShot(grind);
+  simSetAdsRaw(SIM_BOILER_TEMP, adcForTemperature(twin.boilerSensorTemp()));
+  simSetAdsRaw(SIM_HX_TEMP, adcForTemperature(twin.hxSensorTemp()));
+  simSetAdsRaw(SIM_PRESSURE, adcForPressure(0));
+
+  simSetPublishHook(onPublish);
+  simSetPlantHook(benchPlant);
+  if (recordPath != nullptr)
+    simTraceRecord(recordPath);
+
+  clock_t wallStart = clock();
+  setup();
+  heaterOnUs = 0;
+
+  double readyS = -1;
+  double idleS = -1;
+  double maxOvershootC = 0;
+  double minBoilerC = twin.boilerTemp();
+  bool anyShot = false;
+  int shotsDone = 0;
+  ShotResult shot;
+  memset(&shot, 0, sizeof(shot));
+  bool shotPending = false; // finished, recovery still being watched
+
+  // Library mode: rest, select the profile, pull the shot
+  int libraryShot = 0;
+  const int libraryShots = libraryCount * repeat;
+  double libraryNextS = simNowMicros() / 1e6 + SIM_SHOT_REST_S;
+  bool librarySelected = false;
+  bool libraryLever = false;
+  bool libraryPumpStarted = false;
+  double libraryLeverS = 0;
+
+  const uint64_t endUs = (uint64_t)(seconds * 1e6);
+  const uint64_t startUs = simNowMicros();
+  uint64_t nextTickUs = startUs;
+  uint64_t nextCsvUs = startUs;
+  while (simNowMicros() < endUs)
+  {
+    double nowS = simNowMicros() / 1e6;
+    bool pumpOn = simGetOutput(pins.coffeeRelay) == HIGH;
+
+    // --- Library scenario ---
+    if (libraryShot < libraryShots)
+    {
+      const LibraryProfile &profile = library[libraryShot % libraryCount];
+      if (!libraryLever && !librarySelected && nowS >= libraryNextS - 1.0)
+      {
+        char command[48];
+        snprintf(command, sizeof(command), "set active_profile_id=%d", profile.id);
+        simQueueCommand(command);
+        librarySelected = true;
+      }
+      else if (!libraryLever && nowS >= libraryNextS)
+      {
+        libraryLever = true;
+        libraryPumpStarted = false;
+        libraryLeverS = nowS;
+      }
+      else if (libraryLever)
+      {
+        // Lower the lever where a barista would: at the end of the profile
+        double progress = profile.isTargetWeight ? hydraulics.cupWeight() : nowS - libraryLeverS;
+        bool profileDone = profile.length > 0 && progress >= profile.length;
+        libraryPumpStarted |= pumpOn;
+        if (profileDone || (libraryPumpStarted && !pumpOn) || nowS - libraryLeverS >= SIM_MAX_SHOT_S)
+        {
+          libraryLever = false;
+          librarySelected = false;
+          libraryShot++;
+          libraryNextS = nowS + SIM_SHOT_REST_S;
+        }
+      }
+    }
+    else if (libraryShots > 0 && nowS >= libraryNextS)
+    {
+      break; // the last shot has had its rest
+    }
+
+    // --- Lever ---
+    bool lever = eventActive(shots, shotCount, nowS) || libraryLever;
+    if (lever && !leverLifted)
+    {
+      if (shotPending)
+      {
+        printShot(shotsDone - 1, shot, nowS);
+      }
+      // A fresh puck and an empty cup for every shot
+      hydraulics.newShot(grind * (1.0 + puckSpread * (2.0 * noiseUniform() - 1.0)));
+      memset(&shot, 0, sizeof(shot));
+      shot.profileId = libraryLever ? library[libraryShot % libraryCount].id : -1;
+      shot.startS = nowS;
+      shot.minHxC = twin.hxSensorTemp();
+      shotFlowSamples = 0;
+      shotPending = false;
+      anyShot = true;
+    }
+    else if (!lever && leverLifted)
+    {
+      shot.endS = nowS;
+      shot.yieldG = hydraulics.cupWeight();
+      shot.lastOutOfBandS = nowS;
+      measureFlowLag(shot);
+      shotsDone++;
+      shotPending = true;
+      addToLibrary(shot);
+    }
+    leverLifted = lever;
+    simSetInput(pins.brewSwitch, leverLifted ? LOW : HIGH);
+    steamValveOpen = eventActive(steams, steamCount, nowS);
+
+    simTraceStep();
+    controlStep();
+
+    // --- Metrics on what the firmware sees ---
+    double hxErrorC = twin.hxSensorTemp() - tempSetBrew;
+    bool inBand = fabs(hxErrorC) <= SIM_READY_BAND_C;
+    if (readyS < 0 && inBand)
+      readyS = nowS;
+    if (idleS < 0 && strcmp(lastState, "IDLE") == 0)
+      idleS = nowS;
+    if (readyS >= 0 && !anyShot)
+      maxOvershootC = max(maxOvershootC, hxErrorC);
+    minBoilerC = min(minBoilerC, twin.boilerTemp());
+
+    if (leverLifted)
+    {
+      // Tracking error against the plant while the profile engine regulates
+      bool regulating = !profilingIsManual() && strcmp(lastState, "BREWING") == 0 &&
+                        simGetOutput(pins.coffeeRelay) == HIGH && simGetDimmerBrightness() > 0;
+      if (regulating && activeSourceIsFlow())
+        shot.flow.add(hydraulics.cupFlow() - pumpSetpoint);
+      else if (regulating)
+        shot.pressure.add(hydraulics.pressure() - pumpSetpoint);
+#ifdef HAS_SCALE
+      if (shotFlowSamples < SIM_FLOW_HISTORY)
+      {
+        shotTrueFlow[shotFlowSamples] = hydraulics.cupFlow();
+        shotEstimatedFlow[shotFlowSamples] = flowRate;
+        shotFlowSamples++;
+      }
+#endif
+    }
+    if (anyShot)
+    {
+      shot.minHxC = min(shot.minHxC, twin.hxSensorTemp());
+      if (!inBand)
+        shot.lastOutOfBandS = nowS;
+    }
+
+    if (csv != nullptr && simNowMicros() >= nextCsvUs)
+    {
+      fprintf(csv, "%.1f,%.2f,%.2f,%.2f,%.2f,%.0f,%d,%d,%d,%d,%d,%.2f,%.2f,%.1f,%.2f,%.2f,%s\n", nowS,
+              twin.boilerTemp(), twin.hxTemp(), twin.boilerSensorTemp(), twin.hxSensorTemp(), twin.boilerWater(),
+              simGetOutput(pins.heaterSsr), simGetOutput(pins.coffeeRelay), simGetOutput(pins.pumpRelay),
+              steamValveOpen ? 1 : 0, simGetDimmerBrightness(), hydraulics.pressure(), hydraulics.pumpFlow(),
+              hydraulics.cupWeight(), hydraulics.cupFlow(), pumpSetpoint, lastState);
+      nextCsvUs += CSV_PERIOD_US;
+    }
+
+    nextTickUs += CONTROL_PERIOD_US;
+    if (simNowMicros() < nextTickUs)
+    {
+      simAdvanceMicros((uint32_t)(nextTickUs - simNowMicros()));
+    }
+  }
+  double wallS = (double)(clock() - wallStart) / CLOCKS_PER_SEC;
+  if (csv != nullptr)
+    fclose(csv);
+  halTraceStop();
+
+  double runUs = (double)(simNowMicros() - startUs);
+  double endS = simNowMicros() / 1e6;
+  if (shotPending)
+    printShot(shotsDone - 1, shot, endS);
+
+  printf("\n--- Simulation summary ---\n");
+  printf("%-22s %.1f s (%.0fx real time)\n", "Simulated time:", endS, wallS > 0 ? endS / wallS : 0.0);
+  printf("%-22s %s\n", "Final state:", lastState[0] ? lastState : "(none published)");
+  printf("%-22s %.1f C\n", "Brew setpoint:", tempSetBrew);
+  printf("%-22s %.1f C / %.1f C (%.0f g water)\n", "Boiler / HX:", twin.boilerTemp(), twin.hxTemp(), twin.boilerWater());
+  printf("%-22s %.1f %% (%.0f kJ)\n", "Heater duty:", runUs > 0 ? 100.0 * heaterOnUs / runUs : 0.0, twin.heaterEnergy() / 1000.0);
+  printTime("Heat-up (+-0.5 C):", readyS);
+  printTime("IDLE reached:", idleS);
+  printf("%-22s %.2f C\n", "Overshoot:", readyS >= 0 ? maxOvershootC : 0.0);
+  printf("%-22s %.1f C\n", "Lowest boiler:", minBoilerC);
+  if (steamCount > 0)
+    printf("%-22s %.0f g\n", "Steam drawn:", twin.steamDrawn());
+  printf("%-22s %d", "Shots:", shotsDone);
+  if (wallS > 0 && shotsDone > 0)
+    printf(" (%.0f per minute)", shotsDone / wallS * 60.0);
+  printf("\n");
+
+  if (libraryCount > 0)
+  {
+    printf("\n%-4s %-24s %6s %8s %8s %10s %10s\n", "ID", "Profile", "Shots", "Time s", "Yield g", "P rms", "F rms");
+    for (int i = 0; i < libraryCount; i++)
+    {
+      const LibraryProfile &profile = library[i];
+      int n = max(1, profile.shots);
+      printf("%-4d %-24.24s %6d %8.1f %8.1f", profile.id, profile.name, profile.shots, profile.timeSumS / n,
+             profile.yieldSumG / n);
+      if (profile.pressure.samples > 0)
+        printf(" %6.2f bar", profile.pressure.rms());
+      else
+        printf(" %10s", "-");
+      if (profile.flow.samples > 0)
+        printf(" %6.2f g/s\n", profile.flow.rms());
+      else
+        printf(" %10s\n", "-");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <Arduino.h>
+
+#include "stage_profiler.h"
+
+/*
+ * Controls for the host HAL (hal_native.cpp). The simulation runner and the
+ * plant models use these to drive the inputs the firmware reads through
+ * hal.h and to observe what it drives.
+ */
+
+// --- Clock ---
+/**
+ * @brief Called every time simulated time advances, including inside
+ * halDelay(), so plant models keep evolving during blocking waits.
+ */
+typedef void (*SimPlantHook)(uint32_t dtUs);
+
+void simSetPlantHook(SimPlantHook hook);
+void simAdvanceMicros(uint32_t us);
+uint64_t simNowMicros();
+
+// --- GPIO ---
+void simSetInput(int pin, int level);
+int simGetOutput(int pin);
+
+// --- ADS1115 ---
+/**
+ * @brief Publishes a new sample (GAIN_ONE counts) on a channel.
+ */
+void simSetAdsRaw(int channel, int16_t raw);
+
+// --- ADS1232 scale ---
+/**
+ * @brief Queues a finished conversion of whichever input the converter is
+ * on, stamped with the simulated time, as the scale task does on the
+ * machine. Conversions while it settles after a channel change are dropped.
+ */
+void simPushScaleReading(long input1, long input2);
+
+/**
+ * @brief Speed last requested by the firmware (true = 80 SPS, false = 10 SPS).
+ */
+bool simScaleHighSpeed();
+
+// --- Pump dimmer ---
+uint8_t simGetDimmerBrightness();
+
+// --- Transports ---
+/**
+ * @brief Receives every publish, as if MQTT and the screen were connected.
+ */
+typedef void (*SimPublishHook)(const char *topic, const char *payload);
+
+void simSetPublishHook(SimPublishHook hook);
+void simSetOnline(bool online);
+void simQueueCommand(const char *line);
+
+/**
+ * @brief Queues a key=value setting as if it arrived over MQTT.
+ */
+void simQueueSetting(const char *message);
+void simSetConsoleEcho(bool echo);
+
+// --- Input trace ---
+/**
+ * @brief Records the run to path, starting at halTraceBegin() in setup().
+ * Call simTraceStep() before every controlStep().
+ */
+void simTraceRecord(const char *path);
+void simTraceStep();
+
+const int SIM_REPLAY_MAX_DIFFS = 8;
+
+struct SimReplayResult
+{
+  size_t traceBytes;
+  unsigned long steps;
+  unsigned long inputs;
+  unsigned long settings;
+  unsigned long outputsMatched;
+  unsigned long outputsDiffering;
+  unsigned long outputsMissing;
+  unsigned long outputsExtra;
+  uint32_t recordedMs; // span of halMillis() covered so far
+  bool gap;            // the recorder dropped records; replay ends there
+  bool diverged;       // the firmware read a different input than was recorded
+  char divergence[160];
+  int diffCount;
+  char diffs[SIM_REPLAY_MAX_DIFFS][160]; // the first output differences
+};
+
+/**
+ * @brief Feeds the firmware from a trace instead of the simulation. Call
+ * setup(), then controlStep() for as long as simReplayNextStep() is true.
+ */
+bool simReplayOpen(const char *path);
+bool simReplayNextStep();
+const SimReplayResult &simReplayFinish();
+
+// --- Loop profiler ---
+/**
+ * @brief Profiles the whole run as one window instead of PERF_WINDOW_MS ones.
+ */
+void simProfileWholeRun();
+
+/**
+ * @brief Stage summaries, STAGE_COUNT + 1 entries (the last is the whole
+ * step): the last complete window, or the run so far after
+ * simProfileWholeRun().
+ */
+const StageSummary *simStageSummaries();
+
+#endif // SIM_H
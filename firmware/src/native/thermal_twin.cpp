@@ -0,0 +1,90 @@
+// =================================================================
+// --- THERMAL DIGITAL TWIN ---
+// =================================================================
+// See thermal_twin.h for the model. The loss terms call the firmware's own
+// feedForwardHeater()/getTempFromPower(), so a change to the fitted constants
+// moves the plant and the feed-forward together.
+
+#include <Arduino.h>
+
+#include "heat_loss_model.h"
+#include "thermal_twin.h"
+
+// --- Provided by firmware.cpp ---
+double feedForwardHeater(double c1, double c2, double steadyStateTemp, double ambientTemp);
+double getTempFromPower(double targetPower, double c1, double c2, double ambientTemp);
+
+// Explicit Euler is comfortably stable below this step for every time
+// constant in the model (the fastest is the sensor lag).
+const double TWIN_MAX_STEP_S = 0.05;
+
+void ThermalTwin::reset(double boiler, double hx, double waterG)
+{
+  boilerC = boiler;
+  hxC = hx;
+  boilerSensorC = boiler;
+  hxSensorC = hx;
+  boilerWaterG = waterG;
+  heaterEnergyJ = 0;
+  steamDrawnG = 0;
+}
+
+void ThermalTwin::step(const ThermalInputs &in, double dtS)
+{
+  while (dtS > 0)
+  {
+    double h = min(dtS, TWIN_MAX_STEP_S);
+    integrate(in, h);
+    dtS -= h;
+  }
+}
+
+void ThermalTwin::integrate(const ThermalInputs &in, double dtS)
+{
+  // --- Boiler ---
+  double heaterW = in.heaterOn ? TWIN_HEATER_POWER_W : 0.0;
+  double lossW = TWIN_HEATER_POWER_W / 100.0 * feedForwardHeater(c1Boiler, c2Boiler, boilerC, ASSUMED_AMBIENT_TEMP);
+
+  // Brew water leaves the HX coil short of boiler temperature, by the
+  // effectiveness (1 - e^-NTU) of a coil immersed in a well-mixed boiler.
+  double brewOutC = boilerC;
+  double brewW = 0;
+  if (in.brewFlowGps > 0)
+  {
+    double capacityRate = in.brewFlowGps * WATER_J_PER_G_K;
+    brewOutC = boilerC - (boilerC - TWIN_INLET_TEMP) * exp(-TWIN_HX_UA_W_PER_K / capacityRate);
+    brewW = capacityRate * (brewOutC - TWIN_INLET_TEMP);
+  }
+
+  double refillW = in.refillFlowGps * WATER_J_PER_G_K * (boilerC - TWIN_INLET_TEMP);
+
+  double steamGps = 0;
+  if (in.steamValveOpen && boilerC > 100.0)
+  {
+    steamGps = TWIN_STEAM_FLOW_GPS * min(1.0, (boilerC - 100.0) / (TWIN_STEAM_REF_TEMP - 100.0));
+    steamGps = min(steamGps, boilerWaterG / dtS);
+  }
+  double steamW = steamGps * STEAM_LATENT_J_PER_G;
+
+  double boilerJPerK = boilerWaterG * WATER_J_PER_G_K + TWIN_BOILER_SHELL_J_PER_K;
+  boilerC += (heaterW - lossW - brewW - refillW - steamW) / boilerJPerK * dtS;
+  boilerWaterG += (in.refillFlowGps - steamGps) * dtS;
+
+  heaterEnergyJ += heaterW * dtS;
+  steamDrawnG += steamGps * dtS;
+
+  // --- HX / group ---
+  double hxEquilibriumC = getTempFromPower(feedForwardHeater(c1Boiler, c2Boiler, boilerC, ASSUMED_AMBIENT_TEMP),
+                                           c1Brew, c2Brew, ASSUMED_AMBIENT_TEMP);
+  double hxW = TWIN_HX_J_PER_K / TWIN_HX_TAU_S * (hxEquilibriumC - hxC);
+  if (in.brewFlowGps > 0)
+  {
+    hxW += in.brewFlowGps * WATER_J_PER_G_K * (brewOutC - hxC);
+  }
+  hxC += hxW / TWIN_HX_J_PER_K * dtS;
+
+  // --- Sensors ---
+  double sensorAlpha = dtS / (TWIN_SENSOR_TAU_S + dtS);
+  boilerSensorC += (boilerC - boilerSensorC) * sensorAlpha;
+  hxSensorC += (hxC - hxSensorC) * sensorAlpha;
+}
@@ -0,0 +1,81 @@
+#ifndef THERMAL_TWIN_H
+#define THERMAL_TWIN_H
+
+/*
+ * Host-side thermal model of the Mara X boiler and heat exchanger.
+ *
+ * Two lumped nodes:
+ *  - Boiler: water plus shell, heated by the element, losing heat as given by
+ *    the boiler pair of heat_loss_model.h.
+ *  - HX/group: follows the boiler through the thermosiphon towards the HX
+ *    temperature the brew pair of heat_loss_model.h predicts for the current
+ *    boiler temperature (the same equilibrium updateCalculatedBoilerTemp()
+ *    assumes), and is cooled by water drawn through it.
+ *
+ * Water drawn through the HX, cold refills and steam all take their heat from
+ * the boiler. Each NTC sits in a well and is modelled as a first-order lag.
+ */
+
+// --- Machine parameters ---
+const double TWIN_HEATER_POWER_W = 1400.0;
+const double TWIN_BOILER_SHELL_J_PER_K = 1200.0;
+const double TWIN_BOILER_FULL_WATER_G = 1500.0; // water at the level probe
+const double TWIN_HX_J_PER_K = 1500.0;          // HX, E61 group and thermosiphon
+// Thermosiphon response, calibrated on the heat-up: the firmware leaves full
+// power once the HX is 20 C short of the setpoint and then holds the boiler
+// with little more than the feed-forward, so the boiler has to be at
+// calculatedBoilerTemp by then. With a faster thermosiphon it is still a few
+// kelvin short and creeps the rest over most of an hour; slower, it
+// overshoots and cools off just as slowly.
+const double TWIN_HX_TAU_S = 135.0;
+const double TWIN_HX_UA_W_PER_K = 23.0;         // boiler -> brew water exchange
+const double TWIN_STEAM_FLOW_GPS = 0.4;         // wide open at TWIN_STEAM_REF_TEMP
+const double TWIN_STEAM_REF_TEMP = 125.0;
+const double TWIN_INLET_TEMP = 20.0;
+const double TWIN_SENSOR_TAU_S = 4.0;
+
+const double WATER_J_PER_G_K = 4.186;
+const double STEAM_LATENT_J_PER_G = 2257.0;
+
+/**
+ * @brief Actuators and disturbances acting on the model during one step.
+ */
+struct ThermalInputs
+{
+  bool heaterOn;
+  double brewFlowGps;   // water pumped through the HX to the group
+  double refillFlowGps; // cold water pumped into the boiler
+  bool steamValveOpen;
+};
+
+class ThermalTwin
+{
+public:
+  void reset(double boilerC, double hxC, double boilerWaterG);
+
+  /**
+   * @brief Advances the model. Long steps are split internally.
+   */
+  void step(const ThermalInputs &in, double dtS);
+
+  double boilerTemp() const { return boilerC; }
+  double hxTemp() const { return hxC; }
+  double boilerSensorTemp() const { return boilerSensorC; }
+  double hxSensorTemp() const { return hxSensorC; }
+  double boilerWater() const { return boilerWaterG; }
+  double heaterEnergy() const { return heaterEnergyJ; }
+  double steamDrawn() const { return steamDrawnG; }
+
+private:
+  double boilerC = TWIN_INLET_TEMP;
+  double hxC = TWIN_INLET_TEMP;
+  double boilerSensorC = TWIN_INLET_TEMP;
+  double hxSensorC = TWIN_INLET_TEMP;
+  double boilerWaterG = TWIN_BOILER_FULL_WATER_G;
+  double heaterEnergyJ = 0;
+  double steamDrawnG = 0;
+
+  void integrate(const ThermalInputs &in, double dtS);
+};
+
+#endif // THERMAL_TWIN_H
@@ -0,0 +1,109 @@
+// Host benchmark for the NTC conversion in include/ntc_table.h.
+//
+// Compares the flash-resident uniform table against the previous runtime
+// approach (remapping the legacy table at boot and scanning it linearly on
+// every conversion): speed per conversion and worst-case deviation.
+//
+// Build and run from the firmware folder:
+//   g++ -O2 -std=c++17 -Iinclude tools/ntc_bench.cpp -o ntc_bench && ./ntc_bench
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+#include "ntc_table.h"
+
+static float remappedAdcValues[LEGACY_TEMP_LOOKUP_TABLE_SIZE];
+static float remappedTemperatureValues[LEGACY_TEMP_LOOKUP_TABLE_SIZE];
+
+// --- Previous implementation (generateSparseMap + linearInterpolation) ---
+static void generateSparseMap()
+{
+  for (int i = 0; i < LEGACY_TEMP_LOOKUP_TABLE_SIZE; i++)
+  {
+    remappedAdcValues[i] = ntcRemapLegacyAdc(i);
+    remappedTemperatureValues[i] = LEGACY_TEMP_LOOKUP_TABLE[i] / 10.0f;
+  }
+}
+
+static float linearInterpolation(const float xValues[], const float yValues[], int numValues, float pointX)
+{
+  int i = 0;
+  if (pointX <= xValues[0])
+  {
+    i = 0;
+  }
+  else if (pointX >= xValues[numValues - 1])
+  {
+    i = numValues - 2;
+  }
+  else
+  {
+    while (pointX >= xValues[i + 1])
+      i++;
+  }
+  float t = (pointX - xValues[i]) / (xValues[i + 1] - xValues[i]);
+  return yValues[i] * (1 - t) + yValues[i + 1] * t;
+}
+
+static float scanConvert(int adc)
+{
+  return linearInterpolation(remappedAdcValues, remappedTemperatureValues, LEGACY_TEMP_LOOKUP_TABLE_SIZE, (float)adc);
+}
+
+static constexpr NtcTable LEGACY_TABLE = ntcBuildLegacyTable();
+static constexpr NtcTable BETA_TABLE = ntcBuildBetaTable(3950.0, 50000.0);
+
+template <typename F>
+static double nanosPerConversion(F convert, int rounds)
+{
+  volatile float sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    for (int adc = 0; adc < NTC_ADC_MAX; adc += 7)
+    {
+      sink = sink + convert(adc);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double conversions = (double)rounds * ((NTC_ADC_MAX + 6) / 7);
+  return std::chrono::duration<double, std::nano>(end - start).count() / conversions;
+}
+
+int main()
+{
+  generateSparseMap();
+
+  float maxError = 0, maxErrorBrewRange = 0;
+  int worstAdc = 0;
+  for (int adc = 0; adc < NTC_ADC_MAX; adc++)
+  {
+    float reference = scanConvert(adc);
+    float error = std::fabs(ntcLookup(LEGACY_TABLE, adc) - reference);
+    if (error > maxError)
+    {
+      maxError = error;
+      worstAdc = adc;
+    }
+    if (reference >= 80 && reference <= 140 && error > maxErrorBrewRange)
+      maxErrorBrewRange = error;
+  }
+
+  const int rounds = 50;
+  double scanNs = nanosPerConversion(scanConvert, rounds);
+  double tableNs = nanosPerConversion([](int adc) { return ntcLookup(LEGACY_TABLE, adc); }, rounds);
+  double betaNs = nanosPerConversion([](int adc) { return ntcLookup(BETA_TABLE, adc); }, rounds);
+
+  printf("Table: %d entries, shift %d, %u bytes flash (scan needed %u bytes RAM)\n",
+         NTC_TABLE_STEPS + 1, NTC_TABLE_SHIFT, (unsigned)sizeof(NtcTable),
+         (unsigned)(sizeof(remappedAdcValues) + sizeof(remappedTemperatureValues)));
+  printf("Max deviation vs scan:     %.4f C (at code %d)\n", maxError, worstAdc);
+  printf("Max deviation 80..140 C:   %.4f C\n", maxErrorBrewRange);
+  printf("Linear scan:               %8.2f ns/conversion\n", scanNs);
+  printf("Uniform table (legacy):    %8.2f ns/conversion (%.0fx)\n", tableNs, scanNs / tableNs);
+  printf("Uniform table (beta):      %8.2f ns/conversion\n", betaNs);
+  printf("Beta 3950/50k at 93 C check: code for 93 C -> %.2f C\n",
+         ntcLookup(BETA_TABLE, (int)(NTC_VCC * NTC_R_SERIES_OHMS / (NTC_R_SERIES_OHMS + 50000.0 * std::exp(3950.0 * (1 / 366.15 - 1 / 298.15))) / NTC_V_REF * NTC_ADC_MAX)));
+  return 0;
+}